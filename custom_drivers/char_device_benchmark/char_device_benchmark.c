@@ -0,0 +1,1893 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../pseudo_char_driver/pseudo_char_device_ioctl.h"
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#define LIST_SIZE_MAX       16
+#define DEVICE_COUNT_MAX    16
+
+/* Latencies are kept in log2 buckets split into linear sub-buckets, so a
+   percentile is off by at most 1/16 of its value. */
+#define HISTOGRAM_SUB_BUCKET_BITS   4
+#define HISTOGRAM_SUB_BUCKET_COUNT  (1u << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKET_COUNT      (64 * HISTOGRAM_SUB_BUCKET_COUNT)
+
+#define DRAIN_POLL_TIMEOUT_MS   10
+
+/* Stripes of locks of the shared memory map, each guarding the keys
+   hashing to it. */
+#define SHM_MAP_LOCK_COUNT  64
+
+/* Checksums of a pseudo char device are switched through this attribute,
+   the device being named after its node. */
+#define CHECKSUM_ATTRIBUTE_PATH \
+    "/sys/class/pseudo_char_device_class/%s/checksum/enabled"
+
+/* Byte the whole device holds before a stress run, so every block a
+   reader sees is uniform unless a write was torn. */
+#define STRESS_FILL_BYTE    'z'
+
+#define NANOSECONDS_PER_SECOND  1000000000ull
+#define BYTES_PER_MEBIBYTE      (1024.0 * 1024.0)
+
+
+
+/*****************************************************************************/
+/* PRIVATE ENUMS */
+/*****************************************************************************/
+
+typedef enum output_format {
+    OUTPUT_FORMAT_TEXT,
+    OUTPUT_FORMAT_CSV,
+    OUTPUT_FORMAT_JSON
+}output_format_t;
+
+
+
+/* Devices are left alone unless a checksum setting is swept. */
+typedef enum checksum_mode {
+    CHECKSUM_MODE_UNCHANGED,
+    CHECKSUM_MODE_OFF,
+    CHECKSUM_MODE_ON
+}checksum_mode_t;
+
+
+
+/* Where the key-value runs keep their keys, none for the regular runs. */
+typedef enum kv_backend {
+    KV_BACKEND_NONE,
+    KV_BACKEND_DEVICE,
+    KV_BACKEND_SHM
+}kv_backend_t;
+
+
+
+typedef enum operation_type {
+    OPERATION_TYPE_READ,
+    OPERATION_TYPE_WRITE,
+    OPERATION_TYPE_SEEK
+}operation_type_t;
+
+
+
+/*****************************************************************************/
+/* PRIVATE STRUCTURES */
+/*****************************************************************************/
+
+/* Percentages of reads, writes and seeks, adding up to 100. */
+typedef struct operation_mix {
+    unsigned read_percent;
+    unsigned write_percent;
+    unsigned seek_percent;
+}operation_mix_t;
+
+
+
+typedef struct benchmark_config {
+    const char *device_paths[DEVICE_COUNT_MAX];
+    unsigned device_count;
+    size_t block_sizes[LIST_SIZE_MAX];
+    unsigned block_size_count;
+    unsigned thread_counts[LIST_SIZE_MAX];
+    unsigned thread_count_count;
+    operation_mix_t mixes[LIST_SIZE_MAX];
+    unsigned mix_count;
+    bool nonblocking_modes[2];
+    unsigned nonblocking_mode_count;
+    checksum_mode_t checksum_modes[2];
+    unsigned checksum_mode_count;
+    unsigned ring_depth;
+    unsigned kv_key_count;
+    double duration;
+    bool drain;
+    bool pin;
+    bool stress;
+    output_format_t output_format;
+}benchmark_config_t;
+
+
+
+/* Key-value map in memory shared between processes, the userspace
+   counterpart of a device in key-value mode. Its keys are fixed when it is
+   created, which is what keeps the slot of a key from ever moving: only
+   the value and presence of a slot change afterwards, under the lock of
+   the stripe of its key. */
+typedef struct shm_map {
+    void *area;
+    size_t size;
+    pthread_rwlock_t *locks;
+    char *slots;
+    size_t slot_size;
+    uint64_t slot_mask;
+}shm_map_t;
+
+
+
+typedef struct shm_map_slot {
+    char key[PCD_KV_KEY_SIZE];
+    uint32_t length;
+    uint32_t present;
+    char value[];
+}shm_map_slot_t;
+
+
+
+typedef struct run_parameters {
+    const char *device_path;
+    size_t block_size;
+    unsigned thread_count;
+    operation_mix_t mix;
+    bool nonblocking;
+    checksum_mode_t checksum_mode;
+    unsigned ring_depth;
+    kv_backend_t kv_backend;
+    unsigned kv_key_count;
+    shm_map_t *shm_map;
+    double duration;
+    bool drain;
+    bool pin;
+    bool stress;
+}run_parameters_t;
+
+
+
+typedef struct run_result {
+    uint64_t read_count;
+    uint64_t write_count;
+    uint64_t seek_count;
+    uint64_t byte_count;
+    uint64_t syscall_count;
+    uint64_t again_count;
+    uint64_t error_count;
+    uint64_t torn_count;
+    uint64_t histogram[HISTOGRAM_BUCKET_COUNT];
+}run_result_t;
+
+
+
+/* Submission and completion rings of a thread, with the file of the thread
+   registered as the only one. */
+typedef struct ring {
+    int file_descriptor;
+    void *area;
+    size_t size;
+    struct pcd_ring_header *header;
+    struct pcd_ring_submission *submissions;
+    struct pcd_ring_completion *completions;
+    uint32_t submission_tail;
+    uint32_t completion_head;
+}ring_t;
+
+
+
+typedef struct thread_context {
+    pthread_t thread;
+    unsigned index;
+    const run_parameters_t *parameters;
+    pthread_barrier_t *start_barrier;
+    atomic_bool *stop;
+    int open_error;
+    run_result_t result;
+}thread_context_t;
+
+
+
+/*****************************************************************************/
+/* PRIVATE VARIABLES */
+/*****************************************************************************/
+
+static const char *usage_text =
+    "Usage: %s [options] device...\n"
+    "\n"
+    "Drives each device with every combination of the swept parameters and\n"
+    "reports throughput, latency percentiles and syscalls per MiB.\n"
+    "\n"
+    "Options:\n"
+    "  -b sizes     block sizes in bytes (default 64,512,4096)\n"
+    "  -t counts    thread counts, one file per thread (default 1,2,4)\n"
+    "  -m mixes     read:write:seek percentages\n"
+    "               (default 100:0:0,0:100:0,50:50:0,45:45:10)\n"
+    "  -n modes     block, nonblock or both (default block)\n"
+    "  -c modes     checksums of the devices off, on or both\n"
+    "               (default left as they are)\n"
+    "  -u depth     submit operations through the ring device, depth of them\n"
+    "               per kernel entry (default 0, one syscall each)\n"
+    "  -k keys      key-value runs over that many keys, each repeated on a\n"
+    "               map in shared memory: reads get, writes put and seeks\n"
+    "               delete block sized values (default 0, no such runs)\n"
+    "  -d seconds   duration of a single run (default 1)\n"
+    "  -r           drain the device with an extra, unmeasured reader\n"
+    "  -p           pin thread N to CPU N\n"
+    "  -s           stress: sweep pinned threads from 1 to every online CPU\n"
+    "               instead of -t, filling the device first and counting\n"
+    "               reads mixing two writes as errors; meant for a kernel\n"
+    "               with lockdep and KCSAN, whose reports land in dmesg\n"
+    "  -o format    text, csv or json lines (default text)\n"
+    "  -h           show this help\n"
+    "\n"
+    "Example:\n"
+    "  %s -b 512,4096 -t 1,4 -m 100:0:0,0:100:0 -o csv \\\n"
+    "      /dev/pseudo_char_device_3 /dev/pseudo_platform_device_0\n"
+    "\n"
+    "Append scaling of a device in sharded mode:\n"
+    "  %s -m 0:100:0 -t 1,2,4,8 -r -p /dev/pseudo_char_device_N\n"
+    "\n"
+    "Checksum overhead of a device in random access mode:\n"
+    "  %s -c both -m 100:0:0,0:100:0 /dev/pseudo_char_device_N\n"
+    "\n"
+    "Small operations through the rings instead of syscalls:\n"
+    "  %s -b 64 -t 1 -u 256 /dev/pseudo_char_device_N\n"
+    "\n"
+    "Lookups of a device in key-value mode against a shared memory map:\n"
+    "  %s -k 1024 -b 64 -t 1,4,8 -m 100:0:0,90:10:0 "
+    "/dev/pseudo_char_device_N\n"
+    "\n"
+    "Scaling and consistency of a device in random access mode:\n"
+    "  %s -s -d 5 -m 100:0:0,90:10:0,50:50:0 /dev/pseudo_char_device_N\n";
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int parse_arguments(int argc, char *argv[], benchmark_config_t *config);
+
+static int parse_size_list(const char *text, size_t *list, unsigned *count);
+
+static int parse_unsigned_list(const char *text, unsigned *list,
+    unsigned *count);
+
+static int parse_mix_list(const char *text, operation_mix_t *list,
+    unsigned *count);
+
+static int parse_mode_list(const char *text, bool *list, unsigned *count);
+
+static int parse_checksum_mode_list(const char *text, checksum_mode_t *list,
+    unsigned *count);
+
+static int set_checksum_mode(const char *device_path,
+    checksum_mode_t checksum_mode);
+
+static void set_stress_thread_counts(benchmark_config_t *config);
+
+static int stress_fill(const run_parameters_t *parameters);
+
+static int run_kv_backends(const benchmark_config_t *config,
+    run_parameters_t *parameters, run_result_t *result);
+
+static int run_benchmark(const run_parameters_t *parameters,
+    run_result_t *result, double *elapsed);
+
+static void *benchmark_thread(void *argument);
+
+static void *drain_thread(void *argument);
+
+static operation_type_t choose_operation(const run_parameters_t *parameters,
+    off_t device_size, uint64_t *random_state, off_t *offset);
+
+static void account_operation(run_result_t *result,
+    operation_type_t operation_type, ssize_t byte_count, int file_descriptor);
+
+static void run_syscall_loop(thread_context_t *context, int file_descriptor,
+    char *buffer, off_t device_size);
+
+static int ring_create(ring_t *ring, int file_descriptor, unsigned depth);
+
+static void ring_destroy(ring_t *ring);
+
+static void run_ring_loop(thread_context_t *context, ring_t *ring,
+    int file_descriptor, char *buffer, off_t device_size);
+
+static void run_kv_loop(thread_context_t *context, int file_descriptor,
+    char *buffer);
+
+static int kv_device_fill(const run_parameters_t *parameters);
+
+static ssize_t kv_device_operation(int file_descriptor,
+    operation_type_t operation_type, const char *key, char *buffer,
+    size_t block_size);
+
+static int shm_map_create(shm_map_t *map, unsigned key_count,
+    size_t value_size);
+
+static void shm_map_destroy(shm_map_t *map);
+
+static shm_map_slot_t *shm_map_find(const shm_map_t *map, const char *key,
+    uint64_t hash);
+
+static ssize_t shm_map_operation(shm_map_t *map,
+    operation_type_t operation_type, const char *key, char *buffer,
+    size_t block_size);
+
+static uint64_t hash_key(const char *key);
+
+static void merge_result(run_result_t *destination,
+    const run_result_t *source);
+
+static uint64_t now_ns(void);
+
+static uint64_t next_random(uint64_t *state);
+
+static unsigned histogram_index(uint64_t value);
+
+static uint64_t histogram_value(unsigned index);
+
+static uint64_t histogram_percentile(const run_result_t *result,
+    double percentile);
+
+static void print_header(output_format_t output_format);
+
+static void print_result(output_format_t output_format,
+    const run_parameters_t *parameters, const run_result_t *result,
+    double elapsed);
+
+
+
+/*****************************************************************************/
+/* MAIN FUNCTION */
+/*****************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    int return_code = 0;
+    unsigned device_index = 0;
+    unsigned block_size_index = 0;
+    unsigned thread_count_index = 0;
+    unsigned mix_index = 0;
+    unsigned mode_index = 0;
+    unsigned checksum_mode_index = 0;
+    benchmark_config_t config = { 0 };
+    run_parameters_t parameters = { 0 };
+    run_result_t *result = NULL;
+
+    return_code = parse_arguments(argc, argv, &config);
+    if (return_code != 0) {
+        fprintf(stderr, usage_text, argv[0], argv[0], argv[0], argv[0],
+            argv[0], argv[0], argv[0]);
+        return (return_code > 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    result = malloc(sizeof(run_result_t));
+    if (result == NULL) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        return EXIT_FAILURE;
+    }
+
+    print_header(config.output_format);
+
+    parameters.ring_depth = config.ring_depth;
+    parameters.kv_key_count = config.kv_key_count;
+    parameters.duration = config.duration;
+    parameters.drain = config.drain;
+    parameters.pin = config.pin;
+    parameters.stress = config.stress;
+    for (; device_index < config.device_count; ++device_index) {
+        parameters.device_path = config.device_paths[device_index];
+        for (block_size_index = 0; block_size_index < config.block_size_count;
+            ++block_size_index) {
+            parameters.block_size = config.block_sizes[block_size_index];
+            for (thread_count_index = 0;
+                thread_count_index < config.thread_count_count;
+                ++thread_count_index) {
+                parameters.thread_count =
+                    config.thread_counts[thread_count_index];
+                for (mix_index = 0; mix_index < config.mix_count;
+                    ++mix_index) {
+                    parameters.mix = config.mixes[mix_index];
+                    for (mode_index = 0;
+                        mode_index < config.nonblocking_mode_count;
+                        ++mode_index) {
+                        parameters.nonblocking =
+                            config.nonblocking_modes[mode_index];
+
+                        /* Innermost, so runs differing only by the
+                           checksums are printed next to each other. */
+                        for (checksum_mode_index = 0;
+                            checksum_mode_index < config.checksum_mode_count;
+                            ++checksum_mode_index) {
+                            parameters.checksum_mode =
+                                config.checksum_modes[checksum_mode_index];
+
+                            if ((set_checksum_mode(parameters.device_path,
+                                parameters.checksum_mode) != 0) ||
+                                (parameters.stress &&
+                                (stress_fill(&parameters) != 0)) ||
+                                (run_kv_backends(&config, &parameters,
+                                result) != 0)) {
+                                return_code = EXIT_FAILURE;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    free(result);
+
+    return return_code;
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+/* Returns 1 if only the help was requested. */
+static int parse_arguments(int argc, char *argv[], benchmark_config_t *config)
+{
+    int return_code = 0;
+    int option = 0;
+    char *end = NULL;
+
+    parse_size_list("64,512,4096", config->block_sizes,
+        &config->block_size_count);
+    parse_unsigned_list("1,2,4", config->thread_counts,
+        &config->thread_count_count);
+    parse_mix_list("100:0:0,0:100:0,50:50:0,45:45:10", config->mixes,
+        &config->mix_count);
+    parse_mode_list("block", config->nonblocking_modes,
+        &config->nonblocking_mode_count);
+    config->checksum_modes[0] = CHECKSUM_MODE_UNCHANGED;
+    config->checksum_mode_count = 1;
+    config->duration = 1.0;
+    config->output_format = OUTPUT_FORMAT_TEXT;
+
+    while ((return_code == 0) &&
+        ((option = getopt(argc, argv, "b:t:m:n:c:u:k:d:o:rpsh")) != -1)) {
+        switch (option) {
+            case 'b': {
+                return_code = parse_size_list(optarg, config->block_sizes,
+                    &config->block_size_count);
+            }
+            break;
+
+            case 't': {
+                return_code = parse_unsigned_list(optarg,
+                    config->thread_counts, &config->thread_count_count);
+            }
+            break;
+
+            case 'm': {
+                return_code = parse_mix_list(optarg, config->mixes,
+                    &config->mix_count);
+            }
+            break;
+
+            case 'n': {
+                return_code = parse_mode_list(optarg,
+                    config->nonblocking_modes,
+                    &config->nonblocking_mode_count);
+            }
+            break;
+
+            case 'c': {
+                return_code = parse_checksum_mode_list(optarg,
+                    config->checksum_modes, &config->checksum_mode_count);
+            }
+            break;
+
+            case 'u': {
+                errno = 0;
+                config->ring_depth = strtoul(optarg, &end, 10);
+                if ((end == optarg) || (*end != '\0') || (errno != 0) ||
+                    (config->ring_depth > PCD_RING_ENTRY_COUNT_MAX)) {
+                    return_code = -EINVAL;
+                }
+            }
+            break;
+
+            case 'k': {
+                errno = 0;
+                config->kv_key_count = strtoul(optarg, &end, 10);
+                if ((end == optarg) || (*end != '\0') || (errno != 0)) {
+                    return_code = -EINVAL;
+                }
+            }
+            break;
+
+            case 'd': {
+                config->duration = strtod(optarg, &end);
+                if ((end == optarg) || (*end != '\0') ||
+                    !(config->duration > 0.0)) {
+                    return_code = -EINVAL;
+                }
+            }
+            break;
+
+            case 'r': {
+                config->drain = true;
+            }
+            break;
+
+            case 'p': {
+                config->pin = true;
+            }
+            break;
+
+            case 's': {
+                config->stress = true;
+            }
+            break;
+
+            case 'o': {
+                if (strcmp(optarg, "text") == 0) {
+                    config->output_format = OUTPUT_FORMAT_TEXT;
+                } else if (strcmp(optarg, "csv") == 0) {
+                    config->output_format = OUTPUT_FORMAT_CSV;
+                } else if (strcmp(optarg, "json") == 0) {
+                    config->output_format = OUTPUT_FORMAT_JSON;
+                } else {
+                    return_code = -EINVAL;
+                }
+            }
+            break;
+
+            case 'h': {
+                return_code = 1;
+            }
+            break;
+
+            default: {
+                return_code = -EINVAL;
+            }
+            break;
+        }
+    }
+
+    if (return_code == 0) {
+        for (; (optind < argc) && (config->device_count < DEVICE_COUNT_MAX);
+            ++optind) {
+            config->device_paths[config->device_count++] = argv[optind];
+        }
+
+        if ((config->device_count == 0) || (optind < argc)) {
+            return_code = -EINVAL;
+        }
+    }
+
+    /* Key-value runs go through ioctls, neither the rings nor reads apply
+       to them. */
+    if ((return_code == 0) && (config->kv_key_count > 0) &&
+        ((config->ring_depth > 0) || config->drain)) {
+        return_code = -EINVAL;
+    }
+
+    /* Reads are only checked on the syscall path, and a device being
+       drained has no content to check. */
+    if ((return_code == 0) && config->stress) {
+        if ((config->kv_key_count > 0) || (config->ring_depth > 0) ||
+            config->drain) {
+            return_code = -EINVAL;
+        } else {
+            set_stress_thread_counts(config);
+        }
+    }
+
+    return return_code;
+}
+
+
+
+static int parse_size_list(const char *text, size_t *list, unsigned *count)
+{
+    int return_code = 0;
+    unsigned index = 0;
+    unsigned value_count = 0;
+    unsigned values[LIST_SIZE_MAX];
+
+    return_code = parse_unsigned_list(text, values, &value_count);
+    if (return_code == 0) {
+        for (; index < value_count; ++index) {
+            list[index] = values[index];
+        }
+        *count = value_count;
+    }
+
+    return return_code;
+}
+
+
+
+/* Comma separated list of positive numbers. */
+static int parse_unsigned_list(const char *text, unsigned *list,
+    unsigned *count)
+{
+    int return_code = 0;
+    unsigned value_count = 0;
+    unsigned long value = 0;
+    const char *position = text;
+    char *end = NULL;
+
+    do {
+        errno = 0;
+        value = strtoul(position, &end, 10);
+        if ((end == position) || (errno != 0) || (value == 0) ||
+            (value > UINT32_MAX) || (value_count == LIST_SIZE_MAX) ||
+            ((*end != ',') && (*end != '\0'))) {
+            return_code = -EINVAL;
+        } else {
+            list[value_count++] = value;
+            position = end + 1;
+        }
+    } while ((return_code == 0) && (*end == ','));
+
+    if (return_code == 0) {
+        *count = value_count;
+    }
+
+    return return_code;
+}
+
+
+
+static int parse_mix_list(const char *text, operation_mix_t *list,
+    unsigned *count)
+{
+    int return_code = 0;
+    int consumed = 0;
+    unsigned mix_count = 0;
+    operation_mix_t mix = { 0 };
+    const char *position = text;
+
+    do {
+        if ((mix_count == LIST_SIZE_MAX) ||
+            (sscanf(position, "%u:%u:%u%n", &mix.read_percent,
+                &mix.write_percent, &mix.seek_percent, &consumed) != 3) ||
+            ((mix.read_percent + mix.write_percent + mix.seek_percent) !=
+                100)) {
+            return_code = -EINVAL;
+        } else {
+            list[mix_count++] = mix;
+            position += consumed;
+            if (*position == ',') {
+                ++position;
+            } else if (*position != '\0') {
+                return_code = -EINVAL;
+            }
+        }
+    } while ((return_code == 0) && (*position != '\0'));
+
+    if (return_code == 0) {
+        *count = mix_count;
+    }
+
+    return return_code;
+}
+
+
+
+static int parse_mode_list(const char *text, bool *list, unsigned *count)
+{
+    int return_code = 0;
+
+    if (strcmp(text, "block") == 0) {
+        list[0] = false;
+        *count = 1;
+    } else if (strcmp(text, "nonblock") == 0) {
+        list[0] = true;
+        *count = 1;
+    } else if ((strcmp(text, "block,nonblock") == 0) ||
+        (strcmp(text, "both") == 0)) {
+        list[0] = false;
+        list[1] = true;
+        *count = 2;
+    } else {
+        return_code = -EINVAL;
+    }
+
+    return return_code;
+}
+
+
+
+static int parse_checksum_mode_list(const char *text, checksum_mode_t *list,
+    unsigned *count)
+{
+    int return_code = 0;
+
+    if (strcmp(text, "off") == 0) {
+        list[0] = CHECKSUM_MODE_OFF;
+        *count = 1;
+    } else if (strcmp(text, "on") == 0) {
+        list[0] = CHECKSUM_MODE_ON;
+        *count = 1;
+    } else if ((strcmp(text, "off,on") == 0) ||
+        (strcmp(text, "both") == 0)) {
+        list[0] = CHECKSUM_MODE_OFF;
+        list[1] = CHECKSUM_MODE_ON;
+        *count = 2;
+    } else {
+        return_code = -EINVAL;
+    }
+
+    return return_code;
+}
+
+
+
+/* Enabling checksums hashes the whole device, which is done before the
+   clock starts. Only devices in random access mode have them. */
+static int set_checksum_mode(const char *device_path,
+    checksum_mode_t checksum_mode)
+{
+    int return_code = 0;
+    int file_descriptor = -1;
+    char device_name[64];
+    char attribute_path[128];
+    const char *value = (checksum_mode == CHECKSUM_MODE_ON) ? "1" : "0";
+
+    if (checksum_mode == CHECKSUM_MODE_UNCHANGED) {
+        return 0;
+    }
+
+    snprintf(device_name, sizeof(device_name), "%s", device_path);
+    snprintf(attribute_path, sizeof(attribute_path), CHECKSUM_ATTRIBUTE_PATH,
+        basename(device_name));
+
+    file_descriptor = open(attribute_path, O_WRONLY);
+    if ((file_descriptor < 0) ||
+        (write(file_descriptor, value, strlen(value)) < 0)) {
+        return_code = -errno;
+    }
+
+    if (file_descriptor >= 0) {
+        close(file_descriptor);
+    }
+
+    if (return_code != 0) {
+        fprintf(stderr, "Unable to switch checksums of %s: %s, "
+            "run skipped!\n", device_path, strerror(-return_code));
+    }
+
+    return return_code;
+}
+
+
+
+/* Powers of two up to the number of online CPUs, which comes last even
+   when it is not one of them. */
+static void set_stress_thread_counts(benchmark_config_t *config)
+{
+    const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned thread_count = 1;
+
+    config->thread_count_count = 0;
+    for (; (thread_count < cpu_count) &&
+        (config->thread_count_count < (LIST_SIZE_MAX - 1));
+        thread_count *= 2) {
+        config->thread_counts[config->thread_count_count++] = thread_count;
+    }
+    config->thread_counts[config->thread_count_count++] =
+        (cpu_count > 1) ? cpu_count : 1;
+
+    config->pin = true;
+}
+
+
+
+/* Overwrites the whole device with the same byte. Returns a negative
+   errno on failure. */
+static int stress_fill(const run_parameters_t *parameters)
+{
+    int return_code = 0;
+    int file_descriptor = -1;
+    off_t device_size = 0;
+    off_t offset = 0;
+    ssize_t byte_count = 0;
+    char *buffer = NULL;
+
+    buffer = malloc(parameters->block_size);
+    if (buffer == NULL) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        return -ENOMEM;
+    }
+    memset(buffer, STRESS_FILL_BYTE, parameters->block_size);
+
+    file_descriptor = open(parameters->device_path, O_WRONLY);
+    if (file_descriptor < 0) {
+        return_code = -errno;
+    } else {
+        device_size = lseek(file_descriptor, -1, SEEK_END) + 1;
+        if ((device_size <= 0) ||
+            (lseek(file_descriptor, 0, SEEK_SET) < 0)) {
+            return_code = -ESPIPE;
+        }
+    }
+
+    while ((return_code == 0) && (offset < device_size)) {
+        byte_count = write(file_descriptor, buffer, parameters->block_size);
+        if (byte_count <= 0) {
+            return_code = (byte_count < 0) ? -errno : -ENOSPC;
+        } else {
+            offset += byte_count;
+        }
+    }
+
+    if (file_descriptor >= 0) {
+        close(file_descriptor);
+    }
+    free(buffer);
+
+    if (return_code != 0) {
+        fprintf(stderr, "Unable to fill %s: %s, run skipped!\n",
+            parameters->device_path, strerror(-return_code));
+    }
+
+    return return_code;
+}
+
+
+
+/* Key-value runs are made once on the device and once on a shared memory
+   map, so the two are printed next to each other. Both start out with
+   every key holding a block sized value. */
+static int run_kv_backends(const benchmark_config_t *config,
+    run_parameters_t *parameters, run_result_t *result)
+{
+    int return_code = 0;
+    unsigned backend_index = 0;
+    double elapsed = 0.0;
+    shm_map_t shm_map = { 0 };
+    const kv_backend_t regular_backends[] = { KV_BACKEND_NONE };
+    const kv_backend_t kv_backends[] = { KV_BACKEND_DEVICE, KV_BACKEND_SHM };
+    const kv_backend_t *backends = regular_backends;
+    unsigned backend_count = 1;
+
+    if (config->kv_key_count > 0) {
+        backends = kv_backends;
+        backend_count = 2;
+
+        if (parameters->block_size > PCD_KV_VALUE_SIZE_MAX) {
+            fprintf(stderr, "Values of %zu bytes too large, run skipped!\n",
+                parameters->block_size);
+            return -EINVAL;
+        }
+    }
+
+    for (; (backend_index < backend_count) && (return_code == 0);
+        ++backend_index) {
+        parameters->kv_backend = backends[backend_index];
+        parameters->shm_map = NULL;
+
+        if (parameters->kv_backend == KV_BACKEND_DEVICE) {
+            return_code = kv_device_fill(parameters);
+        } else if (parameters->kv_backend == KV_BACKEND_SHM) {
+            return_code = shm_map_create(&shm_map, parameters->kv_key_count,
+                parameters->block_size);
+            parameters->shm_map = &shm_map;
+        }
+
+        if (return_code == 0) {
+            return_code = run_benchmark(parameters, result, &elapsed);
+        }
+
+        if (return_code == 0) {
+            print_result(config->output_format, parameters, result,
+                elapsed);
+        }
+
+        if ((return_code == 0) && (result->torn_count > 0)) {
+            fprintf(stderr, "%" PRIu64 " torn reads from %s!\n",
+                result->torn_count, parameters->device_path);
+            return_code = -EIO;
+        }
+
+        if (parameters->shm_map != NULL) {
+            shm_map_destroy(&shm_map);
+            parameters->shm_map = NULL;
+        }
+    }
+
+    return return_code;
+}
+
+
+
+static int run_benchmark(const run_parameters_t *parameters,
+    run_result_t *result, double *elapsed)
+{
+    int return_code = 0;
+    unsigned thread_index = 0;
+    unsigned started_count = 0;
+    uint64_t start_time = 0;
+    struct timespec duration = { 0 };
+    pthread_barrier_t start_barrier;
+    atomic_bool stop = false;
+    thread_context_t *contexts = NULL;
+    thread_context_t drain_context = { 0 };
+
+    memset(result, 0, sizeof(run_result_t));
+
+    contexts = calloc(parameters->thread_count, sizeof(thread_context_t));
+    if (contexts == NULL) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        return -ENOMEM;
+    }
+
+    /* The extra party is this thread, which starts the clock once every
+       benchmark thread has opened its file. */
+    pthread_barrier_init(&start_barrier, NULL, parameters->thread_count + 1);
+
+    for (; thread_index < parameters->thread_count; ++thread_index) {
+        contexts[thread_index].index = thread_index;
+        contexts[thread_index].parameters = parameters;
+        contexts[thread_index].start_barrier = &start_barrier;
+        contexts[thread_index].stop = &stop;
+
+        if (pthread_create(&contexts[thread_index].thread, NULL,
+            benchmark_thread, &contexts[thread_index]) != 0) {
+            fprintf(stderr, "Thread creation failed!\n");
+            abort();
+        }
+        ++started_count;
+    }
+
+    if (parameters->drain) {
+        drain_context.parameters = parameters;
+        drain_context.stop = &stop;
+
+        if (pthread_create(&drain_context.thread, NULL, drain_thread,
+            &drain_context) != 0) {
+            fprintf(stderr, "Thread creation failed!\n");
+            abort();
+        }
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    start_time = now_ns();
+
+    duration.tv_sec = (time_t)parameters->duration;
+    duration.tv_nsec = (long)((parameters->duration - duration.tv_sec) *
+        NANOSECONDS_PER_SECOND);
+    while (nanosleep(&duration, &duration) != 0) {
+    }
+
+    atomic_store(&stop, true);
+
+    for (thread_index = 0; thread_index < started_count; ++thread_index) {
+        pthread_join(contexts[thread_index].thread, NULL);
+        if (contexts[thread_index].open_error != 0) {
+            return_code = -contexts[thread_index].open_error;
+        } else {
+            merge_result(result, &contexts[thread_index].result);
+        }
+    }
+
+    *elapsed = (double)(now_ns() - start_time) / NANOSECONDS_PER_SECOND;
+
+    if (parameters->drain) {
+        pthread_join(drain_context.thread, NULL);
+        if ((return_code == 0) && (drain_context.open_error != 0)) {
+            return_code = -drain_context.open_error;
+        }
+    }
+
+    pthread_barrier_destroy(&start_barrier);
+    free(contexts);
+
+    if (return_code != 0) {
+        fprintf(stderr, "Unable to open %s: %s, run skipped!\n",
+            parameters->device_path, strerror(-return_code));
+    }
+
+    return return_code;
+}
+
+
+
+/* Every thread works on its own file, so random access devices see
+   independent file positions. Reads and writes wrap around to the start
+   when they hit the end of the device. */
+static void *benchmark_thread(void *argument)
+{
+    thread_context_t *context = argument;
+    const run_parameters_t *parameters = context->parameters;
+    const operation_mix_t *mix = &parameters->mix;
+    int flags = O_RDWR;
+    int file_descriptor = -1;
+    off_t device_size = 0;
+    char *buffer = NULL;
+    ring_t ring = { .file_descriptor = -1 };
+    cpu_set_t cpu_set;
+
+    if (parameters->pin) {
+        CPU_ZERO(&cpu_set);
+        CPU_SET(context->index % sysconf(_SC_NPROCESSORS_ONLN), &cpu_set);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    }
+
+    /* Devices with a single access direction refuse to open otherwise. */
+    if (mix->write_percent == 0) {
+        flags = O_RDONLY;
+    } else if (mix->read_percent == 0) {
+        flags = O_WRONLY;
+    }
+
+    if (parameters->nonblocking) {
+        flags |= O_NONBLOCK;
+    }
+
+    buffer = malloc(parameters->block_size);
+    if (buffer == NULL) {
+        context->open_error = ENOMEM;
+    } else {
+        memset(buffer, 'a' + (context->index % 26), parameters->block_size);
+        if (parameters->kv_backend == KV_BACKEND_SHM) {
+            file_descriptor = -1;
+        } else if ((file_descriptor = open(parameters->device_path,
+            flags)) < 0) {
+            context->open_error = errno;
+        } else if (parameters->ring_depth > 0) {
+            context->open_error = -ring_create(&ring, file_descriptor,
+                parameters->ring_depth);
+        }
+    }
+
+    if (context->open_error != 0) {
+        pthread_barrier_wait(context->start_barrier);
+        if (file_descriptor >= 0) {
+            close(file_descriptor);
+        }
+        free(buffer);
+        return NULL;
+    }
+
+    /* The pseudo char device only accepts positions inside its buffer,
+       hence the size is probed with the last byte. */
+    if (parameters->kv_backend == KV_BACKEND_NONE) {
+        device_size = lseek(file_descriptor, -1, SEEK_END) + 1;
+        lseek(file_descriptor, 0, SEEK_SET);
+    }
+
+    pthread_barrier_wait(context->start_barrier);
+
+    if (parameters->kv_backend != KV_BACKEND_NONE) {
+        run_kv_loop(context, file_descriptor, buffer);
+    } else if (parameters->ring_depth > 0) {
+        run_ring_loop(context, &ring, file_descriptor, buffer, device_size);
+        ring_destroy(&ring);
+    } else {
+        run_syscall_loop(context, file_descriptor, buffer, device_size);
+    }
+
+    if (file_descriptor >= 0) {
+        close(file_descriptor);
+    }
+    free(buffer);
+
+    return NULL;
+}
+
+
+
+/* Keeps append-only devices from filling up, so writers are measured
+   instead of the wait for free space. Nothing it does is counted. */
+static void *drain_thread(void *argument)
+{
+    thread_context_t *context = argument;
+    const run_parameters_t *parameters = context->parameters;
+    struct pollfd poll_descriptor = { 0 };
+    char *buffer = NULL;
+
+    buffer = malloc(parameters->block_size);
+    if (buffer != NULL) {
+        poll_descriptor.fd = open(parameters->device_path,
+            O_RDONLY | O_NONBLOCK);
+        poll_descriptor.events = POLLIN;
+    }
+
+    if ((buffer == NULL) || (poll_descriptor.fd < 0)) {
+        context->open_error = (buffer == NULL) ? ENOMEM : errno;
+        free(buffer);
+        return NULL;
+    }
+
+    while (!atomic_load_explicit(context->stop, memory_order_relaxed)) {
+        if ((read(poll_descriptor.fd, buffer, parameters->block_size) < 0) &&
+            (errno == EAGAIN)) {
+            poll(&poll_descriptor, 1, DRAIN_POLL_TIMEOUT_MS);
+        }
+    }
+
+    close(poll_descriptor.fd);
+    free(buffer);
+
+    return NULL;
+}
+
+
+
+static operation_type_t choose_operation(const run_parameters_t *parameters,
+    off_t device_size, uint64_t *random_state, off_t *offset)
+{
+    const operation_mix_t *mix = &parameters->mix;
+    const unsigned choice = next_random(random_state) % 100;
+    operation_type_t operation_type = OPERATION_TYPE_READ;
+
+    if (choice < mix->read_percent) {
+        operation_type = OPERATION_TYPE_READ;
+    } else if (choice < (mix->read_percent + mix->write_percent)) {
+        operation_type = OPERATION_TYPE_WRITE;
+    } else {
+        operation_type = OPERATION_TYPE_SEEK;
+    }
+
+    if ((operation_type == OPERATION_TYPE_SEEK) && (device_size > 0)) {
+        *offset = next_random(random_state) % device_size;
+        *offset -= *offset % parameters->block_size;
+    } else {
+        *offset = 0;
+    }
+
+    return operation_type;
+}
+
+
+
+/* Byte count or negative errno of a finished operation. */
+static void account_operation(run_result_t *result,
+    operation_type_t operation_type, ssize_t byte_count, int file_descriptor)
+{
+    switch (operation_type) {
+        case OPERATION_TYPE_READ: {
+            ++result->read_count;
+        }
+        break;
+
+        case OPERATION_TYPE_WRITE: {
+            ++result->write_count;
+        }
+        break;
+
+        case OPERATION_TYPE_SEEK: {
+            ++result->seek_count;
+        }
+        break;
+    }
+
+    if (byte_count > 0) {
+        result->byte_count += byte_count;
+    } else if (byte_count == -EAGAIN) {
+        ++result->again_count;
+    } else if ((operation_type != OPERATION_TYPE_SEEK) &&
+        ((byte_count == 0) || (byte_count == -ENOMEM) ||
+            (byte_count == -ENOSPC))) {
+        /* End of the device: rewind. Streams have no position, but
+           then they do not run out of space either. */
+        lseek(file_descriptor, 0, SEEK_SET);
+        ++result->syscall_count;
+    } else if (byte_count < 0) {
+        ++result->error_count;
+    }
+}
+
+
+
+static void run_syscall_loop(thread_context_t *context, int file_descriptor,
+    char *buffer, off_t device_size)
+{
+    const run_parameters_t *parameters = context->parameters;
+    run_result_t *result = &context->result;
+    uint64_t random_state = context->index + 1;
+    uint64_t start_time = 0;
+    off_t offset = 0;
+    ssize_t byte_count = 0;
+    operation_type_t operation_type = OPERATION_TYPE_READ;
+
+    while (!atomic_load_explicit(context->stop, memory_order_relaxed)) {
+        operation_type = choose_operation(parameters, device_size,
+            &random_state, &offset);
+
+        start_time = now_ns();
+        switch (operation_type) {
+            case OPERATION_TYPE_READ: {
+                byte_count = read(file_descriptor, buffer,
+                    parameters->block_size);
+            }
+            break;
+
+            case OPERATION_TYPE_WRITE: {
+                byte_count = write(file_descriptor, buffer,
+                    parameters->block_size);
+            }
+            break;
+
+            case OPERATION_TYPE_SEEK: {
+                byte_count = (lseek(file_descriptor, offset, SEEK_SET) < 0) ?
+                    -1 : 0;
+            }
+            break;
+        }
+        ++result->histogram[histogram_index(now_ns() - start_time)];
+        ++result->syscall_count;
+
+        /* Offsets stay block aligned and every write is of a single byte
+           value, so a block read whole comes from a single write. */
+        if (parameters->stress && (operation_type == OPERATION_TYPE_READ) &&
+            (byte_count > 1) &&
+            (memcmp(buffer, buffer + 1, byte_count - 1) != 0)) {
+            ++result->torn_count;
+            ++result->error_count;
+        }
+
+        account_operation(result, operation_type,
+            (byte_count < 0) ? -errno : byte_count, file_descriptor);
+    }
+}
+
+
+
+/* Rings sized for a full batch, mapped, with the file registered. Returns
+   a negative errno on failure. */
+static int ring_create(ring_t *ring, int file_descriptor, unsigned depth)
+{
+    int return_code = 0;
+    struct pcd_ring_setup setup = { 0 };
+    struct pcd_ring_file ring_file = { .fd = file_descriptor };
+
+    setup.submission_count = 1;
+    while (setup.submission_count < depth) {
+        setup.submission_count <<= 1;
+    }
+
+    ring->file_descriptor = open("/dev/" PCD_RING_DEVICE_NAME, O_RDWR);
+    if ((ring->file_descriptor < 0) ||
+        (ioctl(ring->file_descriptor, PCD_IOCTL_RING_SETUP, &setup) < 0)) {
+        return_code = -errno;
+    } else {
+        ring->size = setup.size;
+        ring->area = mmap(NULL, ring->size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, ring->file_descriptor, 0);
+        if ((ring->area == MAP_FAILED) ||
+            (ioctl(ring->file_descriptor, PCD_IOCTL_RING_REGISTER,
+                &ring_file) < 0)) {
+            return_code = -errno;
+        }
+    }
+
+    if (return_code == 0) {
+        ring->header = ring->area;
+        ring->submissions = (void *)((char *)ring->area +
+            setup.submission_offset);
+        ring->completions = (void *)((char *)ring->area +
+            setup.completion_offset);
+    } else {
+        fprintf(stderr, "Ring setup failed: %s!\n", strerror(-return_code));
+        ring_destroy(ring);
+    }
+
+    return return_code;
+}
+
+
+
+static void ring_destroy(ring_t *ring)
+{
+    if ((ring->area != NULL) && (ring->area != MAP_FAILED)) {
+        munmap(ring->area, ring->size);
+    }
+
+    if (ring->file_descriptor >= 0) {
+        close(ring->file_descriptor);
+    }
+
+    ring->area = NULL;
+    ring->file_descriptor = -1;
+}
+
+
+
+/* The operations of the syscall loop, a batch of ring_depth of them per
+   PCD_IOCTL_RING_ENTER. Reads and writes go at the file position. Each
+   operation is given the latency of its whole batch. */
+static void run_ring_loop(thread_context_t *context, ring_t *ring,
+    int file_descriptor, char *buffer, off_t device_size)
+{
+    const run_parameters_t *parameters = context->parameters;
+    run_result_t *result = &context->result;
+    const uint32_t submission_mask = ring->header->submission_mask;
+    const uint32_t completion_mask = ring->header->completion_mask;
+    struct pcd_ring_submission *submission = NULL;
+    const struct pcd_ring_completion *completion = NULL;
+    uint64_t random_state = context->index + 1;
+    uint64_t start_time = 0;
+    uint64_t latency = 0;
+    uint32_t completion_tail = 0;
+    unsigned index = 0;
+    off_t offset = 0;
+    operation_type_t operation_type = OPERATION_TYPE_READ;
+
+    while (!atomic_load_explicit(context->stop, memory_order_relaxed)) {
+        for (index = 0; index < parameters->ring_depth; ++index) {
+            operation_type = choose_operation(parameters, device_size,
+                &random_state, &offset);
+
+            submission = &ring->submissions[ring->submission_tail &
+                submission_mask];
+            memset(submission, 0, sizeof(*submission));
+            submission->file_index = 0;
+            submission->address = (uintptr_t)buffer;
+            submission->user_data = operation_type;
+            if (operation_type == OPERATION_TYPE_SEEK) {
+                submission->opcode = PCD_RING_OP_SEEK;
+                submission->offset = offset;
+                submission->length = SEEK_SET;
+            } else {
+                submission->opcode = (operation_type == OPERATION_TYPE_READ) ?
+                    PCD_RING_OP_READ : PCD_RING_OP_WRITE;
+                submission->offset = -1;
+                submission->length = parameters->block_size;
+            }
+            ++ring->submission_tail;
+        }
+        __atomic_store_n(&ring->header->submission_tail,
+            ring->submission_tail, __ATOMIC_RELEASE);
+
+        start_time = now_ns();
+        if (ioctl(ring->file_descriptor, PCD_IOCTL_RING_ENTER) < 0) {
+            ++result->error_count;
+            break;
+        }
+        latency = now_ns() - start_time;
+        ++result->syscall_count;
+
+        completion_tail = __atomic_load_n(&ring->header->completion_tail,
+            __ATOMIC_ACQUIRE);
+        for (; ring->completion_head != completion_tail;
+            ++ring->completion_head) {
+            completion = &ring->completions[ring->completion_head &
+                completion_mask];
+            ++result->histogram[histogram_index(latency)];
+            account_operation(result,
+                (operation_type_t)completion->user_data, completion->result,
+                file_descriptor);
+        }
+        __atomic_store_n(&ring->header->completion_head,
+            ring->completion_head, __ATOMIC_RELEASE);
+    }
+}
+
+
+
+/* Random keys, with the operations of the mix mapped to gets, puts and
+   deletes. Keys missing after a delete are not counted as errors. Only
+   the device takes syscalls. */
+static void run_kv_loop(thread_context_t *context, int file_descriptor,
+    char *buffer)
+{
+    const run_parameters_t *parameters = context->parameters;
+    run_result_t *result = &context->result;
+    uint64_t random_state = context->index + 1;
+    uint64_t start_time = 0;
+    off_t offset = 0;
+    ssize_t byte_count = 0;
+    operation_type_t operation_type = OPERATION_TYPE_READ;
+    char key[PCD_KV_KEY_SIZE];
+
+    while (!atomic_load_explicit(context->stop, memory_order_relaxed)) {
+        operation_type = choose_operation(parameters, 0, &random_state,
+            &offset);
+        snprintf(key, sizeof(key), "key%" PRIu64,
+            next_random(&random_state) % parameters->kv_key_count);
+
+        start_time = now_ns();
+        if (parameters->kv_backend == KV_BACKEND_DEVICE) {
+            byte_count = kv_device_operation(file_descriptor,
+                operation_type, key, buffer, parameters->block_size);
+            ++result->syscall_count;
+        } else {
+            byte_count = shm_map_operation(parameters->shm_map,
+                operation_type, key, buffer, parameters->block_size);
+        }
+        ++result->histogram[histogram_index(now_ns() - start_time)];
+
+        if (operation_type == OPERATION_TYPE_READ) {
+            ++result->read_count;
+        } else if (operation_type == OPERATION_TYPE_WRITE) {
+            ++result->write_count;
+        } else {
+            ++result->seek_count;
+        }
+
+        if (byte_count > 0) {
+            result->byte_count += byte_count;
+        } else if ((byte_count < 0) && (byte_count != -ENOENT)) {
+            ++result->error_count;
+        }
+    }
+}
+
+
+
+/* Puts every key of the run, before the clock starts. */
+static int kv_device_fill(const run_parameters_t *parameters)
+{
+    int return_code = 0;
+    int file_descriptor = -1;
+    unsigned key_index = 0;
+    ssize_t byte_count = 0;
+    char *buffer = NULL;
+    char key[PCD_KV_KEY_SIZE];
+
+    buffer = calloc(1, parameters->block_size);
+    file_descriptor = open(parameters->device_path, O_RDWR);
+    if ((buffer == NULL) || (file_descriptor < 0)) {
+        return_code = (buffer == NULL) ? -ENOMEM : -errno;
+    }
+
+    for (; (key_index < parameters->kv_key_count) && (return_code == 0);
+        ++key_index) {
+        snprintf(key, sizeof(key), "key%u", key_index);
+        byte_count = kv_device_operation(file_descriptor,
+            OPERATION_TYPE_WRITE, key, buffer, parameters->block_size);
+        if (byte_count < 0) {
+            return_code = byte_count;
+        }
+    }
+
+    if (file_descriptor >= 0) {
+        close(file_descriptor);
+    }
+    free(buffer);
+
+    if (return_code != 0) {
+        fprintf(stderr, "Unable to fill %s: %s, run skipped!\n",
+            parameters->device_path, strerror(-return_code));
+    }
+
+    return return_code;
+}
+
+
+
+/* Byte count of the value got or put, 0 for a delete, or a negative
+   errno. */
+static ssize_t kv_device_operation(int file_descriptor,
+    operation_type_t operation_type, const char *key, char *buffer,
+    size_t block_size)
+{
+    ssize_t return_code = 0;
+    unsigned long command = PCD_IOCTL_KV_GET;
+    struct pcd_kv_entry entry = { 0 };
+
+    snprintf(entry.key, sizeof(entry.key), "%s", key);
+    entry.value = (uintptr_t)buffer;
+    entry.length = block_size;
+
+    if (operation_type == OPERATION_TYPE_WRITE) {
+        command = PCD_IOCTL_KV_PUT;
+    } else if (operation_type == OPERATION_TYPE_SEEK) {
+        command = PCD_IOCTL_KV_DELETE;
+    }
+
+    if (ioctl(file_descriptor, command, &entry) < 0) {
+        return_code = -errno;
+    } else if (operation_type != OPERATION_TYPE_SEEK) {
+        return_code = entry.length;
+    }
+
+    return return_code;
+}
+
+
+
+/* Open addressing over twice as many slots as keys, each key in the first
+   free slot from its hash on. Returns a negative errno on failure. */
+static int shm_map_create(shm_map_t *map, unsigned key_count,
+    size_t value_size)
+{
+    int return_code = 0;
+    unsigned index = 0;
+    uint64_t slot_count = 1;
+    uint64_t slot_index = 0;
+    size_t lock_area_size = 0;
+    shm_map_slot_t *slot = NULL;
+    pthread_rwlockattr_t lock_attributes;
+    char key[PCD_KV_KEY_SIZE];
+
+    while (slot_count < (2ull * key_count)) {
+        slot_count <<= 1;
+    }
+
+    /* Slots stay 8 byte aligned, locks sit in front of them. */
+    map->slot_size = (sizeof(shm_map_slot_t) + value_size + 7) & ~(size_t)7;
+    map->slot_mask = slot_count - 1;
+    lock_area_size = (SHM_MAP_LOCK_COUNT * sizeof(pthread_rwlock_t) + 63) &
+        ~(size_t)63;
+    map->size = lock_area_size + slot_count * map->slot_size;
+
+    map->area = mmap(NULL, map->size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map->area == MAP_FAILED) {
+        return_code = -errno;
+        fprintf(stderr, "Shared memory map creation failed: %s!\n",
+            strerror(-return_code));
+        map->area = NULL;
+        return return_code;
+    }
+
+    map->locks = map->area;
+    map->slots = (char *)map->area + lock_area_size;
+
+    pthread_rwlockattr_init(&lock_attributes);
+    pthread_rwlockattr_setpshared(&lock_attributes, PTHREAD_PROCESS_SHARED);
+    for (; index < SHM_MAP_LOCK_COUNT; ++index) {
+        pthread_rwlock_init(&map->locks[index], &lock_attributes);
+    }
+    pthread_rwlockattr_destroy(&lock_attributes);
+
+    for (index = 0; index < key_count; ++index) {
+        snprintf(key, sizeof(key), "key%u", index);
+        slot_index = hash_key(key);
+        do {
+            slot = (shm_map_slot_t *)(map->slots +
+                (slot_index++ & map->slot_mask) * map->slot_size);
+        } while (slot->key[0] != '\0');
+
+        memcpy(slot->key, key, sizeof(key));
+        slot->length = value_size;
+        slot->present = 1;
+    }
+
+    return return_code;
+}
+
+
+
+static void shm_map_destroy(shm_map_t *map)
+{
+    unsigned index = 0;
+
+    if (map->area == NULL) {
+        return;
+    }
+
+    for (; index < SHM_MAP_LOCK_COUNT; ++index) {
+        pthread_rwlock_destroy(&map->locks[index]);
+    }
+
+    munmap(map->area, map->size);
+    map->area = NULL;
+}
+
+
+
+/* Keys of a slot never change once the map is created, so finding a slot
+   takes no lock. */
+static shm_map_slot_t *shm_map_find(const shm_map_t *map, const char *key,
+    uint64_t hash)
+{
+    shm_map_slot_t *slot = NULL;
+    uint64_t slot_index = hash;
+
+    do {
+        slot = (shm_map_slot_t *)(map->slots +
+            (slot_index++ & map->slot_mask) * map->slot_size);
+    } while ((slot->key[0] != '\0') &&
+        (strncmp(slot->key, key, PCD_KV_KEY_SIZE) != 0));
+
+    return (slot->key[0] != '\0') ? slot : NULL;
+}
+
+
+
+/* Same results as kv_device_operation(). */
+static ssize_t shm_map_operation(shm_map_t *map,
+    operation_type_t operation_type, const char *key, char *buffer,
+    size_t block_size)
+{
+    ssize_t return_code = 0;
+    const uint64_t hash = hash_key(key);
+    pthread_rwlock_t *lock = &map->locks[hash % SHM_MAP_LOCK_COUNT];
+    shm_map_slot_t *slot = shm_map_find(map, key, hash);
+
+    if (slot == NULL) {
+        return -ENOENT;
+    }
+
+    if (operation_type == OPERATION_TYPE_READ) {
+        pthread_rwlock_rdlock(lock);
+        if (!slot->present) {
+            return_code = -ENOENT;
+        } else if (slot->length > block_size) {
+            return_code = -ERANGE;
+        } else {
+            memcpy(buffer, slot->value, slot->length);
+            return_code = slot->length;
+        }
+        pthread_rwlock_unlock(lock);
+    } else {
+        pthread_rwlock_wrlock(lock);
+        if (operation_type == OPERATION_TYPE_WRITE) {
+            memcpy(slot->value, buffer, block_size);
+            slot->length = block_size;
+            slot->present = 1;
+            return_code = block_size;
+        } else if (slot->present) {
+            slot->present = 0;
+        } else {
+            return_code = -ENOENT;
+        }
+        pthread_rwlock_unlock(lock);
+    }
+
+    return return_code;
+}
+
+
+
+/* FNV-1a. */
+static uint64_t hash_key(const char *key)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (; *key != '\0'; ++key) {
+        hash ^= (unsigned char)*key;
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+
+
+static void merge_result(run_result_t *destination,
+    const run_result_t *source)
+{
+    unsigned index = 0;
+
+    destination->read_count += source->read_count;
+    destination->write_count += source->write_count;
+    destination->seek_count += source->seek_count;
+    destination->byte_count += source->byte_count;
+    destination->syscall_count += source->syscall_count;
+    destination->again_count += source->again_count;
+    destination->error_count += source->error_count;
+    destination->torn_count += source->torn_count;
+
+    for (; index < HISTOGRAM_BUCKET_COUNT; ++index) {
+        destination->histogram[index] += source->histogram[index];
+    }
+}
+
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec time = { 0 };
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (uint64_t)time.tv_sec * NANOSECONDS_PER_SECOND + time.tv_nsec;
+}
+
+
+
+/* xorshift64, good enough to pick operations and offsets. */
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+
+    return *state;
+}
+
+
+
+static unsigned histogram_index(uint64_t value)
+{
+    unsigned exponent = 0;
+
+    if (value < HISTOGRAM_SUB_BUCKET_COUNT) {
+        return value;
+    }
+
+    exponent = 63 - __builtin_clzll(value);
+
+    return (exponent - HISTOGRAM_SUB_BUCKET_BITS + 1) *
+        HISTOGRAM_SUB_BUCKET_COUNT +
+        ((value >> (exponent - HISTOGRAM_SUB_BUCKET_BITS)) &
+            (HISTOGRAM_SUB_BUCKET_COUNT - 1));
+}
+
+
+
+/* Upper bound of the values counted in the given bucket. */
+static uint64_t histogram_value(unsigned index)
+{
+    const unsigned group = index / HISTOGRAM_SUB_BUCKET_COUNT;
+    const unsigned sub_bucket = index % HISTOGRAM_SUB_BUCKET_COUNT;
+
+    if (group == 0) {
+        return index;
+    }
+
+    return (((uint64_t)HISTOGRAM_SUB_BUCKET_COUNT + sub_bucket + 1) <<
+        (group - 1)) - 1;
+}
+
+
+
+static uint64_t histogram_percentile(const run_result_t *result,
+    double percentile)
+{
+    unsigned index = 0;
+    uint64_t total = 0;
+    uint64_t cumulative = 0;
+    uint64_t target = 0;
+
+    for (; index < HISTOGRAM_BUCKET_COUNT; ++index) {
+        total += result->histogram[index];
+    }
+
+    if (total == 0) {
+        return 0;
+    }
+
+    target = (uint64_t)(percentile * total);
+    if (target < (percentile * total)) {
+        ++target;
+    }
+
+    for (index = 0; index < HISTOGRAM_BUCKET_COUNT; ++index) {
+        cumulative += result->histogram[index];
+        if (cumulative >= target) {
+            break;
+        }
+    }
+
+    return histogram_value(index);
+}
+
+
+
+static void print_header(output_format_t output_format)
+{
+    if (output_format == OUTPUT_FORMAT_TEXT) {
+        printf("%-32s %7s %7s %-9s %-8s %-8s %5s %-6s %10s %12s %10s %10s "
+            "%10s %12s %8s\n", "device", "block", "threads", "mix", "mode",
+            "checksum", "ring", "kv", "MiB/s", "ops/s", "p50[ns]", "p99[ns]",
+            "p999[ns]", "syscalls/MiB", "errors");
+    } else if (output_format == OUTPUT_FORMAT_CSV) {
+        printf("device,block_size,threads,read_percent,write_percent,"
+            "seek_percent,nonblocking,checksum,ring_depth,kv,duration_s,reads,"
+            "writes,seeks,"
+            "bytes,syscalls,eagain,errors,throughput_mib_s,ops_per_s,p50_ns,"
+            "p99_ns,p999_ns,syscalls_per_mib\n");
+    }
+}
+
+
+
+/* Syscalls per MiB are reported as 0 when nothing was transferred. */
+static void print_result(output_format_t output_format,
+    const run_parameters_t *parameters, const run_result_t *result,
+    double elapsed)
+{
+    const uint64_t operation_count = result->read_count +
+        result->write_count + result->seek_count;
+    const double mebibyte_count = result->byte_count / BYTES_PER_MEBIBYTE;
+    const double throughput = mebibyte_count / elapsed;
+    const double operation_rate = operation_count / elapsed;
+    const double syscalls_per_mebibyte = (result->byte_count > 0) ?
+        (result->syscall_count / mebibyte_count) : 0.0;
+    const uint64_t p50 = histogram_percentile(result, 0.50);
+    const uint64_t p99 = histogram_percentile(result, 0.99);
+    const uint64_t p999 = histogram_percentile(result, 0.999);
+    const char *checksum_mode_names[] = { "-", "off", "on" };
+    const char *checksum = checksum_mode_names[parameters->checksum_mode];
+    const char *kv_backend_names[] = { "-", "device", "shm" };
+    const char *kv = kv_backend_names[parameters->kv_backend];
+    char mix[16];
+
+    snprintf(mix, sizeof(mix), "%u:%u:%u", parameters->mix.read_percent,
+        parameters->mix.write_percent, parameters->mix.seek_percent);
+
+    switch (output_format) {
+        case OUTPUT_FORMAT_TEXT: {
+            printf("%-32s %7zu %7u %-9s %-8s %-8s %5u %-6s %10.2f %12.0f %10"
+                PRIu64 " %10" PRIu64 " %10" PRIu64 " %12.1f %8" PRIu64 "\n",
+                parameters->device_path, parameters->block_size,
+                parameters->thread_count, mix,
+                parameters->nonblocking ? "nonblock" : "block", checksum,
+                parameters->ring_depth, kv, throughput,
+                operation_rate, p50, p99, p999, syscalls_per_mebibyte,
+                result->error_count);
+        }
+        break;
+
+        case OUTPUT_FORMAT_CSV: {
+            printf("%s,%zu,%u,%u,%u,%u,%d,%s,%u,%s,%.3f,%" PRIu64 ",%" PRIu64
+                ",%"
+                PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+                ",%.3f,%.1f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.3f\n",
+                parameters->device_path, parameters->block_size,
+                parameters->thread_count, parameters->mix.read_percent,
+                parameters->mix.write_percent, parameters->mix.seek_percent,
+                parameters->nonblocking, checksum, parameters->ring_depth,
+                kv, elapsed, result->read_count,
+                result->write_count, result->seek_count, result->byte_count,
+                result->syscall_count, result->again_count,
+                result->error_count, throughput, operation_rate, p50, p99,
+                p999, syscalls_per_mebibyte);
+        }
+        break;
+
+        case OUTPUT_FORMAT_JSON: {
+            printf("{\"device\":\"%s\",\"block_size\":%zu,\"threads\":%u,"
+                "\"read_percent\":%u,\"write_percent\":%u,"
+                "\"seek_percent\":%u,\"nonblocking\":%s,\"checksum\":\"%s\","
+                "\"ring_depth\":%u,\"kv\":\"%s\",\"duration_s\":%.3f,"
+                "\"reads\":%" PRIu64 ",\"writes\":%" PRIu64 ",\"seeks\":%"
+                PRIu64 ",\"bytes\":%" PRIu64 ",\"syscalls\":%" PRIu64
+                ",\"eagain\":%" PRIu64 ",\"errors\":%" PRIu64
+                ",\"throughput_mib_s\":%.3f,\"ops_per_s\":%.1f,"
+                "\"p50_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64
+                ",\"p999_ns\":%" PRIu64 ",\"syscalls_per_mib\":%.3f}\n",
+                parameters->device_path, parameters->block_size,
+                parameters->thread_count, parameters->mix.read_percent,
+                parameters->mix.write_percent, parameters->mix.seek_percent,
+                parameters->nonblocking ? "true" : "false", checksum,
+                parameters->ring_depth, kv, elapsed,
+                result->read_count, result->write_count, result->seek_count,
+                result->byte_count, result->syscall_count,
+                result->again_count, result->error_count, throughput,
+                operation_rate, p50, p99, p999, syscalls_per_mebibyte);
+        }
+        break;
+    }
+
+    fflush(stdout);
+}
@@ -9,6 +9,9 @@
 #include <linux/platform_device.h>
 #include <linux/gpio/consumer.h>
 
+#define CREATE_TRACE_POINTS
+#include "led_ext_trace.h"
+
 
 
 /*****************************************************************************/
@@ -182,7 +185,7 @@ static int led_ext_probe(struct platform_device *platform_device)
         led_ext_devices = devm_kzalloc(&platform_device->dev,
             sizeof(struct device *) * led_ext_device_count, GFP_KERNEL);
         if (led_ext_devices != NULL) {
-            dev_info(&platform_device->dev, "Memory allocation for "
+            dev_dbg(&platform_device->dev, "Memory allocation for "
                 "external LEDs devices done...\n");
 
             for_each_available_child_of_node(parent_device_node,
@@ -195,13 +198,13 @@ static int led_ext_probe(struct platform_device *platform_device)
                 led_ext_private_data = devm_kzalloc(&platform_device->dev,
                     sizeof(struct led_ext_private_data), GFP_KERNEL);
                 if (led_ext_private_data != NULL) {
-                    dev_err(&platform_device->dev, "Memory allocation for "
+                    dev_dbg(&platform_device->dev, "Memory allocation for "
                         "external LED private data done...\n");
 
                     return_code = of_property_read_string(child_device_node,
                         "label", &label);
                     if (return_code == 0) {
-                        dev_info(&platform_device->dev, "External LED label: "
+                        dev_dbg(&platform_device->dev, "External LED label: "
                             "%s\n", label);
                         strcpy(led_ext_private_data->label, label);
                     } else {
@@ -214,7 +217,7 @@ static int led_ext_probe(struct platform_device *platform_device)
                             "state", &child_device_node->fwnode, GPIOD_OUT_LOW,
                             led_ext_private_data->label);
                     if (!IS_ERR(led_ext_private_data->gpio_desc)) {
-                        dev_info(&platform_device->dev, "GPIO assignment "
+                        dev_dbg(&platform_device->dev, "GPIO assignment "
                             "done...\n");
 
                         led_ext_devices[device_index] =
@@ -223,7 +226,7 @@ static int led_ext_probe(struct platform_device *platform_device)
                                 led_ext_attributes_groups,
                                 led_ext_private_data->label);
                         if (!IS_ERR(led_ext_devices[device_index])) {
-                            dev_info(&platform_device->dev, "Device creation "
+                            dev_dbg(&platform_device->dev, "Device creation "
                              "done...\n");
                             ++device_index;
                         } else {
@@ -309,6 +312,8 @@ static ssize_t state_show(struct device *device,
 
     return_code = sprintf(output_buffer, "%s\n", led_state);
 
+    trace_led_ext_state_show(dev_name(device), gpio_value, return_code);
+
     return return_code;
 }
 
@@ -319,15 +324,18 @@ static ssize_t state_store(struct device *device,
     size_t char_count)
 {
     ssize_t return_code = 0;
+    int gpio_value = -1;
     struct led_ext_private_data *led_ext_private_data = NULL;
 
     led_ext_private_data = dev_get_drvdata(device);
     if (led_ext_private_data != NULL) {
         if (sysfs_streq(input_buffer, "ON")) {
-            gpiod_set_value(led_ext_private_data->gpio_desc, 1);
+            gpio_value = 1;
+            gpiod_set_value(led_ext_private_data->gpio_desc, gpio_value);
             return_code = char_count;
         } else if (sysfs_streq(input_buffer, "OFF")) {
-            gpiod_set_value(led_ext_private_data->gpio_desc, 0);
+            gpio_value = 0;
+            gpiod_set_value(led_ext_private_data->gpio_desc, gpio_value);
             return_code = char_count;
         } else {
             return_code = -EINVAL;
@@ -336,6 +344,8 @@ static ssize_t state_store(struct device *device,
         return_code = -ENOENT;
     }
 
+    trace_led_ext_state_store(dev_name(device), gpio_value, return_code);
+
     return return_code;
 }
 
@@ -0,0 +1,68 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM led_ext
+
+#if !defined(LED_EXT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define LED_EXT_TRACE_H
+
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include <linux/tracepoint.h>
+
+
+
+/*****************************************************************************/
+/* TRACE EVENTS */
+/*****************************************************************************/
+
+/* Accesses to the state attribute, available under
+   /sys/kernel/tracing/events/led_ext/. The value is the GPIO value read or
+   written, the result the value returned to sysfs. */
+DECLARE_EVENT_CLASS(led_ext_state,
+    TP_PROTO(const char *label, int value, ssize_t result),
+    TP_ARGS(label, value, result),
+
+    TP_STRUCT__entry(
+        __string(label, label)
+        __field(int, value)
+        __field(ssize_t, result)
+    ),
+
+    TP_fast_assign(
+        __assign_str(label, label);
+        __entry->value = value;
+        __entry->result = result;
+    ),
+
+    TP_printk("label=%s value=%d result=%zd", __get_str(label),
+        __entry->value, __entry->result)
+);
+
+
+
+DEFINE_EVENT(led_ext_state, led_ext_state_show,
+    TP_PROTO(const char *label, int value, ssize_t result),
+    TP_ARGS(label, value, result)
+);
+
+
+
+DEFINE_EVENT(led_ext_state, led_ext_state_store,
+    TP_PROTO(const char *label, int value, ssize_t result),
+    TP_ARGS(label, value, result)
+);
+
+#endif /* LED_EXT_TRACE_H */
+
+
+
+/*****************************************************************************/
+/* TRACE DEFINITIONS */
+/*****************************************************************************/
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE led_ext_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,648 @@
+#ifndef PSEUDO_CHAR_DEVICE_H
+#define PSEUDO_CHAR_DEVICE_H
+
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include <linux/atomic.h>
+#include <linux/cache.h>
+#include <linux/cdev.h>
+#include <linux/crypto.h>
+#include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/hashtable.h>
+#include <linux/mm_types.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/rhashtable-types.h>
+#include <linux/sysfs.h>
+#include <linux/rcupdate.h>
+#include <linux/rwsem.h>
+#include <linux/seqlock.h>
+#include <linux/sizes.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/uio.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+
+#include "pseudo_char_device_ioctl.h"
+
+
+
+/*****************************************************************************/
+/* PUBLIC MACROS */
+/*****************************************************************************/
+
+/* Devices created when the module is loaded, more may be created through
+   the control device. */
+#define DEFAULT_DEVICE_COUNT    4
+#define DEVICE_COUNT_MAX        1024
+#define DEVICE_BUFFER_SIZE      512
+
+#define DEVICE_BUFFER_SIZE_MAX  SZ_1G
+
+/* Sparse and compressed devices only use memory for what has been written
+   to them, so their size is bounded by what file positions can express. */
+#define DEVICE_SPARSE_BUFFER_SIZE_MAX   (SIZE_MAX >> 1)
+
+/* Compressed devices store their data in chunks of this size and keep this
+   many of them decompressed. */
+#define DEVICE_COMPRESSED_CHUNK_SIZE    SZ_16K
+#define DEVICE_COMPRESSED_CACHE_SIZE    4
+
+/* Bucket N of a latency histogram counts operations which took less than
+   2^N nanoseconds, the last one also counts everything slower. */
+#define DEVICE_LATENCY_BUCKET_COUNT 32
+
+/* Watches a device may have registered at a time. */
+#define DEVICE_WATCH_COUNT_MAX  64
+
+/* Open transactions of a device, each holding a copy of its buffer, and
+   the disjoint ranges a transaction may stage writes into. */
+#define DEVICE_TRANSACTION_COUNT_MAX        16
+#define DEVICE_TRANSACTION_RANGE_COUNT_MAX  64
+
+/* Buckets of the table of per file QoS of a device, and the weight of a
+   file without settings. */
+#define DEVICE_QOS_TABLE_BITS       6
+#define DEVICE_QOS_WEIGHT_DEFAULT   100
+
+/* Start time of a write which has not waited for room yet. */
+#define DEVICE_QOS_UNCHARGED        U64_MAX
+
+/* Largest record of a record device, which is also limited to half its
+   buffer. */
+#define DEVICE_RECORD_SIZE_MAX  SZ_64K
+
+/* Random access devices with checksums enabled keep one per chunk of this
+   size, so a small read only hashes a small part of the buffer. */
+#define DEVICE_CHECKSUM_CHUNK_SIZE  SZ_1K
+
+
+
+/*****************************************************************************/
+/* PUBLIC ENUMS */
+/*****************************************************************************/
+
+typedef enum permission_type {
+    PERMISSION_TYPE_READ = PCD_PERMISSION_READ,
+    PERMISSION_TYPE_WRITE = PCD_PERMISSION_WRITE,
+    PERMISSION_TYPE_READ_WRITE = PCD_PERMISSION_READ_WRITE
+}permission_type_t;
+
+
+
+typedef enum device_mode {
+    DEVICE_MODE_RANDOM_ACCESS,
+    DEVICE_MODE_FIFO,
+    DEVICE_MODE_SHARDED,
+    DEVICE_MODE_SPARSE,
+    DEVICE_MODE_COMPRESSED,
+    DEVICE_MODE_RECORD,
+    DEVICE_MODE_BROADCAST,
+    DEVICE_MODE_KV,
+    DEVICE_MODE_COUNT
+}device_mode_t;
+
+
+
+/*****************************************************************************/
+/* PUBLIC STRUCTURES */
+/*****************************************************************************/
+
+/* Set of operations implementing a device mode. Core file operations take
+   care of the common part (permissions, private data) and then dispatch to
+   the mode of the device. Operations left NULL fall back to the defaults,
+   a mode without resize has a fixed buffer size, one without ioctl has no
+   commands. Init sets up the storage of the device, exit releases it, even
+   after a failed init. Release undoes what the file set up. Pages mapped
+   by pseudo_char_device_buffer_mmap() come from fault, if the mode has
+   one, and from the device buffer otherwise. */
+typedef struct device_mode_operations {
+    const char *name;
+    int (*init)(struct device_data *device_data);
+    void (*exit)(struct device_data *device_data);
+    int (*resize)(struct device_data *device_data, size_t size);
+    int (*open)(struct inode *inode, struct file *file);
+    void (*release)(struct file *file);
+    loff_t (*llseek)(struct file *file, loff_t file_position_offset,
+        int whence);
+    ssize_t (*read_iter)(struct kiocb *iocb, struct iov_iter *iov_iter);
+    ssize_t (*write_iter)(struct kiocb *iocb, struct iov_iter *iov_iter);
+    __poll_t (*poll)(struct file *file, struct poll_table_struct *poll_table);
+    int (*mmap)(struct file *file, struct vm_area_struct *vma);
+    vm_fault_t (*fault)(struct vm_fault *vm_fault);
+    long (*ioctl)(struct file *file, unsigned int command,
+        unsigned long argument);
+}device_mode_operations_t;
+
+
+
+/* Single-producer/single-consumer ring placed over the device buffer.
+   Producer and consumer indices are free running and live on separate
+   cache lines, so the writer and the reader never bounce a line between
+   each other. The locks only serialize writers against writers and readers
+   against readers. */
+typedef struct fifo_data {
+    unsigned int head ____cacheline_aligned_in_smp;
+    struct mutex producer_lock;
+    wait_queue_head_t write_queue;
+
+    unsigned int tail ____cacheline_aligned_in_smp;
+    struct mutex consumer_lock;
+    wait_queue_head_t read_queue;
+}fifo_data_t;
+
+
+
+/* Segment of a single CPU in the sharded mode. Like in the FIFO, indices
+   are free running and producer and consumer sides live on separate cache
+   lines. The consumer side is only ever touched by the reader holding the
+   consumer lock of the device. */
+typedef struct sharded_segment {
+    unsigned int head ____cacheline_aligned_in_smp;
+    struct mutex producer_lock;
+    char *data;
+
+    unsigned int tail ____cacheline_aligned_in_smp;
+    unsigned int record_offset;
+}sharded_segment_t;
+
+
+
+typedef struct sharded_data {
+    sharded_segment_t __percpu *segments;
+    struct mutex consumer_lock;
+    wait_queue_head_t read_queue;
+    wait_queue_head_t write_queue;
+}sharded_data_t;
+
+
+
+/* Ring of a broadcast device, every reader sees every byte written to it.
+   Positions are free running offsets into the stream of written bytes, the
+   cursor of a reader is the file position of its file. Writers overwrite
+   the oldest data without looking at the readers; before they do, they
+   move the reservation past the range about to be overwritten, so a
+   reader which copied from it finds out its copy may be torn. Only the
+   ring beyond reservation - size is valid. */
+typedef struct broadcast_data {
+    atomic64_t head ____cacheline_aligned_in_smp;
+    atomic64_t reservation;
+    struct mutex producer_lock;
+
+    wait_queue_head_t read_queue ____cacheline_aligned_in_smp;
+    atomic64_t overrun_count;
+    atomic64_t lost_byte_count;
+}broadcast_data_t;
+
+
+
+/* Store of a key-value device. Lookups only walk the table under RCU,
+   updates are serialized by the lock and free the entries they replace
+   after a grace period. The entries take byte count bytes, at most the
+   buffer size of the device. */
+typedef struct kv_data {
+    struct rhashtable table;
+    struct mutex lock;
+    size_t byte_count;
+    bool table_ready;
+}kv_data_t;
+
+
+
+/* Storage of a device in the sparse mode: its written pages, indexed by
+   their page offset. The lock keeps pages from being freed under readers
+   and writers, it does not protect the page contents from mappings. Devices
+   opted in to reclaim are on the list of the shrinker, which resumes its
+   scan of the device at the reclaim index. Devices opted in to dedup have
+   the pages written to them looked up by the dedup work, pages found in
+   other devices are shared with them. */
+typedef struct sparse_data {
+    struct xarray pages;
+    struct rw_semaphore lock;
+    struct list_head reclaim_node;
+    unsigned long reclaim_index;
+    bool reclaimable;
+    bool dedup;
+    struct delayed_work dedup_work;
+    atomic_long_t resident_page_count;
+    atomic_long_t dedup_page_count;
+    atomic_long_t compressed_byte_count;
+    atomic_long_t reclaimed_byte_count;
+}sparse_data_t;
+
+
+
+/* Decompressed chunk of a compressed device. Dirty ones differ from the
+   stored chunk and are compressed when they leave the cache. Users keep
+   the entry from leaving the cache, the data lock keeps its data from
+   changing while they copy it. */
+typedef struct compressed_cache_entry {
+    unsigned long chunk_index;
+    u8 *data;
+    u64 last_use;
+    unsigned int user_count;
+    bool valid;
+    bool dirty;
+    struct rw_semaphore data_lock;
+}compressed_cache_entry_t;
+
+
+
+/* Storage of a device in the compressed mode: stored chunks indexed by
+   their offset, a cache of decompressed ones and the statistics, under a
+   single lock, as the compressor may only be used by one task at a time.
+   Which chunk an entry holds, its users and the cache hits are protected
+   by the cache lock instead, so reads of cached chunks skip the device
+   lock. Times are in nanoseconds. */
+typedef struct compressed_data {
+    struct xarray chunks;
+    struct mutex lock;
+    spinlock_t cache_lock;
+    wait_queue_head_t cache_queue;
+    struct crypto_comp *compressor;
+    char algorithm[CRYPTO_MAX_ALG_NAME];
+    u8 *scratch;
+    compressed_cache_entry_t cache[DEVICE_COMPRESSED_CACHE_SIZE];
+    u64 use_count;
+    u64 original_byte_count;
+    u64 compressed_byte_count;
+    u64 compression_count;
+    u64 compression_time;
+    u64 decompression_count;
+    u64 decompression_time;
+    u64 cache_hit_count;
+    u64 cache_miss_count;
+}compressed_data_t;
+
+
+
+/* Change notification of a random access device. The generation counts
+   writes, a file is readable once it moved past the generation of the
+   last read of the file (kept in its f_version). Watches are indexed by
+   their id. */
+typedef struct notify_data {
+    atomic64_t generation;
+    wait_queue_head_t change_queue;
+    struct xarray watches;
+}notify_data_t;
+
+
+
+/* QoS settings of a file, kept by the QoS code. */
+typedef struct qos_file qos_file_t;
+
+/* Per file QoS of a device, found by the address of the file. Writers of
+   the streaming modes waiting for room queue up in order of their virtual
+   start time, so a ring filling up is shared in proportion to the weights
+   of their files. The lock serializes changes to the table and the queue,
+   lookups only take the RCU read lock. */
+typedef struct qos_data {
+    DECLARE_HASHTABLE(files, DEVICE_QOS_TABLE_BITS);
+    spinlock_t lock;
+    u32 last_id;
+    struct list_head writers;
+    u64 virtual_time;
+}qos_data_t;
+
+
+
+/* Checksums of a random access device: the hash transform, allocated when
+   they are first enabled, and the mismatches found so far. The checksums
+   themselves belong to the buffer they describe. */
+typedef struct checksum_data {
+    struct crypto_shash *hash;
+    bool enabled;
+    atomic64_t read_mismatch_count;
+    atomic64_t verify_mismatch_count;
+}checksum_data_t;
+
+
+
+/* Optional file holding a copy of the device contents. Pages written since
+   they were last written back are set in the dirty bitmap, sized for the
+   buffer, the writeback work copies them to the file in batches. The
+   writeback lock serializes the work with flushes. Once the device is
+   removed, the files still open write back on release. */
+typedef struct backing_data {
+    struct file *file;
+    unsigned long *dirty_pages;
+    unsigned long page_count;
+    bool stopped;
+    spinlock_t dirty_lock;
+    struct delayed_work writeback_work;
+    struct mutex writeback_lock;
+    int writeback_error;
+}backing_data_t;
+
+
+
+/* Storage of a device. A resize publishes a new buffer with RCU, so the
+   size (and the checksums, if enabled) always travels together with the
+   memory it describes. */
+typedef struct device_buffer {
+    size_t size;
+    char *data;
+    u32 *checksums;
+    struct rcu_head rcu_head;
+}device_buffer_t;
+
+
+
+/* Statistics of one type of transfer. Error counters count failed
+   operations, a short transfer is a successful one which moved less than
+   requested. */
+typedef struct device_transfer_stats {
+    u64_stats_t operation_count;
+    u64_stats_t byte_count;
+    u64_stats_t short_transfer_count;
+    u64_stats_t fault_error_count;
+    u64_stats_t memory_error_count;
+    u64_stats_t latency_histogram[DEVICE_LATENCY_BUCKET_COUNT];
+}device_transfer_stats_t;
+
+
+
+/* Statistics of a device, kept per CPU so that the data path only ever
+   touches counters of its own CPU. The sync member must stay last, all
+   members before it are counters. */
+typedef struct device_stats {
+    device_transfer_stats_t read;
+    device_transfer_stats_t write;
+    u64_stats_t open_count;
+    u64_stats_t permission_error_count;
+    u64_stats_t throttle_count;
+    u64_stats_t throttle_time;
+    struct u64_stats_sync sync;
+}device_stats_t;
+
+
+
+/* Parameters of a device to create. A NULL mode name stands for the random
+   access mode, a NULL backing file for none. */
+typedef struct device_config {
+    const char *serial_number;
+    const char *mode_name;
+    const char *backing_file;
+    size_t buffer_size;
+    permission_type_t permission_type;
+}device_config_t;
+
+
+
+/* Lives for as long as its struct device does: a destroyed device goes
+   away only once the last file opened on it is released. */
+typedef struct device_data {
+    size_t buffer_size;
+    device_buffer_t __rcu *buffer;
+    struct mutex buffer_lock;
+    seqcount_t buffer_sequence;
+    spinlock_t mapping_lock;
+    atomic_t mmap_count;
+    unsigned id;
+    char serial_number[PCD_SERIAL_NUMBER_SIZE];
+    permission_type_t permission_type;
+    const device_mode_operations_t *mode_operations;
+    fifo_data_t fifo;
+    sharded_data_t sharded;
+    broadcast_data_t broadcast;
+    kv_data_t kv;
+    sparse_data_t sparse;
+    compressed_data_t compressed;
+    backing_data_t backing;
+    notify_data_t notify;
+    struct xarray transactions;
+    qos_data_t qos;
+    checksum_data_t checksum;
+    device_stats_t __percpu *stats;
+    device_stats_t stats_baseline;
+    struct mutex stats_lock;
+    struct cdev cdev;
+    struct device device;
+}device_data_t;
+
+
+
+/*****************************************************************************/
+/* PUBLIC VARIABLES */
+/*****************************************************************************/
+
+extern const device_mode_operations_t random_access_mode_operations;
+
+extern const device_mode_operations_t fifo_mode_operations;
+
+extern const device_mode_operations_t sharded_mode_operations;
+
+extern const device_mode_operations_t sparse_mode_operations;
+
+extern const device_mode_operations_t compressed_mode_operations;
+
+extern const device_mode_operations_t record_mode_operations;
+
+extern const device_mode_operations_t broadcast_mode_operations;
+
+extern const device_mode_operations_t kv_mode_operations;
+
+extern const struct attribute_group *pseudo_char_device_attribute_groups[];
+
+extern const struct attribute_group pseudo_char_device_stats_group;
+
+extern const struct attribute_group pseudo_char_device_compression_group;
+
+extern const struct attribute_group pseudo_char_device_checksum_group;
+
+
+
+/*****************************************************************************/
+/* PUBLIC FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+int pseudo_char_device_buffer_init(device_data_t *device_data);
+
+void pseudo_char_device_buffer_exit(device_data_t *device_data);
+
+int pseudo_char_device_buffer_check_size(const device_data_t *device_data,
+    size_t size);
+
+int pseudo_char_device_buffer_resize(device_data_t *device_data,
+    size_t size);
+
+int pseudo_char_device_buffer_lock(device_data_t *device_data, bool nowait);
+
+device_buffer_t *pseudo_char_device_buffer_read_lock(
+    device_data_t *device_data, int *srcu_index);
+
+void pseudo_char_device_buffer_read_unlock(int srcu_index);
+
+void pseudo_char_device_buffer_synchronize(void);
+
+device_buffer_t *pseudo_char_device_buffer_alloc(size_t size);
+
+void pseudo_char_device_buffer_free(device_buffer_t *buffer);
+
+int pseudo_char_device_buffer_replace(device_data_t *device_data,
+    device_buffer_t *new_buffer);
+
+int pseudo_char_device_buffer_mmap(struct file *file,
+    struct vm_area_struct *vma);
+
+int pseudo_char_device_create(const device_config_t *config, unsigned *id);
+
+int pseudo_char_device_destroy(const char *serial_number);
+
+bool pseudo_char_device_is_device_file(const struct file *file);
+
+bool pseudo_char_device_is_nonblocking(const struct kiocb *iocb);
+
+int pseudo_char_device_open_positioned(struct inode *inode, struct file *file);
+
+int pseudo_char_device_backing_init(device_data_t *device_data,
+    const char *path);
+
+void pseudo_char_device_backing_exit(device_data_t *device_data);
+
+void pseudo_char_device_backing_stop(device_data_t *device_data);
+
+void pseudo_char_device_backing_release(struct file *file);
+
+void pseudo_char_device_backing_mark_dirty(device_data_t *device_data,
+    loff_t file_position, size_t byte_count);
+
+void pseudo_char_device_backing_mark_mapped(device_data_t *device_data);
+
+void pseudo_char_device_backing_resize(device_data_t *device_data,
+    size_t size);
+
+int pseudo_char_device_backing_error(device_data_t *device_data);
+
+int pseudo_char_device_backing_fsync(device_data_t *device_data,
+    int datasync);
+
+void pseudo_char_device_notify_init(device_data_t *device_data);
+
+void pseudo_char_device_notify_exit(device_data_t *device_data);
+
+void pseudo_char_device_notify_open(struct file *file);
+
+void pseudo_char_device_notify_read(struct file *file);
+
+void pseudo_char_device_notify_write(device_data_t *device_data,
+    loff_t file_position, size_t byte_count);
+
+__poll_t pseudo_char_device_notify_poll(struct file *file,
+    struct poll_table_struct *poll_table);
+
+long pseudo_char_device_notify_ioctl(struct file *file, unsigned int command,
+    unsigned long argument);
+
+void pseudo_char_device_notify_release(struct file *file);
+
+void pseudo_char_device_checksum_exit(device_data_t *device_data);
+
+void pseudo_char_device_checksum_update(device_data_t *device_data,
+    device_buffer_t *buffer, loff_t file_position, size_t byte_count);
+
+unsigned long pseudo_char_device_checksum_verify(device_data_t *device_data,
+    const device_buffer_t *buffer, loff_t file_position, size_t byte_count,
+    u64 *first_mismatch);
+
+int pseudo_char_device_checksum_resize(device_data_t *device_data,
+    const device_buffer_t *old_buffer, device_buffer_t *new_buffer);
+
+long pseudo_char_device_checksum_ioctl(struct file *file,
+    unsigned int command, unsigned long argument);
+
+long pseudo_char_device_atomic_ioctl(struct file *file, unsigned int command,
+    unsigned long argument);
+
+void pseudo_char_device_transaction_init(device_data_t *device_data);
+
+void pseudo_char_device_transaction_exit(device_data_t *device_data);
+
+long pseudo_char_device_transaction_ioctl(struct file *file,
+    unsigned int command, unsigned long argument);
+
+void pseudo_char_device_transaction_release(struct file *file);
+
+int pseudo_char_device_control_init(void);
+
+void pseudo_char_device_control_exit(void);
+
+int pseudo_char_device_ring_init(void);
+
+void pseudo_char_device_ring_exit(void);
+
+void pseudo_char_device_fifo_init(device_data_t *device_data);
+
+int pseudo_char_device_reclaim_init(void);
+
+void pseudo_char_device_reclaim_exit(void);
+
+int pseudo_char_device_sparse_set_reclaimable(device_data_t *device_data,
+    bool reclaimable);
+
+u64 pseudo_char_device_sparse_resident_bytes(const device_data_t *device_data);
+
+int pseudo_char_device_sparse_set_dedup(device_data_t *device_data,
+    bool dedup);
+
+struct page *pseudo_char_device_dedup_insert(device_data_t *device_data,
+    struct page *page);
+
+void pseudo_char_device_dedup_put(device_data_t *device_data,
+    struct page *page);
+
+bool pseudo_char_device_dedup_try_remove(device_data_t *device_data,
+    struct page *page);
+
+unsigned long pseudo_char_device_dedup_saved_pages(void);
+
+u64 pseudo_char_device_compressed_resident_bytes(device_data_t *device_data);
+
+u64 pseudo_char_device_kv_resident_bytes(const device_data_t *device_data);
+
+int pseudo_char_device_stats_init(device_data_t *device_data);
+
+void pseudo_char_device_stats_exit(device_data_t *device_data);
+
+void pseudo_char_device_stats_open(device_data_t *device_data, int result);
+
+void pseudo_char_device_stats_read(device_data_t *device_data,
+    size_t byte_count, ssize_t result, u64 latency);
+
+void pseudo_char_device_stats_write(device_data_t *device_data,
+    size_t byte_count, ssize_t result, u64 latency);
+
+void pseudo_char_device_stats_throttle(device_data_t *device_data,
+    u64 throttle_time);
+
+void pseudo_char_device_qos_init(device_data_t *device_data);
+
+void pseudo_char_device_qos_exit(device_data_t *device_data);
+
+long pseudo_char_device_qos_ioctl(struct file *file, unsigned int command,
+    unsigned long argument);
+
+void pseudo_char_device_qos_release(struct file *file);
+
+ssize_t pseudo_char_device_qos_show(device_data_t *device_data,
+    char *output_buffer);
+
+int pseudo_char_device_qos_write_begin(struct kiocb *iocb, size_t byte_count,
+    qos_file_t **qos_file);
+
+void pseudo_char_device_qos_write_end(qos_file_t *qos_file,
+    size_t byte_count, ssize_t result);
+
+int pseudo_char_device_qos_wait(struct file *file, size_t byte_count,
+    u64 *start_time,
+    bool (*has_room)(const device_data_t *device_data, size_t byte_count));
+
+void pseudo_char_device_qos_wake(device_data_t *device_data);
+
+#endif /* PSEUDO_CHAR_DEVICE_H */
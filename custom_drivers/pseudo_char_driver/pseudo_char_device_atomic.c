@@ -0,0 +1,309 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <linux/atomic.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s: "fmt, __func__
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int atomic_apply_ops(device_data_t *device_data,
+    struct pcd_atomic_op *ops, u32 op_count, u32 *applied_count);
+
+static int atomic_check_op(const device_buffer_t *buffer,
+    const struct pcd_atomic_op *op);
+
+static u64 atomic_apply_op(device_buffer_t *buffer,
+    const struct pcd_atomic_op *op);
+
+static bool atomic_op_changed(const struct pcd_atomic_op *op);
+
+
+
+/*****************************************************************************/
+/* PUBLIC FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+/* A single operation returns its status, a batch the number of operations
+   applied and the status of each of them. */
+long pseudo_char_device_atomic_ioctl(struct file *file, unsigned int command,
+    unsigned long argument)
+{
+    long return_code = 0;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    void __user *user_pointer = (void __user *)argument;
+    struct pcd_atomic_op op;
+    struct pcd_atomic_batch batch;
+    struct pcd_atomic_op *ops = NULL;
+    u32 applied_count = 0;
+
+    /* Every operation may modify the buffer and returns its previous
+       value, so it takes a file open for both. */
+    if ((file->f_mode & (FMODE_READ | FMODE_WRITE)) !=
+        (FMODE_READ | FMODE_WRITE)) {
+        return -EBADF;
+    }
+
+    if (command == PCD_IOCTL_ATOMIC) {
+        if (copy_from_user(&op, user_pointer, sizeof(op)) != 0) {
+            return -EFAULT;
+        }
+
+        return_code = atomic_apply_ops(device_data, &op, 1, &applied_count);
+        if (return_code == 0) {
+            return_code = op.status;
+            if (copy_to_user(user_pointer, &op, sizeof(op)) != 0) {
+                return_code = -EFAULT;
+            }
+        }
+    } else if (command == PCD_IOCTL_ATOMIC_BATCH) {
+        if (copy_from_user(&batch, user_pointer, sizeof(batch)) != 0) {
+            return -EFAULT;
+        }
+
+        if (batch.count > PCD_ATOMIC_BATCH_COUNT_MAX) {
+            return -EINVAL;
+        }
+
+        ops = memdup_user(u64_to_user_ptr(batch.ops),
+            batch.count * sizeof(*ops));
+        if (IS_ERR(ops)) {
+            return PTR_ERR(ops);
+        }
+
+        return_code = atomic_apply_ops(device_data, ops, batch.count,
+            &batch.applied_count);
+        if ((return_code == 0) &&
+            ((copy_to_user(u64_to_user_ptr(batch.ops), ops,
+                batch.count * sizeof(*ops)) != 0) ||
+            (copy_to_user(user_pointer, &batch, sizeof(batch)) != 0))) {
+            return_code = -EFAULT;
+        }
+
+        kfree(ops);
+    } else {
+        return_code = -ENOTTY;
+    }
+
+    return return_code;
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+/* Apply the operations in order within a single write section, so readers
+   see all of them or none. The device lock keeps the buffer from being
+   resized and serializes the operations with writes, yet the operations
+   themselves are atomic instructions, so they are atomic to tasks using
+   the same instructions on a mapping of the device too. */
+static int atomic_apply_ops(device_data_t *device_data,
+    struct pcd_atomic_op *ops, u32 op_count, u32 *applied_count)
+{
+    int return_code = 0;
+    u32 index = 0;
+    device_buffer_t *buffer = NULL;
+
+    *applied_count = 0;
+    if (op_count == 0) {
+        return 0;
+    }
+
+    return_code = pseudo_char_device_buffer_lock(device_data, false);
+    if (return_code != 0) {
+        return return_code;
+    }
+
+    buffer = rcu_dereference_protected(device_data->buffer,
+        lockdep_is_held(&device_data->buffer_lock));
+
+    raw_write_seqcount_begin(&device_data->buffer_sequence);
+    for (; index < op_count; ++index) {
+        ops[index].status = atomic_check_op(buffer, &ops[index]);
+        if (ops[index].status == 0) {
+            ops[index].result = atomic_apply_op(buffer, &ops[index]);
+            pseudo_char_device_checksum_update(device_data, buffer,
+                ops[index].offset, ops[index].width);
+            ++(*applied_count);
+        }
+    }
+    raw_write_seqcount_end(&device_data->buffer_sequence);
+
+    /* Operations which left their value as it was are not writes. */
+    for (index = 0; index < op_count; ++index) {
+        if ((ops[index].status == 0) && atomic_op_changed(&ops[index])) {
+            pseudo_char_device_backing_mark_dirty(device_data,
+                ops[index].offset, ops[index].width);
+            pseudo_char_device_notify_write(device_data, ops[index].offset,
+                ops[index].width);
+        }
+    }
+
+    mutex_unlock(&device_data->buffer_lock);
+
+    return 0;
+}
+
+
+
+static int atomic_check_op(const device_buffer_t *buffer,
+    const struct pcd_atomic_op *op)
+{
+    int return_code = 0;
+
+    if (op->reserved != 0) {
+        return_code = -EINVAL;
+    } else if ((op->width != sizeof(u32)) && (op->width != sizeof(u64))) {
+        return_code = -EINVAL;
+    } else if ((op->offset % op->width) != 0) {
+        return_code = -EINVAL;
+    } else if ((op->offset >= buffer->size) ||
+        ((buffer->size - op->offset) < op->width)) {
+        return_code = -ENXIO;
+    } else if (op->opcode > PCD_ATOMIC_OP_FETCH_XOR) {
+        return_code = -EOPNOTSUPP;
+    }
+
+    return return_code;
+}
+
+
+
+/* The buffer is at least 8 byte aligned, so is an operand at an offset
+   which is a multiple of its width. Returns the previous value. */
+static u64 atomic_apply_op(device_buffer_t *buffer,
+    const struct pcd_atomic_op *op)
+{
+    u64 result = 0;
+    atomic_t *value = NULL;
+    atomic64_t *value64 = NULL;
+
+    if (op->width == sizeof(u32)) {
+        value = (atomic_t *)&buffer->data[op->offset];
+
+        switch (op->opcode) {
+            case PCD_ATOMIC_OP_CMPXCHG: {
+                result = (u32)atomic_cmpxchg(value, (u32)op->expected,
+                    (u32)op->operand);
+            }
+            break;
+
+            case PCD_ATOMIC_OP_FETCH_ADD: {
+                result = (u32)atomic_fetch_add((u32)op->operand, value);
+            }
+            break;
+
+            case PCD_ATOMIC_OP_FETCH_AND: {
+                result = (u32)atomic_fetch_and((u32)op->operand, value);
+            }
+            break;
+
+            case PCD_ATOMIC_OP_FETCH_OR: {
+                result = (u32)atomic_fetch_or((u32)op->operand, value);
+            }
+            break;
+
+            default: {
+                result = (u32)atomic_fetch_xor((u32)op->operand, value);
+            }
+            break;
+        }
+    } else {
+        value64 = (atomic64_t *)&buffer->data[op->offset];
+
+        switch (op->opcode) {
+            case PCD_ATOMIC_OP_CMPXCHG: {
+                result = atomic64_cmpxchg(value64, op->expected,
+                    op->operand);
+            }
+            break;
+
+            case PCD_ATOMIC_OP_FETCH_ADD: {
+                result = atomic64_fetch_add(op->operand, value64);
+            }
+            break;
+
+            case PCD_ATOMIC_OP_FETCH_AND: {
+                result = atomic64_fetch_and(op->operand, value64);
+            }
+            break;
+
+            case PCD_ATOMIC_OP_FETCH_OR: {
+                result = atomic64_fetch_or(op->operand, value64);
+            }
+            break;
+
+            default: {
+                result = atomic64_fetch_xor(op->operand, value64);
+            }
+            break;
+        }
+    }
+
+    return result;
+}
+
+
+
+/* Whether the operation, already applied, stored a different value. */
+static bool atomic_op_changed(const struct pcd_atomic_op *op)
+{
+    const u64 mask = (op->width == sizeof(u32)) ? U32_MAX : U64_MAX;
+    const u64 operand = op->operand & mask;
+    const u64 result = op->result;
+    bool changed = false;
+
+    switch (op->opcode) {
+        case PCD_ATOMIC_OP_CMPXCHG: {
+            changed = (result == (op->expected & mask)) &&
+                (result != operand);
+        }
+        break;
+
+        case PCD_ATOMIC_OP_FETCH_ADD: {
+            changed = (operand != 0);
+        }
+        break;
+
+        case PCD_ATOMIC_OP_FETCH_AND: {
+            changed = ((result & operand) != result);
+        }
+        break;
+
+        case PCD_ATOMIC_OP_FETCH_OR: {
+            changed = ((result | operand) != result);
+        }
+        break;
+
+        default: {
+            changed = (operand != 0);
+        }
+        break;
+    }
+
+    return changed;
+}
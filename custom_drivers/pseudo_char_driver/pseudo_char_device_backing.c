@@ -0,0 +1,461 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <linux/bitmap.h>
+#include <linux/err.h>
+#include <linux/fadvise.h>
+#include <linux/fcntl.h>
+#include <linux/fs.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s: "fmt, __func__
+
+/* Writes are given this long to pile up before they are written back, so
+   a burst of small ones costs a single write to the file. */
+#define BACKING_WRITEBACK_DELAY HZ
+
+/* Largest transfer to or from the file, dirty pages are written back in
+   runs of up to this many bytes. */
+#define BACKING_IO_SIZE     SZ_4M
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static void backing_writeback_work(struct work_struct *work);
+
+static int backing_flush(device_data_t *device_data);
+
+static int backing_writeback(device_data_t *device_data);
+
+static int backing_load(device_data_t *device_data);
+
+
+
+/*****************************************************************************/
+/* PUBLIC FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+/* Open (or create) the backing file of the device and fill the buffer with
+   its contents. The file is then kept the size of the buffer. Only random
+   access devices have a buffer laid out like a file. */
+int pseudo_char_device_backing_init(device_data_t *device_data,
+    const char *path)
+{
+    int return_code = 0;
+    backing_data_t *backing = &device_data->backing;
+
+    INIT_DELAYED_WORK(&backing->writeback_work, backing_writeback_work);
+    mutex_init(&backing->writeback_lock);
+    spin_lock_init(&backing->dirty_lock);
+
+    if (device_data->mode_operations != &random_access_mode_operations) {
+        pr_err("Backing file of %s device %s not supported!\n",
+            device_data->mode_operations->name, device_data->serial_number);
+        return -EOPNOTSUPP;
+    }
+
+    backing->page_count = PAGE_ALIGN(device_data->buffer_size) >> PAGE_SHIFT;
+    backing->dirty_pages = bitmap_zalloc(backing->page_count, GFP_KERNEL);
+    if (backing->dirty_pages == NULL) {
+        return -ENOMEM;
+    }
+
+    backing->file = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    if (IS_ERR(backing->file)) {
+        return_code = PTR_ERR(backing->file);
+        backing->file = NULL;
+    } else if (!S_ISREG(file_inode(backing->file)->i_mode)) {
+        return_code = -EINVAL;
+    } else {
+        return_code = backing_load(device_data);
+    }
+
+    if (return_code == 0) {
+        pr_info("Device %s backed by %s...\n", device_data->serial_number,
+            path);
+    } else {
+        pr_err("Backing file %s of device %s unusable (%d)!\n", path,
+            device_data->serial_number, return_code);
+
+        /* Left as it was, nothing is written back. */
+        if (backing->file != NULL) {
+            fput(backing->file);
+            backing->file = NULL;
+        }
+        bitmap_free(backing->dirty_pages);
+        backing->dirty_pages = NULL;
+    }
+
+    return return_code;
+}
+
+
+
+/* Let go of the file. Called once the device has no file open anymore,
+   from wherever its last reference is dropped, so nothing is written back
+   in here: that was done when the device was removed, and when the files
+   left open then were released. */
+void pseudo_char_device_backing_exit(device_data_t *device_data)
+{
+    backing_data_t *backing = &device_data->backing;
+
+    if (backing->file != NULL) {
+        cancel_delayed_work_sync(&backing->writeback_work);
+        fput(backing->file);
+        backing->file = NULL;
+    }
+
+    bitmap_free(backing->dirty_pages);
+    backing->dirty_pages = NULL;
+}
+
+
+
+/* Write back and sync what is dirty for the last time, as the device is
+   removed. Files still open may keep writing to it, each one writes back
+   what it wrote as it is released. */
+void pseudo_char_device_backing_stop(device_data_t *device_data)
+{
+    backing_data_t *backing = &device_data->backing;
+
+    if (backing->file == NULL) {
+        return;
+    }
+
+    WRITE_ONCE(backing->stopped, true);
+    if (pseudo_char_device_backing_fsync(device_data, 0) != 0) {
+        pr_err("Final writeback of device %s failed!\n",
+            device_data->serial_number);
+    }
+}
+
+
+
+/* Files written to once the device was removed write back on release, as
+   nobody may sync the device anymore. */
+void pseudo_char_device_backing_release(struct file *file)
+{
+    device_data_t *device_data = (device_data_t *)file->private_data;
+
+    if ((device_data->backing.file != NULL) &&
+        (file->f_mode & FMODE_WRITE) &&
+        READ_ONCE(device_data->backing.stopped) &&
+        (pseudo_char_device_backing_fsync(device_data, 0) != 0)) {
+        pr_err("Writeback of removed device %s failed!\n",
+            device_data->serial_number);
+    }
+}
+
+
+
+/* Called by writers once the data has reached the buffer: the writeback
+   work clears the bit before it copies the page, so a page written again
+   meanwhile is written back again. */
+void pseudo_char_device_backing_mark_dirty(device_data_t *device_data,
+    loff_t file_position, size_t byte_count)
+{
+    backing_data_t *backing = &device_data->backing;
+    unsigned long first_page = 0;
+    unsigned long last_page = 0;
+
+    if ((backing->file == NULL) || (byte_count == 0)) {
+        return;
+    }
+
+    first_page = file_position >> PAGE_SHIFT;
+    last_page = (file_position + byte_count - 1) >> PAGE_SHIFT;
+
+    /* Pages past the bitmap belong to a buffer being resized, the resize
+       marks all of them dirty. */
+    spin_lock(&backing->dirty_lock);
+    if (first_page < backing->page_count) {
+        last_page = min(last_page, backing->page_count - 1);
+        bitmap_set(backing->dirty_pages, first_page,
+            last_page - first_page + 1);
+    }
+    spin_unlock(&backing->dirty_lock);
+
+    schedule_delayed_work(&backing->writeback_work, BACKING_WRITEBACK_DELAY);
+}
+
+
+
+/* Mapped memory is written without the device noticing, so all of it is
+   considered dirty while a mapping exists. */
+void pseudo_char_device_backing_mark_mapped(device_data_t *device_data)
+{
+    pseudo_char_device_backing_mark_dirty(device_data, 0,
+        READ_ONCE(device_data->buffer_size));
+}
+
+
+
+/* Give the bitmap the size of the new buffer, pages the buffer grew by
+   are dirty. Called with the buffer lock held, right after the switch, so
+   resizes come in order. The file takes the new size on the next
+   writeback. Without memory for the bitmap the old one is kept, and the
+   next sync reports the error. */
+void pseudo_char_device_backing_resize(device_data_t *device_data,
+    size_t size)
+{
+    backing_data_t *backing = &device_data->backing;
+    const unsigned long page_count = PAGE_ALIGN(size) >> PAGE_SHIFT;
+    unsigned long *dirty_pages = NULL;
+
+    if (backing->file == NULL) {
+        return;
+    }
+
+    dirty_pages = bitmap_zalloc(page_count, GFP_KERNEL);
+    if (dirty_pages != NULL) {
+        spin_lock(&backing->dirty_lock);
+        bitmap_copy(dirty_pages, backing->dirty_pages,
+            min(page_count, backing->page_count));
+        if (page_count > backing->page_count) {
+            bitmap_set(dirty_pages, backing->page_count,
+                page_count - backing->page_count);
+        }
+        swap(dirty_pages, backing->dirty_pages);
+        backing->page_count = page_count;
+        spin_unlock(&backing->dirty_lock);
+
+        bitmap_free(dirty_pages);
+    } else {
+        pr_err("Dirty page bitmap of device %s not resized!\n",
+            device_data->serial_number);
+
+        mutex_lock(&backing->writeback_lock);
+        if (backing->writeback_error == 0) {
+            backing->writeback_error = -ENOMEM;
+        }
+        mutex_unlock(&backing->writeback_lock);
+    }
+
+    schedule_delayed_work(&backing->writeback_work, BACKING_WRITEBACK_DELAY);
+}
+
+
+
+/* Report, once, an error of a writeback done by the work since the last
+   report, without writing anything back. */
+int pseudo_char_device_backing_error(device_data_t *device_data)
+{
+    int return_code = 0;
+    backing_data_t *backing = &device_data->backing;
+
+    if (backing->file == NULL) {
+        return 0;
+    }
+
+    mutex_lock(&backing->writeback_lock);
+    return_code = backing->writeback_error;
+    backing->writeback_error = 0;
+    mutex_unlock(&backing->writeback_lock);
+
+    return return_code;
+}
+
+
+
+/* Flush, then have the file system make the file durable. */
+int pseudo_char_device_backing_fsync(device_data_t *device_data,
+    int datasync)
+{
+    int return_code = 0;
+
+    return_code = backing_flush(device_data);
+    if ((return_code == 0) && (device_data->backing.file != NULL)) {
+        return_code = vfs_fsync(device_data->backing.file, datasync);
+    }
+
+    return return_code;
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static void backing_writeback_work(struct work_struct *work)
+{
+    backing_data_t *backing = container_of(to_delayed_work(work),
+        backing_data_t, writeback_work);
+    device_data_t *device_data = container_of(backing, device_data_t,
+        backing);
+    int return_code = 0;
+
+    mutex_lock(&backing->writeback_lock);
+    return_code = backing_writeback(device_data);
+    if ((return_code != 0) && (backing->writeback_error == 0)) {
+        backing->writeback_error = return_code;
+    }
+    mutex_unlock(&backing->writeback_lock);
+
+    if (return_code != 0) {
+        pr_err("Writeback of device %s failed (%d)!\n",
+            device_data->serial_number, return_code);
+    }
+}
+
+
+
+/* Write back all dirty pages now, without waiting for the work. Errors of
+   earlier writebacks done by the work are reported here as well, once. */
+static int backing_flush(device_data_t *device_data)
+{
+    int return_code = 0;
+    backing_data_t *backing = &device_data->backing;
+
+    if (backing->file == NULL) {
+        return 0;
+    }
+
+    if (atomic_read(&device_data->mmap_count) > 0) {
+        pseudo_char_device_backing_mark_mapped(device_data);
+    }
+
+    mutex_lock(&backing->writeback_lock);
+    return_code = backing_writeback(device_data);
+    if (return_code == 0) {
+        return_code = backing->writeback_error;
+    }
+    backing->writeback_error = 0;
+    mutex_unlock(&backing->writeback_lock);
+
+    return return_code;
+}
+
+
+
+/* Called with the writeback lock held. Runs of dirty pages are written in
+   single transfers, straight from the buffer. A resize replaces the buffer
+   and changes the size of the file along with it; the buffer in use is
+   kept from being freed by the read lock, as for readers. */
+static int backing_writeback(device_data_t *device_data)
+{
+    int return_code = 0;
+    int srcu_index = 0;
+    backing_data_t *backing = &device_data->backing;
+    device_buffer_t *buffer = NULL;
+    unsigned long page_count = 0;
+    unsigned long first_page = 0;
+    unsigned long last_page = 0;
+    loff_t file_position = 0;
+    size_t byte_count = 0;
+    ssize_t written_byte_count = 0;
+
+    buffer = pseudo_char_device_buffer_read_lock(device_data, &srcu_index);
+
+    if (i_size_read(file_inode(backing->file)) != buffer->size) {
+        return_code = vfs_truncate(&backing->file->f_path, buffer->size);
+    }
+
+    while (return_code == 0) {
+        /* The bitmap may be sized for a buffer resized meanwhile, the
+           resize schedules another writeback for it. */
+        spin_lock(&backing->dirty_lock);
+        page_count = min(PAGE_ALIGN(buffer->size) >> PAGE_SHIFT,
+            backing->page_count);
+        first_page = find_next_bit(backing->dirty_pages, page_count,
+            first_page);
+        last_page = find_next_zero_bit(backing->dirty_pages,
+            min(page_count, first_page + (BACKING_IO_SIZE >> PAGE_SHIFT)),
+            first_page);
+        if (first_page < page_count) {
+            bitmap_clear(backing->dirty_pages, first_page,
+                last_page - first_page);
+        }
+        spin_unlock(&backing->dirty_lock);
+
+        if (first_page >= page_count) {
+            break;
+        }
+
+        file_position = (loff_t)first_page << PAGE_SHIFT;
+        byte_count = min_t(size_t, buffer->size - file_position,
+            (last_page - first_page) << PAGE_SHIFT);
+
+        written_byte_count = kernel_write(backing->file,
+            &buffer->data[file_position], byte_count, &file_position);
+        if (written_byte_count != byte_count) {
+            return_code = (written_byte_count < 0) ? written_byte_count :
+                -EIO;
+
+            /* Left for the next attempt. */
+            spin_lock(&backing->dirty_lock);
+            bitmap_set(backing->dirty_pages, first_page,
+                last_page - first_page);
+            spin_unlock(&backing->dirty_lock);
+        }
+
+        first_page = last_page;
+    }
+
+    pseudo_char_device_buffer_read_unlock(srcu_index);
+
+    return return_code;
+}
+
+
+
+/* Read the file into the buffer in large transfers, telling the file
+   system to read ahead as much as it can, then give the file the size of
+   the buffer. Nothing is dirty afterwards. */
+static int backing_load(device_data_t *device_data)
+{
+    int return_code = 0;
+    backing_data_t *backing = &device_data->backing;
+    device_buffer_t *buffer = rcu_dereference_protected(device_data->buffer,
+        true);
+    const loff_t load_size = min_t(loff_t, buffer->size,
+        i_size_read(file_inode(backing->file)));
+    loff_t file_position = 0;
+    ssize_t read_byte_count = 0;
+
+    vfs_fadvise(backing->file, 0, load_size, POSIX_FADV_SEQUENTIAL);
+
+    while ((return_code == 0) && (file_position < load_size)) {
+        read_byte_count = kernel_read(backing->file,
+            &buffer->data[file_position],
+            min_t(loff_t, load_size - file_position, BACKING_IO_SIZE),
+            &file_position);
+        if (read_byte_count < 0) {
+            return_code = read_byte_count;
+        } else if (read_byte_count == 0) {
+            /* Shrunk meanwhile, the rest stays zeros. */
+            break;
+        }
+    }
+
+    if ((return_code == 0) &&
+        (i_size_read(file_inode(backing->file)) != buffer->size)) {
+        return_code = vfs_truncate(&backing->file->f_path, buffer->size);
+    }
+
+    if (return_code == 0) {
+        pr_info("Loaded %lld bytes of device %s...\n", file_position,
+            device_data->serial_number);
+    }
+
+    return return_code;
+}
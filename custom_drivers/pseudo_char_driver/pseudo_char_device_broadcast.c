@@ -0,0 +1,459 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <linux/atomic.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/wait.h>
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s: "fmt, __func__
+
+/* Number of copies a reader tries, restarting from the oldest byte after
+   each overrun, before it gives up on writers lapping it. */
+#define COPY_ATTEMPT_COUNT  3
+
+
+
+/*****************************************************************************/
+/* MODE OPERATIONS FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int broadcast_init(device_data_t *device_data);
+
+static int broadcast_open(struct inode *inode, struct file *file);
+
+static loff_t broadcast_llseek(struct file *file,
+    loff_t file_position_offset, int whence);
+
+static ssize_t broadcast_read_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter);
+
+static ssize_t broadcast_write_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter);
+
+static __poll_t broadcast_poll(struct file *file,
+    struct poll_table_struct *poll_table);
+
+static long broadcast_ioctl(struct file *file, unsigned int command,
+    unsigned long argument);
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static ssize_t broadcast_copy(device_data_t *device_data,
+    const device_buffer_t *buffer, struct kiocb *iocb,
+    struct iov_iter *iov_iter);
+
+static ssize_t broadcast_try_copy(const device_data_t *device_data,
+    const device_buffer_t *buffer, u64 position, struct iov_iter *iov_iter);
+
+static int broadcast_wait(device_data_t *device_data, u64 position,
+    bool nonblocking);
+
+static u64 broadcast_oldest(const device_data_t *device_data);
+
+
+
+/*****************************************************************************/
+/* PUBLIC VARIABLES */
+/*****************************************************************************/
+
+/* Ring in the style of the ftrace one: a single stream of written bytes,
+   read by every file at its own pace. Readers only ever read shared state,
+   so each of them costs one copy and writers do nothing per reader. The
+   ring size is fixed, the positions of the readers would not survive a
+   resize. */
+const device_mode_operations_t broadcast_mode_operations = {
+    .name = "broadcast",
+    .init = broadcast_init,
+    .exit = pseudo_char_device_buffer_exit,
+    .open = broadcast_open,
+    .llseek = broadcast_llseek,
+    .read_iter = broadcast_read_iter,
+    .write_iter = broadcast_write_iter,
+    .poll = broadcast_poll,
+    .ioctl = broadcast_ioctl
+};
+
+
+
+/*****************************************************************************/
+/* MODE OPERATIONS FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static int broadcast_init(device_data_t *device_data)
+{
+    broadcast_data_t *broadcast = &device_data->broadcast;
+
+    atomic64_set(&broadcast->head, 0);
+    atomic64_set(&broadcast->reservation, 0);
+    mutex_init(&broadcast->producer_lock);
+    init_waitqueue_head(&broadcast->read_queue);
+    atomic64_set(&broadcast->overrun_count, 0);
+    atomic64_set(&broadcast->lost_byte_count, 0);
+
+    return pseudo_char_device_buffer_init(device_data);
+}
+
+
+
+/* A new reader starts at the head, with nothing lost so far. */
+static int broadcast_open(struct inode *inode, struct file *file)
+{
+    device_data_t *device_data = (device_data_t *)file->private_data;
+
+    file->f_pos = atomic64_read(&device_data->broadcast.head);
+    file->f_version = 0;
+
+    return pseudo_char_device_open_positioned(inode, file);
+}
+
+
+
+/* The cursor may be moved anywhere between the oldest byte still in the
+   ring and the head. */
+static loff_t broadcast_llseek(struct file *file,
+    loff_t file_position_offset, int whence)
+{
+    loff_t return_code = 0;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    const loff_t head = atomic64_read(&device_data->broadcast.head);
+    const loff_t oldest = broadcast_oldest(device_data);
+    loff_t new_file_position = 0;
+
+    switch (whence) {
+        case SEEK_SET: {
+            new_file_position = file_position_offset;
+        }
+        break;
+
+        case SEEK_CUR: {
+            new_file_position = file->f_pos + file_position_offset;
+        }
+        break;
+
+        case SEEK_END: {
+            new_file_position = head + file_position_offset;
+        }
+        break;
+
+        default: {
+            return -EINVAL;
+        }
+    }
+
+    if ((new_file_position >= oldest) && (new_file_position <= head)) {
+        file->f_pos = new_file_position;
+        return_code = file->f_pos;
+    } else {
+        return_code = -EINVAL;
+    }
+
+    return return_code;
+}
+
+
+
+/* Read from the cursor of the file on, waiting for data if it caught up
+   with the head. A file whose cursor has been overwritten reads from the
+   oldest byte still in the ring instead, what it skipped is added to its
+   lost bytes. */
+static ssize_t broadcast_read_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter)
+{
+    ssize_t return_code = 0;
+    int srcu_index = 0;
+    device_data_t *device_data = (device_data_t *)iocb->ki_filp->private_data;
+    device_buffer_t *buffer = NULL;
+
+    if (iov_iter_count(iov_iter) == 0) {
+        return 0;
+    }
+
+    return_code = broadcast_wait(device_data, iocb->ki_pos,
+        pseudo_char_device_is_nonblocking(iocb));
+    if (return_code == 0) {
+        buffer = pseudo_char_device_buffer_read_lock(device_data,
+            &srcu_index);
+        return_code = broadcast_copy(device_data, buffer, iocb, iov_iter);
+        pseudo_char_device_buffer_read_unlock(srcu_index);
+    }
+
+    return return_code;
+}
+
+
+
+/* Writers only wait for each other, never for the readers: the oldest data
+   is overwritten whether it has been read or not. Writes longer than the
+   ring are cut short to its size. */
+static ssize_t broadcast_write_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter)
+{
+    ssize_t return_code = 0;
+    size_t byte_count = iov_iter_count(iov_iter);
+    size_t copied_byte_count = 0;
+    u64 head = 0;
+    unsigned int offset = 0;
+    unsigned int first_chunk = 0;
+    device_data_t *device_data = (device_data_t *)iocb->ki_filp->private_data;
+    broadcast_data_t *broadcast = &device_data->broadcast;
+    device_buffer_t *buffer = NULL;
+
+    if (byte_count == 0) {
+        return 0;
+    }
+
+    if (pseudo_char_device_is_nonblocking(iocb)) {
+        return_code = mutex_trylock(&broadcast->producer_lock) ? 0 : -EAGAIN;
+    } else {
+        return_code = mutex_lock_interruptible(&broadcast->producer_lock);
+    }
+
+    if (return_code != 0) {
+        return return_code;
+    }
+
+    buffer = rcu_dereference_protected(device_data->buffer,
+        lockdep_is_held(&broadcast->producer_lock));
+
+    byte_count = min_t(size_t, byte_count, buffer->size);
+    head = atomic64_read(&broadcast->head);
+    offset = head & (buffer->size - 1);
+    first_chunk = min_t(unsigned int, byte_count, buffer->size - offset);
+
+    /* Readers see the reservation move before any of the data they may be
+       copying changes. It never moves back, a failed copy may have
+       overwritten more than it reports. */
+    if ((head + byte_count) > atomic64_read(&broadcast->reservation)) {
+        atomic64_set(&broadcast->reservation, head + byte_count);
+    }
+    smp_wmb();
+
+    copied_byte_count = copy_from_iter(&buffer->data[offset], first_chunk,
+        iov_iter);
+    if (copied_byte_count == first_chunk) {
+        copied_byte_count += copy_from_iter(&buffer->data[0],
+            byte_count - first_chunk, iov_iter);
+    }
+
+    if (copied_byte_count == 0) {
+        pr_debug("Unable to copy %zu bytes...\n", byte_count);
+        return_code = -EFAULT;
+    } else {
+        /* Publish the data before the new head. */
+        atomic64_set_release(&broadcast->head, head + copied_byte_count);
+        return_code = copied_byte_count;
+    }
+
+    mutex_unlock(&broadcast->producer_lock);
+
+    if ((return_code > 0) && wq_has_sleeper(&broadcast->read_queue)) {
+        wake_up_interruptible_poll(&broadcast->read_queue,
+            EPOLLIN | EPOLLRDNORM);
+    }
+
+    return return_code;
+}
+
+
+
+/* Readable once the head moved past the cursor of the file, which is also
+   the case after an overrun. Writers never wait. */
+static __poll_t broadcast_poll(struct file *file,
+    struct poll_table_struct *poll_table)
+{
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+
+    poll_wait(file, &device_data->broadcast.read_queue, poll_table);
+
+    if (atomic64_read(&device_data->broadcast.head) >
+        (u64)READ_ONCE(file->f_pos)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+
+    return mask;
+}
+
+
+
+static long broadcast_ioctl(struct file *file, unsigned int command,
+    unsigned long argument)
+{
+    long return_code = 0;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    broadcast_data_t *broadcast = &device_data->broadcast;
+    struct pcd_broadcast_status status;
+
+    if (command != PCD_IOCTL_BROADCAST_STATUS) {
+        return -ENOTTY;
+    }
+
+    status.position = READ_ONCE(file->f_pos);
+    status.head = atomic64_read(&broadcast->head);
+    status.oldest = broadcast_oldest(device_data);
+    status.lost_byte_count = READ_ONCE(file->f_version);
+    status.device_overrun_count = atomic64_read(&broadcast->overrun_count);
+    status.device_lost_byte_count =
+        atomic64_read(&broadcast->lost_byte_count);
+
+    if (copy_to_user((void __user *)argument, &status, sizeof(status)) != 0) {
+        return_code = -EFAULT;
+    }
+
+    return return_code;
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+/* Copy what has been written from the file position on. A position which
+   has been overwritten is moved to the oldest byte still in the ring and
+   the copy is tried again, the overrun only showing in the lost bytes,
+   kept in the f_version of the file, and the counters of the device. Only
+   a copy which succeeded moves the position and counts the overrun, so an
+   overrun is counted once however many reads it takes. Readers lapped by
+   the writers on every attempt fail with EPIPE, with nothing moved. */
+static ssize_t broadcast_copy(device_data_t *device_data,
+    const device_buffer_t *buffer, struct kiocb *iocb,
+    struct iov_iter *iov_iter)
+{
+    ssize_t return_code = -EPIPE;
+    broadcast_data_t *broadcast = &device_data->broadcast;
+    u64 position = iocb->ki_pos;
+    u64 lost_byte_count = 0;
+    unsigned attempt = 0;
+
+    for (; (attempt < COPY_ATTEMPT_COUNT) && (return_code == -EPIPE);
+        ++attempt) {
+        if (attempt > 0) {
+            position = max_t(u64, position, broadcast_oldest(device_data));
+        }
+        return_code = broadcast_try_copy(device_data, buffer, position,
+            iov_iter);
+    }
+
+    if (return_code > 0) {
+        lost_byte_count = position - iocb->ki_pos;
+        if (lost_byte_count > 0) {
+            iocb->ki_filp->f_version += lost_byte_count;
+            atomic64_inc(&broadcast->overrun_count);
+            atomic64_add(lost_byte_count, &broadcast->lost_byte_count);
+
+            pr_debug("Reader of device %s lost %llu bytes...\n",
+                device_data->serial_number, lost_byte_count);
+        }
+
+        iocb->ki_pos = position + return_code;
+    }
+
+    return return_code;
+}
+
+
+
+/* One copy without any lock: it is only kept if the reservation, read
+   after it, shows no write got to the copied range meanwhile. Fails with
+   EPIPE otherwise, or if the position was overwritten before the copy
+   even started. */
+static ssize_t broadcast_try_copy(const device_data_t *device_data,
+    const device_buffer_t *buffer, u64 position, struct iov_iter *iov_iter)
+{
+    ssize_t return_code = 0;
+    const broadcast_data_t *broadcast = &device_data->broadcast;
+    size_t byte_count = iov_iter_count(iov_iter);
+    size_t copied_byte_count = 0;
+    unsigned int offset = 0;
+    unsigned int first_chunk = 0;
+    u64 head = 0;
+    u64 reservation = 0;
+
+    /* Pairs with the release in broadcast_write_iter(): the data up to the
+       head is visible. */
+    head = atomic64_read_acquire(&broadcast->head);
+
+    if ((head - position) <= buffer->size) {
+        byte_count = min_t(u64, byte_count, head - position);
+        offset = position & (buffer->size - 1);
+        first_chunk = min_t(unsigned int, byte_count, buffer->size - offset);
+
+        copied_byte_count = copy_to_iter(&buffer->data[offset], first_chunk,
+            iov_iter);
+        if (copied_byte_count == first_chunk) {
+            copied_byte_count += copy_to_iter(&buffer->data[0],
+                byte_count - first_chunk, iov_iter);
+        }
+    }
+
+    /* Pairs with the barrier in broadcast_write_iter(): a write which
+       changed the copied data has moved the reservation by now. */
+    smp_rmb();
+    reservation = atomic64_read(&broadcast->reservation);
+
+    if ((reservation - position) > buffer->size) {
+        iov_iter_revert(iov_iter, copied_byte_count);
+        return_code = -EPIPE;
+    } else if (copied_byte_count == 0) {
+        pr_debug("Unable to copy %zu bytes...\n", byte_count);
+        return_code = -EFAULT;
+    } else {
+        return_code = copied_byte_count;
+    }
+
+    return return_code;
+}
+
+
+
+/* Readers wait for every write, as they all need to see it, so they are
+   not queued exclusively. */
+static int broadcast_wait(device_data_t *device_data, u64 position,
+    bool nonblocking)
+{
+    int return_code = 0;
+    broadcast_data_t *broadcast = &device_data->broadcast;
+
+    if (atomic64_read(&broadcast->head) > position) {
+        return_code = 0;
+    } else if (nonblocking) {
+        return_code = -EAGAIN;
+    } else {
+        return_code = wait_event_interruptible(broadcast->read_queue,
+            atomic64_read(&broadcast->head) > position);
+    }
+
+    return return_code;
+}
+
+
+
+static u64 broadcast_oldest(const device_data_t *device_data)
+{
+    const u64 reservation =
+        atomic64_read(&device_data->broadcast.reservation);
+    const size_t buffer_size = READ_ONCE(device_data->buffer_size);
+
+    return (reservation > buffer_size) ? (reservation - buffer_size) : 0;
+}
@@ -0,0 +1,533 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <linux/atomic.h>
+#include <linux/fs.h>
+#include <linux/gfp.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/srcu.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s: "fmt, __func__
+
+
+
+/*****************************************************************************/
+/* VM OPERATIONS FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static void buffer_vm_open(struct vm_area_struct *vma);
+
+static void buffer_vm_close(struct vm_area_struct *vma);
+
+static vm_fault_t buffer_fault(struct vm_fault *vm_fault);
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static device_buffer_t *buffer_alloc(size_t size);
+
+static void buffer_free(device_buffer_t *buffer);
+
+static void buffer_free_rcu(struct rcu_head *rcu_head);
+
+static struct page *buffer_page(const device_buffer_t *buffer,
+    unsigned long page_index);
+
+
+
+/*****************************************************************************/
+/* PRIVATE VARIABLES */
+/*****************************************************************************/
+
+/* Readers may sleep while copying to user space, hence sleepable RCU. */
+DEFINE_STATIC_SRCU(buffer_srcu);
+
+static const struct vm_operations_struct vm_operations = {
+    .open = buffer_vm_open,
+    .close = buffer_vm_close,
+    .fault = buffer_fault
+};
+
+
+
+/*****************************************************************************/
+/* PUBLIC FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+int pseudo_char_device_buffer_init(device_data_t *device_data)
+{
+    int return_code = 0;
+    device_buffer_t *buffer = NULL;
+
+    mutex_init(&device_data->buffer_lock);
+    seqcount_init(&device_data->buffer_sequence);
+    spin_lock_init(&device_data->mapping_lock);
+    atomic_set(&device_data->mmap_count, 0);
+
+    return_code = pseudo_char_device_buffer_check_size(device_data,
+        device_data->buffer_size);
+    if (return_code == 0) {
+        buffer = buffer_alloc(device_data->buffer_size);
+        if (buffer != NULL) {
+            pr_info("Buffer of %zu bytes allocated for device %s...\n",
+                buffer->size, device_data->serial_number);
+        } else {
+            pr_err("Buffer allocation for device %s failed!\n",
+                device_data->serial_number);
+            return_code = -ENOMEM;
+        }
+    }
+
+    RCU_INIT_POINTER(device_data->buffer, buffer);
+
+    return return_code;
+}
+
+
+
+void pseudo_char_device_buffer_exit(device_data_t *device_data)
+{
+    /* No file is open anymore, but buffers replaced by a resize may still
+       wait for the grace period to end. */
+    buffer_free(rcu_dereference_protected(device_data->buffer, true));
+    RCU_INIT_POINTER(device_data->buffer, NULL);
+
+    srcu_barrier(&buffer_srcu);
+}
+
+
+
+int pseudo_char_device_buffer_check_size(const device_data_t *device_data,
+    size_t size)
+{
+    int return_code = 0;
+    const size_t size_max =
+        ((device_data->mode_operations == &sparse_mode_operations) ||
+        (device_data->mode_operations == &compressed_mode_operations)) ?
+        DEVICE_SPARSE_BUFFER_SIZE_MAX : DEVICE_BUFFER_SIZE_MAX;
+
+    if ((size == 0) || (size > size_max)) {
+        pr_err("Buffer size %zu of device %s out of range!\n", size,
+            device_data->serial_number);
+        return_code = -EINVAL;
+    } else if (((device_data->mode_operations == &fifo_mode_operations) ||
+        (device_data->mode_operations == &sharded_mode_operations) ||
+        (device_data->mode_operations == &record_mode_operations) ||
+        (device_data->mode_operations == &broadcast_mode_operations)) &&
+        !is_power_of_2(size)) {
+        pr_err("Buffer size %zu of %s device %s not a power of two!\n",
+            size, device_data->mode_operations->name,
+            device_data->serial_number);
+        return_code = -EINVAL;
+    }
+
+    return return_code;
+}
+
+
+
+/* Replace the buffer of the device with a new one of the given size. The
+   content is carried over (truncated if the buffer shrinks), writers wait
+   for the switch to complete, while readers keep using the old buffer until
+   they are done with it. */
+int pseudo_char_device_buffer_resize(device_data_t *device_data,
+    size_t size)
+{
+    int return_code = 0;
+    device_buffer_t *old_buffer = NULL;
+    device_buffer_t *new_buffer = NULL;
+    fifo_data_t *fifo = &device_data->fifo;
+
+    return_code = pseudo_char_device_buffer_check_size(device_data, size);
+    if (return_code == 0) {
+        new_buffer = buffer_alloc(size);
+        if (new_buffer == NULL) {
+            return_code = -ENOMEM;
+        }
+    }
+
+    if (return_code == 0) {
+        mutex_lock(&device_data->buffer_lock);
+        mutex_lock(&fifo->producer_lock);
+        mutex_lock(&fifo->consumer_lock);
+
+        old_buffer = rcu_dereference_protected(device_data->buffer,
+            lockdep_is_held(&device_data->buffer_lock));
+
+        if (fifo->head != fifo->tail) {
+            /* The ring is only resized while it is drained. */
+            return_code = -EBUSY;
+        } else {
+            memcpy(new_buffer->data, old_buffer->data,
+                min(old_buffer->size, new_buffer->size));
+
+            fifo->head = 0;
+            fifo->tail = 0;
+
+            return_code = pseudo_char_device_checksum_resize(device_data,
+                old_buffer, new_buffer);
+        }
+
+        if (return_code == 0) {
+            /* Mapped pages would silently stop being the device memory. */
+            spin_lock(&device_data->mapping_lock);
+            if (atomic_read(&device_data->mmap_count) > 0) {
+                return_code = -EBUSY;
+            } else {
+                /* Counts as a write, so whoever took a copy of the old
+                   buffer notices the switch. */
+                raw_write_seqcount_begin(&device_data->buffer_sequence);
+                rcu_assign_pointer(device_data->buffer, new_buffer);
+                WRITE_ONCE(device_data->buffer_size, size);
+                raw_write_seqcount_end(&device_data->buffer_sequence);
+            }
+            spin_unlock(&device_data->mapping_lock);
+        }
+
+        if (return_code == 0) {
+            pseudo_char_device_backing_resize(device_data, size);
+        }
+
+        mutex_unlock(&fifo->consumer_lock);
+        mutex_unlock(&fifo->producer_lock);
+        mutex_unlock(&device_data->buffer_lock);
+    }
+
+    if (return_code == 0) {
+        call_srcu(&buffer_srcu, &old_buffer->rcu_head, buffer_free_rcu);
+        pr_info("Buffer of device %s resized to %zu bytes.\n",
+            device_data->serial_number, size);
+    } else {
+        buffer_free(new_buffer);
+        pr_err("Buffer resize of device %s failed!\n",
+            device_data->serial_number);
+    }
+
+    return return_code;
+}
+
+
+
+/* Buffer of the given size, without checksums, for the caller to fill. */
+device_buffer_t *pseudo_char_device_buffer_alloc(size_t size)
+{
+    return buffer_alloc(size);
+}
+
+
+
+void pseudo_char_device_buffer_free(device_buffer_t *buffer)
+{
+    buffer_free(buffer);
+}
+
+
+
+/* Publish a new buffer of the same size in place of the current one, as a
+   single write: optimistic readers copy again, readers still using the
+   old buffer keep seeing all of it, and it is freed once they are done.
+   Nobody waits for them. Called with the buffer lock held, the new buffer
+   belongs to the device on success. */
+int pseudo_char_device_buffer_replace(device_data_t *device_data,
+    device_buffer_t *new_buffer)
+{
+    int return_code = 0;
+    device_buffer_t *old_buffer = rcu_dereference_protected(
+        device_data->buffer, lockdep_is_held(&device_data->buffer_lock));
+
+    return_code = pseudo_char_device_checksum_resize(device_data, old_buffer,
+        new_buffer);
+    if (return_code == 0) {
+        /* Mapped pages would silently stop being the device memory. */
+        spin_lock(&device_data->mapping_lock);
+        if (atomic_read(&device_data->mmap_count) > 0) {
+            return_code = -EBUSY;
+        } else {
+            raw_write_seqcount_begin(&device_data->buffer_sequence);
+            rcu_assign_pointer(device_data->buffer, new_buffer);
+            raw_write_seqcount_end(&device_data->buffer_sequence);
+        }
+        spin_unlock(&device_data->mapping_lock);
+    }
+
+    if (return_code == 0) {
+        call_srcu(&buffer_srcu, &old_buffer->rcu_head, buffer_free_rcu);
+    } else {
+        kvfree(new_buffer->checksums);
+        new_buffer->checksums = NULL;
+    }
+
+    return return_code;
+}
+
+
+
+/* Take the buffer lock, as writers do. With nowait set the caller may not
+   sleep waiting for it (IOCB_NOWAIT), otherwise the wait is interruptible. */
+int pseudo_char_device_buffer_lock(device_data_t *device_data, bool nowait)
+{
+    int return_code = 0;
+
+    if (nowait) {
+        if (!mutex_trylock(&device_data->buffer_lock)) {
+            return_code = -EAGAIN;
+        }
+    } else if (mutex_lock_interruptible(&device_data->buffer_lock) != 0) {
+        return_code = -ERESTARTSYS;
+    }
+
+    return return_code;
+}
+
+
+
+device_buffer_t *pseudo_char_device_buffer_read_lock(
+    device_data_t *device_data, int *srcu_index)
+{
+    *srcu_index = srcu_read_lock(&buffer_srcu);
+
+    return srcu_dereference(device_data->buffer, &buffer_srcu);
+}
+
+
+
+void pseudo_char_device_buffer_read_unlock(int srcu_index)
+{
+    srcu_read_unlock(&buffer_srcu, srcu_index);
+}
+
+
+
+/* Wait for the readers of the buffers to be done with what they read. */
+void pseudo_char_device_buffer_synchronize(void)
+{
+    synchronize_srcu(&buffer_srcu);
+}
+
+
+
+int pseudo_char_device_buffer_mmap(struct file *file,
+    struct vm_area_struct *vma)
+{
+    int return_code = 0;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    unsigned long buffer_page_count = 0;
+
+    pr_debug("Mmap operation requested for %lu pages at offset %lu...\n",
+        vma_pages(vma), vma->vm_pgoff);
+
+    switch (device_data->permission_type) {
+        case PERMISSION_TYPE_READ: {
+            /* Private mappings may still be written, the changes are
+               copied on write and never reach the device. */
+            if ((vma->vm_flags & VM_SHARED) && (vma->vm_flags & VM_WRITE)) {
+                return_code = -EPERM;
+            } else if (vma->vm_flags & VM_SHARED) {
+                vma->vm_flags &= ~VM_MAYWRITE;
+            }
+        }
+        break;
+
+        case PERMISSION_TYPE_WRITE: {
+            /* Page tables have no notion of write-only memory, any
+               writable mapping would be readable as well. */
+            return_code = -EACCES;
+        }
+        break;
+
+        case PERMISSION_TYPE_READ_WRITE: {
+            return_code = 0;
+        }
+        break;
+
+        default: {
+            return_code = -EPERM;
+        }
+        break;
+    }
+
+    if (return_code == 0) {
+        /* Resizing is held off for as long as the buffer is mapped. The
+           buffer lock cannot be used here: writers fault user pages in
+           while holding it, so it nests inside mmap_lock already. */
+        spin_lock(&device_data->mapping_lock);
+
+        buffer_page_count = PAGE_ALIGN(device_data->buffer_size) >> PAGE_SHIFT;
+        if (device_data->checksum.enabled) {
+            /* Stores through the mapping would bypass the checksums. */
+            pr_debug("Checksums of the device enabled...\n");
+            return_code = -EBUSY;
+        } else if ((vma->vm_pgoff >= buffer_page_count) ||
+            (vma_pages(vma) > (buffer_page_count - vma->vm_pgoff))) {
+            pr_debug("Mapping exceeds the device buffer...\n");
+            return_code = -EINVAL;
+        } else {
+            vma->vm_ops = &vm_operations;
+            vma->vm_private_data = device_data;
+            vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+
+            atomic_inc(&device_data->mmap_count);
+        }
+
+        spin_unlock(&device_data->mapping_lock);
+    }
+
+    if (return_code == 0) {
+        pr_debug("Mmap operation done successfully.\n");
+    } else {
+        pr_debug("Mmap operation failed!\n");
+    }
+
+    return return_code;
+}
+
+
+
+/*****************************************************************************/
+/* VM OPERATIONS FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static void buffer_vm_open(struct vm_area_struct *vma)
+{
+    device_data_t *device_data = (device_data_t *)vma->vm_private_data;
+
+    atomic_inc(&device_data->mmap_count);
+}
+
+
+
+/* What was written through a shared mapping only gets written back once
+   the mapping goes away, or on fsync. */
+static void buffer_vm_close(struct vm_area_struct *vma)
+{
+    device_data_t *device_data = (device_data_t *)vma->vm_private_data;
+
+    if ((vma->vm_flags & (VM_SHARED | VM_MAYWRITE)) ==
+        (VM_SHARED | VM_MAYWRITE)) {
+        pseudo_char_device_backing_mark_mapped(device_data);
+    }
+
+    atomic_dec(&device_data->mmap_count);
+}
+
+
+
+static vm_fault_t buffer_fault(struct vm_fault *vm_fault)
+{
+    vm_fault_t return_code = 0;
+    int srcu_index = 0;
+    device_data_t *device_data =
+        (device_data_t *)vm_fault->vma->vm_private_data;
+    device_buffer_t *buffer = NULL;
+    struct page *page = NULL;
+
+    if (device_data->mode_operations->fault != NULL) {
+        return device_data->mode_operations->fault(vm_fault);
+    }
+
+    buffer = pseudo_char_device_buffer_read_lock(device_data, &srcu_index);
+
+    if (vm_fault->pgoff < (PAGE_ALIGN(buffer->size) >> PAGE_SHIFT)) {
+        page = buffer_page(buffer, vm_fault->pgoff);
+        get_page(page);
+        vm_fault->page = page;
+    } else {
+        return_code = VM_FAULT_SIGBUS;
+    }
+
+    pseudo_char_device_buffer_read_unlock(srcu_index);
+
+    return return_code;
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static device_buffer_t *buffer_alloc(size_t size)
+{
+    device_buffer_t *buffer = NULL;
+    const size_t allocation_size = PAGE_ALIGN(size);
+
+    buffer = kzalloc(sizeof(device_buffer_t), GFP_KERNEL);
+    if (buffer != NULL) {
+        buffer->size = size;
+
+        /* The buffer is built out of whole pages which are not slab memory,
+           so each of them may be handed over to user space by mmap(). Small
+           buffers come straight from the page allocator and are physically
+           contiguous, large ones are virtually contiguous only, so they do
+           not depend on high order allocations succeeding. Either way the
+           memory is charged to the memory cgroup of the allocating task. */
+        if (get_order(allocation_size) <= PAGE_ALLOC_COSTLY_ORDER) {
+            buffer->data = alloc_pages_exact(allocation_size,
+                GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+        } else {
+            buffer->data = __vmalloc(allocation_size,
+                GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+        }
+
+        if (buffer->data == NULL) {
+            kfree(buffer);
+            buffer = NULL;
+        }
+    }
+
+    return buffer;
+}
+
+
+
+static void buffer_free(device_buffer_t *buffer)
+{
+    if (buffer != NULL) {
+        if (is_vmalloc_addr(buffer->data)) {
+            vfree(buffer->data);
+        } else {
+            free_pages_exact(buffer->data, PAGE_ALIGN(buffer->size));
+        }
+
+        kvfree(buffer->checksums);
+        kfree(buffer);
+    }
+}
+
+
+
+static void buffer_free_rcu(struct rcu_head *rcu_head)
+{
+    buffer_free(container_of(rcu_head, device_buffer_t, rcu_head));
+}
+
+
+
+static struct page *buffer_page(const device_buffer_t *buffer,
+    unsigned long page_index)
+{
+    const char *address = buffer->data + (page_index << PAGE_SHIFT);
+
+    return is_vmalloc_addr(address) ? vmalloc_to_page(address) :
+        virt_to_page(address);
+}
@@ -0,0 +1,510 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <crypto/hash.h>
+#include <linux/atomic.h>
+#include <linux/device.h>
+#include <linux/err.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/sysfs.h>
+#include <linux/uaccess.h>
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s: "fmt, __func__
+
+/* The generic name, so the fastest implementation the machine has (SSE4.2,
+   ARMv8 CRC instructions...) is picked by the crypto API. */
+#define CHECKSUM_ALGORITHM  "crc32c"
+
+#define CHECKSUM_COUNTER_ATTR(_name, _member)                               \
+    struct dev_ext_attribute dev_attr_##_name = {                           \
+        __ATTR(_name, 0444, checksum_counter_show, NULL),                   \
+        (void *)offsetof(checksum_data_t, _member)                          \
+    }
+
+
+
+/*****************************************************************************/
+/* DEVICE ATTRIBUTES FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static ssize_t enabled_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer);
+
+static ssize_t enabled_store(struct device *device,
+    struct device_attribute *device_attribute, const char *input_buffer,
+    size_t char_count);
+
+static ssize_t driver_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer);
+
+static ssize_t checksum_counter_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer);
+
+static umode_t checksum_attribute_is_visible(struct kobject *kobject,
+    struct attribute *attribute, int index);
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int checksum_enable(device_data_t *device_data);
+
+static void checksum_disable(device_data_t *device_data);
+
+static u32 *checksum_compute(device_data_t *device_data,
+    const device_buffer_t *buffer);
+
+static void checksum_chunk(checksum_data_t *checksum,
+    const device_buffer_t *buffer, unsigned long chunk_index, u32 *crc);
+
+static unsigned long checksum_chunk_count(size_t size);
+
+
+
+/*****************************************************************************/
+/* PRIVATE VARIABLES */
+/*****************************************************************************/
+
+static DEVICE_ATTR_RW(enabled);
+static DEVICE_ATTR_RO(driver);
+static CHECKSUM_COUNTER_ATTR(read_mismatches, read_mismatch_count);
+static CHECKSUM_COUNTER_ATTR(verify_mismatches, verify_mismatch_count);
+
+static struct attribute *pseudo_char_device_checksum_attributes[] = {
+    &dev_attr_enabled.attr,
+    &dev_attr_driver.attr,
+    &dev_attr_read_mismatches.attr.attr,
+    &dev_attr_verify_mismatches.attr.attr,
+    NULL
+};
+
+
+
+/*****************************************************************************/
+/* PUBLIC VARIABLES */
+/*****************************************************************************/
+
+/* Shows up as the checksum/ directory of random access devices. Mismatches
+   found by reads and by PCD_IOCTL_VERIFY are counted apart. */
+const struct attribute_group pseudo_char_device_checksum_group = {
+    .name = "checksum",
+    .attrs = pseudo_char_device_checksum_attributes,
+    .is_visible = checksum_attribute_is_visible
+};
+
+
+
+/*****************************************************************************/
+/* PUBLIC FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+void pseudo_char_device_checksum_exit(device_data_t *device_data)
+{
+    if (!IS_ERR_OR_NULL(device_data->checksum.hash)) {
+        crypto_free_shash(device_data->checksum.hash);
+    }
+}
+
+
+
+/* Called by writers inside their write section, once the data has reached
+   the buffer: only the chunks written to are hashed again. */
+void pseudo_char_device_checksum_update(device_data_t *device_data,
+    device_buffer_t *buffer, loff_t file_position, size_t byte_count)
+{
+    unsigned long chunk_index = file_position / DEVICE_CHECKSUM_CHUNK_SIZE;
+    unsigned long last_chunk_index = 0;
+
+    if ((buffer->checksums == NULL) || (byte_count == 0)) {
+        return;
+    }
+
+    last_chunk_index = (file_position + byte_count - 1) /
+        DEVICE_CHECKSUM_CHUNK_SIZE;
+    for (; chunk_index <= last_chunk_index; ++chunk_index) {
+        checksum_chunk(&device_data->checksum, buffer, chunk_index,
+            &buffer->checksums[chunk_index]);
+    }
+}
+
+
+
+/* Hash the chunks covering the range and compare them with the stored
+   checksums. Returns the number of chunks which differ, the offset of the
+   first of them is stored if asked for. Readers call it in their read
+   section, a write racing with it makes them try again. */
+unsigned long pseudo_char_device_checksum_verify(device_data_t *device_data,
+    const device_buffer_t *buffer, loff_t file_position, size_t byte_count,
+    u64 *first_mismatch)
+{
+    unsigned long mismatch_count = 0;
+    unsigned long chunk_index = file_position / DEVICE_CHECKSUM_CHUNK_SIZE;
+    unsigned long last_chunk_index = 0;
+    const u32 *checksums = smp_load_acquire(&buffer->checksums);
+    u32 crc = 0;
+
+    if ((checksums == NULL) || (byte_count == 0)) {
+        return 0;
+    }
+
+    last_chunk_index = (file_position + byte_count - 1) /
+        DEVICE_CHECKSUM_CHUNK_SIZE;
+    for (; chunk_index <= last_chunk_index; ++chunk_index) {
+        checksum_chunk(&device_data->checksum, buffer, chunk_index, &crc);
+        if (crc != READ_ONCE(checksums[chunk_index])) {
+            if ((mismatch_count == 0) && (first_mismatch != NULL)) {
+                *first_mismatch = (u64)chunk_index *
+                    DEVICE_CHECKSUM_CHUNK_SIZE;
+            }
+            ++mismatch_count;
+        }
+    }
+
+    return mismatch_count;
+}
+
+
+
+/* The new buffer gets checksums if the old one had them. Called by a
+   resize with the buffer lock held, after the data has been copied. */
+int pseudo_char_device_checksum_resize(device_data_t *device_data,
+    const device_buffer_t *old_buffer, device_buffer_t *new_buffer)
+{
+    u32 *checksums = NULL;
+
+    if (old_buffer->checksums == NULL) {
+        return 0;
+    }
+
+    checksums = checksum_compute(device_data, new_buffer);
+    if (IS_ERR(checksums)) {
+        return PTR_ERR(checksums);
+    }
+
+    new_buffer->checksums = checksums;
+
+    return 0;
+}
+
+
+
+/* Check a range of the device against its checksums, the whole device
+   for a zero length. Writers are held off meanwhile. */
+long pseudo_char_device_checksum_ioctl(struct file *file,
+    unsigned int command, unsigned long argument)
+{
+    long return_code = 0;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    checksum_data_t *checksum = &device_data->checksum;
+    device_buffer_t *buffer = NULL;
+    struct pcd_verify user_verify;
+    void __user *user_pointer = (void __user *)argument;
+
+    if (command != PCD_IOCTL_VERIFY) {
+        return -ENOTTY;
+    }
+
+    if (copy_from_user(&user_verify, user_pointer,
+        sizeof(user_verify)) != 0) {
+        return -EFAULT;
+    }
+
+    return_code = pseudo_char_device_buffer_lock(device_data, false);
+    if (return_code != 0) {
+        return return_code;
+    }
+
+    buffer = rcu_dereference_protected(device_data->buffer,
+        lockdep_is_held(&device_data->buffer_lock));
+
+    if (buffer->checksums == NULL) {
+        return_code = -EOPNOTSUPP;
+    } else if (user_verify.offset >= buffer->size) {
+        return_code = -EINVAL;
+    } else {
+        if ((user_verify.length == 0) ||
+            (user_verify.length > (buffer->size - user_verify.offset))) {
+            user_verify.length = buffer->size - user_verify.offset;
+        }
+
+        user_verify.first_mismatch = U64_MAX;
+        user_verify.mismatch_count = pseudo_char_device_checksum_verify(
+            device_data, buffer, user_verify.offset, user_verify.length,
+            &user_verify.first_mismatch);
+        atomic64_add(user_verify.mismatch_count,
+            &checksum->verify_mismatch_count);
+    }
+
+    mutex_unlock(&device_data->buffer_lock);
+
+    if ((return_code == 0) &&
+        (copy_to_user(user_pointer, &user_verify,
+            sizeof(user_verify)) != 0)) {
+        return_code = -EFAULT;
+    }
+
+    return return_code;
+}
+
+
+
+/*****************************************************************************/
+/* DEVICE ATTRIBUTES FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static ssize_t enabled_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer)
+{
+    ssize_t return_code = 0;
+    device_data_t *device_data = dev_get_drvdata(device);
+
+    if (device_data != NULL) {
+        return_code = sprintf(output_buffer, "%d\n",
+            READ_ONCE(device_data->checksum.enabled));
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+static ssize_t enabled_store(struct device *device,
+    struct device_attribute *device_attribute, const char *input_buffer,
+    size_t char_count)
+{
+    ssize_t return_code = 0;
+    bool enabled = false;
+    device_data_t *device_data = dev_get_drvdata(device);
+
+    if (device_data != NULL) {
+        return_code = kstrtobool(input_buffer, &enabled);
+        if (return_code == 0) {
+            if (enabled) {
+                return_code = checksum_enable(device_data);
+            } else {
+                checksum_disable(device_data);
+            }
+        }
+
+        if (return_code == 0) {
+            return_code = char_count;
+        }
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+/* Implementation picked by the crypto API, once checksums were enabled. */
+static ssize_t driver_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer)
+{
+    ssize_t return_code = 0;
+    device_data_t *device_data = dev_get_drvdata(device);
+    struct crypto_shash *hash = NULL;
+
+    if (device_data != NULL) {
+        mutex_lock(&device_data->buffer_lock);
+        hash = device_data->checksum.hash;
+        return_code = sprintf(output_buffer, "%s\n",
+            IS_ERR_OR_NULL(hash) ? "none" : crypto_shash_driver_name(hash));
+        mutex_unlock(&device_data->buffer_lock);
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+static ssize_t checksum_counter_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer)
+{
+    ssize_t return_code = 0;
+    device_data_t *device_data = dev_get_drvdata(device);
+    struct dev_ext_attribute *extended_attribute =
+        container_of(device_attribute, struct dev_ext_attribute, attr);
+    const atomic64_t *counter = NULL;
+
+    if (device_data != NULL) {
+        counter = (const atomic64_t *)((const char *)&device_data->checksum +
+            (uintptr_t)extended_attribute->var);
+        return_code = sprintf(output_buffer, "%lld\n",
+            atomic64_read(counter));
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+static umode_t checksum_attribute_is_visible(struct kobject *kobject,
+    struct attribute *attribute, int index)
+{
+    device_data_t *device_data = dev_get_drvdata(kobj_to_dev(kobject));
+
+    return ((device_data != NULL) &&
+        (device_data->mode_operations == &random_access_mode_operations)) ?
+        attribute->mode : 0;
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+/* Hash the whole buffer, then publish the checksums: readers see either
+   none or all of them. Mapped devices are refused, as are mmaps for as
+   long as the checksums are enabled. */
+static int checksum_enable(device_data_t *device_data)
+{
+    int return_code = 0;
+    checksum_data_t *checksum = &device_data->checksum;
+    device_buffer_t *buffer = NULL;
+    u32 *checksums = NULL;
+
+    mutex_lock(&device_data->buffer_lock);
+
+    buffer = rcu_dereference_protected(device_data->buffer,
+        lockdep_is_held(&device_data->buffer_lock));
+
+    if (!checksum->enabled) {
+        checksums = checksum_compute(device_data, buffer);
+        if (IS_ERR(checksums)) {
+            return_code = PTR_ERR(checksums);
+        } else {
+            spin_lock(&device_data->mapping_lock);
+            if (atomic_read(&device_data->mmap_count) > 0) {
+                return_code = -EBUSY;
+            } else {
+                smp_store_release(&buffer->checksums, checksums);
+                checksum->enabled = true;
+            }
+            spin_unlock(&device_data->mapping_lock);
+        }
+    }
+
+    mutex_unlock(&device_data->buffer_lock);
+
+    if (return_code == 0) {
+        if (checksums != NULL) {
+            pr_info("Checksums of device %s enabled (%s)...\n",
+                device_data->serial_number,
+                crypto_shash_driver_name(checksum->hash));
+        }
+    } else {
+        if (!IS_ERR(checksums)) {
+            kvfree(checksums);
+        }
+        pr_err("Enabling checksums of device %s failed (%d)!\n",
+            device_data->serial_number, return_code);
+    }
+
+    return return_code;
+}
+
+
+
+/* Readers may still be verifying against the checksums, they are freed
+   once they are done. */
+static void checksum_disable(device_data_t *device_data)
+{
+    device_buffer_t *buffer = NULL;
+    u32 *checksums = NULL;
+
+    mutex_lock(&device_data->buffer_lock);
+
+    buffer = rcu_dereference_protected(device_data->buffer,
+        lockdep_is_held(&device_data->buffer_lock));
+    checksums = buffer->checksums;
+    WRITE_ONCE(buffer->checksums, NULL);
+
+    spin_lock(&device_data->mapping_lock);
+    device_data->checksum.enabled = false;
+    spin_unlock(&device_data->mapping_lock);
+
+    mutex_unlock(&device_data->buffer_lock);
+
+    if (checksums != NULL) {
+        pseudo_char_device_buffer_synchronize();
+        kvfree(checksums);
+        pr_info("Checksums of device %s disabled...\n",
+            device_data->serial_number);
+    }
+}
+
+
+
+/* Checksums of the whole buffer, the hash transform is allocated the
+   first time. Called with the buffer lock held. */
+static u32 *checksum_compute(device_data_t *device_data,
+    const device_buffer_t *buffer)
+{
+    checksum_data_t *checksum = &device_data->checksum;
+    unsigned long chunk_index = 0;
+    const unsigned long chunk_count = checksum_chunk_count(buffer->size);
+    u32 *checksums = NULL;
+
+    if (IS_ERR_OR_NULL(checksum->hash)) {
+        checksum->hash = crypto_alloc_shash(CHECKSUM_ALGORITHM, 0, 0);
+        if (IS_ERR(checksum->hash)) {
+            return ERR_CAST(checksum->hash);
+        }
+    }
+
+    checksums = kvmalloc_array(chunk_count, sizeof(u32), GFP_KERNEL_ACCOUNT);
+    if (checksums == NULL) {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    for (; chunk_index < chunk_count; ++chunk_index) {
+        checksum_chunk(checksum, buffer, chunk_index, &checksums[chunk_index]);
+    }
+
+    return checksums;
+}
+
+
+
+/* The last chunk may be shorter than the others. */
+static void checksum_chunk(checksum_data_t *checksum,
+    const device_buffer_t *buffer, unsigned long chunk_index, u32 *crc)
+{
+    const size_t offset = chunk_index * DEVICE_CHECKSUM_CHUNK_SIZE;
+
+    crypto_shash_tfm_digest(checksum->hash, (const u8 *)&buffer->data[offset],
+        min_t(size_t, DEVICE_CHECKSUM_CHUNK_SIZE, buffer->size - offset),
+        (u8 *)crc);
+}
+
+
+
+static unsigned long checksum_chunk_count(size_t size)
+{
+    return DIV_ROUND_UP(size, DEVICE_CHECKSUM_CHUNK_SIZE);
+}
@@ -0,0 +1,1045 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <linux/crypto.h>
+#include <linux/device.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/overflow.h>
+#include <linux/rwsem.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+#include <linux/uio.h>
+#include <linux/wait.h>
+#include <linux/xarray.h>
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s: "fmt, __func__
+
+/* Read-only attribute showing the u64 at the given member of
+   compressed_data_t. */
+#define COMPRESSED_COUNTER_ATTR(_name, _member)                             \
+    struct dev_ext_attribute dev_attr_##_name = {                           \
+        __ATTR(_name, 0444, compressed_counter_show, NULL),                 \
+        (void *)offsetof(compressed_data_t, _member)                        \
+    }
+
+
+
+/*****************************************************************************/
+/* PRIVATE STRUCTURES */
+/*****************************************************************************/
+
+/* Stored form of a chunk. A chunk which does not compress is stored as it
+   is, with the size of a whole chunk. */
+typedef struct compressed_chunk {
+    unsigned int size;
+    u8 data[];
+}compressed_chunk_t;
+
+
+
+/*****************************************************************************/
+/* MODE OPERATIONS FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int compressed_init(device_data_t *device_data);
+
+static void compressed_exit(device_data_t *device_data);
+
+static int compressed_resize(device_data_t *device_data, size_t size);
+
+static loff_t compressed_llseek(struct file *file,
+    loff_t file_position_offset, int whence);
+
+static ssize_t compressed_read_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter);
+
+static ssize_t compressed_write_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter);
+
+
+
+/*****************************************************************************/
+/* DEVICE ATTRIBUTES FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static ssize_t algorithm_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer);
+
+static ssize_t algorithm_store(struct device *device,
+    struct device_attribute *device_attribute, const char *input_buffer,
+    size_t char_count);
+
+static ssize_t ratio_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer);
+
+static ssize_t compressed_counter_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer);
+
+static umode_t compressed_attribute_is_visible(struct kobject *kobject,
+    struct attribute *attribute, int index);
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int compressed_lock(device_data_t *device_data, bool nowait);
+
+static int compressed_set_algorithm(device_data_t *device_data,
+    const char *algorithm);
+
+static compressed_cache_entry_t *compressed_cache_lookup(
+    compressed_data_t *compressed, unsigned long chunk_index);
+
+static int compressed_cache_get(device_data_t *device_data,
+    unsigned long chunk_index, bool load, bool nowait, gfp_t gfp,
+    compressed_cache_entry_t **cache_entry);
+
+static void compressed_cache_put(compressed_data_t *compressed,
+    compressed_cache_entry_t *cache_entry);
+
+static bool compressed_cache_has_victim(compressed_data_t *compressed);
+
+static int compressed_load(device_data_t *device_data,
+    unsigned long chunk_index, u8 *destination);
+
+static int compressed_store(device_data_t *device_data,
+    compressed_cache_entry_t *cache_entry, gfp_t gfp);
+
+static void compressed_erase(device_data_t *device_data,
+    unsigned long chunk_index);
+
+
+
+/*****************************************************************************/
+/* MODULE PARAMETERS */
+/*****************************************************************************/
+
+static char *compression_algorithm = "lz4";
+module_param(compression_algorithm, charp, 0444);
+MODULE_PARM_DESC(compression_algorithm,
+    "Compression algorithm of new compressed devices, any the crypto API "
+    "provides, e.g. lz4 (default) or zstd");
+
+
+
+/*****************************************************************************/
+/* PRIVATE VARIABLES */
+/*****************************************************************************/
+
+static DEVICE_ATTR_RW(algorithm);
+static DEVICE_ATTR_RO(ratio);
+static COMPRESSED_COUNTER_ATTR(original_bytes, original_byte_count);
+static COMPRESSED_COUNTER_ATTR(compressed_bytes, compressed_byte_count);
+static COMPRESSED_COUNTER_ATTR(compressions, compression_count);
+static COMPRESSED_COUNTER_ATTR(compression_ns, compression_time);
+static COMPRESSED_COUNTER_ATTR(decompressions, decompression_count);
+static COMPRESSED_COUNTER_ATTR(decompression_ns, decompression_time);
+static COMPRESSED_COUNTER_ATTR(cache_hits, cache_hit_count);
+static COMPRESSED_COUNTER_ATTR(cache_misses, cache_miss_count);
+
+static struct attribute *pseudo_char_device_compression_attributes[] = {
+    &dev_attr_algorithm.attr,
+    &dev_attr_ratio.attr,
+    &dev_attr_original_bytes.attr.attr,
+    &dev_attr_compressed_bytes.attr.attr,
+    &dev_attr_compressions.attr.attr,
+    &dev_attr_compression_ns.attr.attr,
+    &dev_attr_decompressions.attr.attr,
+    &dev_attr_decompression_ns.attr.attr,
+    &dev_attr_cache_hits.attr.attr,
+    &dev_attr_cache_misses.attr.attr,
+    NULL
+};
+
+
+
+/*****************************************************************************/
+/* PUBLIC VARIABLES */
+/*****************************************************************************/
+
+/* Random access mode storing data compressed in fixed size chunks. Chunks
+   never written take no memory and read as zeros. Recently used chunks are
+   kept decompressed in a small cache, written ones are compressed when they
+   leave it, so runs of small sequential transfers cost a single compression
+   or decompression per chunk. */
+const device_mode_operations_t compressed_mode_operations = {
+    .name = "compressed",
+    .init = compressed_init,
+    .exit = compressed_exit,
+    .resize = compressed_resize,
+    .open = pseudo_char_device_open_positioned,
+    .llseek = compressed_llseek,
+    .read_iter = compressed_read_iter,
+    .write_iter = compressed_write_iter
+};
+
+
+
+/* Shows up as the compression/ directory of compressed devices. Counters
+   cover chunks compressed in storage, not the ones in the cache. */
+const struct attribute_group pseudo_char_device_compression_group = {
+    .name = "compression",
+    .attrs = pseudo_char_device_compression_attributes,
+    .is_visible = compressed_attribute_is_visible
+};
+
+
+
+/*****************************************************************************/
+/* PUBLIC FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+/* Memory holding the data of the device, the cache included. */
+u64 pseudo_char_device_compressed_resident_bytes(device_data_t *device_data)
+{
+    u64 resident_byte_count = 0;
+    compressed_data_t *compressed = &device_data->compressed;
+
+    mutex_lock(&compressed->lock);
+    resident_byte_count = compressed->compressed_byte_count +
+        ((DEVICE_COMPRESSED_CACHE_SIZE + 1) * DEVICE_COMPRESSED_CHUNK_SIZE);
+    mutex_unlock(&compressed->lock);
+
+    return resident_byte_count;
+}
+
+
+
+/*****************************************************************************/
+/* MODE OPERATIONS FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static int compressed_init(device_data_t *device_data)
+{
+    int return_code = 0;
+    unsigned entry_index = 0;
+    compressed_data_t *compressed = &device_data->compressed;
+
+    xa_init(&compressed->chunks);
+    mutex_init(&compressed->lock);
+    spin_lock_init(&compressed->cache_lock);
+    init_waitqueue_head(&compressed->cache_queue);
+
+    return_code = pseudo_char_device_buffer_check_size(device_data,
+        device_data->buffer_size);
+    if (return_code == 0) {
+        return_code = compressed_set_algorithm(device_data,
+            compression_algorithm);
+    }
+
+    /* The scratch buffer receives compressed chunks before they are
+       copied out at their final size. */
+    if (return_code == 0) {
+        compressed->scratch = kvmalloc(DEVICE_COMPRESSED_CHUNK_SIZE,
+            GFP_KERNEL_ACCOUNT);
+        if (compressed->scratch == NULL) {
+            return_code = -ENOMEM;
+        }
+    }
+
+    for (; (entry_index < DEVICE_COMPRESSED_CACHE_SIZE) &&
+        (return_code == 0); ++entry_index) {
+        init_rwsem(&compressed->cache[entry_index].data_lock);
+        compressed->cache[entry_index].data = kvmalloc(
+            DEVICE_COMPRESSED_CHUNK_SIZE, GFP_KERNEL_ACCOUNT);
+        if (compressed->cache[entry_index].data == NULL) {
+            return_code = -ENOMEM;
+        }
+    }
+
+    if (return_code == 0) {
+        pr_info("Compressed buffer of %zu bytes set up for device %s...\n",
+            device_data->buffer_size, device_data->serial_number);
+    } else {
+        pr_err("Compressed buffer setup for device %s failed!\n",
+            device_data->serial_number);
+    }
+
+    return return_code;
+}
+
+
+
+/* Dirty chunks of the cache are simply dropped, nobody reads them anymore. */
+static void compressed_exit(device_data_t *device_data)
+{
+    unsigned entry_index = 0;
+    unsigned long chunk_index = 0;
+    compressed_data_t *compressed = &device_data->compressed;
+    void *chunk = NULL;
+
+    xa_for_each(&compressed->chunks, chunk_index, chunk) {
+        kfree(chunk);
+    }
+    xa_destroy(&compressed->chunks);
+
+    for (; entry_index < DEVICE_COMPRESSED_CACHE_SIZE; ++entry_index) {
+        kvfree(compressed->cache[entry_index].data);
+    }
+    kvfree(compressed->scratch);
+
+    if (!IS_ERR_OR_NULL(compressed->compressor)) {
+        crypto_free_comp(compressed->compressor);
+    }
+}
+
+
+
+/* Chunks past the new end are freed and the rest of the last chunk is
+   cleared, so the bytes come back as zeros if the device grows again. */
+static int compressed_resize(device_data_t *device_data, size_t size)
+{
+    int return_code = 0;
+    unsigned entry_index = 0;
+    unsigned long chunk_index = 0;
+    const unsigned long chunk_count = DIV_ROUND_UP(size,
+        DEVICE_COMPRESSED_CHUNK_SIZE);
+    const size_t chunk_offset = size % DEVICE_COMPRESSED_CHUNK_SIZE;
+    compressed_data_t *compressed = &device_data->compressed;
+    compressed_cache_entry_t *cache_entry = NULL;
+    void *chunk = NULL;
+
+    return_code = pseudo_char_device_buffer_check_size(device_data, size);
+    if (return_code == 0) {
+        mutex_lock(&compressed->lock);
+
+        if ((chunk_offset != 0) && (size < device_data->buffer_size)) {
+            return_code = compressed_cache_get(device_data,
+                size / DEVICE_COMPRESSED_CHUNK_SIZE, true, false, GFP_KERNEL,
+                &cache_entry);
+            if (return_code == 0) {
+                down_write(&cache_entry->data_lock);
+                memset(&cache_entry->data[chunk_offset], 0,
+                    DEVICE_COMPRESSED_CHUNK_SIZE - chunk_offset);
+                cache_entry->dirty = true;
+                up_write(&cache_entry->data_lock);
+                compressed_cache_put(compressed, cache_entry);
+            }
+        }
+
+        /* Readers still copying out of a dropped entry notice once they
+           hold its data lock. */
+        if (return_code == 0) {
+            spin_lock(&compressed->cache_lock);
+            for (; entry_index < DEVICE_COMPRESSED_CACHE_SIZE;
+                ++entry_index) {
+                cache_entry = &compressed->cache[entry_index];
+                if (cache_entry->valid &&
+                    (cache_entry->chunk_index >= chunk_count)) {
+                    cache_entry->valid = false;
+                    cache_entry->dirty = false;
+                }
+            }
+            spin_unlock(&compressed->cache_lock);
+
+            xa_for_each_start(&compressed->chunks, chunk_index, chunk,
+                chunk_count) {
+                compressed_erase(device_data, chunk_index);
+            }
+
+            WRITE_ONCE(device_data->buffer_size, size);
+        }
+
+        mutex_unlock(&compressed->lock);
+    }
+
+    if (return_code == 0) {
+        pr_info("Compressed buffer of device %s resized to %zu bytes.\n",
+            device_data->serial_number, size);
+    } else {
+        pr_err("Compressed buffer resize of device %s failed!\n",
+            device_data->serial_number);
+    }
+
+    return return_code;
+}
+
+
+
+static loff_t compressed_llseek(struct file *file,
+    loff_t file_position_offset, int whence)
+{
+    device_data_t *device_data = (device_data_t *)file->private_data;
+
+    return fixed_size_llseek(file, file_position_offset, whence,
+        READ_ONCE(device_data->buffer_size));
+}
+
+
+
+/* Chunks in the cache are copied without the device lock, only missing
+   ones take it to be brought in. The data lock of the entry is held while
+   copying, as the copy may fault, so a writer or a miss reusing the entry
+   waits for the copy to complete. */
+static ssize_t compressed_read_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter)
+{
+    ssize_t return_code = 0;
+    size_t byte_count = iov_iter_count(iov_iter);
+    size_t copied_byte_count = 0;
+    size_t chunk_size = 0;
+    size_t chunk_copied_byte_count = 0;
+    size_t chunk_offset = 0;
+    unsigned long chunk_index = 0;
+    loff_t file_position = iocb->ki_pos;
+    bool reused = false;
+    const bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    device_data_t *device_data = (device_data_t *)iocb->ki_filp->private_data;
+    const size_t buffer_size = READ_ONCE(device_data->buffer_size);
+    compressed_data_t *compressed = &device_data->compressed;
+    compressed_cache_entry_t *cache_entry = NULL;
+
+    pr_debug("Read operation requested for %zu bytes...\n", byte_count);
+    pr_debug("Current file position: %lld\n", iocb->ki_pos);
+
+    if (file_position >= buffer_size) {
+        byte_count = 0;
+    } else if ((file_position + byte_count) > buffer_size) {
+        byte_count = buffer_size - file_position;
+    }
+
+    while (copied_byte_count < byte_count) {
+        chunk_index = file_position / DEVICE_COMPRESSED_CHUNK_SIZE;
+        chunk_offset = file_position % DEVICE_COMPRESSED_CHUNK_SIZE;
+        chunk_size = min_t(size_t, byte_count - copied_byte_count,
+            DEVICE_COMPRESSED_CHUNK_SIZE - chunk_offset);
+
+        cache_entry = compressed_cache_lookup(compressed, chunk_index);
+        if (cache_entry == NULL) {
+            return_code = compressed_lock(device_data, nowait);
+            if (return_code == 0) {
+                return_code = compressed_cache_get(device_data, chunk_index,
+                    true, nowait,
+                    nowait ? (GFP_NOWAIT | __GFP_NOWARN) : GFP_KERNEL,
+                    &cache_entry);
+                mutex_unlock(&compressed->lock);
+            }
+        }
+
+        if ((return_code == 0) && nowait &&
+            !down_read_trylock(&cache_entry->data_lock)) {
+            compressed_cache_put(compressed, cache_entry);
+            return_code = -EAGAIN;
+        } else if ((return_code == 0) && !nowait) {
+            down_read(&cache_entry->data_lock);
+        }
+
+        if (return_code != 0) {
+            break;
+        }
+
+        /* Reused for another chunk before the data lock was taken, the
+           chunk is looked up again. */
+        spin_lock(&compressed->cache_lock);
+        reused = !cache_entry->valid ||
+            (cache_entry->chunk_index != chunk_index);
+        spin_unlock(&compressed->cache_lock);
+
+        chunk_copied_byte_count = 0;
+        if (!reused) {
+            chunk_copied_byte_count = copy_to_iter(
+                &cache_entry->data[chunk_offset], chunk_size, iov_iter);
+            if (chunk_copied_byte_count < chunk_size) {
+                return_code = -EFAULT;
+            }
+        }
+
+        up_read(&cache_entry->data_lock);
+        compressed_cache_put(compressed, cache_entry);
+
+        copied_byte_count += chunk_copied_byte_count;
+        file_position += chunk_copied_byte_count;
+
+        if (return_code != 0) {
+            break;
+        }
+    }
+
+    if ((copied_byte_count > 0) || (byte_count == 0)) {
+        return_code = copied_byte_count;
+
+        iocb->ki_pos = file_position;
+        pr_debug("New file position: %lld\n", iocb->ki_pos);
+        pr_debug("Successfully read byte count: %zu\n", copied_byte_count);
+    }
+
+    return return_code;
+}
+
+
+
+static ssize_t compressed_write_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter)
+{
+    ssize_t return_code = 0;
+    size_t byte_count = iov_iter_count(iov_iter);
+    size_t copied_byte_count = 0;
+    size_t chunk_size = 0;
+    size_t chunk_copied_byte_count = 0;
+    size_t chunk_offset = 0;
+    loff_t file_position = iocb->ki_pos;
+    bool load = false;
+    const bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    device_data_t *device_data = (device_data_t *)iocb->ki_filp->private_data;
+    compressed_cache_entry_t *cache_entry = NULL;
+
+    pr_debug("Write operation requested for %zu bytes...\n", byte_count);
+    pr_debug("Current file position: %lld\n", iocb->ki_pos);
+
+    return_code = compressed_lock(device_data, nowait);
+    if (return_code != 0) {
+        return return_code;
+    }
+
+    if (file_position >= device_data->buffer_size) {
+        byte_count = 0;
+    } else if ((file_position + byte_count) > device_data->buffer_size) {
+        byte_count = device_data->buffer_size - file_position;
+    }
+
+    if (byte_count == 0) {
+        pr_debug("No available memory for write operation...\n");
+        return_code = -ENOMEM;
+    }
+
+    while (copied_byte_count < byte_count) {
+        chunk_offset = file_position % DEVICE_COMPRESSED_CHUNK_SIZE;
+        chunk_size = min_t(size_t, byte_count - copied_byte_count,
+            DEVICE_COMPRESSED_CHUNK_SIZE - chunk_offset);
+
+        /* A chunk overwritten as a whole need not be decompressed first. */
+        load = chunk_size < DEVICE_COMPRESSED_CHUNK_SIZE;
+        return_code = compressed_cache_get(device_data,
+            file_position / DEVICE_COMPRESSED_CHUNK_SIZE, load, nowait,
+            nowait ? (GFP_NOWAIT | __GFP_ACCOUNT | __GFP_NOWARN) :
+            GFP_KERNEL_ACCOUNT, &cache_entry);
+        if (return_code != 0) {
+            break;
+        }
+
+        /* Readers copying out of the chunk are waited for. */
+        down_write(&cache_entry->data_lock);
+
+        chunk_copied_byte_count = copy_from_iter(
+            &cache_entry->data[chunk_offset], chunk_size, iov_iter);
+
+        if ((chunk_copied_byte_count < chunk_size) && !load) {
+            /* The rest of the chunk holds nothing of it, so the chunk is
+               dropped from the cache and the partial copy undone. */
+            iov_iter_revert(iov_iter, chunk_copied_byte_count);
+            chunk_copied_byte_count = 0;
+            spin_lock(&device_data->compressed.cache_lock);
+            cache_entry->valid = false;
+            spin_unlock(&device_data->compressed.cache_lock);
+        } else {
+            cache_entry->dirty = true;
+        }
+
+        up_write(&cache_entry->data_lock);
+        compressed_cache_put(&device_data->compressed, cache_entry);
+
+        copied_byte_count += chunk_copied_byte_count;
+        file_position += chunk_copied_byte_count;
+
+        if (chunk_copied_byte_count < chunk_size) {
+            return_code = -EFAULT;
+            break;
+        }
+    }
+
+    mutex_unlock(&device_data->compressed.lock);
+
+    if (copied_byte_count > 0) {
+        return_code = copied_byte_count;
+
+        iocb->ki_pos = file_position;
+        pr_debug("New file position: %lld\n", iocb->ki_pos);
+        pr_debug("Successfully written byte count: %zu\n",
+            copied_byte_count);
+    } else if (return_code == -EFAULT) {
+        pr_debug("Unable to copy %zu bytes...\n", byte_count);
+    }
+
+    return return_code;
+}
+
+
+
+/*****************************************************************************/
+/* DEVICE ATTRIBUTES FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static ssize_t algorithm_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer)
+{
+    ssize_t return_code = 0;
+    device_data_t *device_data = dev_get_drvdata(device);
+
+    if (device_data != NULL) {
+        mutex_lock(&device_data->compressed.lock);
+        return_code = sprintf(output_buffer, "%s\n",
+            device_data->compressed.algorithm);
+        mutex_unlock(&device_data->compressed.lock);
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+/* The algorithm may only change while the device holds no data. */
+static ssize_t algorithm_store(struct device *device,
+    struct device_attribute *device_attribute, const char *input_buffer,
+    size_t char_count)
+{
+    ssize_t return_code = 0;
+    unsigned entry_index = 0;
+    char algorithm[CRYPTO_MAX_ALG_NAME];
+    device_data_t *device_data = dev_get_drvdata(device);
+    compressed_data_t *compressed = NULL;
+
+    if (device_data == NULL) {
+        return -ENOENT;
+    }
+
+    compressed = &device_data->compressed;
+    strscpy(algorithm, input_buffer, sizeof(algorithm));
+
+    mutex_lock(&compressed->lock);
+
+    if (!xa_empty(&compressed->chunks)) {
+        return_code = -EBUSY;
+    }
+
+    for (; (entry_index < DEVICE_COMPRESSED_CACHE_SIZE) &&
+        (return_code == 0); ++entry_index) {
+        if (compressed->cache[entry_index].dirty) {
+            return_code = -EBUSY;
+        }
+    }
+
+    if (return_code == 0) {
+        return_code = compressed_set_algorithm(device_data,
+            strim(algorithm));
+    }
+
+    mutex_unlock(&compressed->lock);
+
+    if (return_code == 0) {
+        return_code = char_count;
+    }
+
+    return return_code;
+}
+
+
+
+/* Original size over compressed size, with two decimal places. */
+static ssize_t ratio_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer)
+{
+    ssize_t return_code = 0;
+    u64 ratio = 0;
+    device_data_t *device_data = dev_get_drvdata(device);
+    compressed_data_t *compressed = NULL;
+
+    if (device_data != NULL) {
+        compressed = &device_data->compressed;
+
+        mutex_lock(&compressed->lock);
+        if (compressed->compressed_byte_count != 0) {
+            ratio = div64_u64(compressed->original_byte_count * 100,
+                compressed->compressed_byte_count);
+        }
+        mutex_unlock(&compressed->lock);
+
+        return_code = sprintf(output_buffer, "%llu.%02llu\n", ratio / 100,
+            ratio % 100);
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+static ssize_t compressed_counter_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer)
+{
+    ssize_t return_code = 0;
+    u64 value = 0;
+    device_data_t *device_data = dev_get_drvdata(device);
+    const size_t offset = (size_t)container_of(device_attribute,
+        struct dev_ext_attribute, attr)->var;
+
+    /* Cache hits are counted under the cache lock alone. */
+    if (device_data != NULL) {
+        mutex_lock(&device_data->compressed.lock);
+        spin_lock(&device_data->compressed.cache_lock);
+        value = *(u64 *)((char *)&device_data->compressed + offset);
+        spin_unlock(&device_data->compressed.cache_lock);
+        mutex_unlock(&device_data->compressed.lock);
+
+        return_code = sprintf(output_buffer, "%llu\n", value);
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+static umode_t compressed_attribute_is_visible(struct kobject *kobject,
+    struct attribute *attribute, int index)
+{
+    device_data_t *device_data = dev_get_drvdata(kobj_to_dev(kobject));
+
+    return (device_data->mode_operations == &compressed_mode_operations) ?
+        attribute->mode : 0;
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+/* With nowait set the caller may not sleep waiting for the lock
+   (IOCB_NOWAIT), otherwise the wait is interruptible. */
+static int compressed_lock(device_data_t *device_data, bool nowait)
+{
+    int return_code = 0;
+
+    if (nowait) {
+        if (!mutex_trylock(&device_data->compressed.lock)) {
+            return_code = -EAGAIN;
+        }
+    } else if (mutex_lock_interruptible(&device_data->compressed.lock) !=
+        0) {
+        return_code = -ERESTARTSYS;
+    }
+
+    return return_code;
+}
+
+
+
+static int compressed_set_algorithm(device_data_t *device_data,
+    const char *algorithm)
+{
+    int return_code = 0;
+    compressed_data_t *compressed = &device_data->compressed;
+    struct crypto_comp *compressor = NULL;
+
+    compressor = crypto_alloc_comp(algorithm, 0, 0);
+    if (!IS_ERR(compressor)) {
+        if (!IS_ERR_OR_NULL(compressed->compressor)) {
+            crypto_free_comp(compressed->compressor);
+        }
+        compressed->compressor = compressor;
+        strscpy(compressed->algorithm, algorithm,
+            sizeof(compressed->algorithm));
+
+        pr_info("Device %s compresses with %s...\n",
+            device_data->serial_number, algorithm);
+    } else {
+        pr_err("Compression algorithm %s not available!\n", algorithm);
+        return_code = PTR_ERR(compressor);
+    }
+
+    return return_code;
+}
+
+
+
+/* Entry holding the chunk, with one more user, NULL if the chunk is not
+   in the cache. Takes no more than the cache lock. */
+static compressed_cache_entry_t *compressed_cache_lookup(
+    compressed_data_t *compressed, unsigned long chunk_index)
+{
+    unsigned entry_index = 0;
+    compressed_cache_entry_t *entry = NULL;
+
+    spin_lock(&compressed->cache_lock);
+
+    for (; entry_index < DEVICE_COMPRESSED_CACHE_SIZE; ++entry_index) {
+        entry = &compressed->cache[entry_index];
+        if (entry->valid && (entry->chunk_index == chunk_index)) {
+            ++entry->user_count;
+            entry->last_use = ++compressed->use_count;
+            ++compressed->cache_hit_count;
+            break;
+        }
+        entry = NULL;
+    }
+
+    spin_unlock(&compressed->cache_lock);
+
+    return entry;
+}
+
+
+
+/* Find the chunk in the cache, or bring it in in place of the least
+   recently used entry nobody uses, which is compressed first if it was
+   written to. The entry is returned with one more user, for the caller to
+   put. Called with the device lock held, so only readers compete for the
+   cache; with all entries in use, the caller waits for one to be put. The
+   readers may be stuck copying to user memory which keeps faulting, so
+   the wait can be interrupted. */
+static int compressed_cache_get(device_data_t *device_data,
+    unsigned long chunk_index, bool load, bool nowait, gfp_t gfp,
+    compressed_cache_entry_t **cache_entry)
+{
+    int return_code = 0;
+    unsigned entry_index = 0;
+    compressed_data_t *compressed = &device_data->compressed;
+    compressed_cache_entry_t *entry = NULL;
+    compressed_cache_entry_t *victim = NULL;
+
+    entry = compressed_cache_lookup(compressed, chunk_index);
+
+    while ((entry == NULL) && (victim == NULL) && (return_code == 0)) {
+        spin_lock(&compressed->cache_lock);
+        for (entry_index = 0; entry_index < DEVICE_COMPRESSED_CACHE_SIZE;
+            ++entry_index) {
+            entry = &compressed->cache[entry_index];
+            if ((entry->user_count == 0) && ((victim == NULL) ||
+                !entry->valid ||
+                (victim->valid && (entry->last_use < victim->last_use)))) {
+                victim = entry;
+            }
+        }
+        entry = NULL;
+
+        if (victim != NULL) {
+            ++victim->user_count;
+            ++compressed->cache_miss_count;
+        }
+        spin_unlock(&compressed->cache_lock);
+
+        if ((victim == NULL) && nowait) {
+            return_code = -EAGAIN;
+        } else if (victim == NULL) {
+            return_code = wait_event_interruptible(compressed->cache_queue,
+                compressed_cache_has_victim(compressed));
+        }
+    }
+
+    if (victim != NULL) {
+        /* Readers which found the entry before it became the victim
+           finish their copy first. */
+        down_write(&victim->data_lock);
+
+        if (victim->valid && victim->dirty) {
+            return_code = compressed_store(device_data, victim, gfp);
+        }
+
+        if (return_code == 0) {
+            spin_lock(&compressed->cache_lock);
+            victim->valid = false;
+            victim->dirty = false;
+            spin_unlock(&compressed->cache_lock);
+
+            if (load) {
+                return_code = compressed_load(device_data, chunk_index,
+                    victim->data);
+            }
+        }
+
+        if (return_code == 0) {
+            spin_lock(&compressed->cache_lock);
+            victim->chunk_index = chunk_index;
+            victim->valid = true;
+            victim->last_use = ++compressed->use_count;
+            spin_unlock(&compressed->cache_lock);
+        }
+
+        up_write(&victim->data_lock);
+
+        if (return_code == 0) {
+            entry = victim;
+        } else {
+            compressed_cache_put(compressed, victim);
+        }
+    }
+
+    if (return_code == 0) {
+        *cache_entry = entry;
+    }
+
+    return return_code;
+}
+
+
+
+/* Once the last user is gone, the entry may be reused for another chunk. */
+static void compressed_cache_put(compressed_data_t *compressed,
+    compressed_cache_entry_t *cache_entry)
+{
+    bool idle = false;
+
+    spin_lock(&compressed->cache_lock);
+    idle = (--cache_entry->user_count == 0);
+    spin_unlock(&compressed->cache_lock);
+
+    if (idle && wq_has_sleeper(&compressed->cache_queue)) {
+        wake_up(&compressed->cache_queue);
+    }
+}
+
+
+
+static bool compressed_cache_has_victim(compressed_data_t *compressed)
+{
+    unsigned entry_index = 0;
+    bool has_victim = false;
+
+    spin_lock(&compressed->cache_lock);
+    for (; (entry_index < DEVICE_COMPRESSED_CACHE_SIZE) && !has_victim;
+        ++entry_index) {
+        has_victim = (compressed->cache[entry_index].user_count == 0);
+    }
+    spin_unlock(&compressed->cache_lock);
+
+    return has_victim;
+}
+
+
+
+static int compressed_load(device_data_t *device_data,
+    unsigned long chunk_index, u8 *destination)
+{
+    int return_code = 0;
+    unsigned int decompressed_size = DEVICE_COMPRESSED_CHUNK_SIZE;
+    u64 start = 0;
+    compressed_data_t *compressed = &device_data->compressed;
+    const compressed_chunk_t *chunk = xa_load(&compressed->chunks,
+        chunk_index);
+
+    if (chunk == NULL) {
+        memset(destination, 0, DEVICE_COMPRESSED_CHUNK_SIZE);
+    } else if (chunk->size == DEVICE_COMPRESSED_CHUNK_SIZE) {
+        memcpy(destination, chunk->data, DEVICE_COMPRESSED_CHUNK_SIZE);
+    } else {
+        start = ktime_get_ns();
+        return_code = crypto_comp_decompress(compressed->compressor,
+            chunk->data, chunk->size, destination, &decompressed_size);
+        compressed->decompression_time += ktime_get_ns() - start;
+        ++compressed->decompression_count;
+
+        if ((return_code != 0) ||
+            (decompressed_size != DEVICE_COMPRESSED_CHUNK_SIZE)) {
+            pr_err("Chunk %lu of device %s corrupted!\n", chunk_index,
+                device_data->serial_number);
+            return_code = -EIO;
+        }
+    }
+
+    return return_code;
+}
+
+
+
+/* A chunk of zeros is not stored at all, one which does not compress is
+   stored as it is. */
+static int compressed_store(device_data_t *device_data,
+    compressed_cache_entry_t *cache_entry, gfp_t gfp)
+{
+    int return_code = 0;
+    unsigned int compressed_size = DEVICE_COMPRESSED_CHUNK_SIZE;
+    u64 start = 0;
+    compressed_data_t *compressed = &device_data->compressed;
+    compressed_chunk_t *chunk = NULL;
+    void *old_chunk = NULL;
+    const u8 *data = cache_entry->data;
+
+    if (memchr_inv(cache_entry->data, 0, DEVICE_COMPRESSED_CHUNK_SIZE) ==
+        NULL) {
+        compressed_erase(device_data, cache_entry->chunk_index);
+        return 0;
+    }
+
+    start = ktime_get_ns();
+    return_code = crypto_comp_compress(compressed->compressor,
+        cache_entry->data, DEVICE_COMPRESSED_CHUNK_SIZE, compressed->scratch,
+        &compressed_size);
+    compressed->compression_time += ktime_get_ns() - start;
+    ++compressed->compression_count;
+
+    if ((return_code == 0) &&
+        (compressed_size < DEVICE_COMPRESSED_CHUNK_SIZE)) {
+        data = compressed->scratch;
+    } else {
+        compressed_size = DEVICE_COMPRESSED_CHUNK_SIZE;
+    }
+
+    chunk = kmalloc(struct_size(chunk, data, compressed_size), gfp);
+    if (chunk != NULL) {
+        chunk->size = compressed_size;
+        memcpy(chunk->data, data, compressed_size);
+
+        old_chunk = xa_store(&compressed->chunks, cache_entry->chunk_index,
+            chunk, gfp);
+        if (xa_is_err(old_chunk)) {
+            kfree(chunk);
+            return_code = xa_err(old_chunk);
+        } else {
+            if (old_chunk != NULL) {
+                compressed->original_byte_count -=
+                    DEVICE_COMPRESSED_CHUNK_SIZE;
+                compressed->compressed_byte_count -=
+                    ((compressed_chunk_t *)old_chunk)->size;
+                kfree(old_chunk);
+            }
+
+            compressed->original_byte_count += DEVICE_COMPRESSED_CHUNK_SIZE;
+            compressed->compressed_byte_count += compressed_size;
+            return_code = 0;
+        }
+    } else {
+        return_code = -ENOMEM;
+    }
+
+    return return_code;
+}
+
+
+
+static void compressed_erase(device_data_t *device_data,
+    unsigned long chunk_index)
+{
+    compressed_data_t *compressed = &device_data->compressed;
+    compressed_chunk_t *chunk = xa_erase(&compressed->chunks, chunk_index);
+
+    if (chunk != NULL) {
+        compressed->original_byte_count -= DEVICE_COMPRESSED_CHUNK_SIZE;
+        compressed->compressed_byte_count -= chunk->size;
+        kfree(chunk);
+    }
+}
@@ -0,0 +1,167 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/miscdevice.h>
+#include <linux/module.h>
+#include <linux/uaccess.h>
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s: "fmt, __func__
+
+
+
+/*****************************************************************************/
+/* CONTROL FILE OPERATIONS FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static long control_ioctl(struct file *file, unsigned int command,
+    unsigned long argument);
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int control_create(struct pcd_device_config *user_config);
+
+
+
+/*****************************************************************************/
+/* PRIVATE VARIABLES */
+/*****************************************************************************/
+
+static const struct file_operations control_file_operations = {
+    .owner = THIS_MODULE,
+    .unlocked_ioctl = control_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .llseek = noop_llseek
+};
+
+/* Only root may create and destroy devices, as with loop-control. */
+static struct miscdevice control_device = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = PCD_CONTROL_DEVICE_NAME,
+    .fops = &control_file_operations,
+    .mode = 0600
+};
+
+
+
+/*****************************************************************************/
+/* PUBLIC FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+int pseudo_char_device_control_init(void)
+{
+    int return_code = 0;
+
+    return_code = misc_register(&control_device);
+    if (return_code == 0) {
+        pr_info("Control device registration done...\n");
+    } else {
+        pr_err("Control device registration failed!\n");
+    }
+
+    return return_code;
+}
+
+
+
+void pseudo_char_device_control_exit(void)
+{
+    misc_deregister(&control_device);
+}
+
+
+
+/*****************************************************************************/
+/* CONTROL FILE OPERATIONS FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static long control_ioctl(struct file *file, unsigned int command,
+    unsigned long argument)
+{
+    long return_code = 0;
+    struct pcd_device_config user_config;
+    void __user *user_pointer = (void __user *)argument;
+
+    if ((command != PCD_IOCTL_CREATE) && (command != PCD_IOCTL_DESTROY)) {
+        return -ENOTTY;
+    }
+
+    if (copy_from_user(&user_config, user_pointer, sizeof(user_config)) != 0) {
+        return -EFAULT;
+    }
+
+    /* Strings from user space do not have to be terminated. */
+    user_config.serial_number[PCD_SERIAL_NUMBER_SIZE - 1] = '\0';
+    user_config.mode[PCD_MODE_NAME_SIZE - 1] = '\0';
+    user_config.backing_file[PCD_BACKING_FILE_SIZE - 1] = '\0';
+
+    if (command == PCD_IOCTL_CREATE) {
+        return_code = control_create(&user_config);
+        if ((return_code == 0) &&
+            (copy_to_user(user_pointer, &user_config,
+                sizeof(user_config)) != 0)) {
+            return_code = -EFAULT;
+        }
+    } else {
+        return_code = pseudo_char_device_destroy(user_config.serial_number);
+    }
+
+    return return_code;
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static int control_create(struct pcd_device_config *user_config)
+{
+    int return_code = 0;
+    unsigned id = 0;
+    device_config_t config = {
+        .serial_number = user_config->serial_number,
+        .mode_name = NULL,
+        .backing_file = NULL,
+        .buffer_size = user_config->buffer_size,
+        .permission_type = user_config->permission
+    };
+
+    if (user_config->mode[0] != '\0') {
+        config.mode_name = user_config->mode;
+    }
+
+    if (user_config->backing_file[0] != '\0') {
+        config.backing_file = user_config->backing_file;
+    }
+
+    /* Checked before it gets truncated to size_t on 32-bit machines, the
+       mode checks the range of its own. */
+    if ((user_config->buffer_size > SIZE_MAX) ||
+        (user_config->permission > PCD_PERMISSION_READ_WRITE)) {
+        return_code = -EINVAL;
+    } else {
+        return_code = pseudo_char_device_create(&config, &id);
+    }
+
+    if (return_code == 0) {
+        user_config->id = id;
+    }
+
+    return return_code;
+}
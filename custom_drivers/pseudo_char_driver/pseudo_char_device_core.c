@@ -0,0 +1,860 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/kdev_t.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/splice.h>
+#include <linux/string.h>
+#include <linux/uio.h>
+#include <linux/xarray.h>
+
+#define CREATE_TRACE_POINTS
+#include "pseudo_char_device_trace.h"
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s: "fmt, __func__
+
+
+
+/*****************************************************************************/
+/* MODULE INIT & EXIT FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int __init pseudo_char_device_init(void);
+
+static void __exit pseudo_char_device_exit(void);
+
+
+
+/*****************************************************************************/
+/* MODULE FILE OPERATIONS FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static loff_t pseudo_char_device_llseek(struct file *file,
+    loff_t file_position_offset, int whence);
+
+static ssize_t pseudo_char_device_read_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter);
+
+static ssize_t pseudo_char_device_write_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter);
+
+static __poll_t pseudo_char_device_poll(struct file *file,
+    struct poll_table_struct *poll_table);
+
+static int pseudo_char_device_mmap(struct file *file,
+    struct vm_area_struct *vma);
+
+static long pseudo_char_device_ioctl(struct file *file, unsigned int command,
+    unsigned long argument);
+
+static int pseudo_char_device_fsync(struct file *file, loff_t start,
+    loff_t end, int datasync);
+
+static int pseudo_char_device_flush(struct file *file, fl_owner_t id);
+
+static int pseudo_char_device_open(struct inode *inode, struct file *file);
+
+static int pseudo_char_device_release(struct inode *inode, struct file *file);
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int check_permission(const permission_type_t device_permission,
+    const int access_mode);
+
+static int create_default_devices(void);
+
+static void destroy_devices(void);
+
+static int add_device(device_data_t *device_data);
+
+static void remove_device(device_data_t *device_data);
+
+static device_data_t *find_device(const char *serial_number);
+
+static void release_device(struct device *device);
+
+static const device_mode_operations_t *find_mode_operations(
+    const char *mode_name);
+
+
+
+/*****************************************************************************/
+/* MODULE PARAMETERS */
+/*****************************************************************************/
+
+static char *device_modes[DEFAULT_DEVICE_COUNT];
+module_param_array(device_modes, charp, NULL, 0444);
+MODULE_PARM_DESC(device_modes,
+    "Comma separated mode of each default device: random_access (default), "
+    "fifo, sharded, sparse, compressed, record, broadcast or kv");
+
+static unsigned long buffer_sizes[DEFAULT_DEVICE_COUNT];
+module_param_array(buffer_sizes, ulong, NULL, 0444);
+MODULE_PARM_DESC(buffer_sizes,
+    "Comma separated buffer size of each default device in bytes "
+    "(default 512)");
+
+static char *backing_files[DEFAULT_DEVICE_COUNT];
+module_param_array(backing_files, charp, NULL, 0444);
+MODULE_PARM_DESC(backing_files,
+    "Comma separated path of the file backing each default device, "
+    "random_access devices only (default none)");
+
+
+
+/*****************************************************************************/
+/* PRIVATE VARIABLES */
+/*****************************************************************************/
+
+static struct file_operations file_operations = {
+    .owner = THIS_MODULE,
+    .llseek = pseudo_char_device_llseek,
+    .read_iter = pseudo_char_device_read_iter,
+    .write_iter = pseudo_char_device_write_iter,
+    .splice_read = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
+    .poll = pseudo_char_device_poll,
+    .mmap = pseudo_char_device_mmap,
+    .unlocked_ioctl = pseudo_char_device_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .fsync = pseudo_char_device_fsync,
+    .flush = pseudo_char_device_flush,
+    .open = pseudo_char_device_open,
+    .release = pseudo_char_device_release
+};
+
+
+
+static const device_mode_operations_t *mode_operations_table[
+    DEVICE_MODE_COUNT] = {
+        [DEVICE_MODE_RANDOM_ACCESS] = &random_access_mode_operations,
+        [DEVICE_MODE_FIFO] = &fifo_mode_operations,
+        [DEVICE_MODE_SHARDED] = &sharded_mode_operations,
+        [DEVICE_MODE_SPARSE] = &sparse_mode_operations,
+        [DEVICE_MODE_COMPRESSED] = &compressed_mode_operations,
+        [DEVICE_MODE_RECORD] = &record_mode_operations,
+        [DEVICE_MODE_BROADCAST] = &broadcast_mode_operations,
+        [DEVICE_MODE_KV] = &kv_mode_operations
+};
+
+
+
+
+/*****************************************************************************/
+/* PRIVATE STRUCTURES */
+/*****************************************************************************/
+
+/* Devices are indexed by their id, which is also the offset of their minor
+   number and the suffix of their node name. */
+typedef struct driver_data {
+    dev_t device_number;
+    struct class *device_class;
+    struct xarray devices;
+    struct mutex devices_lock;
+}driver_data_t;
+
+static driver_data_t driver_data = {
+    .devices = XARRAY_INIT(driver_data.devices, XA_FLAGS_ALLOC),
+    .devices_lock = __MUTEX_INITIALIZER(driver_data.devices_lock)
+};
+
+static const device_config_t default_device_configs[DEFAULT_DEVICE_COUNT] = {
+    [0] = {
+        .serial_number = "pcd1",
+        .buffer_size = DEVICE_BUFFER_SIZE,
+        .permission_type = PERMISSION_TYPE_READ
+    },
+    [1] = {
+        .serial_number = "pcd2",
+        .buffer_size = DEVICE_BUFFER_SIZE,
+        .permission_type = PERMISSION_TYPE_WRITE
+    },
+    [2] = {
+        .serial_number = "pcd3",
+        .buffer_size = DEVICE_BUFFER_SIZE,
+        .permission_type = PERMISSION_TYPE_READ_WRITE
+    },
+    [3] = {
+        .serial_number = "pcd4",
+        .buffer_size = DEVICE_BUFFER_SIZE,
+        .permission_type = PERMISSION_TYPE_READ_WRITE
+    }
+};
+
+
+
+/*****************************************************************************/
+/* MODULE INIT & EXIT FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static int __init pseudo_char_device_init(void)
+{
+    int return_code = 0;
+
+    /* Dynamically allocate device numbers for every device there may be. */
+    return_code = alloc_chrdev_region(&driver_data.device_number, 0,
+        DEVICE_COUNT_MAX, "pseudo_char_devices");
+    if (return_code == 0) {
+        pr_info("Device number allocation done...\n");
+
+        /* Create a device class under /sys/class/. */
+        driver_data.device_class = class_create(THIS_MODULE,
+            "pseudo_char_device_class");
+        if (!IS_ERR(driver_data.device_class)) {
+            pr_info("Device class creation done...\n");
+
+            return_code = pseudo_char_device_reclaim_init();
+            if (return_code == 0) {
+                return_code = create_default_devices();
+                if (return_code == 0) {
+                    return_code = pseudo_char_device_control_init();
+                }
+
+                if (return_code == 0) {
+                    return_code = pseudo_char_device_ring_init();
+                    if (return_code != 0) {
+                        pseudo_char_device_control_exit();
+                    }
+                }
+
+                if (return_code != 0) {
+                    destroy_devices();
+                    pseudo_char_device_reclaim_exit();
+                }
+            }
+
+            if (return_code != 0) {
+                class_destroy(driver_data.device_class);
+                unregister_chrdev_region(driver_data.device_number,
+                    DEVICE_COUNT_MAX);
+            }
+        } else {
+            pr_err("Device class creation failed!\n");
+            unregister_chrdev_region(driver_data.device_number,
+                DEVICE_COUNT_MAX);
+            return_code = PTR_ERR(driver_data.device_class);
+        }
+    } else {
+        pr_err("Device number allocation failed!\n");
+    }
+
+    if (return_code == 0) {
+        pr_info("Module initialization done successfully.\n");
+    } else {
+        pr_err("Module initialization failed!\n");
+    }
+
+    return return_code;
+}
+
+
+
+static void __exit pseudo_char_device_exit(void)
+{
+    /* No more devices may be created from now on. */
+    pseudo_char_device_control_exit();
+
+    pseudo_char_device_ring_exit();
+
+    destroy_devices();
+
+    pseudo_char_device_reclaim_exit();
+
+    /* Remove class from /sys/class/. */
+    class_destroy(driver_data.device_class);
+
+    /* Deallocate assigned device numbers. */
+    unregister_chrdev_region(driver_data.device_number, DEVICE_COUNT_MAX);
+
+    xa_destroy(&driver_data.devices);
+
+    pr_info("Module unloaded...\n");
+}
+
+
+
+/*****************************************************************************/
+/* PUBLIC FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+int pseudo_char_device_create(const device_config_t *config, unsigned *id)
+{
+    int return_code = 0;
+    device_data_t *device_data = NULL;
+    const device_mode_operations_t *mode_operations =
+        &random_access_mode_operations;
+
+    if ((config->serial_number[0] == '\0') ||
+        (strlen(config->serial_number) >= PCD_SERIAL_NUMBER_SIZE) ||
+        (config->permission_type > PERMISSION_TYPE_READ_WRITE)) {
+        pr_err("Invalid device configuration!\n");
+        return -EINVAL;
+    }
+
+    /* Checked up front: dropping the device runs the exit of its mode,
+       which only works on a mode which has been initialized. */
+    if (config->mode_name != NULL) {
+        mode_operations = find_mode_operations(config->mode_name);
+        if (mode_operations == NULL) {
+            pr_err("Unknown mode %s of device %s!\n", config->mode_name,
+                config->serial_number);
+            return -EINVAL;
+        }
+    }
+
+    device_data = kzalloc(sizeof(device_data_t), GFP_KERNEL);
+    if (device_data == NULL) {
+        pr_err("Memory allocation for device %s failed!\n",
+            config->serial_number);
+        return -ENOMEM;
+    }
+
+    /* From now on the device data is freed by dropping the last reference
+       to the device. */
+    device_initialize(&device_data->device);
+    device_data->device.class = driver_data.device_class;
+    device_data->device.groups = pseudo_char_device_attribute_groups;
+    device_data->device.release = release_device;
+    dev_set_drvdata(&device_data->device, device_data);
+
+    strscpy(device_data->serial_number, config->serial_number,
+        sizeof(device_data->serial_number));
+    device_data->permission_type = config->permission_type;
+    device_data->buffer_size = (config->buffer_size != 0) ?
+        config->buffer_size : DEVICE_BUFFER_SIZE;
+    device_data->mode_operations = mode_operations;
+
+    pseudo_char_device_fifo_init(device_data);
+    pseudo_char_device_qos_init(device_data);
+
+    pr_info("Device %s works in %s mode...\n", device_data->serial_number,
+        mode_operations->name);
+
+    return_code = device_data->mode_operations->init(device_data);
+
+    /* The buffer is filled from the file before anyone may open it. */
+    if ((return_code == 0) && (config->backing_file != NULL)) {
+        return_code = pseudo_char_device_backing_init(device_data,
+            config->backing_file);
+    }
+
+    if (return_code == 0) {
+        return_code = pseudo_char_device_stats_init(device_data);
+    }
+
+    if (return_code == 0) {
+        mutex_lock(&driver_data.devices_lock);
+        return_code = add_device(device_data);
+        mutex_unlock(&driver_data.devices_lock);
+    }
+
+    if (return_code == 0) {
+        pr_info("Device %s created as %s...\n", device_data->serial_number,
+            dev_name(&device_data->device));
+        *id = device_data->id;
+    } else {
+        pr_err("Creating device %s failed!\n", config->serial_number);
+        put_device(&device_data->device);
+    }
+
+    return return_code;
+}
+
+
+
+int pseudo_char_device_destroy(const char *serial_number)
+{
+    int return_code = 0;
+    device_data_t *device_data = NULL;
+
+    mutex_lock(&driver_data.devices_lock);
+
+    device_data = find_device(serial_number);
+    if (device_data != NULL) {
+        pr_info("Device %s destroyed...\n", serial_number);
+        remove_device(device_data);
+    } else {
+        return_code = -ENOENT;
+    }
+
+    mutex_unlock(&driver_data.devices_lock);
+
+    return return_code;
+}
+
+
+
+bool pseudo_char_device_is_device_file(const struct file *file)
+{
+    return file->f_op == &file_operations;
+}
+
+
+
+/* Both O_NONBLOCK and IOCB_NOWAIT (e.g. io_uring, preadv2() with
+   RWF_NOWAIT) ask for -EAGAIN instead of sleeping. */
+bool pseudo_char_device_is_nonblocking(const struct kiocb *iocb)
+{
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+        (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+
+
+/* Open operation of the seekable modes. Tasks sharing the file descriptor
+   serialize their llseek, read and write calls on the file position, like
+   they do for regular files. */
+int pseudo_char_device_open_positioned(struct inode *inode, struct file *file)
+{
+    file->f_mode |= FMODE_ATOMIC_POS;
+
+    return 0;
+}
+
+
+
+/*****************************************************************************/
+/* MODULE FILE OPERATIONS FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static loff_t pseudo_char_device_llseek(struct file *file,
+    loff_t file_position_offset, int whence)
+{
+    loff_t return_code = 0;
+    const loff_t file_position = file->f_pos;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+
+    return_code = device_data->mode_operations->llseek(file,
+        file_position_offset, whence);
+
+    trace_pcd_llseek(iminor(file_inode(file)), file_position,
+        file_position_offset, whence, return_code);
+
+    return return_code;
+}
+
+
+
+static ssize_t pseudo_char_device_read_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter)
+{
+    ssize_t return_code = 0;
+    const loff_t file_position = iocb->ki_pos;
+    const size_t byte_count = iov_iter_count(iov_iter);
+    const u64 start_time = ktime_get_ns();
+    device_data_t *device_data = (device_data_t *)iocb->ki_filp->private_data;
+
+    return_code = device_data->mode_operations->read_iter(iocb, iov_iter);
+
+    pseudo_char_device_stats_read(device_data, byte_count, return_code,
+        ktime_get_ns() - start_time);
+
+    trace_pcd_read(iminor(file_inode(iocb->ki_filp)), file_position,
+        byte_count, return_code);
+
+    return return_code;
+}
+
+
+
+static ssize_t pseudo_char_device_write_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter)
+{
+    ssize_t return_code = 0;
+    const loff_t file_position = iocb->ki_pos;
+    const size_t byte_count = iov_iter_count(iov_iter);
+    const u64 start_time = ktime_get_ns();
+    device_data_t *device_data = (device_data_t *)iocb->ki_filp->private_data;
+    qos_file_t *qos_file = NULL;
+
+    /* Time spent throttled counts towards the latency of the write. */
+    return_code = pseudo_char_device_qos_write_begin(iocb, byte_count,
+        &qos_file);
+    if (return_code == 0) {
+        return_code = device_data->mode_operations->write_iter(iocb,
+            iov_iter);
+        pseudo_char_device_qos_write_end(qos_file, byte_count, return_code);
+    }
+
+    pseudo_char_device_stats_write(device_data, byte_count, return_code,
+        ktime_get_ns() - start_time);
+
+    trace_pcd_write(iminor(file_inode(iocb->ki_filp)), file_position,
+        byte_count, return_code);
+
+    return return_code;
+}
+
+
+
+static __poll_t pseudo_char_device_poll(struct file *file,
+    struct poll_table_struct *poll_table)
+{
+    __poll_t return_code = DEFAULT_POLLMASK;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+
+    if (device_data->mode_operations->poll != NULL) {
+        return_code = device_data->mode_operations->poll(file, poll_table);
+    }
+
+    return return_code;
+}
+
+
+
+static int pseudo_char_device_mmap(struct file *file,
+    struct vm_area_struct *vma)
+{
+    int return_code = -ENODEV;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+
+    if (device_data->mode_operations->mmap != NULL) {
+        return_code = device_data->mode_operations->mmap(file, vma);
+    }
+
+    return return_code;
+}
+
+
+
+static long pseudo_char_device_ioctl(struct file *file, unsigned int command,
+    unsigned long argument)
+{
+    long return_code = -ENOTTY;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+
+    if ((command == PCD_IOCTL_QOS_SET) || (command == PCD_IOCTL_QOS_GET)) {
+        return_code = pseudo_char_device_qos_ioctl(file, command, argument);
+    } else if (device_data->mode_operations->ioctl != NULL) {
+        return_code = device_data->mode_operations->ioctl(file, command,
+            argument);
+    }
+
+    return return_code;
+}
+
+
+
+/* Devices without a backing file have nothing to sync. The range is not
+   looked at, the writeback covers all dirty pages anyway. */
+static int pseudo_char_device_fsync(struct file *file, loff_t start,
+    loff_t end, int datasync)
+{
+    device_data_t *device_data = (device_data_t *)file->private_data;
+
+    return pseudo_char_device_backing_fsync(device_data, datasync);
+}
+
+
+
+/* Closing a file written to reports a failed writeback of the backing
+   file, the data reaches it with the writeback work or fsync(). */
+static int pseudo_char_device_flush(struct file *file, fl_owner_t id)
+{
+    int return_code = 0;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+
+    if (file->f_mode & FMODE_WRITE) {
+        return_code = pseudo_char_device_backing_error(device_data);
+    }
+
+    return return_code;
+}
+
+
+
+static int pseudo_char_device_open(struct inode *inode, struct file *file)
+{
+    int return_code = 0;
+    device_data_t *device_data = NULL;
+
+    pr_debug("Open operation requested on the device %d:%d...\n",
+        MAJOR(inode->i_rdev), MINOR(inode->i_rdev));
+
+    /* Get device's private data structure. */
+    device_data = container_of(inode->i_cdev, device_data_t, cdev);
+
+    /* Store address of device's private data structure for other file
+       operations like llseek, read, write, etc. */
+    file->private_data = device_data;
+
+    /* Every mode honors IOCB_NOWAIT, so io_uring may issue requests inline
+       instead of punting them to a worker thread. */
+    file->f_mode |= FMODE_NOWAIT;
+
+    return_code = check_permission(device_data->permission_type, file->f_mode);
+    if ((return_code == 0) && (device_data->mode_operations->open != NULL)) {
+        return_code = device_data->mode_operations->open(inode, file);
+    }
+
+    pseudo_char_device_stats_open(device_data, return_code);
+    trace_pcd_open(iminor(inode), file->f_mode, return_code);
+
+    if (return_code == 0) {
+        pr_debug("Open operation done successfully.\n");
+    } else {
+        pr_debug("Open operation failed with %d!\n", return_code);
+    }
+
+    return return_code;
+}
+
+
+
+static int pseudo_char_device_release(struct inode *inode, struct file *file)
+{
+    device_data_t *device_data = (device_data_t *)file->private_data;
+
+    trace_pcd_release(iminor(inode));
+
+    pr_debug("Release operation requested...\n");
+
+    if (device_data->mode_operations->release != NULL) {
+        device_data->mode_operations->release(file);
+    }
+
+    pseudo_char_device_qos_release(file);
+    pseudo_char_device_backing_release(file);
+
+    return 0;
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static int check_permission(const permission_type_t device_permission,
+    const int access_mode)
+{
+    int return_code = 0;
+
+    switch (device_permission) {
+        case PERMISSION_TYPE_READ: {
+            if ((access_mode & FMODE_READ) && !(access_mode & FMODE_WRITE)) {
+                return_code = 0;
+            } else {
+                return_code = -EPERM;
+            }
+        }
+        break;
+
+        case PERMISSION_TYPE_WRITE: {
+            if ((access_mode & FMODE_WRITE) && !(access_mode & FMODE_READ)) {
+                return_code = 0;
+            } else {
+                return_code = -EPERM;
+            }
+        }
+        break;
+
+        case PERMISSION_TYPE_READ_WRITE: {
+            return_code = 0;
+        }
+        break;
+
+        default: {
+            return_code = -EPERM;
+        }
+        break;
+    }
+
+    return return_code;
+}
+
+
+
+static int create_default_devices(void)
+{
+    int return_code = 0;
+    unsigned device_index = 0;
+    unsigned id = 0;
+    device_config_t config;
+
+    for (; (device_index < DEFAULT_DEVICE_COUNT) && (return_code == 0);
+        ++device_index) {
+        config = default_device_configs[device_index];
+
+        if (device_modes[device_index] != NULL) {
+            config.mode_name = device_modes[device_index];
+        }
+
+        if (buffer_sizes[device_index] != 0) {
+            config.buffer_size = buffer_sizes[device_index];
+        }
+
+        if (backing_files[device_index] != NULL) {
+            config.backing_file = backing_files[device_index];
+        }
+
+        return_code = pseudo_char_device_create(&config, &id);
+    }
+
+    return return_code;
+}
+
+
+
+static void destroy_devices(void)
+{
+    unsigned long id = 0;
+    device_data_t *device_data = NULL;
+
+    mutex_lock(&driver_data.devices_lock);
+    xa_for_each(&driver_data.devices, id, device_data) {
+        remove_device(device_data);
+    }
+    mutex_unlock(&driver_data.devices_lock);
+}
+
+
+
+/* Takes the lowest free id and makes the device visible to user space.
+   Called with the devices lock held. */
+static int add_device(device_data_t *device_data)
+{
+    int return_code = 0;
+
+    if (find_device(device_data->serial_number) != NULL) {
+        pr_err("Serial number %s already taken!\n",
+            device_data->serial_number);
+        return_code = -EEXIST;
+    } else {
+        return_code = xa_alloc(&driver_data.devices, &device_data->id,
+            device_data, XA_LIMIT(0, DEVICE_COUNT_MAX - 1), GFP_KERNEL);
+    }
+
+    if (return_code == 0) {
+        device_data->device.devt = driver_data.device_number +
+            device_data->id;
+
+        return_code = dev_set_name(&device_data->device,
+            "pseudo_char_device_%u", device_data->id);
+        if (return_code == 0) {
+            /* Initialize cdev structure with the file operations and
+               register it with VFS together with the device. */
+            cdev_init(&device_data->cdev, &file_operations);
+            device_data->cdev.owner = THIS_MODULE;
+
+            return_code = cdev_device_add(&device_data->cdev,
+                &device_data->device);
+        }
+
+        if (return_code != 0) {
+            xa_erase(&driver_data.devices, device_data->id);
+        }
+    }
+
+    return return_code;
+}
+
+
+
+/* Called with the devices lock held. Files still open keep the device
+   data alive, only new opens fail. The backing file is synced here rather
+   than when the device data goes away, which may happen anywhere the last
+   reference is dropped. */
+static void remove_device(device_data_t *device_data)
+{
+    xa_erase(&driver_data.devices, device_data->id);
+
+    cdev_device_del(&device_data->cdev, &device_data->device);
+
+    pseudo_char_device_backing_stop(device_data);
+
+    put_device(&device_data->device);
+}
+
+
+
+/* Called with the devices lock held. */
+static device_data_t *find_device(const char *serial_number)
+{
+    unsigned long id = 0;
+    device_data_t *device_data = NULL;
+
+    xa_for_each(&driver_data.devices, id, device_data) {
+        if (strcmp(device_data->serial_number, serial_number) == 0) {
+            break;
+        }
+    }
+
+    return device_data;
+}
+
+
+
+static void release_device(struct device *device)
+{
+    device_data_t *device_data = container_of(device, device_data_t, device);
+
+    /* Before the buffer goes, the work may still be using it. */
+    pseudo_char_device_backing_exit(device_data);
+    device_data->mode_operations->exit(device_data);
+    pseudo_char_device_stats_exit(device_data);
+    pseudo_char_device_qos_exit(device_data);
+
+    kfree(device_data);
+}
+
+
+
+/* Returns NULL for an unknown mode. */
+static const device_mode_operations_t *find_mode_operations(
+    const char *mode_name)
+{
+    const device_mode_operations_t *mode_operations = NULL;
+    unsigned mode_index = 0;
+
+    for (; mode_index < DEVICE_MODE_COUNT; ++mode_index) {
+        if (sysfs_streq(mode_name, mode_operations_table[mode_index]->name)) {
+            mode_operations = mode_operations_table[mode_index];
+            break;
+        }
+    }
+
+    return mode_operations;
+}
+
+
+
+/*****************************************************************************/
+/* MODULE REGISTRATION */
+/*****************************************************************************/
+
+/* The KUnit suite creates and destroys devices of its own. */
+#if IS_ENABLED(CONFIG_KUNIT)
+EXPORT_SYMBOL_GPL(pseudo_char_device_create);
+EXPORT_SYMBOL_GPL(pseudo_char_device_destroy);
+#endif
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Jakub Standarski");
+MODULE_DESCRIPTION("Pseudo character device driver for learning purposes.");
+
+module_init(pseudo_char_device_init);
+module_exit(pseudo_char_device_exit);
+
@@ -0,0 +1,180 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <linux/atomic.h>
+#include <linux/hashtable.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/xxhash.h>
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s: "fmt, __func__
+
+#define DEDUP_TABLE_BITS    12
+
+
+
+/*****************************************************************************/
+/* PRIVATE STRUCTURES */
+/*****************************************************************************/
+
+/* Page whose content may be shared by any number of device pages. The page
+   points back to its entry through its private field. */
+typedef struct dedup_entry {
+    struct hlist_node node;
+    u64 hash;
+    struct page *page;
+    unsigned int share_count;
+}dedup_entry_t;
+
+
+
+/*****************************************************************************/
+/* PRIVATE VARIABLES */
+/*****************************************************************************/
+
+/* Pages of all devices, indexed by the hash of their content. Pages in the
+   table are never written to, writers take a private copy first. */
+static DEFINE_HASHTABLE(dedup_table, DEDUP_TABLE_BITS);
+static DEFINE_MUTEX(dedup_lock);
+
+/* Device pages pointing to a page of the table, less the table pages. */
+static atomic_long_t dedup_saved_page_count = ATOMIC_LONG_INIT(0);
+
+
+
+/*****************************************************************************/
+/* PUBLIC FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+/* Look for a page with the same content. If there is one, it gets one more
+   sharer and is returned with a reference for the caller, who is expected
+   to replace its page with it. Otherwise the page itself enters the table
+   and is returned. NULL means the page was left out: a page referenced by
+   anyone but the device may be written to through a mapping. */
+struct page *pseudo_char_device_dedup_insert(device_data_t *device_data,
+    struct page *page)
+{
+    const void *data = page_address(page);
+    const u64 hash = xxh64(data, PAGE_SIZE, 0);
+    dedup_entry_t *entry = NULL;
+    struct page *shared_page = NULL;
+
+    mutex_lock(&dedup_lock);
+
+    hash_for_each_possible(dedup_table, entry, node, hash) {
+        if ((entry->hash == hash) &&
+            (memcmp(page_address(entry->page), data, PAGE_SIZE) == 0)) {
+            ++entry->share_count;
+            atomic_long_inc(&dedup_saved_page_count);
+            get_page(entry->page);
+            shared_page = entry->page;
+            break;
+        }
+    }
+
+    if (shared_page == NULL) {
+        entry = kmalloc(sizeof(dedup_entry_t), GFP_KERNEL);
+        if (entry != NULL) {
+            entry->hash = hash;
+            entry->page = page;
+            entry->share_count = 1;
+            set_page_private(page, (unsigned long)entry);
+
+            /* Pairs with the barrier of the fault taking its reference
+               before looking at the private field, one of the two sees
+               the other. */
+            smp_mb();
+            if (page_count(page) == 1) {
+                hash_add(dedup_table, &entry->node, hash);
+                shared_page = page;
+            } else {
+                set_page_private(page, 0);
+                kfree(entry);
+            }
+        }
+    }
+
+    if (shared_page != NULL) {
+        atomic_long_inc(&device_data->sparse.dedup_page_count);
+    }
+
+    mutex_unlock(&dedup_lock);
+
+    return shared_page;
+}
+
+
+
+/* Drop one sharer of a page of the table, the page leaves the table with
+   the last one. The reference of the sharer is left to the caller. */
+void pseudo_char_device_dedup_put(device_data_t *device_data,
+    struct page *page)
+{
+    dedup_entry_t *entry = NULL;
+
+    mutex_lock(&dedup_lock);
+
+    entry = (dedup_entry_t *)page_private(page);
+    if (entry != NULL) {
+        if (--entry->share_count > 0) {
+            atomic_long_dec(&dedup_saved_page_count);
+        } else {
+            hash_del(&entry->node);
+            set_page_private(page, 0);
+            kfree(entry);
+        }
+        atomic_long_dec(&device_data->sparse.dedup_page_count);
+    }
+
+    mutex_unlock(&dedup_lock);
+}
+
+
+
+/* Take a page out of the table if its caller is its only sharer, so the
+   page may be written to in place. Returns false if it is shared. */
+bool pseudo_char_device_dedup_try_remove(device_data_t *device_data,
+    struct page *page)
+{
+    bool removed = true;
+    dedup_entry_t *entry = NULL;
+
+    mutex_lock(&dedup_lock);
+
+    entry = (dedup_entry_t *)page_private(page);
+    if (entry != NULL) {
+        if (entry->share_count == 1) {
+            hash_del(&entry->node);
+            set_page_private(page, 0);
+            kfree(entry);
+            atomic_long_dec(&device_data->sparse.dedup_page_count);
+        } else {
+            removed = false;
+        }
+    }
+
+    mutex_unlock(&dedup_lock);
+
+    return removed;
+}
+
+
+
+/* Pages the devices would use on top of the current ones without
+   deduplication. */
+unsigned long pseudo_char_device_dedup_saved_pages(void)
+{
+    return atomic_long_read(&dedup_saved_page_count);
+}
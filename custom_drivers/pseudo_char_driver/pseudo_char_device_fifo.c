@@ -0,0 +1,392 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/sched/signal.h>
+#include <linux/uio.h>
+#include <linux/wait.h>
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s: "fmt, __func__
+
+
+
+/*****************************************************************************/
+/* MODE OPERATIONS FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int fifo_open(struct inode *inode, struct file *file);
+
+static ssize_t fifo_read_iter(struct kiocb *iocb, struct iov_iter *iov_iter);
+
+static ssize_t fifo_write_iter(struct kiocb *iocb, struct iov_iter *iov_iter);
+
+static __poll_t fifo_poll(struct file *file,
+    struct poll_table_struct *poll_table);
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static unsigned int fifo_used_byte_count(const device_data_t *device_data);
+
+static unsigned int fifo_free_byte_count(const device_data_t *device_data);
+
+static bool fifo_is_readable(const device_data_t *device_data);
+
+static bool fifo_is_writable(const device_data_t *device_data);
+
+static bool fifo_has_room(const device_data_t *device_data,
+    size_t byte_count);
+
+static int fifo_wait(device_data_t *device_data, bool nonblocking,
+    struct mutex *lock, wait_queue_head_t *wait_queue,
+    bool (*is_ready)(const device_data_t *device_data));
+
+static int fifo_wait_writable(struct kiocb *iocb, size_t byte_count);
+
+
+
+/*****************************************************************************/
+/* PUBLIC VARIABLES */
+/*****************************************************************************/
+
+const device_mode_operations_t fifo_mode_operations = {
+    .name = "fifo",
+    .init = pseudo_char_device_buffer_init,
+    .exit = pseudo_char_device_buffer_exit,
+    .resize = pseudo_char_device_buffer_resize,
+    .open = fifo_open,
+    .llseek = no_llseek,
+    .read_iter = fifo_read_iter,
+    .write_iter = fifo_write_iter,
+    .poll = fifo_poll
+};
+
+
+
+/*****************************************************************************/
+/* PUBLIC FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+void pseudo_char_device_fifo_init(device_data_t *device_data)
+{
+    fifo_data_t *fifo = &device_data->fifo;
+
+    fifo->head = 0;
+    fifo->tail = 0;
+
+    mutex_init(&fifo->producer_lock);
+    mutex_init(&fifo->consumer_lock);
+
+    init_waitqueue_head(&fifo->write_queue);
+    init_waitqueue_head(&fifo->read_queue);
+}
+
+
+
+/*****************************************************************************/
+/* MODE OPERATIONS FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static int fifo_open(struct inode *inode, struct file *file)
+{
+    /* There is no notion of a file position in a stream. */
+    return stream_open(inode, file);
+}
+
+
+
+static ssize_t fifo_read_iter(struct kiocb *iocb, struct iov_iter *iov_iter)
+{
+    ssize_t return_code = 0;
+    size_t byte_count = iov_iter_count(iov_iter);
+    size_t copied_byte_count = 0;
+    unsigned int head = 0;
+    unsigned int tail = 0;
+    unsigned int offset = 0;
+    unsigned int first_chunk = 0;
+    device_data_t *device_data = (device_data_t *)iocb->ki_filp->private_data;
+    device_buffer_t *buffer = NULL;
+    fifo_data_t *fifo = &device_data->fifo;
+
+    if (byte_count == 0) {
+        return 0;
+    }
+
+    /* On success the consumer lock is held and there is data to read. */
+    return_code = fifo_wait(device_data,
+        pseudo_char_device_is_nonblocking(iocb), &fifo->consumer_lock,
+        &fifo->read_queue, fifo_is_readable);
+    if (return_code == 0) {
+        /* Pairs with the release in fifo_write(): the data written by the
+           producer is visible before the new head is. */
+        head = smp_load_acquire(&fifo->head);
+        tail = fifo->tail;
+
+        /* A resize takes both ring locks, so the buffer is stable. Free
+           running indices are masked with (size - 1), which is why the size
+           of a ring is always a power of two. */
+        buffer = rcu_dereference_protected(device_data->buffer,
+            lockdep_is_held(&fifo->consumer_lock));
+
+        byte_count = min_t(size_t, byte_count, head - tail);
+        offset = tail & (buffer->size - 1);
+        first_chunk = min_t(unsigned int, byte_count, buffer->size - offset);
+
+        copied_byte_count = copy_to_iter(&buffer->data[offset], first_chunk,
+            iov_iter);
+        if (copied_byte_count == first_chunk) {
+            copied_byte_count += copy_to_iter(&buffer->data[0],
+                byte_count - first_chunk, iov_iter);
+        }
+
+        if (copied_byte_count == 0) {
+            pr_debug("Unable to copy %zu bytes...\n", byte_count);
+            return_code = -EFAULT;
+        } else {
+            /* Data must be read out before the producer may reuse the
+               space. */
+            smp_store_release(&fifo->tail, tail + copied_byte_count);
+            return_code = copied_byte_count;
+        }
+
+        mutex_unlock(&fifo->consumer_lock);
+
+        if (return_code > 0) {
+            wake_up_interruptible_poll(&fifo->write_queue,
+                EPOLLOUT | EPOLLWRNORM);
+            pseudo_char_device_qos_wake(device_data);
+        }
+
+        /* Readers are woken one at a time, so pass the wake up on to the
+           next reader if this one left something behind. */
+        if (fifo_is_readable(device_data)) {
+            wake_up_interruptible_poll(&fifo->read_queue,
+                EPOLLIN | EPOLLRDNORM);
+        }
+    }
+
+    return return_code;
+}
+
+
+
+static ssize_t fifo_write_iter(struct kiocb *iocb, struct iov_iter *iov_iter)
+{
+    ssize_t return_code = 0;
+    size_t byte_count = iov_iter_count(iov_iter);
+    size_t copied_byte_count = 0;
+    unsigned int head = 0;
+    unsigned int tail = 0;
+    unsigned int offset = 0;
+    unsigned int first_chunk = 0;
+    device_data_t *device_data = (device_data_t *)iocb->ki_filp->private_data;
+    device_buffer_t *buffer = NULL;
+    fifo_data_t *fifo = &device_data->fifo;
+
+    if (byte_count == 0) {
+        return 0;
+    }
+
+    /* On success the producer lock is held and there is free space. */
+    return_code = fifo_wait_writable(iocb, byte_count);
+    if (return_code == 0) {
+        /* Pairs with the release in fifo_read(): the consumer is done with
+           the space before it shows up as free. */
+        tail = smp_load_acquire(&fifo->tail);
+        head = fifo->head;
+
+        buffer = rcu_dereference_protected(device_data->buffer,
+            lockdep_is_held(&fifo->producer_lock));
+
+        byte_count = min_t(size_t, byte_count, buffer->size - (head - tail));
+        offset = head & (buffer->size - 1);
+        first_chunk = min_t(unsigned int, byte_count, buffer->size - offset);
+
+        copied_byte_count = copy_from_iter(&buffer->data[offset],
+            first_chunk, iov_iter);
+        if (copied_byte_count == first_chunk) {
+            copied_byte_count += copy_from_iter(&buffer->data[0],
+                byte_count - first_chunk, iov_iter);
+        }
+
+        if (copied_byte_count == 0) {
+            pr_debug("Unable to copy %zu bytes...\n", byte_count);
+            return_code = -EFAULT;
+        } else {
+            /* Publish the data before the new head. */
+            smp_store_release(&fifo->head, head + copied_byte_count);
+            return_code = copied_byte_count;
+        }
+
+        mutex_unlock(&fifo->producer_lock);
+
+        if (return_code > 0) {
+            wake_up_interruptible_poll(&fifo->read_queue,
+                EPOLLIN | EPOLLRDNORM);
+        }
+
+        if (fifo_is_writable(device_data)) {
+            wake_up_interruptible_poll(&fifo->write_queue,
+                EPOLLOUT | EPOLLWRNORM);
+            pseudo_char_device_qos_wake(device_data);
+        }
+    }
+
+    return return_code;
+}
+
+
+
+static __poll_t fifo_poll(struct file *file,
+    struct poll_table_struct *poll_table)
+{
+    __poll_t mask = 0;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+
+    poll_wait(file, &device_data->fifo.read_queue, poll_table);
+    poll_wait(file, &device_data->fifo.write_queue, poll_table);
+
+    if (fifo_is_readable(device_data)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+
+    if (fifo_is_writable(device_data)) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+
+    return mask;
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static unsigned int fifo_used_byte_count(const device_data_t *device_data)
+{
+    return READ_ONCE(device_data->fifo.head) -
+        READ_ONCE(device_data->fifo.tail);
+}
+
+
+
+static unsigned int fifo_free_byte_count(const device_data_t *device_data)
+{
+    return READ_ONCE(device_data->buffer_size) -
+        fifo_used_byte_count(device_data);
+}
+
+
+
+static bool fifo_is_readable(const device_data_t *device_data)
+{
+    return fifo_used_byte_count(device_data) > 0;
+}
+
+
+
+static bool fifo_is_writable(const device_data_t *device_data)
+{
+    return fifo_free_byte_count(device_data) > 0;
+}
+
+
+
+/* Any room will do, writes are cut short to it. */
+static bool fifo_has_room(const device_data_t *device_data,
+    size_t byte_count)
+{
+    return fifo_is_writable(device_data);
+}
+
+
+
+/* Take the given side's lock once the ring is ready for that side. Waiters
+   are queued exclusively, so a single wake up only gets a single waiter
+   running instead of the whole crowd. */
+static int fifo_wait(device_data_t *device_data, bool nonblocking,
+    struct mutex *lock, wait_queue_head_t *wait_queue,
+    bool (*is_ready)(const device_data_t *device_data))
+{
+    int return_code = 0;
+
+    if (nonblocking) {
+        return_code = mutex_trylock(lock) ? 0 : -EAGAIN;
+    } else {
+        return_code = mutex_lock_interruptible(lock);
+    }
+
+    while ((return_code == 0) && !is_ready(device_data)) {
+        mutex_unlock(lock);
+
+        if (nonblocking) {
+            return_code = -EAGAIN;
+        } else {
+            return_code = wait_event_interruptible_exclusive(*wait_queue,
+                is_ready(device_data));
+            if (return_code == 0) {
+                return_code = mutex_lock_interruptible(lock);
+            }
+        }
+    }
+
+    return return_code;
+}
+
+
+
+/* Take the producer lock once there is free space. Writers waiting for it
+   queue up fairly between their files instead of on the write queue, which
+   is left to poll(). */
+static int fifo_wait_writable(struct kiocb *iocb, size_t byte_count)
+{
+    int return_code = 0;
+    device_data_t *device_data = (device_data_t *)iocb->ki_filp->private_data;
+    fifo_data_t *fifo = &device_data->fifo;
+    const bool nonblocking = pseudo_char_device_is_nonblocking(iocb);
+    u64 start_time = DEVICE_QOS_UNCHARGED;
+
+    if (nonblocking) {
+        return_code = mutex_trylock(&fifo->producer_lock) ? 0 : -EAGAIN;
+    } else {
+        return_code = mutex_lock_interruptible(&fifo->producer_lock);
+    }
+
+    /* A write never takes more than the whole ring. */
+    byte_count = min_t(size_t, byte_count,
+        READ_ONCE(device_data->buffer_size));
+
+    while ((return_code == 0) && !fifo_is_writable(device_data)) {
+        mutex_unlock(&fifo->producer_lock);
+
+        if (nonblocking) {
+            return_code = -EAGAIN;
+        } else {
+            return_code = pseudo_char_device_qos_wait(iocb->ki_filp,
+                byte_count, &start_time, fifo_has_room);
+            if (return_code == 0) {
+                return_code = mutex_lock_interruptible(&fifo->producer_lock);
+            }
+        }
+    }
+
+    return return_code;
+}
@@ -0,0 +1,395 @@
+#ifndef PSEUDO_CHAR_DEVICE_IOCTL_H
+#define PSEUDO_CHAR_DEVICE_IOCTL_H
+
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+
+
+/*****************************************************************************/
+/* PUBLIC MACROS */
+/*****************************************************************************/
+
+/* Shared with user space, which is why only fixed size types are used. */
+
+#define PCD_CONTROL_DEVICE_NAME "pseudo_char_device_control"
+#define PCD_RING_DEVICE_NAME    "pseudo_char_device_ring"
+
+#define PCD_SERIAL_NUMBER_SIZE  32
+#define PCD_MODE_NAME_SIZE      16
+#define PCD_BACKING_FILE_SIZE   256
+
+#define PCD_PERMISSION_READ         0
+#define PCD_PERMISSION_WRITE        1
+#define PCD_PERMISSION_READ_WRITE   2
+
+#define PCD_IOCTL_MAGIC 0xB7
+
+/* Commands of /dev/pseudo_char_device_control. */
+#define PCD_IOCTL_CREATE    _IOWR(PCD_IOCTL_MAGIC, 0x00, \
+    struct pcd_device_config)
+#define PCD_IOCTL_DESTROY   _IOW(PCD_IOCTL_MAGIC, 0x01, \
+    struct pcd_device_config)
+
+/* Commands of random access devices. */
+#define PCD_IOCTL_WATCH             _IOWR(PCD_IOCTL_MAGIC, 0x10, \
+    struct pcd_watch)
+#define PCD_IOCTL_UNWATCH           _IOW(PCD_IOCTL_MAGIC, 0x11, \
+    struct pcd_watch)
+#define PCD_IOCTL_GET_GENERATION    _IOWR(PCD_IOCTL_MAGIC, 0x12, \
+    struct pcd_watch)
+#define PCD_IOCTL_VERIFY            _IOWR(PCD_IOCTL_MAGIC, 0x13, \
+    struct pcd_verify)
+#define PCD_IOCTL_ATOMIC            _IOWR(PCD_IOCTL_MAGIC, 0x14, \
+    struct pcd_atomic_op)
+#define PCD_IOCTL_ATOMIC_BATCH      _IOWR(PCD_IOCTL_MAGIC, 0x15, \
+    struct pcd_atomic_batch)
+#define PCD_IOCTL_TXN_BEGIN         _IOR(PCD_IOCTL_MAGIC, 0x16, \
+    struct pcd_transaction)
+#define PCD_IOCTL_TXN_WRITE         _IOW(PCD_IOCTL_MAGIC, 0x17, \
+    struct pcd_transaction)
+#define PCD_IOCTL_TXN_COMMIT        _IOW(PCD_IOCTL_MAGIC, 0x18, \
+    struct pcd_transaction)
+#define PCD_IOCTL_TXN_ABORT         _IOW(PCD_IOCTL_MAGIC, 0x19, \
+    struct pcd_transaction)
+
+/* Commands of /dev/pseudo_char_device_ring. */
+#define PCD_IOCTL_RING_SETUP        _IOWR(PCD_IOCTL_MAGIC, 0x20, \
+    struct pcd_ring_setup)
+#define PCD_IOCTL_RING_REGISTER     _IOWR(PCD_IOCTL_MAGIC, 0x21, \
+    struct pcd_ring_file)
+#define PCD_IOCTL_RING_UNREGISTER   _IOW(PCD_IOCTL_MAGIC, 0x22, \
+    struct pcd_ring_file)
+#define PCD_IOCTL_RING_ENTER        _IO(PCD_IOCTL_MAGIC, 0x23)
+
+/* Commands of record devices. */
+#define PCD_IOCTL_RECORD_NEXT       _IOR(PCD_IOCTL_MAGIC, 0x30, \
+    struct pcd_record_header)
+#define PCD_IOCTL_RECORD_BATCH      _IOW(PCD_IOCTL_MAGIC, 0x31, __u32)
+
+/* Commands of broadcast devices. */
+#define PCD_IOCTL_BROADCAST_STATUS  _IOR(PCD_IOCTL_MAGIC, 0x40, \
+    struct pcd_broadcast_status)
+
+/* Commands of key-value devices. */
+#define PCD_IOCTL_KV_GET        _IOWR(PCD_IOCTL_MAGIC, 0x50, \
+    struct pcd_kv_entry)
+#define PCD_IOCTL_KV_PUT        _IOW(PCD_IOCTL_MAGIC, 0x51, \
+    struct pcd_kv_entry)
+#define PCD_IOCTL_KV_DELETE     _IOW(PCD_IOCTL_MAGIC, 0x52, \
+    struct pcd_kv_entry)
+#define PCD_IOCTL_KV_MULTI_GET  _IOWR(PCD_IOCTL_MAGIC, 0x53, \
+    struct pcd_kv_batch)
+#define PCD_IOCTL_KV_ITERATE    _IOWR(PCD_IOCTL_MAGIC, 0x54, \
+    struct pcd_kv_iterate)
+
+/* Commands of every device. */
+#define PCD_IOCTL_QOS_SET   _IOW(PCD_IOCTL_MAGIC, 0x60, struct pcd_qos)
+#define PCD_IOCTL_QOS_GET   _IOR(PCD_IOCTL_MAGIC, 0x61, struct pcd_qos)
+
+/* Operations of struct pcd_atomic_op. */
+#define PCD_ATOMIC_OP_CMPXCHG   0
+#define PCD_ATOMIC_OP_FETCH_ADD 1
+#define PCD_ATOMIC_OP_FETCH_AND 2
+#define PCD_ATOMIC_OP_FETCH_OR  3
+#define PCD_ATOMIC_OP_FETCH_XOR 4
+
+#define PCD_ATOMIC_BATCH_COUNT_MAX  256
+
+/* Weights of struct pcd_qos. */
+#define PCD_QOS_WEIGHT_MAX  1000
+
+/* Flags of struct pcd_ring_setup. */
+#define PCD_RING_SETUP_POLL         (1U << 0)
+
+/* Flags of struct pcd_ring_header. */
+#define PCD_RING_NEED_WAKEUP        (1U << 0)
+
+/* Operations of struct pcd_ring_submission. */
+#define PCD_RING_OP_READ    0
+#define PCD_RING_OP_WRITE   1
+#define PCD_RING_OP_SEEK    2
+
+#define PCD_RING_ENTRY_COUNT_MAX    4096
+#define PCD_RING_FILE_COUNT_MAX     64
+
+/* Keys are NUL terminated strings, the batches of PCD_IOCTL_KV_MULTI_GET
+   and PCD_IOCTL_KV_ITERATE are limited to PCD_KV_BATCH_COUNT_MAX. */
+#define PCD_KV_KEY_SIZE         64
+#define PCD_KV_VALUE_SIZE_MAX   4096
+#define PCD_KV_BATCH_COUNT_MAX  256
+
+
+
+/*****************************************************************************/
+/* PUBLIC STRUCTURES */
+/*****************************************************************************/
+
+/* Description of a device to create, or the serial number of a device to
+   destroy. An empty mode stands for random_access, a zero buffer size for
+   the default one, an empty backing file for none. On creation the id of
+   the new device is returned, its node is /dev/pseudo_char_device_<id>. */
+struct pcd_device_config {
+    char serial_number[PCD_SERIAL_NUMBER_SIZE];
+    __u64 buffer_size;
+    char mode[PCD_MODE_NAME_SIZE];
+    __u32 permission;
+    __u32 id;
+    char backing_file[PCD_BACKING_FILE_SIZE];
+};
+
+
+
+/* Byte range of a device whose writes are signalled on an eventfd, one
+   count per write. Every write is a new generation of the device, the one
+   of a watch is the generation of the last write into its range.
+   PCD_IOCTL_WATCH takes the eventfd and the range, and returns the id of
+   the watch and the current generation. PCD_IOCTL_UNWATCH takes the id.
+   PCD_IOCTL_GET_GENERATION takes the id, 0 standing for the whole device,
+   and returns the range and its generation. Watches belong to the file
+   they were registered through. */
+struct pcd_watch {
+    __u64 offset;
+    __u64 length;
+    __u64 generation;
+    __s32 eventfd;
+    __u32 id;
+};
+
+
+
+/* Byte range of a device to check against its checksums, a zero length
+   standing for the rest of the device. Returns the number of checksum
+   chunks which do not match and the offset of the first of them (all ones
+   if none). Fails with EOPNOTSUPP while checksums are disabled. */
+struct pcd_verify {
+    __u64 offset;
+    __u64 length;
+    __u64 mismatch_count;
+    __u64 first_mismatch;
+};
+
+
+
+/* Atomic operation on the width (4 or 8) bytes at offset, in native byte
+   order, the offset being a multiple of the width. Compare-and-swap
+   stores the operand if the value equals expected, the others combine the
+   value with the operand. Result is the value before the operation, so a
+   compare-and-swap succeeded if it equals expected. Status holds the
+   outcome of the operation as PCD_IOCTL_ATOMIC returns it, EINVAL unless
+   reserved is zero. Both ioctls fail with EBADF unless the file is open
+   for reading and writing. */
+struct pcd_atomic_op {
+    __u64 offset;
+    __u64 operand;
+    __u64 expected;
+    __u64 result;
+    __u32 opcode;
+    __u32 width;
+    __s32 status;
+    __u32 reserved;
+};
+
+
+
+/* Count operations at address ops, applied in order under a single hold
+   of the device lock: reads, writes and other operations see either none
+   or all of them, mappings of the device see them one at a time. Invalid
+   operations only fail their own status. Returns the number of operations
+   applied. */
+struct pcd_atomic_batch {
+    __u64 ops;
+    __u32 count;
+    __u32 applied_count;
+};
+
+
+
+/* Transaction id, returned by PCD_IOCTL_TXN_BEGIN, belonging to the file
+   which began it. PCD_IOCTL_TXN_WRITE stages length bytes at address data
+   into offset, readers see none of the staged writes until
+   PCD_IOCTL_TXN_COMMIT makes all of them visible at once, on top of
+   whatever was written to the device meanwhile. Commit and abort end the
+   transaction, whether the commit succeeds or not; closing the file aborts
+   the transactions left. Commands other than begin fail with EINVAL unless
+   reserved is zero, all but abort with EBADF unless the file is open for
+   writing. */
+struct pcd_transaction {
+    __u64 offset;
+    __u64 length;
+    __u64 data;
+    __u32 id;
+    __u32 reserved;
+};
+
+
+
+/* Rings of an open /dev/pseudo_char_device_ring, both power of two sized.
+   The completion ring defaults to twice the submission ring for a zero
+   count. With PCD_RING_SETUP_POLL a kernel thread consumes submissions,
+   going to sleep after idle_ms without any (and setting
+   PCD_RING_NEED_WAKEUP); otherwise PCD_IOCTL_RING_ENTER does. Polling
+   fails with EPERM without CAP_SYS_NICE. Returns the layout of the area
+   to mmap() at offset 0 of the ring file. */
+struct pcd_ring_setup {
+    __u32 submission_count;
+    __u32 completion_count;
+    __u32 flags;
+    __u32 idle_ms;
+    __u64 submission_offset;
+    __u64 completion_offset;
+    __u64 size;
+};
+
+
+
+/* Start of the ring area. User space owns the submission tail and the
+   completion head, the kernel the other two; each side publishes its
+   index with a release store once the entries before it are written. */
+struct pcd_ring_header {
+    __u32 submission_head;
+    __u32 submission_tail;
+    __u32 completion_head;
+    __u32 completion_tail;
+    __u32 submission_mask;
+    __u32 completion_mask;
+    __u32 flags;
+    __u32 reserved;
+};
+
+
+
+/* Open device file to use from the rings, PCD_IOCTL_RING_REGISTER returns
+   the index submissions refer to it by. */
+struct pcd_ring_file {
+    __s32 fd;
+    __u32 index;
+};
+
+
+
+/* Read or write of length bytes at address, at the given offset of the
+   file or at its file position for an offset of -1 (which then moves).
+   A seek takes the whence in length. */
+struct pcd_ring_submission {
+    __u8 opcode;
+    __u8 reserved;
+    __u16 file_index;
+    __u32 length;
+    __s64 offset;
+    __u64 address;
+    __u64 user_data;
+};
+
+
+
+/* Result of a submission as its syscall would return it, a negative errno
+   on failure. A submission interrupted by a signal fails with EINTR, the
+   ones after it are left for the next PCD_IOCTL_RING_ENTER. */
+struct pcd_ring_completion {
+    __u64 user_data;
+    __s64 result;
+};
+
+
+
+/* Metadata of a record: its payload length and the CLOCK_MONOTONIC time
+   it was written at. PCD_IOCTL_RECORD_NEXT returns the header of the next
+   one (EAGAIN if there is none). After PCD_IOCTL_RECORD_BATCH with a
+   non-zero value, reads through the file return one record per segment
+   behind its header, for as many segments as there are records; zero goes
+   back to reading the payload of a single record. */
+struct pcd_record_header {
+    __u32 length;
+    __u32 flags;
+    __u64 timestamp_ns;
+};
+
+
+
+/* Cursor of a file of a broadcast device. Positions count the bytes
+   written to the device so far: the file position of the file, the head
+   the next write lands at and the oldest byte still in the ring. A read
+   from an overwritten position reads from the oldest byte instead, so
+   overruns only show here: lost bytes are those the file skipped over
+   them, the device counters sum the overruns of all its files. */
+struct pcd_broadcast_status {
+    __u64 position;
+    __u64 head;
+    __u64 oldest;
+    __u64 lost_byte_count;
+    __u64 device_overrun_count;
+    __u64 device_lost_byte_count;
+};
+
+
+
+/* Key and value of a key-value device, the value being length bytes at
+   address value. PCD_IOCTL_KV_PUT stores it, replacing the previous one.
+   PCD_IOCTL_KV_GET takes the room at value in length and returns the
+   length of the value, failing with ERANGE (and copying nothing) if it
+   does not fit. Result holds the outcome as the ioctl returns it.
+   Storing and deleting fail with EBADF unless the file is open for
+   writing, lookups and iterations unless it is open for reading. */
+struct pcd_kv_entry {
+    char key[PCD_KV_KEY_SIZE];
+    __u64 value;
+    __u32 length;
+    __s32 result;
+};
+
+
+
+/* Lookup of count entries at address entries, each getting its own result.
+   Returns the number of them found. */
+struct pcd_kv_batch {
+    __u64 entries;
+    __u32 count;
+    __u32 found_count;
+};
+
+
+
+/* Keys of up to count entries, skipping the first position ones, into an
+   array of PCD_KV_KEY_SIZE sized keys at address keys. Returns the number
+   of keys and moves the position past them, no keys being left once none
+   are returned. Keys stored or deleted meanwhile may be missed, and a
+   resize of the table may return some twice. */
+struct pcd_kv_iterate {
+    __u64 position;
+    __u64 keys;
+    __u32 count;
+    __u32 reserved;
+};
+
+
+
+/* QoS of the writes through a file. Writes are limited to byte_rate bytes
+   and op_rate writes a second, zero standing for no limit, with bursts of
+   up to byte_burst bytes and op_burst writes (one second worth for zero).
+   A write needing more waits for it, or fails with EAGAIN if nonblocking.
+   Writers of fifo and record devices waiting for room get it in proportion
+   to their weight, up to PCD_QOS_WEIGHT_MAX, zero for the default of 100.
+   PCD_IOCTL_QOS_SET fails with EBADF unless the file is open for writing,
+   with EPERM for a weight above the default without CAP_SYS_NICE, and
+   with EINVAL unless reserved is zero. PCD_IOCTL_QOS_GET also returns what
+   the file wrote since its settings were first set, and how often and how
+   long it was throttled. */
+struct pcd_qos {
+    __u64 byte_rate;
+    __u64 byte_burst;
+    __u64 op_rate;
+    __u64 op_burst;
+    __u32 weight;
+    __u32 reserved;
+    __u64 byte_count;
+    __u64 op_count;
+    __u64 throttle_count;
+    __u64 throttle_time_ns;
+};
+
+#endif /* PSEUDO_CHAR_DEVICE_IOCTL_H */
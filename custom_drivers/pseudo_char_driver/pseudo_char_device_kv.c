@@ -0,0 +1,604 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/overflow.h>
+#include <linux/rcupdate.h>
+#include <linux/rhashtable.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s: "fmt, __func__
+
+
+
+/*****************************************************************************/
+/* PRIVATE STRUCTURES */
+/*****************************************************************************/
+
+/* Keys are padded with zeros to their full size, so the table compares and
+   hashes them as fixed size blobs. An entry is never changed once it is in
+   the table, a put replaces it with a new one. */
+typedef struct kv_entry {
+    struct rhash_head node;
+    struct rcu_head rcu_head;
+    char key[PCD_KV_KEY_SIZE];
+    u32 length;
+    u8 value[];
+}kv_entry_t;
+
+
+
+/*****************************************************************************/
+/* MODE OPERATIONS FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int kv_init(device_data_t *device_data);
+
+static void kv_exit(device_data_t *device_data);
+
+static int kv_resize(device_data_t *device_data, size_t size);
+
+static ssize_t kv_read_iter(struct kiocb *iocb, struct iov_iter *iov_iter);
+
+static ssize_t kv_write_iter(struct kiocb *iocb, struct iov_iter *iov_iter);
+
+static long kv_ioctl(struct file *file, unsigned int command,
+    unsigned long argument);
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int kv_get(kv_data_t *kv, struct pcd_kv_entry *user_entry,
+    u8 *value);
+
+static int kv_put(device_data_t *device_data,
+    const struct pcd_kv_entry *user_entry);
+
+static int kv_delete(kv_data_t *kv, const struct pcd_kv_entry *user_entry);
+
+static int kv_multi_get(kv_data_t *kv, struct pcd_kv_batch *batch);
+
+static int kv_iterate(kv_data_t *kv, struct pcd_kv_iterate *iterate);
+
+static int kv_check_key(char *key);
+
+static size_t kv_entry_size(u32 length);
+
+static void kv_free_entry(void *entry, void *argument);
+
+
+
+/*****************************************************************************/
+/* PRIVATE VARIABLES */
+/*****************************************************************************/
+
+static const struct rhashtable_params kv_table_params = {
+    .key_len = PCD_KV_KEY_SIZE,
+    .key_offset = offsetof(kv_entry_t, key),
+    .head_offset = offsetof(kv_entry_t, node),
+    .automatic_shrinking = true
+};
+
+
+
+/*****************************************************************************/
+/* PUBLIC VARIABLES */
+/*****************************************************************************/
+
+/* Hash table of small values, reached through ioctls only. Lookups take no
+   lock, so they scale with the number of CPUs; puts and deletes are
+   serialized. The buffer size bounds the memory the entries take. */
+const device_mode_operations_t kv_mode_operations = {
+    .name = "kv",
+    .init = kv_init,
+    .exit = kv_exit,
+    .resize = kv_resize,
+    .open = nonseekable_open,
+    .llseek = no_llseek,
+    .read_iter = kv_read_iter,
+    .write_iter = kv_write_iter,
+    .ioctl = kv_ioctl
+};
+
+
+
+/*****************************************************************************/
+/* PUBLIC FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+u64 pseudo_char_device_kv_resident_bytes(const device_data_t *device_data)
+{
+    return READ_ONCE(device_data->kv.byte_count);
+}
+
+
+
+/*****************************************************************************/
+/* MODE OPERATIONS FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static int kv_init(device_data_t *device_data)
+{
+    int return_code = 0;
+    kv_data_t *kv = &device_data->kv;
+
+    mutex_init(&kv->lock);
+    kv->byte_count = 0;
+
+    return_code = pseudo_char_device_buffer_check_size(device_data,
+        device_data->buffer_size);
+    if (return_code == 0) {
+        return_code = rhashtable_init(&kv->table, &kv_table_params);
+    }
+
+    if (return_code == 0) {
+        kv->table_ready = true;
+        pr_info("Key-value store of %zu bytes set up for device %s...\n",
+            device_data->buffer_size, device_data->serial_number);
+    }
+
+    return return_code;
+}
+
+
+
+/* No file is left, so neither are readers of the table. */
+static void kv_exit(device_data_t *device_data)
+{
+    kv_data_t *kv = &device_data->kv;
+
+    if (kv->table_ready) {
+        rhashtable_free_and_destroy(&kv->table, kv_free_entry, NULL);
+        kv->table_ready = false;
+    }
+}
+
+
+
+/* Shrinking below what the entries take only keeps new ones out. */
+static int kv_resize(device_data_t *device_data, size_t size)
+{
+    int return_code = 0;
+
+    return_code = pseudo_char_device_buffer_check_size(device_data, size);
+    if (return_code == 0) {
+        mutex_lock(&device_data->kv.lock);
+        WRITE_ONCE(device_data->buffer_size, size);
+        mutex_unlock(&device_data->kv.lock);
+    }
+
+    return return_code;
+}
+
+
+
+/* The store is only reachable through its ioctls. */
+static ssize_t kv_read_iter(struct kiocb *iocb, struct iov_iter *iov_iter)
+{
+    return -EOPNOTSUPP;
+}
+
+
+
+static ssize_t kv_write_iter(struct kiocb *iocb, struct iov_iter *iov_iter)
+{
+    return -EOPNOTSUPP;
+}
+
+
+
+static long kv_ioctl(struct file *file, unsigned int command,
+    unsigned long argument)
+{
+    long return_code = 0;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    void __user *user_pointer = (void __user *)argument;
+    struct pcd_kv_entry user_entry;
+    struct pcd_kv_batch batch;
+    struct pcd_kv_iterate iterate;
+    u8 *value = NULL;
+
+    /* Lookups take a file open for reading and changes one open for
+       writing, the same way reads and writes of the other modes do. */
+    if ((((command == PCD_IOCTL_KV_PUT) ||
+        (command == PCD_IOCTL_KV_DELETE)) &&
+        !(file->f_mode & FMODE_WRITE)) ||
+        (((command == PCD_IOCTL_KV_GET) ||
+        (command == PCD_IOCTL_KV_MULTI_GET) ||
+        (command == PCD_IOCTL_KV_ITERATE)) &&
+        !(file->f_mode & FMODE_READ))) {
+        return -EBADF;
+    }
+
+    switch (command) {
+        case PCD_IOCTL_KV_GET:
+        case PCD_IOCTL_KV_PUT:
+        case PCD_IOCTL_KV_DELETE: {
+            if (copy_from_user(&user_entry, user_pointer,
+                sizeof(user_entry)) != 0) {
+                return_code = -EFAULT;
+            } else if (command == PCD_IOCTL_KV_PUT) {
+                return_code = kv_put(device_data, &user_entry);
+            } else if (command == PCD_IOCTL_KV_DELETE) {
+                return_code = kv_delete(&device_data->kv, &user_entry);
+            } else {
+                value = kmalloc(PCD_KV_VALUE_SIZE_MAX, GFP_KERNEL);
+                if (value == NULL) {
+                    return_code = -ENOMEM;
+                } else {
+                    return_code = kv_get(&device_data->kv, &user_entry,
+                        value);
+                    kfree(value);
+                }
+
+                /* The length is returned on ERANGE too. */
+                user_entry.result = return_code;
+                if ((return_code != -EFAULT) &&
+                    (copy_to_user(user_pointer, &user_entry,
+                        sizeof(user_entry)) != 0)) {
+                    return_code = -EFAULT;
+                }
+            }
+        }
+        break;
+
+        case PCD_IOCTL_KV_MULTI_GET: {
+            if (copy_from_user(&batch, user_pointer, sizeof(batch)) != 0) {
+                return_code = -EFAULT;
+            } else {
+                return_code = kv_multi_get(&device_data->kv, &batch);
+            }
+
+            if ((return_code == 0) &&
+                (copy_to_user(user_pointer, &batch, sizeof(batch)) != 0)) {
+                return_code = -EFAULT;
+            }
+        }
+        break;
+
+        case PCD_IOCTL_KV_ITERATE: {
+            if (copy_from_user(&iterate, user_pointer,
+                sizeof(iterate)) != 0) {
+                return_code = -EFAULT;
+            } else {
+                return_code = kv_iterate(&device_data->kv, &iterate);
+            }
+
+            if ((return_code == 0) &&
+                (copy_to_user(user_pointer, &iterate,
+                    sizeof(iterate)) != 0)) {
+                return_code = -EFAULT;
+            }
+        }
+        break;
+
+        default: {
+            return_code = -ENOTTY;
+        }
+        break;
+    }
+
+    return return_code;
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+/* The value is copied out of the entry under RCU only, into the given
+   buffer of PCD_KV_VALUE_SIZE_MAX bytes, and then on to user space once
+   faulting is allowed again. */
+static int kv_get(kv_data_t *kv, struct pcd_kv_entry *user_entry,
+    u8 *value)
+{
+    int return_code = 0;
+    const kv_entry_t *entry = NULL;
+    u32 length = 0;
+
+    return_code = kv_check_key(user_entry->key);
+    if (return_code != 0) {
+        return return_code;
+    }
+
+    rcu_read_lock();
+    entry = rhashtable_lookup(&kv->table, user_entry->key, kv_table_params);
+    if (entry == NULL) {
+        return_code = -ENOENT;
+    } else {
+        length = entry->length;
+        if (length > user_entry->length) {
+            return_code = -ERANGE;
+        } else {
+            memcpy(value, entry->value, length);
+        }
+    }
+    rcu_read_unlock();
+
+    if (return_code != -ENOENT) {
+        user_entry->length = length;
+    }
+
+    if ((return_code == 0) &&
+        (copy_to_user(u64_to_user_ptr(user_entry->value), value,
+            length) != 0)) {
+        return_code = -EFAULT;
+    }
+
+    return return_code;
+}
+
+
+
+/* The new entry is filled in before it is published, readers either find
+   the previous one or this one. */
+static int kv_put(device_data_t *device_data,
+    const struct pcd_kv_entry *user_entry)
+{
+    int return_code = 0;
+    kv_data_t *kv = &device_data->kv;
+    kv_entry_t *entry = NULL;
+    kv_entry_t *old_entry = NULL;
+    size_t byte_count = 0;
+
+    if (user_entry->length > PCD_KV_VALUE_SIZE_MAX) {
+        return -EMSGSIZE;
+    }
+
+    entry = kmalloc(kv_entry_size(user_entry->length), GFP_KERNEL);
+    if (entry == NULL) {
+        return -ENOMEM;
+    }
+
+    memcpy(entry->key, user_entry->key, PCD_KV_KEY_SIZE);
+    entry->length = user_entry->length;
+
+    return_code = kv_check_key(entry->key);
+    if ((return_code == 0) &&
+        (copy_from_user(entry->value, u64_to_user_ptr(user_entry->value),
+            entry->length) != 0)) {
+        return_code = -EFAULT;
+    }
+
+    if (return_code != 0) {
+        kfree(entry);
+        return return_code;
+    }
+
+    mutex_lock(&kv->lock);
+
+    old_entry = rhashtable_lookup_fast(&kv->table, entry->key,
+        kv_table_params);
+    byte_count = kv->byte_count + kv_entry_size(entry->length);
+    if (old_entry != NULL) {
+        byte_count -= kv_entry_size(old_entry->length);
+    }
+
+    if (byte_count > device_data->buffer_size) {
+        return_code = -ENOSPC;
+    } else if (old_entry != NULL) {
+        return_code = rhashtable_replace_fast(&kv->table, &old_entry->node,
+            &entry->node, kv_table_params);
+    } else {
+        return_code = rhashtable_insert_fast(&kv->table, &entry->node,
+            kv_table_params);
+    }
+
+    if (return_code == 0) {
+        WRITE_ONCE(kv->byte_count, byte_count);
+    }
+
+    mutex_unlock(&kv->lock);
+
+    if (return_code != 0) {
+        kfree(entry);
+    } else if (old_entry != NULL) {
+        kfree_rcu(old_entry, rcu_head);
+    }
+
+    return return_code;
+}
+
+
+
+static int kv_delete(kv_data_t *kv, const struct pcd_kv_entry *user_entry)
+{
+    int return_code = 0;
+    kv_entry_t *entry = NULL;
+    char key[PCD_KV_KEY_SIZE];
+
+    memcpy(key, user_entry->key, sizeof(key));
+
+    return_code = kv_check_key(key);
+    if (return_code != 0) {
+        return return_code;
+    }
+
+    mutex_lock(&kv->lock);
+
+    entry = rhashtable_lookup_fast(&kv->table, key, kv_table_params);
+    if (entry == NULL) {
+        return_code = -ENOENT;
+    } else {
+        return_code = rhashtable_remove_fast(&kv->table, &entry->node,
+            kv_table_params);
+    }
+
+    if (return_code == 0) {
+        WRITE_ONCE(kv->byte_count,
+            kv->byte_count - kv_entry_size(entry->length));
+    }
+
+    mutex_unlock(&kv->lock);
+
+    if (return_code == 0) {
+        kfree_rcu(entry, rcu_head);
+    }
+
+    return return_code;
+}
+
+
+
+/* Entries not found only fail their own lookup, a fault fails the whole
+   batch. */
+static int kv_multi_get(kv_data_t *kv, struct pcd_kv_batch *batch)
+{
+    int return_code = 0;
+    struct pcd_kv_entry __user *user_entries =
+        u64_to_user_ptr(batch->entries);
+    struct pcd_kv_entry *entries = NULL;
+    u8 *value = NULL;
+    u32 index = 0;
+
+    if (batch->count > PCD_KV_BATCH_COUNT_MAX) {
+        return -EINVAL;
+    }
+
+    entries = memdup_user(user_entries, batch->count * sizeof(*entries));
+    if (IS_ERR(entries)) {
+        return PTR_ERR(entries);
+    }
+
+    value = kmalloc(PCD_KV_VALUE_SIZE_MAX, GFP_KERNEL);
+    if (value == NULL) {
+        kfree(entries);
+        return -ENOMEM;
+    }
+
+    batch->found_count = 0;
+    for (; (index < batch->count) && (return_code == 0); ++index) {
+        entries[index].result = kv_get(kv, &entries[index], value);
+        if (entries[index].result == -EFAULT) {
+            return_code = -EFAULT;
+        } else if (entries[index].result == 0) {
+            ++batch->found_count;
+        }
+    }
+
+    if ((return_code == 0) &&
+        (copy_to_user(user_entries, entries,
+            batch->count * sizeof(*entries)) != 0)) {
+        return_code = -EFAULT;
+    }
+
+    kfree(value);
+    kfree(entries);
+
+    return return_code;
+}
+
+
+
+/* Walks the table from its start on every call, skipping what earlier
+   calls returned. Keeping a walk across calls would pin per file state the
+   device does not have, and stores are meant to stay small. */
+static int kv_iterate(kv_data_t *kv, struct pcd_kv_iterate *iterate)
+{
+    int return_code = 0;
+    struct rhashtable_iter iterator;
+    kv_entry_t *entry = NULL;
+    char (*keys)[PCD_KV_KEY_SIZE] = NULL;
+    u64 skipped_count = 0;
+    u32 key_count = 0;
+
+    if (iterate->count > PCD_KV_BATCH_COUNT_MAX) {
+        return -EINVAL;
+    }
+
+    keys = kmalloc_array(max_t(u32, iterate->count, 1), PCD_KV_KEY_SIZE,
+        GFP_KERNEL);
+    if (keys == NULL) {
+        return -ENOMEM;
+    }
+
+    rhashtable_walk_enter(&kv->table, &iterator);
+    rhashtable_walk_start(&iterator);
+
+    while (key_count < iterate->count) {
+        entry = rhashtable_walk_next(&iterator);
+        if (entry == NULL) {
+            break;
+        } else if (IS_ERR(entry)) {
+            /* The table got resized and the walk starts over, so what it
+               skipped and collected so far is seen again. */
+            if (PTR_ERR(entry) != -EAGAIN) {
+                break;
+            }
+
+            skipped_count = 0;
+            key_count = 0;
+        } else if (skipped_count < iterate->position) {
+            ++skipped_count;
+        } else {
+            memcpy(keys[key_count++], entry->key, PCD_KV_KEY_SIZE);
+        }
+    }
+
+    rhashtable_walk_stop(&iterator);
+    rhashtable_walk_exit(&iterator);
+
+    if (copy_to_user(u64_to_user_ptr(iterate->keys), keys,
+        key_count * PCD_KV_KEY_SIZE) != 0) {
+        return_code = -EFAULT;
+    } else {
+        iterate->position += key_count;
+        iterate->count = key_count;
+    }
+
+    kfree(keys);
+
+    return return_code;
+}
+
+
+
+/* Keys are non-empty strings, whatever follows their terminator is
+   cleared. */
+static int kv_check_key(char *key)
+{
+    const size_t length = strnlen(key, PCD_KV_KEY_SIZE);
+
+    if ((length == 0) || (length == PCD_KV_KEY_SIZE)) {
+        return -EINVAL;
+    }
+
+    memset(&key[length], 0, PCD_KV_KEY_SIZE - length);
+
+    return 0;
+}
+
+
+
+static size_t kv_entry_size(u32 length)
+{
+    const kv_entry_t *entry = NULL;
+
+    return struct_size(entry, value, length);
+}
+
+
+
+static void kv_free_entry(void *entry, void *argument)
+{
+    kfree(entry);
+}
@@ -0,0 +1,348 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <linux/atomic.h>
+#include <linux/err.h>
+#include <linux/eventfd.h>
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+#include <linux/xarray.h>
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s: "fmt, __func__
+
+
+
+/*****************************************************************************/
+/* PRIVATE STRUCTURES */
+/*****************************************************************************/
+
+/* Byte range [offset, end) watched by the file which registered it. The
+   generation is the one of the last write into the range. */
+typedef struct notify_watch {
+    struct eventfd_ctx *eventfd;
+    struct file *owner;
+    u64 offset;
+    u64 end;
+    atomic64_t generation;
+    struct list_head release_node;
+}notify_watch_t;
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int notify_watch(struct file *file, struct pcd_watch *user_watch);
+
+static int notify_unwatch(struct file *file, u32 id);
+
+static int notify_get_generation(struct file *file,
+    struct pcd_watch *user_watch);
+
+static void notify_free_watches(struct list_head *watches);
+
+
+
+/*****************************************************************************/
+/* PUBLIC FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+void pseudo_char_device_notify_init(device_data_t *device_data)
+{
+    notify_data_t *notify = &device_data->notify;
+
+    atomic64_set(&notify->generation, 0);
+    init_waitqueue_head(&notify->change_queue);
+    xa_init_flags(&notify->watches, XA_FLAGS_ALLOC1);
+}
+
+
+
+/* Every file registering a watch releases it, nothing is left by now. */
+void pseudo_char_device_notify_exit(device_data_t *device_data)
+{
+    xa_destroy(&device_data->notify.watches);
+}
+
+
+
+/* Whatever the file has read so far is up to date. */
+void pseudo_char_device_notify_open(struct file *file)
+{
+    device_data_t *device_data = (device_data_t *)file->private_data;
+
+    file->f_version = atomic64_read(&device_data->notify.generation);
+}
+
+
+
+/* Called before the data is copied, so a write landing during the read
+   still makes the file readable again. */
+void pseudo_char_device_notify_read(struct file *file)
+{
+    device_data_t *device_data = (device_data_t *)file->private_data;
+
+    file->f_version = atomic64_read(&device_data->notify.generation);
+}
+
+
+
+/* Called once the data has reached the buffer. Each write is a new
+   generation of the device and of the watches it overlaps. */
+void pseudo_char_device_notify_write(device_data_t *device_data,
+    loff_t file_position, size_t byte_count)
+{
+    notify_data_t *notify = &device_data->notify;
+    const u64 end = file_position + byte_count;
+    unsigned long id = 0;
+    notify_watch_t *watch = NULL;
+    u64 generation = 0;
+
+    if (byte_count == 0) {
+        return;
+    }
+
+    generation = atomic64_inc_return(&notify->generation);
+
+    if (wq_has_sleeper(&notify->change_queue)) {
+        wake_up_interruptible_poll(&notify->change_queue,
+            EPOLLIN | EPOLLRDNORM);
+    }
+
+    if (!xa_empty(&notify->watches)) {
+        rcu_read_lock();
+        xa_for_each(&notify->watches, id, watch) {
+            if (((u64)file_position < watch->end) &&
+                (watch->offset < end)) {
+                atomic64_set(&watch->generation, generation);
+                eventfd_signal(watch->eventfd, 1);
+            }
+        }
+        rcu_read_unlock();
+    }
+}
+
+
+
+/* Readable once a write has landed after the last read of the file, the
+   device is always writable. */
+__poll_t pseudo_char_device_notify_poll(struct file *file,
+    struct poll_table_struct *poll_table)
+{
+    __poll_t return_code = EPOLLOUT | EPOLLWRNORM;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+
+    poll_wait(file, &device_data->notify.change_queue, poll_table);
+
+    if (atomic64_read(&device_data->notify.generation) != file->f_version) {
+        return_code |= EPOLLIN | EPOLLRDNORM;
+    }
+
+    return return_code;
+}
+
+
+
+long pseudo_char_device_notify_ioctl(struct file *file, unsigned int command,
+    unsigned long argument)
+{
+    long return_code = 0;
+    struct pcd_watch user_watch;
+    void __user *user_pointer = (void __user *)argument;
+
+    if ((command != PCD_IOCTL_WATCH) && (command != PCD_IOCTL_UNWATCH) &&
+        (command != PCD_IOCTL_GET_GENERATION)) {
+        return -ENOTTY;
+    }
+
+    if (copy_from_user(&user_watch, user_pointer, sizeof(user_watch)) != 0) {
+        return -EFAULT;
+    }
+
+    switch (command) {
+        case PCD_IOCTL_WATCH: {
+            return_code = notify_watch(file, &user_watch);
+        }
+        break;
+
+        case PCD_IOCTL_UNWATCH: {
+            return_code = notify_unwatch(file, user_watch.id);
+        }
+        break;
+
+        default: {
+            return_code = notify_get_generation(file, &user_watch);
+        }
+        break;
+    }
+
+    if ((return_code == 0) && (command != PCD_IOCTL_UNWATCH) &&
+        (copy_to_user(user_pointer, &user_watch, sizeof(user_watch)) != 0)) {
+        return_code = -EFAULT;
+    }
+
+    return return_code;
+}
+
+
+
+/* Drop the watches registered through the file. */
+void pseudo_char_device_notify_release(struct file *file)
+{
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    struct xarray *watches = &device_data->notify.watches;
+    unsigned long id = 0;
+    notify_watch_t *watch = NULL;
+    LIST_HEAD(released_watches);
+
+    xa_lock(watches);
+    xa_for_each(watches, id, watch) {
+        if (watch->owner == file) {
+            __xa_erase(watches, id);
+            list_add(&watch->release_node, &released_watches);
+        }
+    }
+    xa_unlock(watches);
+
+    notify_free_watches(&released_watches);
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static int notify_watch(struct file *file, struct pcd_watch *user_watch)
+{
+    int return_code = 0;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    notify_watch_t *watch = NULL;
+
+    if ((user_watch->length == 0) ||
+        (user_watch->offset > (U64_MAX - user_watch->length))) {
+        return -EINVAL;
+    }
+
+    watch = kzalloc(sizeof(notify_watch_t), GFP_KERNEL);
+    if (watch == NULL) {
+        return -ENOMEM;
+    }
+
+    watch->eventfd = eventfd_ctx_fdget(user_watch->eventfd);
+    if (IS_ERR(watch->eventfd)) {
+        return_code = PTR_ERR(watch->eventfd);
+        kfree(watch);
+        return return_code;
+    }
+
+    watch->owner = file;
+    watch->offset = user_watch->offset;
+    watch->end = user_watch->offset + user_watch->length;
+    user_watch->generation = atomic64_read(&device_data->notify.generation);
+    atomic64_set(&watch->generation, user_watch->generation);
+
+    /* Full when the limit is reached. */
+    return_code = xa_alloc(&device_data->notify.watches, &user_watch->id,
+        watch, XA_LIMIT(1, DEVICE_WATCH_COUNT_MAX), GFP_KERNEL);
+    if (return_code != 0) {
+        eventfd_ctx_put(watch->eventfd);
+        kfree(watch);
+    }
+
+    return return_code;
+}
+
+
+
+static int notify_unwatch(struct file *file, u32 id)
+{
+    int return_code = 0;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    struct xarray *watches = &device_data->notify.watches;
+    notify_watch_t *watch = NULL;
+    LIST_HEAD(released_watches);
+
+    xa_lock(watches);
+    watch = xa_load(watches, id);
+    if ((watch != NULL) && (watch->owner == file)) {
+        __xa_erase(watches, id);
+        list_add(&watch->release_node, &released_watches);
+    } else {
+        return_code = -ENOENT;
+    }
+    xa_unlock(watches);
+
+    notify_free_watches(&released_watches);
+
+    return return_code;
+}
+
+
+
+/* Watch 0 stands for the whole device. */
+static int notify_get_generation(struct file *file,
+    struct pcd_watch *user_watch)
+{
+    int return_code = 0;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    notify_watch_t *watch = NULL;
+
+    if (user_watch->id == 0) {
+        user_watch->offset = 0;
+        user_watch->length = READ_ONCE(device_data->buffer_size);
+        user_watch->generation =
+            atomic64_read(&device_data->notify.generation);
+        return 0;
+    }
+
+    rcu_read_lock();
+    watch = xa_load(&device_data->notify.watches, user_watch->id);
+    if ((watch != NULL) && (watch->owner == file)) {
+        user_watch->offset = watch->offset;
+        user_watch->length = watch->end - watch->offset;
+        user_watch->generation = atomic64_read(&watch->generation);
+    } else {
+        return_code = -ENOENT;
+    }
+    rcu_read_unlock();
+
+    return return_code;
+}
+
+
+
+/* Writers may still be signalling the watches, they are freed once they
+   are done. */
+static void notify_free_watches(struct list_head *watches)
+{
+    notify_watch_t *watch = NULL;
+    notify_watch_t *next_watch = NULL;
+
+    if (list_empty(watches)) {
+        return;
+    }
+
+    synchronize_rcu();
+
+    list_for_each_entry_safe(watch, next_watch, watches, release_node) {
+        eventfd_ctx_put(watch->eventfd);
+        kfree(watch);
+    }
+}
@@ -0,0 +1,625 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <linux/capability.h>
+#include <linux/fs.h>
+#include <linux/hashtable.h>
+#include <linux/hrtimer.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s: "fmt, __func__
+
+/* Rates and bursts are kept well within the range of the token counts. */
+#define QOS_LIMIT_MAX   (1ULL << 48)
+
+
+
+/*****************************************************************************/
+/* PRIVATE DATA TYPES */
+/*****************************************************************************/
+
+/* Token bucket, unlimited for a zero rate. Tokens may go negative, as a
+   write is admitted while there is any token left and charged in full. */
+typedef struct qos_bucket {
+    u64 rate;
+    u64 burst;
+    s64 tokens;
+    u64 refill_time;
+}qos_bucket_t;
+
+
+
+/* Settings and consumption of a file, protected by the lock, which a file
+   gets when it first sets its QoS or waits for room. It lives until the
+   file is released, so the writes through the file may keep using it
+   without any reference. The virtual finish time of the last write of the
+   file is protected by the device QoS lock. */
+struct qos_file {
+    struct hlist_node node;
+    struct file *owner;
+    u32 id;
+    bool configured;
+    spinlock_t lock;
+    qos_bucket_t bytes;
+    qos_bucket_t ops;
+    u32 weight;
+    u64 byte_count;
+    u64 op_count;
+    u64 throttle_count;
+    u64 throttle_time;
+    u64 finish_time;
+    struct rcu_head rcu;
+};
+
+
+
+/* Writer waiting for room, queued by its virtual start time. */
+typedef struct qos_writer {
+    struct list_head node;
+    struct task_struct *task;
+    u64 start_time;
+}qos_writer_t;
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int qos_set(struct file *file, const struct pcd_qos *user_qos);
+
+static void qos_get(struct file *file, struct pcd_qos *user_qos);
+
+static qos_file_t *qos_find(device_data_t *device_data,
+    const struct file *file);
+
+static qos_file_t *qos_add(device_data_t *device_data, struct file *file);
+
+static bool qos_is_next(qos_data_t *qos, const qos_writer_t *writer);
+
+static int qos_sleep(u64 delay);
+
+static void qos_bucket_set(qos_bucket_t *bucket, u64 rate, u64 burst,
+    u64 now);
+
+static void qos_bucket_refill(qos_bucket_t *bucket, u64 now);
+
+static u64 qos_bucket_delay(const qos_bucket_t *bucket);
+
+
+
+/*****************************************************************************/
+/* PUBLIC FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+void pseudo_char_device_qos_init(device_data_t *device_data)
+{
+    qos_data_t *qos = &device_data->qos;
+
+    hash_init(qos->files);
+    spin_lock_init(&qos->lock);
+    qos->last_id = 0;
+    INIT_LIST_HEAD(&qos->writers);
+    qos->virtual_time = 0;
+}
+
+
+
+/* Every file with QoS releases it, nothing is left by now. */
+void pseudo_char_device_qos_exit(device_data_t *device_data)
+{
+    if (!hash_empty(device_data->qos.files)) {
+        pr_err("QoS of a file left on device %s!\n",
+            device_data->serial_number);
+    }
+}
+
+
+
+long pseudo_char_device_qos_ioctl(struct file *file, unsigned int command,
+    unsigned long argument)
+{
+    long return_code = 0;
+    void __user *user_pointer = (void __user *)argument;
+    struct pcd_qos user_qos;
+
+    if (command == PCD_IOCTL_QOS_SET) {
+        if (copy_from_user(&user_qos, user_pointer, sizeof(user_qos)) != 0) {
+            return_code = -EFAULT;
+        } else {
+            return_code = qos_set(file, &user_qos);
+        }
+    } else if (command == PCD_IOCTL_QOS_GET) {
+        qos_get(file, &user_qos);
+        if (copy_to_user(user_pointer, &user_qos, sizeof(user_qos)) != 0) {
+            return_code = -EFAULT;
+        }
+    } else {
+        return_code = -ENOTTY;
+    }
+
+    return return_code;
+}
+
+
+
+/* Drop the QoS of the file. Lookups for other files may still be going
+   through it. */
+void pseudo_char_device_qos_release(struct file *file)
+{
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    qos_data_t *qos = &device_data->qos;
+    qos_file_t *qos_file = NULL;
+
+    spin_lock(&qos->lock);
+    qos_file = qos_find(device_data, file);
+    if (qos_file != NULL) {
+        hash_del_rcu(&qos_file->node);
+    }
+    spin_unlock(&qos->lock);
+
+    if (qos_file != NULL) {
+        kfree_rcu(qos_file, rcu);
+    }
+}
+
+
+
+/* One line per file with settings: id, weight, bytes and writes through
+   the file, times it was throttled and nanoseconds it spent throttled. */
+ssize_t pseudo_char_device_qos_show(device_data_t *device_data,
+    char *output_buffer)
+{
+    ssize_t return_code = 0;
+    unsigned bucket = 0;
+    qos_file_t *qos_file = NULL;
+
+    rcu_read_lock();
+    hash_for_each_rcu(device_data->qos.files, bucket, qos_file, node) {
+        spin_lock(&qos_file->lock);
+        if (qos_file->configured) {
+            return_code += scnprintf(&output_buffer[return_code],
+                PAGE_SIZE - return_code, "%u %u %llu %llu %llu %llu\n",
+                qos_file->id, qos_file->weight, qos_file->byte_count,
+                qos_file->op_count, qos_file->throttle_count,
+                qos_file->throttle_time);
+        }
+        spin_unlock(&qos_file->lock);
+    }
+    rcu_read_unlock();
+
+    return return_code;
+}
+
+
+
+/* Wait until the file may write byte_count more bytes, and charge them in
+   advance, so concurrent writes through the file cannot overshoot the
+   limits together. Files without settings only pay for a lookup in the
+   table of the device. On success the settings of the file, if any, are to
+   be passed on to pseudo_char_device_qos_write_end(). */
+int pseudo_char_device_qos_write_begin(struct kiocb *iocb, size_t byte_count,
+    qos_file_t **qos_file)
+{
+    int return_code = 0;
+    device_data_t *device_data = (device_data_t *)iocb->ki_filp->private_data;
+    qos_file_t *settings = NULL;
+    const bool nonblocking = pseudo_char_device_is_nonblocking(iocb);
+    bool throttled = false;
+    u64 throttle_start = 0;
+    u64 throttle_time = 0;
+    u64 delay = 0;
+    u64 now = 0;
+
+    *qos_file = NULL;
+    settings = qos_find(device_data, iocb->ki_filp);
+    if ((settings == NULL) || !READ_ONCE(settings->configured)) {
+        return 0;
+    }
+
+    do {
+        spin_lock(&settings->lock);
+
+        now = ktime_get_ns();
+        qos_bucket_refill(&settings->bytes, now);
+        qos_bucket_refill(&settings->ops, now);
+        delay = max(qos_bucket_delay(&settings->bytes),
+            qos_bucket_delay(&settings->ops));
+
+        if ((delay != 0) && !throttled) {
+            throttled = true;
+            throttle_start = now;
+            ++settings->throttle_count;
+        }
+
+        if (delay == 0) {
+            settings->bytes.tokens -= byte_count;
+            settings->ops.tokens -= 1;
+            settings->byte_count += byte_count;
+            ++settings->op_count;
+        }
+
+        spin_unlock(&settings->lock);
+
+        if (delay == 0) {
+            *qos_file = settings;
+        } else if (nonblocking) {
+            return_code = -EAGAIN;
+        } else {
+            return_code = qos_sleep(delay);
+        }
+    } while ((return_code == 0) && (delay != 0));
+
+    if (throttled) {
+        throttle_time = ktime_get_ns() - throttle_start;
+
+        spin_lock(&settings->lock);
+        settings->throttle_time += throttle_time;
+        spin_unlock(&settings->lock);
+
+        pseudo_char_device_stats_throttle(device_data, throttle_time);
+    }
+
+    return return_code;
+}
+
+
+
+/* Give back what the write was charged for but did not write. */
+void pseudo_char_device_qos_write_end(qos_file_t *qos_file,
+    size_t byte_count, ssize_t result)
+{
+    const size_t refund = byte_count - ((result > 0) ? result : 0);
+
+    if ((qos_file == NULL) || (refund == 0)) {
+        return;
+    }
+
+    spin_lock(&qos_file->lock);
+    qos_file->bytes.tokens = min_t(s64, qos_file->bytes.tokens + refund,
+        qos_file->bytes.burst);
+    qos_file->byte_count -= refund;
+    spin_unlock(&qos_file->lock);
+}
+
+
+
+/* Wait until the writer is the next one in line and the device has room
+   for it, with start-time fair queueing: a writer starts no earlier than
+   the previous write of its file finished, in virtual time, and the write
+   takes byte_count bytes divided by the weight of the file. A steady
+   writer thus keeps moving its own writes back, while one joining the
+   queue starts right away. The first wait of a write, with a start time of
+   DEVICE_QOS_UNCHARGED, charges the write to its file; the start time it
+   gets is kept for waiting again, should the room be gone by the time the
+   writer gets to it. Called without any lock held, the caller is expected
+   to wake the next writer once done with the room. */
+int pseudo_char_device_qos_wait(struct file *file, size_t byte_count,
+    u64 *start_time,
+    bool (*has_room)(const device_data_t *device_data, size_t byte_count))
+{
+    int return_code = 0;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    qos_data_t *qos = &device_data->qos;
+    qos_writer_t writer = { .task = current };
+    qos_writer_t *position = NULL;
+    qos_file_t *qos_file = NULL;
+    u32 weight = DEVICE_QOS_WEIGHT_DEFAULT;
+
+    /* Without memory for it the file keeps no finish time, its writes
+       start with the queue. */
+    if (*start_time == DEVICE_QOS_UNCHARGED) {
+        qos_file = qos_add(device_data, file);
+        if (qos_file != NULL) {
+            weight = READ_ONCE(qos_file->weight);
+        }
+    }
+
+    spin_lock(&qos->lock);
+
+    if (*start_time == DEVICE_QOS_UNCHARGED) {
+        *start_time = qos->virtual_time;
+        if (qos_file != NULL) {
+            *start_time = max(*start_time, qos_file->finish_time);
+            qos_file->finish_time = *start_time +
+                div_u64((u64)byte_count * DEVICE_QOS_WEIGHT_DEFAULT, weight);
+        }
+    }
+    writer.start_time = *start_time;
+
+    /* Behind the writers starting no later, for first come first served
+       among equals. */
+    list_for_each_entry(position, &qos->writers, node) {
+        if (position->start_time > writer.start_time) {
+            break;
+        }
+    }
+    list_add_tail(&writer.node, &position->node);
+
+    spin_unlock(&qos->lock);
+
+    for (;;) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (has_room(device_data, byte_count) && qos_is_next(qos, &writer)) {
+            break;
+        }
+
+        if (signal_pending(current)) {
+            return_code = -ERESTARTSYS;
+            break;
+        }
+
+        schedule();
+    }
+    __set_current_state(TASK_RUNNING);
+
+    spin_lock(&qos->lock);
+    list_del(&writer.node);
+    qos->virtual_time = max(qos->virtual_time, writer.start_time);
+    spin_unlock(&qos->lock);
+
+    /* Not going to use the room, so the next writer may. */
+    if (return_code != 0) {
+        pseudo_char_device_qos_wake(device_data);
+    }
+
+    return return_code;
+}
+
+
+
+/* Wake the writer next in line, which checks for room itself. */
+void pseudo_char_device_qos_wake(device_data_t *device_data)
+{
+    qos_data_t *qos = &device_data->qos;
+
+    /* Pairs with set_current_state() of the writer: either it sees the
+       room made by the caller, or it is seen queued. */
+    smp_mb();
+    if (list_empty(&qos->writers)) {
+        return;
+    }
+
+    spin_lock(&qos->lock);
+    if (!list_empty(&qos->writers)) {
+        wake_up_process(list_first_entry(&qos->writers, qos_writer_t,
+            node)->task);
+    }
+    spin_unlock(&qos->lock);
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+/* Only the writes of a file are subject to QoS, so it has to be open for
+   writing. Like a nice value, a file may lower its own share of the device
+   freely, while a weight above the default needs CAP_SYS_NICE. Buckets
+   start full, so new limits never throttle right away. */
+static int qos_set(struct file *file, const struct pcd_qos *user_qos)
+{
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    qos_file_t *qos_file = NULL;
+    u64 now = 0;
+
+    if ((user_qos->byte_rate > QOS_LIMIT_MAX) ||
+        (user_qos->byte_burst > QOS_LIMIT_MAX) ||
+        (user_qos->op_rate > QOS_LIMIT_MAX) ||
+        (user_qos->op_burst > QOS_LIMIT_MAX) ||
+        (user_qos->weight > PCD_QOS_WEIGHT_MAX) ||
+        (user_qos->reserved != 0)) {
+        return -EINVAL;
+    }
+
+    if (!(file->f_mode & FMODE_WRITE)) {
+        return -EBADF;
+    }
+
+    if ((user_qos->weight > DEVICE_QOS_WEIGHT_DEFAULT) &&
+        !capable(CAP_SYS_NICE)) {
+        return -EPERM;
+    }
+
+    qos_file = qos_add(device_data, file);
+    if (qos_file == NULL) {
+        return -ENOMEM;
+    }
+
+    spin_lock(&qos_file->lock);
+    now = ktime_get_ns();
+    qos_bucket_set(&qos_file->bytes, user_qos->byte_rate,
+        user_qos->byte_burst, now);
+    qos_bucket_set(&qos_file->ops, user_qos->op_rate, user_qos->op_burst,
+        now);
+    WRITE_ONCE(qos_file->weight, (user_qos->weight != 0) ?
+        user_qos->weight : DEVICE_QOS_WEIGHT_DEFAULT);
+    WRITE_ONCE(qos_file->configured, true);
+    spin_unlock(&qos_file->lock);
+
+    return 0;
+}
+
+
+
+/* A file without settings has no limits, the default weight and nothing
+   counted. */
+static void qos_get(struct file *file, struct pcd_qos *user_qos)
+{
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    qos_file_t *qos_file = qos_find(device_data, file);
+
+    memset(user_qos, 0, sizeof(*user_qos));
+    user_qos->weight = DEVICE_QOS_WEIGHT_DEFAULT;
+
+    if ((qos_file != NULL) && READ_ONCE(qos_file->configured)) {
+        spin_lock(&qos_file->lock);
+        user_qos->byte_rate = qos_file->bytes.rate;
+        user_qos->byte_burst = qos_file->bytes.burst;
+        user_qos->op_rate = qos_file->ops.rate;
+        user_qos->op_burst = qos_file->ops.burst;
+        user_qos->weight = qos_file->weight;
+        user_qos->byte_count = qos_file->byte_count;
+        user_qos->op_count = qos_file->op_count;
+        user_qos->throttle_count = qos_file->throttle_count;
+        user_qos->throttle_time_ns = qos_file->throttle_time;
+        spin_unlock(&qos_file->lock);
+    }
+}
+
+
+
+/* QoS of the file, which stays valid for as long as the file is in use.
+   The bucket may hold QoS of other files, which may be going away. */
+static qos_file_t *qos_find(device_data_t *device_data,
+    const struct file *file)
+{
+    qos_file_t *qos_file = NULL;
+    qos_file_t *found_qos_file = NULL;
+
+    rcu_read_lock();
+    hash_for_each_possible_rcu(device_data->qos.files, qos_file, node,
+        (unsigned long)file) {
+        if (qos_file->owner == file) {
+            found_qos_file = qos_file;
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    return found_qos_file;
+}
+
+
+
+/* QoS of the file, added without settings if it has none yet. Two tasks
+   adding the QoS of the same file at once must not both add it. There is
+   no limit besides the files open, each one having QoS once at most. */
+static qos_file_t *qos_add(device_data_t *device_data, struct file *file)
+{
+    qos_data_t *qos = &device_data->qos;
+    qos_file_t *qos_file = qos_find(device_data, file);
+    qos_file_t *new_qos_file = NULL;
+
+    if (qos_file != NULL) {
+        return qos_file;
+    }
+
+    new_qos_file = kzalloc(sizeof(qos_file_t), GFP_KERNEL);
+    if (new_qos_file == NULL) {
+        return NULL;
+    }
+
+    new_qos_file->owner = file;
+    new_qos_file->weight = DEVICE_QOS_WEIGHT_DEFAULT;
+    spin_lock_init(&new_qos_file->lock);
+
+    spin_lock(&qos->lock);
+    qos_file = qos_find(device_data, file);
+    if (qos_file == NULL) {
+        new_qos_file->id = ++qos->last_id;
+        hash_add_rcu(qos->files, &new_qos_file->node, (unsigned long)file);
+        qos_file = new_qos_file;
+        new_qos_file = NULL;
+    }
+    spin_unlock(&qos->lock);
+
+    kfree(new_qos_file);
+
+    return qos_file;
+}
+
+
+
+static bool qos_is_next(qos_data_t *qos, const qos_writer_t *writer)
+{
+    bool is_next = false;
+
+    spin_lock(&qos->lock);
+    is_next = (list_first_entry(&qos->writers, qos_writer_t, node) ==
+        writer);
+    spin_unlock(&qos->lock);
+
+    return is_next;
+}
+
+
+
+/* Sleep for delay nanoseconds at most, returning early on a signal. */
+static int qos_sleep(u64 delay)
+{
+    ktime_t expires = ns_to_ktime(delay);
+
+    set_current_state(TASK_INTERRUPTIBLE);
+    schedule_hrtimeout(&expires, HRTIMER_MODE_REL);
+
+    return signal_pending(current) ? -ERESTARTSYS : 0;
+}
+
+
+
+static void qos_bucket_set(qos_bucket_t *bucket, u64 rate, u64 burst,
+    u64 now)
+{
+    bucket->rate = rate;
+    bucket->burst = (burst != 0) ? burst : rate;
+    bucket->tokens = bucket->burst;
+    bucket->refill_time = now;
+}
+
+
+
+/* Only the time the credited tokens stand for is used up, so slow rates
+   refilled often still make progress. */
+static void qos_bucket_refill(qos_bucket_t *bucket, u64 now)
+{
+    u64 credit = 0;
+
+    if (bucket->rate == 0) {
+        return;
+    }
+
+    credit = mul_u64_u64_div_u64(now - bucket->refill_time, bucket->rate,
+        NSEC_PER_SEC);
+    if (credit >= (u64)(bucket->burst - bucket->tokens)) {
+        bucket->tokens = bucket->burst;
+        bucket->refill_time = now;
+    } else if (credit > 0) {
+        bucket->tokens += credit;
+        bucket->refill_time += mul_u64_u64_div_u64(credit, NSEC_PER_SEC,
+            bucket->rate);
+    }
+}
+
+
+
+/* Time until a token is left, zero if there is one already. */
+static u64 qos_bucket_delay(const qos_bucket_t *bucket)
+{
+    if ((bucket->rate == 0) || (bucket->tokens > 0)) {
+        return 0;
+    }
+
+    return mul_u64_u64_div_u64(1 - bucket->tokens, NSEC_PER_SEC,
+        bucket->rate);
+}
@@ -0,0 +1,397 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <linux/atomic.h>
+#include <linux/compiler.h>
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/uio.h>
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s: "fmt, __func__
+
+/* Number of optimistic, lock-free copy attempts of a reader before it
+   falls back to waiting for the writers. */
+#define READ_ATTEMPT_COUNT  3
+
+
+
+/*****************************************************************************/
+/* MODE OPERATIONS FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int random_access_init(device_data_t *device_data);
+
+static void random_access_exit(device_data_t *device_data);
+
+static int random_access_open(struct inode *inode, struct file *file);
+
+static void random_access_release(struct file *file);
+
+static loff_t random_access_llseek(struct file *file,
+    loff_t file_position_offset, int whence);
+
+static ssize_t random_access_read_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter);
+
+static ssize_t random_access_write_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter);
+
+static long random_access_ioctl(struct file *file, unsigned int command,
+    unsigned long argument);
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static ssize_t copy_snapshot_to_iter(device_data_t *device_data,
+    const device_buffer_t *buffer, struct iov_iter *iov_iter,
+    loff_t file_position, size_t byte_count, bool nowait);
+
+
+
+/*****************************************************************************/
+/* PUBLIC VARIABLES */
+/*****************************************************************************/
+
+const device_mode_operations_t random_access_mode_operations = {
+    .name = "random_access",
+    .init = random_access_init,
+    .exit = random_access_exit,
+    .resize = pseudo_char_device_buffer_resize,
+    .open = random_access_open,
+    .release = random_access_release,
+    .llseek = random_access_llseek,
+    .read_iter = random_access_read_iter,
+    .write_iter = random_access_write_iter,
+    .poll = pseudo_char_device_notify_poll,
+    .mmap = pseudo_char_device_buffer_mmap,
+    .ioctl = random_access_ioctl
+};
+
+
+
+/*****************************************************************************/
+/* MODE OPERATIONS FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static int random_access_init(device_data_t *device_data)
+{
+    pseudo_char_device_notify_init(device_data);
+    pseudo_char_device_transaction_init(device_data);
+
+    return pseudo_char_device_buffer_init(device_data);
+}
+
+
+
+static void random_access_exit(device_data_t *device_data)
+{
+    pseudo_char_device_buffer_exit(device_data);
+    pseudo_char_device_checksum_exit(device_data);
+    pseudo_char_device_transaction_exit(device_data);
+    pseudo_char_device_notify_exit(device_data);
+}
+
+
+
+static int random_access_open(struct inode *inode, struct file *file)
+{
+    pseudo_char_device_notify_open(file);
+
+    return pseudo_char_device_open_positioned(inode, file);
+}
+
+
+
+static void random_access_release(struct file *file)
+{
+    pseudo_char_device_transaction_release(file);
+    pseudo_char_device_notify_release(file);
+}
+
+
+
+static loff_t random_access_llseek(struct file *file,
+    loff_t file_position_offset, int whence)
+{
+    loff_t return_code = 0;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    const loff_t buffer_size = READ_ONCE(device_data->buffer_size);
+
+    pr_debug("Llseek operation requested...\n");
+    pr_debug("Current file position: %lld\n", file->f_pos);
+
+    switch (whence) {
+        case SEEK_SET: {
+            if ((file_position_offset < buffer_size) &&
+                (file_position_offset >= 0)) {
+                    file->f_pos = file_position_offset;
+                    return_code = file->f_pos;
+            } else {
+                return_code = -EINVAL;
+            }
+        }
+        break;
+
+        case SEEK_CUR: {
+            const loff_t new_file_position = file->f_pos +
+                file_position_offset;
+            if ((new_file_position < buffer_size) &&
+                (new_file_position >= 0)) {
+                    file->f_pos = new_file_position;
+                    return_code = file->f_pos;
+            } else {
+                return_code = -EINVAL;
+            }
+        }
+        break;
+
+        case SEEK_END: {
+            const loff_t new_file_position = buffer_size +
+                file_position_offset;
+            if ((new_file_position < buffer_size) &&
+                (new_file_position >= 0)) {
+                    file->f_pos = new_file_position;
+                    return_code = file->f_pos;
+            } else {
+                return_code = -EINVAL;
+            }
+        }
+        break;
+
+        default: {
+            return_code = -EINVAL;
+        }
+    }
+
+    if (return_code == -EINVAL) {
+        pr_debug("Llseek operation failed!\n");
+    } else {
+        pr_debug("New file position: %lld\n", file->f_pos);
+    }
+
+    return return_code;
+}
+
+
+
+static ssize_t random_access_read_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter)
+{
+    ssize_t return_code = 0;
+    size_t byte_count = iov_iter_count(iov_iter);
+    int srcu_index = 0;
+    device_data_t *device_data = (device_data_t *)iocb->ki_filp->private_data;
+    device_buffer_t *buffer = NULL;
+
+    pr_debug("Read operation requested for %zu bytes...\n", byte_count);
+    pr_debug("Current file position: %lld\n", iocb->ki_pos);
+
+    /* A concurrent resize does not wait for this read to finish, the buffer
+       stays valid until the read lock is dropped. */
+    buffer = pseudo_char_device_buffer_read_lock(device_data, &srcu_index);
+
+    pseudo_char_device_notify_read(iocb->ki_filp);
+
+    if (iocb->ki_pos >= buffer->size) {
+        byte_count = 0;
+    } else if ((iocb->ki_pos + byte_count) > buffer->size) {
+        byte_count = buffer->size - iocb->ki_pos;
+    }
+
+    return_code = copy_snapshot_to_iter(device_data, buffer, iov_iter,
+        iocb->ki_pos, byte_count, iocb->ki_flags & IOCB_NOWAIT);
+
+    pseudo_char_device_buffer_read_unlock(srcu_index);
+
+    if (return_code >= 0) {
+        iocb->ki_pos += return_code;
+        pr_debug("New file position: %lld\n", iocb->ki_pos);
+        pr_debug("Successfully read byte count: %zd\n", return_code);
+    }
+
+    return return_code;
+}
+
+
+
+static ssize_t random_access_write_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter)
+{
+    ssize_t return_code = 0;
+    size_t byte_count = iov_iter_count(iov_iter);
+    size_t copied_byte_count = 0;
+    device_data_t *device_data = (device_data_t *)iocb->ki_filp->private_data;
+    device_buffer_t *buffer = NULL;
+
+    pr_debug("Write operation requested for %zu bytes...\n", byte_count);
+    pr_debug("Current file position: %lld\n", iocb->ki_pos);
+
+    return_code = pseudo_char_device_buffer_lock(device_data,
+        iocb->ki_flags & IOCB_NOWAIT);
+    if (return_code != 0) {
+        return return_code;
+    }
+
+    buffer = rcu_dereference_protected(device_data->buffer,
+        lockdep_is_held(&device_data->buffer_lock));
+
+    if (iocb->ki_pos >= buffer->size) {
+        byte_count = 0;
+    } else if ((iocb->ki_pos + byte_count) > buffer->size) {
+        byte_count = buffer->size - iocb->ki_pos;
+    }
+
+    if (byte_count == 0) {
+        pr_debug("No available memory for write operation...\n");
+        return_code = -ENOMEM;
+    } else {
+        /* Readers do not wait for the write to end, they notice it through
+           the sequence count and copy again. Writers are serialized by the
+           buffer lock, so the write section may fault user pages in. */
+        raw_write_seqcount_begin(&device_data->buffer_sequence);
+        copied_byte_count = copy_from_iter(&buffer->data[iocb->ki_pos],
+            byte_count, iov_iter);
+        pseudo_char_device_checksum_update(device_data, buffer,
+            iocb->ki_pos, copied_byte_count);
+        raw_write_seqcount_end(&device_data->buffer_sequence);
+
+        pseudo_char_device_backing_mark_dirty(device_data, iocb->ki_pos,
+            copied_byte_count);
+        pseudo_char_device_notify_write(device_data, iocb->ki_pos,
+            copied_byte_count);
+
+        if (copied_byte_count == 0) {
+            pr_debug("Unable to copy %zu bytes...\n", byte_count);
+            return_code = -EFAULT;
+        } else {
+            return_code = copied_byte_count;
+
+            iocb->ki_pos += copied_byte_count;
+            pr_debug("New file position: %lld\n", iocb->ki_pos);
+            pr_debug("Successfully written byte count: %zu\n",
+                copied_byte_count);
+        }
+    }
+
+    mutex_unlock(&device_data->buffer_lock);
+
+    return return_code;
+}
+
+
+
+static long random_access_ioctl(struct file *file, unsigned int command,
+    unsigned long argument)
+{
+    long return_code = 0;
+
+    if (command == PCD_IOCTL_VERIFY) {
+        return_code = pseudo_char_device_checksum_ioctl(file, command,
+            argument);
+    } else if ((command == PCD_IOCTL_ATOMIC) ||
+        (command == PCD_IOCTL_ATOMIC_BATCH)) {
+        return_code = pseudo_char_device_atomic_ioctl(file, command,
+            argument);
+    } else if ((command == PCD_IOCTL_TXN_BEGIN) ||
+        (command == PCD_IOCTL_TXN_WRITE) ||
+        (command == PCD_IOCTL_TXN_COMMIT) ||
+        (command == PCD_IOCTL_TXN_ABORT)) {
+        return_code = pseudo_char_device_transaction_ioctl(file, command,
+            argument);
+    } else {
+        return_code = pseudo_char_device_notify_ioctl(file, command,
+            argument);
+    }
+
+    return return_code;
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+/* Copy data no write has modified meanwhile. Readers neither wait for nor
+   write to anything shared with other readers: the copy is done optimistically
+   and repeated if a write overlapped it. As the write section may sleep,
+   readers never spin on it; after a few failed attempts they queue up with
+   the writers instead, so a steady stream of writes cannot starve them.
+   With checksums enabled the data is verified before it is copied, a
+   mismatch no write explains fails the read. */
+static ssize_t copy_snapshot_to_iter(device_data_t *device_data,
+    const device_buffer_t *buffer, struct iov_iter *iov_iter,
+    loff_t file_position, size_t byte_count, bool nowait)
+{
+    ssize_t return_code = 0;
+    size_t copied_byte_count = 0;
+    unsigned long mismatch_count = 0;
+    unsigned attempt = 0;
+    unsigned sequence = 0;
+    bool done = false;
+
+    for (; (attempt < READ_ATTEMPT_COUNT) && !done; ++attempt) {
+        sequence = raw_read_seqcount(&device_data->buffer_sequence);
+        if ((sequence & 1) == 0) {
+            /* Writers may change the data under this copy, which is why
+               its result is only kept if the sequence shows no write
+               overlapped it. The race is intended, not reported. */
+            copied_byte_count = 0;
+            mismatch_count = data_race(pseudo_char_device_checksum_verify(
+                device_data, buffer, file_position, byte_count, NULL));
+            if (mismatch_count == 0) {
+                copied_byte_count = data_race(copy_to_iter(
+                    &buffer->data[file_position], byte_count, iov_iter));
+            }
+            done = !read_seqcount_retry(&device_data->buffer_sequence,
+                sequence);
+            if (!done) {
+                iov_iter_revert(iov_iter, copied_byte_count);
+            }
+        }
+    }
+
+    if (!done) {
+        return_code = pseudo_char_device_buffer_lock(device_data, nowait);
+        if (return_code == 0) {
+            mismatch_count = pseudo_char_device_checksum_verify(device_data,
+                buffer, file_position, byte_count, NULL);
+            if (mismatch_count == 0) {
+                copied_byte_count = copy_to_iter(
+                    &buffer->data[file_position], byte_count, iov_iter);
+            }
+            mutex_unlock(&device_data->buffer_lock);
+        }
+    }
+
+    if ((return_code == 0) && (mismatch_count > 0)) {
+        atomic64_add(mismatch_count,
+            &device_data->checksum.read_mismatch_count);
+        pr_err_ratelimited("Checksum mismatch in device %s at %lld!\n",
+            device_data->serial_number, file_position);
+        return_code = -EIO;
+    } else if (return_code == 0) {
+        if ((copied_byte_count == 0) && (byte_count > 0)) {
+            return_code = -EFAULT;
+        } else {
+            return_code = copied_byte_count;
+        }
+    }
+
+    return return_code;
+}
@@ -0,0 +1,466 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/wait.h>
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s: "fmt, __func__
+
+/* Records start on multiples of their header size, so a header never wraps
+   around the end of the ring. */
+#define RECORD_ALIGNMENT    sizeof(struct pcd_record_header)
+
+/* Fills the end of the ring when the next record does not fit there. */
+#define RECORD_FLAG_PADDING (1U << 31)
+
+
+
+/*****************************************************************************/
+/* MODE OPERATIONS FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int record_open(struct inode *inode, struct file *file);
+
+static ssize_t record_read_iter(struct kiocb *iocb, struct iov_iter *iov_iter);
+
+static ssize_t record_write_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter);
+
+static __poll_t record_poll(struct file *file,
+    struct poll_table_struct *poll_table);
+
+static long record_ioctl(struct file *file, unsigned int command,
+    unsigned long argument);
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static ssize_t record_read_one(device_data_t *device_data,
+    const device_buffer_t *buffer, struct iov_iter *iov_iter,
+    bool with_header);
+
+static struct pcd_record_header *record_next(device_data_t *device_data,
+    const device_buffer_t *buffer);
+
+static size_t record_space(size_t length);
+
+static unsigned int record_used_byte_count(const device_data_t *device_data);
+
+static bool record_is_readable(const device_data_t *device_data);
+
+static bool record_has_room(const device_data_t *device_data, size_t length);
+
+
+
+/*****************************************************************************/
+/* PUBLIC VARIABLES */
+/*****************************************************************************/
+
+/* Datagrams over the ring of the fifo mode: the buffer is the preallocated
+   pool the records are stored in, back to back, each behind a header
+   holding its length and the time it was written at. */
+const device_mode_operations_t record_mode_operations = {
+    .name = "record",
+    .init = pseudo_char_device_buffer_init,
+    .exit = pseudo_char_device_buffer_exit,
+    .resize = pseudo_char_device_buffer_resize,
+    .open = record_open,
+    .llseek = no_llseek,
+    .read_iter = record_read_iter,
+    .write_iter = record_write_iter,
+    .poll = record_poll,
+    .ioctl = record_ioctl
+};
+
+
+
+/*****************************************************************************/
+/* MODE OPERATIONS FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+/* Files start out reading single records. Whether they read batches is
+   kept in their f_version. */
+static int record_open(struct inode *inode, struct file *file)
+{
+    file->f_version = 0;
+
+    return stream_open(inode, file);
+}
+
+
+
+/* A read returns the payload of exactly one record and fails with
+   EMSGSIZE, leaving it in place, if it does not fit. A file reading
+   batches takes one record per segment instead, header included, for as
+   many segments as there are records; it only waits for the first one. */
+static ssize_t record_read_iter(struct kiocb *iocb, struct iov_iter *iov_iter)
+{
+    ssize_t return_code = 0;
+    ssize_t read_byte_count = 0;
+    size_t total_byte_count = 0;
+    device_data_t *device_data = (device_data_t *)iocb->ki_filp->private_data;
+    device_buffer_t *buffer = NULL;
+    fifo_data_t *fifo = &device_data->fifo;
+    const bool batched = READ_ONCE(iocb->ki_filp->f_version) != 0;
+
+    if (iov_iter_count(iov_iter) == 0) {
+        return 0;
+    }
+
+    if (pseudo_char_device_is_nonblocking(iocb)) {
+        return_code = mutex_trylock(&fifo->consumer_lock) ? 0 : -EAGAIN;
+    } else {
+        return_code = mutex_lock_interruptible(&fifo->consumer_lock);
+    }
+
+    while ((return_code == 0) && !record_is_readable(device_data)) {
+        mutex_unlock(&fifo->consumer_lock);
+
+        if (pseudo_char_device_is_nonblocking(iocb)) {
+            return_code = -EAGAIN;
+        } else {
+            return_code = wait_event_interruptible_exclusive(
+                fifo->read_queue, record_is_readable(device_data));
+            if (return_code == 0) {
+                return_code = mutex_lock_interruptible(&fifo->consumer_lock);
+            }
+        }
+    }
+
+    if (return_code != 0) {
+        return return_code;
+    }
+
+    buffer = rcu_dereference_protected(device_data->buffer,
+        lockdep_is_held(&fifo->consumer_lock));
+
+    do {
+        read_byte_count = record_read_one(device_data, buffer, iov_iter,
+            batched);
+        if (read_byte_count > 0) {
+            total_byte_count += read_byte_count;
+        }
+    } while (batched && (read_byte_count > 0) &&
+        (iov_iter_count(iov_iter) > 0) && record_is_readable(device_data));
+
+    mutex_unlock(&fifo->consumer_lock);
+
+    if (total_byte_count > 0) {
+        return_code = total_byte_count;
+        wake_up_interruptible_poll(&fifo->write_queue,
+            EPOLLOUT | EPOLLWRNORM);
+        pseudo_char_device_qos_wake(device_data);
+    } else {
+        return_code = read_byte_count;
+    }
+
+    if (record_is_readable(device_data)) {
+        wake_up_interruptible_poll(&fifo->read_queue, EPOLLIN | EPOLLRDNORM);
+    }
+
+    return return_code;
+}
+
+
+
+/* Each write is one record, all of it or nothing: it waits for enough
+   room, and fails with EMSGSIZE if there never could be. */
+static ssize_t record_write_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter)
+{
+    ssize_t return_code = 0;
+    const size_t length = iov_iter_count(iov_iter);
+    unsigned int head = 0;
+    unsigned int offset = 0;
+    device_data_t *device_data = (device_data_t *)iocb->ki_filp->private_data;
+    device_buffer_t *buffer = NULL;
+    fifo_data_t *fifo = &device_data->fifo;
+    struct pcd_record_header *header = NULL;
+    u64 start_time = DEVICE_QOS_UNCHARGED;
+
+    if (length == 0) {
+        return 0;
+    }
+
+    /* Half the ring, so a record fits whatever the padding in front of
+       it. */
+    if ((length > DEVICE_RECORD_SIZE_MAX) ||
+        (record_space(length) >
+            (READ_ONCE(device_data->buffer_size) / 2))) {
+        return -EMSGSIZE;
+    }
+
+    if (pseudo_char_device_is_nonblocking(iocb)) {
+        return_code = mutex_trylock(&fifo->producer_lock) ? 0 : -EAGAIN;
+    } else {
+        return_code = mutex_lock_interruptible(&fifo->producer_lock);
+    }
+
+    while ((return_code == 0) && !record_has_room(device_data, length)) {
+        mutex_unlock(&fifo->producer_lock);
+
+        if (pseudo_char_device_is_nonblocking(iocb)) {
+            return_code = -EAGAIN;
+        } else {
+            /* Waiting writers queue up fairly between their files, a
+               record too large for the room left holds back the ones
+               behind it rather than being overtaken forever. */
+            return_code = pseudo_char_device_qos_wait(iocb->ki_filp, length,
+                &start_time, record_has_room);
+            if (return_code == 0) {
+                return_code = mutex_lock_interruptible(&fifo->producer_lock);
+            }
+        }
+    }
+
+    if (return_code != 0) {
+        return return_code;
+    }
+
+    buffer = rcu_dereference_protected(device_data->buffer,
+        lockdep_is_held(&fifo->producer_lock));
+    head = fifo->head;
+    offset = head & (buffer->size - 1);
+
+    if ((buffer->size - offset) < (sizeof(*header) + length)) {
+        header = (struct pcd_record_header *)&buffer->data[offset];
+        header->length = buffer->size - offset - sizeof(*header);
+        header->flags = RECORD_FLAG_PADDING;
+        head += buffer->size - offset;
+        offset = 0;
+    }
+
+    header = (struct pcd_record_header *)&buffer->data[offset];
+    if (copy_from_iter_full(&buffer->data[offset + sizeof(*header)], length,
+        iov_iter)) {
+        header->length = length;
+        header->flags = 0;
+        header->timestamp_ns = ktime_get_ns();
+
+        /* Publish the record before the new head. */
+        smp_store_release(&fifo->head,
+            head + ALIGN(sizeof(*header) + length, RECORD_ALIGNMENT));
+        return_code = length;
+    } else {
+        /* The padding, if any, stays unpublished as well. */
+        return_code = -EFAULT;
+    }
+
+    mutex_unlock(&fifo->producer_lock);
+
+    if (return_code > 0) {
+        wake_up_interruptible_poll(&fifo->read_queue, EPOLLIN | EPOLLRDNORM);
+    }
+
+    /* The next writer in line may fit into what is left. */
+    pseudo_char_device_qos_wake(device_data);
+
+    return return_code;
+}
+
+
+
+/* Writable once a record of a byte fits. */
+static __poll_t record_poll(struct file *file,
+    struct poll_table_struct *poll_table)
+{
+    __poll_t mask = 0;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+
+    poll_wait(file, &device_data->fifo.read_queue, poll_table);
+    poll_wait(file, &device_data->fifo.write_queue, poll_table);
+
+    if (record_is_readable(device_data)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+
+    if (record_has_room(device_data, 1)) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+
+    return mask;
+}
+
+
+
+/* Header of the next record, without consuming it, so a reader may size
+   its buffer, or the way the file reads records. */
+static long record_ioctl(struct file *file, unsigned int command,
+    unsigned long argument)
+{
+    long return_code = 0;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    fifo_data_t *fifo = &device_data->fifo;
+    const struct pcd_record_header *header = NULL;
+    struct pcd_record_header user_header;
+    u32 batched = 0;
+
+    if (command == PCD_IOCTL_RECORD_BATCH) {
+        if (get_user(batched, (__u32 __user *)argument) != 0) {
+            return -EFAULT;
+        }
+
+        WRITE_ONCE(file->f_version, batched != 0);
+        return 0;
+    }
+
+    if (command != PCD_IOCTL_RECORD_NEXT) {
+        return -ENOTTY;
+    }
+
+    if (mutex_lock_interruptible(&fifo->consumer_lock) != 0) {
+        return -ERESTARTSYS;
+    }
+
+    header = record_next(device_data, rcu_dereference_protected(
+        device_data->buffer, lockdep_is_held(&fifo->consumer_lock)));
+    if (header != NULL) {
+        user_header = *header;
+    } else {
+        return_code = -EAGAIN;
+    }
+
+    mutex_unlock(&fifo->consumer_lock);
+
+    if ((return_code == 0) &&
+        (copy_to_user((void __user *)argument, &user_header,
+            sizeof(user_header)) != 0)) {
+        return_code = -EFAULT;
+    }
+
+    return return_code;
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+/* Consume the next record into the iterator, into the current segment only
+   for batches. Called with the consumer lock held and a record
+   available. Returns the bytes copied. */
+static ssize_t record_read_one(device_data_t *device_data,
+    const device_buffer_t *buffer, struct iov_iter *iov_iter,
+    bool with_header)
+{
+    fifo_data_t *fifo = &device_data->fifo;
+    const struct pcd_record_header *header = record_next(device_data,
+        buffer);
+    const size_t capacity = with_header ?
+        iov_iter_single_seg_count(iov_iter) : iov_iter_count(iov_iter);
+    size_t byte_count = 0;
+
+    if (header == NULL) {
+        return 0;
+    }
+
+    byte_count = header->length + (with_header ? sizeof(*header) : 0);
+    if (capacity < byte_count) {
+        return -EMSGSIZE;
+    }
+
+    if (copy_to_iter((const char *)header +
+        (with_header ? 0 : sizeof(*header)), byte_count,
+        iov_iter) != byte_count) {
+        return -EFAULT;
+    }
+
+    /* Whatever is left of the segment stays unused. */
+    if (with_header) {
+        iov_iter_advance(iov_iter, capacity - byte_count);
+    }
+
+    /* The record must be read out before the producer may reuse the
+       space. */
+    smp_store_release(&fifo->tail, fifo->tail +
+        ALIGN(sizeof(*header) + header->length, RECORD_ALIGNMENT));
+
+    return byte_count;
+}
+
+
+
+/* Next record in the ring, skipping the padding at its end. Called with
+   the consumer lock held, NULL if the ring is empty. */
+static struct pcd_record_header *record_next(device_data_t *device_data,
+    const device_buffer_t *buffer)
+{
+    fifo_data_t *fifo = &device_data->fifo;
+    struct pcd_record_header *header = NULL;
+
+    /* Pairs with the release of the writer: the record is visible before
+       the head moving past it is. */
+    while (smp_load_acquire(&fifo->head) != fifo->tail) {
+        header = (struct pcd_record_header *)
+            &buffer->data[fifo->tail & (buffer->size - 1)];
+        if (!(header->flags & RECORD_FLAG_PADDING)) {
+            return header;
+        }
+
+        smp_store_release(&fifo->tail,
+            fifo->tail + sizeof(*header) + header->length);
+    }
+
+    return NULL;
+}
+
+
+
+/* Room a record takes in the ring, padding at the end aside. */
+static size_t record_space(size_t length)
+{
+    return ALIGN(sizeof(struct pcd_record_header) + length, RECORD_ALIGNMENT);
+}
+
+
+
+static unsigned int record_used_byte_count(const device_data_t *device_data)
+{
+    return READ_ONCE(device_data->fifo.head) -
+        READ_ONCE(device_data->fifo.tail);
+}
+
+
+
+static bool record_is_readable(const device_data_t *device_data)
+{
+    return record_used_byte_count(device_data) > 0;
+}
+
+
+
+/* Whether a record of the given length fits behind the head, including the
+   padding needed if it does not fit before the end of the ring. */
+static bool record_has_room(const device_data_t *device_data, size_t length)
+{
+    const size_t size = READ_ONCE(device_data->buffer_size);
+    const size_t offset = READ_ONCE(device_data->fifo.head) & (size - 1);
+    size_t space = record_space(length);
+
+    if ((size - offset) < (sizeof(struct pcd_record_header) + length)) {
+        space += size - offset;
+    }
+
+    return (size - record_used_byte_count(device_data)) >= space;
+}
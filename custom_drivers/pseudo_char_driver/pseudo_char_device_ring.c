@@ -0,0 +1,714 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <linux/capability.h>
+#include <linux/err.h>
+#include <linux/errno.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/log2.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s: "fmt, __func__
+
+#define RING_IDLE_MS_DEFAULT    100
+#define RING_IDLE_MS_MAX        10000
+
+
+
+/*****************************************************************************/
+/* PRIVATE STRUCTURES */
+/*****************************************************************************/
+
+/* State of an open ring file. The area is shared with user space, so the
+   kernel keeps its own copy of the indices it owns and of the masks, and
+   never trusts what it reads back beyond masking it. The lock guards the
+   files and the setup, and is never held across an operation. The submit
+   lock serializes consuming submissions, whose operations may sleep, so
+   registering, unregistering and mmap() never wait for them. */
+typedef struct ring_context {
+    struct pcd_ring_header *header;
+    struct pcd_ring_submission *submissions;
+    struct pcd_ring_completion *completions;
+    size_t area_size;
+    u32 submission_head;
+    u32 submission_mask;
+    u32 completion_tail;
+    u32 completion_mask;
+    struct file *files[PCD_RING_FILE_COUNT_MAX];
+    struct mutex lock;
+    struct mutex submit_lock;
+    struct task_struct *poller;
+    wait_queue_head_t poller_queue;
+    struct mm_struct *mm;
+    unsigned long idle_time;
+}ring_context_t;
+
+
+
+/*****************************************************************************/
+/* RING FILE OPERATIONS FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int ring_open(struct inode *inode, struct file *file);
+
+static int ring_release(struct inode *inode, struct file *file);
+
+static int ring_mmap(struct file *file, struct vm_area_struct *vma);
+
+static long ring_ioctl(struct file *file, unsigned int command,
+    unsigned long argument);
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int ring_setup(ring_context_t *context,
+    struct pcd_ring_setup *user_setup);
+
+static int ring_register(ring_context_t *context,
+    struct pcd_ring_file *user_file);
+
+static int ring_unregister(ring_context_t *context, u32 index);
+
+static unsigned ring_submit(ring_context_t *context, bool nowait);
+
+static long ring_execute(ring_context_t *context,
+    const struct pcd_ring_submission *submission, bool nowait);
+
+static int ring_lock_position(struct file *file, bool nowait);
+
+static void ring_unlock_position(struct file *file);
+
+static bool ring_submission_pending(const ring_context_t *context);
+
+static int ring_poller(void *data);
+
+
+
+/*****************************************************************************/
+/* PRIVATE VARIABLES */
+/*****************************************************************************/
+
+static const struct file_operations ring_file_operations = {
+    .owner = THIS_MODULE,
+    .open = ring_open,
+    .release = ring_release,
+    .mmap = ring_mmap,
+    .unlocked_ioctl = ring_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .llseek = noop_llseek
+};
+
+/* Anyone may use rings, the operations are done on device files the user
+   opened, with the permissions they were opened with. Polling keeps a CPU
+   busy, so it takes CAP_SYS_NICE. */
+static struct miscdevice ring_device = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = PCD_RING_DEVICE_NAME,
+    .fops = &ring_file_operations,
+    .mode = 0666
+};
+
+
+
+/*****************************************************************************/
+/* PUBLIC FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+int pseudo_char_device_ring_init(void)
+{
+    int return_code = 0;
+
+    return_code = misc_register(&ring_device);
+    if (return_code == 0) {
+        pr_info("Ring device registration done...\n");
+    } else {
+        pr_err("Ring device registration failed!\n");
+    }
+
+    return return_code;
+}
+
+
+
+void pseudo_char_device_ring_exit(void)
+{
+    misc_deregister(&ring_device);
+}
+
+
+
+/*****************************************************************************/
+/* RING FILE OPERATIONS FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static int ring_open(struct inode *inode, struct file *file)
+{
+    ring_context_t *context = NULL;
+
+    context = kzalloc(sizeof(ring_context_t), GFP_KERNEL);
+    if (context == NULL) {
+        return -ENOMEM;
+    }
+
+    mutex_init(&context->lock);
+    mutex_init(&context->submit_lock);
+    init_waitqueue_head(&context->poller_queue);
+
+    file->private_data = context;
+
+    return 0;
+}
+
+
+
+static int ring_release(struct inode *inode, struct file *file)
+{
+    ring_context_t *context = (ring_context_t *)file->private_data;
+    unsigned index = 0;
+
+    if (context->poller != NULL) {
+        kthread_stop(context->poller);
+        put_task_struct(context->poller);
+    }
+
+    if (context->mm != NULL) {
+        mmdrop(context->mm);
+    }
+
+    for (; index < PCD_RING_FILE_COUNT_MAX; ++index) {
+        if (context->files[index] != NULL) {
+            fput(context->files[index]);
+        }
+    }
+
+    vfree(context->header);
+    kfree(context);
+
+    return 0;
+}
+
+
+
+static int ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    int return_code = 0;
+    ring_context_t *context = (ring_context_t *)file->private_data;
+
+    mutex_lock(&context->lock);
+
+    if (context->header == NULL) {
+        return_code = -ENXIO;
+    } else if ((vma->vm_pgoff != 0) ||
+        ((vma->vm_end - vma->vm_start) != PAGE_ALIGN(context->area_size))) {
+        return_code = -EINVAL;
+    } else {
+        return_code = remap_vmalloc_range(vma, context->header, 0);
+    }
+
+    mutex_unlock(&context->lock);
+
+    return return_code;
+}
+
+
+
+static long ring_ioctl(struct file *file, unsigned int command,
+    unsigned long argument)
+{
+    long return_code = 0;
+    ring_context_t *context = (ring_context_t *)file->private_data;
+    struct pcd_ring_setup user_setup;
+    struct pcd_ring_file user_file;
+    void __user *user_pointer = (void __user *)argument;
+
+    switch (command) {
+        case PCD_IOCTL_RING_SETUP: {
+            if (copy_from_user(&user_setup, user_pointer,
+                sizeof(user_setup)) != 0) {
+                return_code = -EFAULT;
+            } else {
+                return_code = ring_setup(context, &user_setup);
+                if ((return_code == 0) &&
+                    (copy_to_user(user_pointer, &user_setup,
+                        sizeof(user_setup)) != 0)) {
+                    return_code = -EFAULT;
+                }
+            }
+        }
+        break;
+
+        case PCD_IOCTL_RING_REGISTER: {
+            if (copy_from_user(&user_file, user_pointer,
+                sizeof(user_file)) != 0) {
+                return_code = -EFAULT;
+            } else {
+                return_code = ring_register(context, &user_file);
+                if ((return_code == 0) &&
+                    (copy_to_user(user_pointer, &user_file,
+                        sizeof(user_file)) != 0)) {
+                    return_code = -EFAULT;
+                }
+            }
+        }
+        break;
+
+        case PCD_IOCTL_RING_UNREGISTER: {
+            if (copy_from_user(&user_file, user_pointer,
+                sizeof(user_file)) != 0) {
+                return_code = -EFAULT;
+            } else {
+                return_code = ring_unregister(context, user_file.index);
+            }
+        }
+        break;
+
+        case PCD_IOCTL_RING_ENTER: {
+            /* The doorbell: wake the poller if there is one, otherwise
+               consume the submissions right away. Returns how many. */
+            if (smp_load_acquire(&context->header) == NULL) {
+                return_code = -ENXIO;
+            } else if (context->poller != NULL) {
+                wake_up(&context->poller_queue);
+            } else {
+                return_code = mutex_lock_interruptible(
+                    &context->submit_lock);
+                if (return_code == 0) {
+                    return_code = ring_submit(context, false);
+                    mutex_unlock(&context->submit_lock);
+                }
+            }
+        }
+        break;
+
+        default: {
+            return_code = -ENOTTY;
+        }
+        break;
+    }
+
+    return return_code;
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+/* Allocate the area, entries laid out after the header, and start the
+   poller if asked for and allowed to. A ring is set up once. */
+static int ring_setup(ring_context_t *context,
+    struct pcd_ring_setup *user_setup)
+{
+    int return_code = 0;
+    struct task_struct *poller = NULL;
+    void *area = NULL;
+
+    if (user_setup->completion_count == 0) {
+        user_setup->completion_count = 2 * user_setup->submission_count;
+    }
+
+    if ((user_setup->submission_count == 0) ||
+        (user_setup->submission_count > PCD_RING_ENTRY_COUNT_MAX) ||
+        !is_power_of_2(user_setup->submission_count) ||
+        (user_setup->completion_count > (2 * PCD_RING_ENTRY_COUNT_MAX)) ||
+        !is_power_of_2(user_setup->completion_count) ||
+        (user_setup->flags & ~PCD_RING_SETUP_POLL) ||
+        (user_setup->idle_ms > RING_IDLE_MS_MAX)) {
+        return -EINVAL;
+    }
+
+    if ((user_setup->flags & PCD_RING_SETUP_POLL) && !capable(CAP_SYS_NICE)) {
+        return -EPERM;
+    }
+
+    user_setup->submission_offset = sizeof(struct pcd_ring_header);
+    user_setup->completion_offset = user_setup->submission_offset +
+        user_setup->submission_count * sizeof(struct pcd_ring_submission);
+    user_setup->size = user_setup->completion_offset +
+        user_setup->completion_count * sizeof(struct pcd_ring_completion);
+
+    /* Zeroed, and made of whole pages which may be mapped. */
+    area = vmalloc_user(user_setup->size);
+    if (area == NULL) {
+        return -ENOMEM;
+    }
+
+    mutex_lock(&context->lock);
+
+    if (context->header != NULL) {
+        return_code = -EBUSY;
+    } else if (user_setup->flags & PCD_RING_SETUP_POLL) {
+        context->idle_time = msecs_to_jiffies((user_setup->idle_ms != 0) ?
+            user_setup->idle_ms : RING_IDLE_MS_DEFAULT);
+
+        /* The poller reaches the buffers of the submissions through the
+           address space of the task setting up the ring. */
+        mmgrab(current->mm);
+        context->mm = current->mm;
+
+        poller = kthread_create(ring_poller, context, "pcd_ring/%d",
+            task_pid_nr(current));
+        if (IS_ERR(poller)) {
+            return_code = PTR_ERR(poller);
+            mmdrop(context->mm);
+            context->mm = NULL;
+        } else {
+            get_task_struct(poller);
+            context->poller = poller;
+        }
+    }
+
+    if (return_code == 0) {
+        context->submissions = area + user_setup->submission_offset;
+        context->completions = area + user_setup->completion_offset;
+        context->area_size = user_setup->size;
+        context->submission_mask = user_setup->submission_count - 1;
+        context->completion_mask = user_setup->completion_count - 1;
+        ((struct pcd_ring_header *)area)->submission_mask =
+            context->submission_mask;
+        ((struct pcd_ring_header *)area)->completion_mask =
+            context->completion_mask;
+
+        /* The doorbell looks at the ring without the lock. */
+        smp_store_release(&context->header, area);
+
+        if (context->poller != NULL) {
+            wake_up_process(context->poller);
+        }
+    }
+
+    mutex_unlock(&context->lock);
+
+    if (return_code != 0) {
+        vfree(area);
+    }
+
+    return return_code;
+}
+
+
+
+/* Only files of pseudo char devices may be used, each keeps a reference
+   until it is unregistered or the ring is released. */
+static int ring_register(ring_context_t *context,
+    struct pcd_ring_file *user_file)
+{
+    int return_code = -ENFILE;
+    unsigned index = 0;
+    struct file *file = NULL;
+
+    file = fget(user_file->fd);
+    if (file == NULL) {
+        return -EBADF;
+    }
+
+    if (!pseudo_char_device_is_device_file(file)) {
+        fput(file);
+        return -EINVAL;
+    }
+
+    mutex_lock(&context->lock);
+    for (; index < PCD_RING_FILE_COUNT_MAX; ++index) {
+        if (context->files[index] == NULL) {
+            context->files[index] = file;
+            user_file->index = index;
+            return_code = 0;
+            break;
+        }
+    }
+    mutex_unlock(&context->lock);
+
+    if (return_code != 0) {
+        fput(file);
+    }
+
+    return return_code;
+}
+
+
+
+static int ring_unregister(ring_context_t *context, u32 index)
+{
+    struct file *file = NULL;
+
+    if (index >= PCD_RING_FILE_COUNT_MAX) {
+        return -EINVAL;
+    }
+
+    mutex_lock(&context->lock);
+    file = context->files[index];
+    context->files[index] = NULL;
+    mutex_unlock(&context->lock);
+
+    if (file == NULL) {
+        return -ENOENT;
+    }
+
+    fput(file);
+
+    return 0;
+}
+
+
+
+/* Consume submissions for as long as there are some and room for their
+   completions. Entries are copied before they are looked at, user space
+   may be changing them meanwhile. An operation interrupted by a signal
+   completes with EINTR, as restarting is up to a syscall, and leaves the
+   submissions after it for the next time. Called with the submit lock
+   held, returns how many submissions were consumed. */
+static unsigned ring_submit(ring_context_t *context, bool nowait)
+{
+    struct pcd_ring_header *header = context->header;
+    const struct pcd_ring_submission *shared_submission = NULL;
+    struct pcd_ring_submission submission;
+    struct pcd_ring_completion *completion = NULL;
+    const u32 submission_tail = smp_load_acquire(&header->submission_tail);
+    const u32 completion_head = smp_load_acquire(&header->completion_head);
+    unsigned submitted_count = 0;
+    long result = 0;
+    bool interrupted = false;
+
+    while ((context->submission_head != submission_tail) &&
+        ((context->completion_tail - completion_head) <=
+            context->completion_mask) && !interrupted) {
+        shared_submission = &context->submissions[context->submission_head &
+            context->submission_mask];
+        submission.opcode = READ_ONCE(shared_submission->opcode);
+        submission.file_index = READ_ONCE(shared_submission->file_index);
+        submission.length = READ_ONCE(shared_submission->length);
+        submission.offset = READ_ONCE(shared_submission->offset);
+        submission.address = READ_ONCE(shared_submission->address);
+        submission.user_data = READ_ONCE(shared_submission->user_data);
+
+        completion = &context->completions[context->completion_tail &
+            context->completion_mask];
+        result = ring_execute(context, &submission, nowait);
+        if ((result == -ERESTARTSYS) || (result == -ERESTARTNOINTR) ||
+            (result == -ERESTARTNOHAND) ||
+            (result == -ERESTART_RESTARTBLOCK)) {
+            result = -EINTR;
+            interrupted = true;
+        }
+
+        WRITE_ONCE(completion->user_data, submission.user_data);
+        WRITE_ONCE(completion->result, result);
+
+        ++context->submission_head;
+        ++context->completion_tail;
+        ++submitted_count;
+
+        cond_resched();
+    }
+
+    if (submitted_count > 0) {
+        smp_store_release(&header->submission_head, context->submission_head);
+        smp_store_release(&header->completion_tail, context->completion_tail);
+    }
+
+    return submitted_count;
+}
+
+
+
+/* Go through the file operations, as the syscall would, so permissions,
+   statistics and tracing all apply. Like the syscall, operations at the
+   file position hold the position lock of files which share it. The file
+   is held by a reference of its own meanwhile, it may be unregistered. */
+static long ring_execute(ring_context_t *context,
+    const struct pcd_ring_submission *submission, bool nowait)
+{
+    long return_code = 0;
+    struct file *file = NULL;
+    struct iovec iovec;
+    struct iov_iter iov_iter;
+    loff_t file_position = 0;
+    const bool use_file_position = (submission->offset == -1);
+    const int direction = (submission->opcode == PCD_RING_OP_READ) ?
+        READ : WRITE;
+
+    if (submission->file_index >= PCD_RING_FILE_COUNT_MAX) {
+        return -EBADF;
+    }
+
+    mutex_lock(&context->lock);
+    file = context->files[submission->file_index];
+    if (file != NULL) {
+        get_file(file);
+    }
+    mutex_unlock(&context->lock);
+
+    if (file == NULL) {
+        return -EBADF;
+    }
+
+    switch (submission->opcode) {
+        case PCD_RING_OP_READ:
+        case PCD_RING_OP_WRITE: {
+            if (submission->offset < -1) {
+                return_code = -EINVAL;
+            } else {
+                return_code = import_single_range(direction,
+                    u64_to_user_ptr(submission->address), submission->length,
+                    &iovec, &iov_iter);
+            }
+
+            if ((return_code == 0) && use_file_position) {
+                return_code = ring_lock_position(file, nowait);
+            }
+
+            if (return_code == 0) {
+                file_position = use_file_position ? file->f_pos :
+                    submission->offset;
+                if (direction == READ) {
+                    return_code = vfs_iter_read(file, &iov_iter,
+                        &file_position, nowait ? RWF_NOWAIT : 0);
+                } else {
+                    return_code = vfs_iter_write(file, &iov_iter,
+                        &file_position, nowait ? RWF_NOWAIT : 0);
+                }
+
+                if (use_file_position) {
+                    if (return_code >= 0) {
+                        file->f_pos = file_position;
+                    }
+                    ring_unlock_position(file);
+                }
+            }
+        }
+        break;
+
+        case PCD_RING_OP_SEEK: {
+            return_code = ring_lock_position(file, nowait);
+            if (return_code == 0) {
+                return_code = vfs_llseek(file, submission->offset,
+                    submission->length);
+                ring_unlock_position(file);
+            }
+        }
+        break;
+
+        default: {
+            return_code = -EINVAL;
+        }
+        break;
+    }
+
+    fput(file);
+
+    return return_code;
+}
+
+
+
+/* Files keeping their position for every user of it, as fdget_pos()
+   does. The poller never sleeps on the lock. */
+static int ring_lock_position(struct file *file, bool nowait)
+{
+    int return_code = 0;
+
+    if (file->f_mode & FMODE_ATOMIC_POS) {
+        if (nowait) {
+            return_code = mutex_trylock(&file->f_pos_lock) ? 0 : -EAGAIN;
+        } else {
+            return_code = mutex_lock_interruptible(&file->f_pos_lock);
+        }
+    }
+
+    return return_code;
+}
+
+
+
+static void ring_unlock_position(struct file *file)
+{
+    if (file->f_mode & FMODE_ATOMIC_POS) {
+        mutex_unlock(&file->f_pos_lock);
+    }
+}
+
+
+
+static bool ring_submission_pending(const ring_context_t *context)
+{
+    return READ_ONCE(context->header->submission_tail) !=
+        context->submission_head;
+}
+
+
+
+/* Consume submissions while they keep coming, then sleep until the
+   doorbell rings. The address space is only held while polling: a task
+   exiting has its mappings, and with them the ring file, torn down only
+   once nobody uses it anymore. Operations never sleep in here, one which
+   would completes with EAGAIN. */
+static int ring_poller(void *data)
+{
+    ring_context_t *context = (ring_context_t *)data;
+    struct pcd_ring_header *header = context->header;
+    unsigned long idle_deadline = 0;
+    bool address_space_alive = true;
+
+    while (!kthread_should_stop()) {
+        if (address_space_alive && mmget_not_zero(context->mm)) {
+            kthread_use_mm(context->mm);
+
+            idle_deadline = jiffies + context->idle_time;
+            while (!kthread_should_stop() &&
+                time_before(jiffies, idle_deadline)) {
+                mutex_lock(&context->submit_lock);
+                if (ring_submit(context, true) > 0) {
+                    idle_deadline = jiffies + context->idle_time;
+                }
+                mutex_unlock(&context->submit_lock);
+
+                cond_resched();
+            }
+
+            kthread_unuse_mm(context->mm);
+            mmput(context->mm);
+        } else {
+            address_space_alive = false;
+        }
+
+        /* User space checks the flag after publishing submissions, so
+           either it sees the flag and rings, or the poller sees them. */
+        WRITE_ONCE(header->flags, header->flags | PCD_RING_NEED_WAKEUP);
+        smp_mb();
+
+        wait_event_interruptible(context->poller_queue,
+            kthread_should_stop() ||
+            (address_space_alive && ring_submission_pending(context)));
+
+        WRITE_ONCE(header->flags, header->flags & ~PCD_RING_NEED_WAKEUP);
+    }
+
+    return 0;
+}
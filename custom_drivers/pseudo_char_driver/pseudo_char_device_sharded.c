@@ -0,0 +1,553 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/poll.h>
+#include <linux/sched/signal.h>
+#include <linux/string.h>
+#include <linux/topology.h>
+#include <linux/uio.h>
+#include <linux/wait.h>
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s: "fmt, __func__
+
+/* Smallest segment still holding a record header and some payload. */
+#define SHARDED_SEGMENT_SIZE_MIN    64
+
+
+
+/*****************************************************************************/
+/* PRIVATE STRUCTURES */
+/*****************************************************************************/
+
+/* Every write becomes a record in the segment of the writing CPU. The
+   timestamp is taken under the segment lock, so records of a segment are
+   always in timestamp order. */
+typedef struct sharded_record_header {
+    u64 timestamp;
+    u32 length;
+    u32 reserved;
+}sharded_record_header_t;
+
+
+
+/*****************************************************************************/
+/* MODE OPERATIONS FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int sharded_init(device_data_t *device_data);
+
+static void sharded_exit(device_data_t *device_data);
+
+static int sharded_open(struct inode *inode, struct file *file);
+
+static ssize_t sharded_read_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter);
+
+static ssize_t sharded_write_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter);
+
+static __poll_t sharded_poll(struct file *file,
+    struct poll_table_struct *poll_table);
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static bool sharded_is_readable(device_data_t *device_data);
+
+static bool segment_has_space(const device_data_t *device_data,
+    const sharded_segment_t *segment, size_t record_size);
+
+static sharded_segment_t *oldest_segment(device_data_t *device_data,
+    sharded_record_header_t *header);
+
+static int segment_lock(sharded_segment_t *segment, bool nonblocking);
+
+static void segment_read(const device_data_t *device_data,
+    const sharded_segment_t *segment, unsigned int index, void *destination,
+    size_t byte_count);
+
+static void segment_write(const device_data_t *device_data,
+    sharded_segment_t *segment, unsigned int index, const void *source,
+    size_t byte_count);
+
+static size_t segment_copy_to_iter(const device_data_t *device_data,
+    const sharded_segment_t *segment, unsigned int index, size_t byte_count,
+    struct iov_iter *iov_iter);
+
+static size_t segment_copy_from_iter(const device_data_t *device_data,
+    sharded_segment_t *segment, unsigned int index, size_t byte_count,
+    struct iov_iter *iov_iter);
+
+
+
+/*****************************************************************************/
+/* PUBLIC VARIABLES */
+/*****************************************************************************/
+
+/* Append-only mode for many concurrent writers. Each CPU appends to its
+   own segment, so writers on different CPUs share no lock and no cache
+   line. Reads return the payload of the records of all segments merged in
+   timestamp order. The buffer size is the size of a single segment. */
+const device_mode_operations_t sharded_mode_operations = {
+    .name = "sharded",
+    .init = sharded_init,
+    .exit = sharded_exit,
+    .open = sharded_open,
+    .llseek = no_llseek,
+    .read_iter = sharded_read_iter,
+    .write_iter = sharded_write_iter,
+    .poll = sharded_poll
+};
+
+
+
+/*****************************************************************************/
+/* MODE OPERATIONS FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static int sharded_init(device_data_t *device_data)
+{
+    int return_code = 0;
+    unsigned cpu = 0;
+    sharded_data_t *sharded = &device_data->sharded;
+    sharded_segment_t *segment = NULL;
+
+    mutex_init(&sharded->consumer_lock);
+    init_waitqueue_head(&sharded->read_queue);
+    init_waitqueue_head(&sharded->write_queue);
+
+    return_code = pseudo_char_device_buffer_check_size(device_data,
+        device_data->buffer_size);
+    if ((return_code == 0) &&
+        (device_data->buffer_size < SHARDED_SEGMENT_SIZE_MIN)) {
+        pr_err("Segment size of device %s below %u bytes!\n",
+            device_data->serial_number, SHARDED_SEGMENT_SIZE_MIN);
+        return_code = -EINVAL;
+    }
+
+    if (return_code == 0) {
+        sharded->segments = alloc_percpu(sharded_segment_t);
+        if (sharded->segments == NULL) {
+            return_code = -ENOMEM;
+        }
+    }
+
+    if (return_code == 0) {
+        /* Segments come from the memory node of their CPU. */
+        for_each_possible_cpu(cpu) {
+            segment = per_cpu_ptr(sharded->segments, cpu);
+            mutex_init(&segment->producer_lock);
+
+            segment->data = kvmalloc_node(device_data->buffer_size,
+                GFP_KERNEL_ACCOUNT, cpu_to_node(cpu));
+            if (segment->data == NULL) {
+                return_code = -ENOMEM;
+                break;
+            }
+        }
+    }
+
+    if (return_code == 0) {
+        pr_info("Segments of %zu bytes allocated for device %s...\n",
+            device_data->buffer_size, device_data->serial_number);
+    } else {
+        pr_err("Segment allocation for device %s failed!\n",
+            device_data->serial_number);
+    }
+
+    return return_code;
+}
+
+
+
+static void sharded_exit(device_data_t *device_data)
+{
+    unsigned cpu = 0;
+    sharded_data_t *sharded = &device_data->sharded;
+
+    if (sharded->segments != NULL) {
+        for_each_possible_cpu(cpu) {
+            kvfree(per_cpu_ptr(sharded->segments, cpu)->data);
+        }
+
+        free_percpu(sharded->segments);
+        sharded->segments = NULL;
+    }
+}
+
+
+
+static int sharded_open(struct inode *inode, struct file *file)
+{
+    return stream_open(inode, file);
+}
+
+
+
+static ssize_t sharded_read_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter)
+{
+    ssize_t return_code = 0;
+    size_t copied_byte_count = 0;
+    size_t chunk = 0;
+    size_t chunk_copied = 0;
+    unsigned int tail = 0;
+    bool space_freed = false;
+    bool nonblocking = pseudo_char_device_is_nonblocking(iocb);
+    device_data_t *device_data = (device_data_t *)iocb->ki_filp->private_data;
+    sharded_data_t *sharded = &device_data->sharded;
+    sharded_segment_t *segment = NULL;
+    sharded_record_header_t header;
+
+    if (iov_iter_count(iov_iter) == 0) {
+        return 0;
+    }
+
+    if (nonblocking) {
+        return_code = mutex_trylock(&sharded->consumer_lock) ? 0 : -EAGAIN;
+    } else {
+        return_code = mutex_lock_interruptible(&sharded->consumer_lock);
+    }
+
+    while ((return_code == 0) && !sharded_is_readable(device_data)) {
+        mutex_unlock(&sharded->consumer_lock);
+
+        if (nonblocking) {
+            return_code = -EAGAIN;
+        } else {
+            return_code = wait_event_interruptible(sharded->read_queue,
+                sharded_is_readable(device_data));
+            if (return_code == 0) {
+                return_code = mutex_lock_interruptible(
+                    &sharded->consumer_lock);
+            }
+        }
+    }
+
+    if (return_code != 0) {
+        return return_code;
+    }
+
+    /* Records longer than the space left are split across reads, the rest
+       of such a record is returned first by the next read. */
+    while (iov_iter_count(iov_iter) > 0) {
+        segment = oldest_segment(device_data, &header);
+        if (segment == NULL) {
+            break;
+        }
+
+        tail = segment->tail;
+        chunk = min_t(size_t, header.length - segment->record_offset,
+            iov_iter_count(iov_iter));
+        chunk_copied = segment_copy_to_iter(device_data, segment,
+            tail + sizeof(header) + segment->record_offset, chunk, iov_iter);
+
+        copied_byte_count += chunk_copied;
+        segment->record_offset += chunk_copied;
+        if (segment->record_offset == header.length) {
+            segment->record_offset = 0;
+            /* The record is read out before the writer may reuse it. */
+            smp_store_release(&segment->tail,
+                tail + sizeof(header) + header.length);
+            space_freed = true;
+        }
+
+        if (chunk_copied < chunk) {
+            break;
+        }
+    }
+
+    mutex_unlock(&sharded->consumer_lock);
+
+    if (copied_byte_count == 0) {
+        return_code = -EFAULT;
+    } else {
+        return_code = copied_byte_count;
+    }
+
+    /* The check keeps readers from touching the wait queue lock, and with
+       it writers' cache lines, as long as nobody waits. */
+    if (space_freed && wq_has_sleeper(&sharded->write_queue)) {
+        wake_up_interruptible_poll(&sharded->write_queue,
+            EPOLLOUT | EPOLLWRNORM);
+    }
+
+    return return_code;
+}
+
+
+
+static ssize_t sharded_write_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter)
+{
+    ssize_t return_code = 0;
+    size_t byte_count = iov_iter_count(iov_iter);
+    size_t copied_byte_count = 0;
+    unsigned int head = 0;
+    bool nonblocking = pseudo_char_device_is_nonblocking(iocb);
+    device_data_t *device_data = (device_data_t *)iocb->ki_filp->private_data;
+    sharded_data_t *sharded = &device_data->sharded;
+    sharded_segment_t *segment = NULL;
+    sharded_record_header_t header = { 0 };
+
+    if (byte_count == 0) {
+        return 0;
+    }
+
+    /* A record never exceeds a segment, longer writes are cut short. */
+    byte_count = min_t(size_t, byte_count,
+        device_data->buffer_size - sizeof(header));
+
+    /* Being migrated right after picking the segment is harmless, its lock
+       is what keeps writers apart. The lock stays uncontended and cache hot
+       for as long as the writers stay on their CPUs. */
+    segment = raw_cpu_ptr(sharded->segments);
+
+    return_code = segment_lock(segment, nonblocking);
+    while ((return_code == 0) && !segment_has_space(device_data, segment,
+        sizeof(header) + byte_count)) {
+        mutex_unlock(&segment->producer_lock);
+
+        if (nonblocking) {
+            return_code = -EAGAIN;
+        } else {
+            return_code = wait_event_interruptible(sharded->write_queue,
+                segment_has_space(device_data, segment,
+                    sizeof(header) + byte_count));
+            if (return_code == 0) {
+                return_code = segment_lock(segment, false);
+            }
+        }
+    }
+
+    if (return_code != 0) {
+        return return_code;
+    }
+
+    head = segment->head;
+
+    /* The header goes in once the payload size is known. */
+    copied_byte_count = segment_copy_from_iter(device_data, segment,
+        head + sizeof(header), byte_count, iov_iter);
+    if (copied_byte_count == 0) {
+        return_code = -EFAULT;
+    } else {
+        header.timestamp = ktime_get_ns();
+        header.length = copied_byte_count;
+        segment_write(device_data, segment, head, &header, sizeof(header));
+
+        /* Publish the record before the new head. */
+        smp_store_release(&segment->head,
+            head + sizeof(header) + copied_byte_count);
+        return_code = copied_byte_count;
+    }
+
+    mutex_unlock(&segment->producer_lock);
+
+    if ((return_code > 0) && wq_has_sleeper(&sharded->read_queue)) {
+        wake_up_interruptible_poll(&sharded->read_queue,
+            EPOLLIN | EPOLLRDNORM);
+    }
+
+    return return_code;
+}
+
+
+
+static __poll_t sharded_poll(struct file *file,
+    struct poll_table_struct *poll_table)
+{
+    __poll_t mask = 0;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    sharded_data_t *sharded = &device_data->sharded;
+
+    poll_wait(file, &sharded->read_queue, poll_table);
+    poll_wait(file, &sharded->write_queue, poll_table);
+
+    if (sharded_is_readable(device_data)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+
+    /* Only a hint, the writer may end up on another CPU. */
+    if (segment_has_space(device_data, raw_cpu_ptr(sharded->segments),
+        sizeof(sharded_record_header_t) + 1)) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+
+    return mask;
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static bool sharded_is_readable(device_data_t *device_data)
+{
+    unsigned cpu = 0;
+    const sharded_segment_t *segment = NULL;
+
+    for_each_possible_cpu(cpu) {
+        segment = per_cpu_ptr(device_data->sharded.segments, cpu);
+        if (READ_ONCE(segment->head) != READ_ONCE(segment->tail)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+
+/* Pairs with the release in sharded_read_iter(): the reader is done with
+   the space before it shows up as free. */
+static bool segment_has_space(const device_data_t *device_data,
+    const sharded_segment_t *segment, size_t record_size)
+{
+    const unsigned int used_byte_count = READ_ONCE(segment->head) -
+        smp_load_acquire(&segment->tail);
+
+    return (device_data->buffer_size - used_byte_count) >= record_size;
+}
+
+
+
+/* Find the segment whose oldest record is the oldest one overall. Called
+   with the consumer lock held. */
+static sharded_segment_t *oldest_segment(device_data_t *device_data,
+    sharded_record_header_t *header)
+{
+    unsigned cpu = 0;
+    sharded_segment_t *segment = NULL;
+    sharded_segment_t *oldest = NULL;
+    sharded_record_header_t segment_header;
+
+    for_each_possible_cpu(cpu) {
+        segment = per_cpu_ptr(device_data->sharded.segments, cpu);
+
+        /* Pairs with the release in sharded_write_iter(): the record is
+           complete before the new head is visible. */
+        if (smp_load_acquire(&segment->head) == segment->tail) {
+            continue;
+        }
+
+        segment_read(device_data, segment, segment->tail, &segment_header,
+            sizeof(segment_header));
+        if ((oldest == NULL) ||
+            (segment_header.timestamp < header->timestamp)) {
+            oldest = segment;
+            *header = segment_header;
+        }
+    }
+
+    return oldest;
+}
+
+
+
+static int segment_lock(sharded_segment_t *segment, bool nonblocking)
+{
+    int return_code = 0;
+
+    if (nonblocking) {
+        return_code = mutex_trylock(&segment->producer_lock) ? 0 : -EAGAIN;
+    } else {
+        return_code = mutex_lock_interruptible(&segment->producer_lock);
+    }
+
+    return return_code;
+}
+
+
+
+/* Segment accessors take free running indices and wrap around the end of
+   the segment, whose size is a power of two. */
+static void segment_read(const device_data_t *device_data,
+    const sharded_segment_t *segment, unsigned int index, void *destination,
+    size_t byte_count)
+{
+    const unsigned int offset = index & (device_data->buffer_size - 1);
+    const size_t first_chunk = min_t(size_t, byte_count,
+        device_data->buffer_size - offset);
+
+    memcpy(destination, &segment->data[offset], first_chunk);
+    memcpy((char *)destination + first_chunk, &segment->data[0],
+        byte_count - first_chunk);
+}
+
+
+
+static void segment_write(const device_data_t *device_data,
+    sharded_segment_t *segment, unsigned int index, const void *source,
+    size_t byte_count)
+{
+    const unsigned int offset = index & (device_data->buffer_size - 1);
+    const size_t first_chunk = min_t(size_t, byte_count,
+        device_data->buffer_size - offset);
+
+    memcpy(&segment->data[offset], source, first_chunk);
+    memcpy(&segment->data[0], (const char *)source + first_chunk,
+        byte_count - first_chunk);
+}
+
+
+
+static size_t segment_copy_to_iter(const device_data_t *device_data,
+    const sharded_segment_t *segment, unsigned int index, size_t byte_count,
+    struct iov_iter *iov_iter)
+{
+    size_t copied_byte_count = 0;
+    const unsigned int offset = index & (device_data->buffer_size - 1);
+    const size_t first_chunk = min_t(size_t, byte_count,
+        device_data->buffer_size - offset);
+
+    copied_byte_count = copy_to_iter(&segment->data[offset], first_chunk,
+        iov_iter);
+    if (copied_byte_count == first_chunk) {
+        copied_byte_count += copy_to_iter(&segment->data[0],
+            byte_count - first_chunk, iov_iter);
+    }
+
+    return copied_byte_count;
+}
+
+
+
+static size_t segment_copy_from_iter(const device_data_t *device_data,
+    sharded_segment_t *segment, unsigned int index, size_t byte_count,
+    struct iov_iter *iov_iter)
+{
+    size_t copied_byte_count = 0;
+    const unsigned int offset = index & (device_data->buffer_size - 1);
+    const size_t first_chunk = min_t(size_t, byte_count,
+        device_data->buffer_size - offset);
+
+    copied_byte_count = copy_from_iter(&segment->data[offset], first_chunk,
+        iov_iter);
+    if (copied_byte_count == first_chunk) {
+        copied_byte_count += copy_from_iter(&segment->data[0],
+            byte_count - first_chunk, iov_iter);
+    }
+
+    return copied_byte_count;
+}
@@ -0,0 +1,1210 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <linux/atomic.h>
+#include <linux/fs.h>
+#include <linux/gfp.h>
+#include <linux/highmem.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/kobject.h>
+#include <linux/list.h>
+#include <linux/lz4.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/overflow.h>
+#include <linux/page_ref.h>
+#include <linux/rcupdate.h>
+#include <linux/rwsem.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s: "fmt, __func__
+
+/* Entries of the page array are either pages or, tagged with this, pages
+   compressed by the shrinker. */
+#define SPARSE_COMPRESSED_TAG   1
+
+/* Compressing a page is only worth it if it frees at least half of it. */
+#define SPARSE_COMPRESSED_SIZE_MAX  (PAGE_SIZE / 2)
+
+/* Pages written since the dedup work last saw them. The work waits for
+   writes to settle and looks at a batch of pages per run, so writers are
+   not held off for long. */
+#define SPARSE_DEDUP_MARK   XA_MARK_1
+#define SPARSE_DEDUP_DELAY  HZ
+#define SPARSE_DEDUP_BATCH  256
+
+
+
+/*****************************************************************************/
+/* PRIVATE STRUCTURES */
+/*****************************************************************************/
+
+/* Freed after a grace period, readers decompress it under RCU. */
+typedef struct sparse_compressed_page {
+    struct rcu_head rcu_head;
+    unsigned int size;
+    char data[];
+}sparse_compressed_page_t;
+
+
+
+/*****************************************************************************/
+/* MODE OPERATIONS FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int sparse_init(device_data_t *device_data);
+
+static void sparse_exit(device_data_t *device_data);
+
+static int sparse_resize(device_data_t *device_data, size_t size);
+
+static loff_t sparse_llseek(struct file *file, loff_t file_position_offset,
+    int whence);
+
+static ssize_t sparse_read_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter);
+
+static ssize_t sparse_write_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter);
+
+static vm_fault_t sparse_fault(struct vm_fault *vm_fault);
+
+
+
+/*****************************************************************************/
+/* SHRINKER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static unsigned long sparse_count_objects(struct shrinker *shrinker,
+    struct shrink_control *shrink_control);
+
+static unsigned long sparse_scan_objects(struct shrinker *shrinker,
+    struct shrink_control *shrink_control);
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int sparse_lock(device_data_t *device_data, bool write, bool nowait);
+
+static struct page *sparse_get_page(device_data_t *device_data,
+    unsigned long page_index, gfp_t gfp);
+
+static struct page *sparse_unshare_page(device_data_t *device_data,
+    unsigned long page_index, struct page *page,
+    struct address_space *mapping, gfp_t gfp);
+
+static void sparse_touch_page(struct page *page);
+
+static bool sparse_is_compressed(const void *entry);
+
+static int sparse_decompress(const void *entry, void *destination);
+
+static void sparse_free_compressed(device_data_t *device_data, void *entry);
+
+static void sparse_truncate(device_data_t *device_data, size_t size);
+
+static loff_t sparse_next_data(device_data_t *device_data,
+    loff_t file_position, loff_t buffer_size);
+
+static loff_t sparse_next_hole(device_data_t *device_data,
+    loff_t file_position, loff_t buffer_size);
+
+static device_data_t *reclaim_next_device(void);
+
+static unsigned long reclaim_device(device_data_t *device_data,
+    unsigned long scan_count, unsigned long *freed_count);
+
+static bool reclaim_page(device_data_t *device_data,
+    unsigned long page_index, struct page *page);
+
+static void dedup_work_function(struct work_struct *work);
+
+static void dedup_page(device_data_t *device_data, unsigned long page_index,
+    struct page *page);
+
+
+
+/*****************************************************************************/
+/* PRIVATE VARIABLES */
+/*****************************************************************************/
+
+static struct shrinker sparse_shrinker = {
+    .count_objects = sparse_count_objects,
+    .scan_objects = sparse_scan_objects,
+    .seeks = DEFAULT_SEEKS
+};
+
+/* Devices which opted in to reclaim, scanned in a round robin fashion. */
+static LIST_HEAD(reclaim_devices);
+static DEFINE_SPINLOCK(reclaim_devices_lock);
+static unsigned reclaim_device_count;
+
+/* Serializes scans, which share the compression buffers. */
+static DEFINE_MUTEX(reclaim_lock);
+static void *reclaim_work_memory;
+static char *reclaim_buffer;
+
+
+
+/*****************************************************************************/
+/* PUBLIC VARIABLES */
+/*****************************************************************************/
+
+/* Random access mode for very large devices. Memory is allocated a page at
+   a time on the first write to it, so it follows the amount of data written
+   rather than the buffer size. Reads of pages never written return zeros,
+   and SEEK_DATA and SEEK_HOLE find the written ones. */
+const device_mode_operations_t sparse_mode_operations = {
+    .name = "sparse",
+    .init = sparse_init,
+    .exit = sparse_exit,
+    .resize = sparse_resize,
+    .open = pseudo_char_device_open_positioned,
+    .llseek = sparse_llseek,
+    .read_iter = sparse_read_iter,
+    .write_iter = sparse_write_iter,
+    .mmap = pseudo_char_device_buffer_mmap,
+    .fault = sparse_fault
+};
+
+
+
+/*****************************************************************************/
+/* PUBLIC FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+int pseudo_char_device_reclaim_init(void)
+{
+    int return_code = 0;
+
+    reclaim_work_memory = kmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+    reclaim_buffer = kmalloc(LZ4_COMPRESSBOUND(PAGE_SIZE), GFP_KERNEL);
+    if ((reclaim_work_memory == NULL) || (reclaim_buffer == NULL)) {
+        return_code = -ENOMEM;
+    } else {
+        return_code = register_shrinker(&sparse_shrinker);
+    }
+
+    if (return_code == 0) {
+        pr_info("Shrinker registration done...\n");
+    } else {
+        pr_err("Shrinker registration failed!\n");
+        kfree(reclaim_buffer);
+        kfree(reclaim_work_memory);
+    }
+
+    return return_code;
+}
+
+
+
+void pseudo_char_device_reclaim_exit(void)
+{
+    unregister_shrinker(&sparse_shrinker);
+
+    kfree(reclaim_buffer);
+    kfree(reclaim_work_memory);
+}
+
+
+
+/* Let the shrinker compress the cold pages of the device, and free the
+   ones holding nothing but zeros. */
+int pseudo_char_device_sparse_set_reclaimable(device_data_t *device_data,
+    bool reclaimable)
+{
+    int return_code = 0;
+    sparse_data_t *sparse = &device_data->sparse;
+
+    if (device_data->mode_operations != &sparse_mode_operations) {
+        return_code = -EOPNOTSUPP;
+    } else {
+        spin_lock(&reclaim_devices_lock);
+        if (reclaimable && !sparse->reclaimable) {
+            list_add_tail(&sparse->reclaim_node, &reclaim_devices);
+            ++reclaim_device_count;
+        } else if (!reclaimable && sparse->reclaimable) {
+            list_del(&sparse->reclaim_node);
+            --reclaim_device_count;
+        }
+        sparse->reclaimable = reclaimable;
+        spin_unlock(&reclaim_devices_lock);
+    }
+
+    return return_code;
+}
+
+
+
+/* Share the pages of the device with other devices holding the same data.
+   Pages already written are looked at too. Turning it off only stops new
+   pages from being shared. */
+int pseudo_char_device_sparse_set_dedup(device_data_t *device_data,
+    bool dedup)
+{
+    int return_code = 0;
+    sparse_data_t *sparse = &device_data->sparse;
+    unsigned long page_index = 0;
+    void *entry = NULL;
+
+    if (device_data->mode_operations != &sparse_mode_operations) {
+        return_code = -EOPNOTSUPP;
+    } else {
+        down_write(&sparse->lock);
+        if (dedup && !sparse->dedup) {
+            xa_for_each(&sparse->pages, page_index, entry) {
+                xa_set_mark(&sparse->pages, page_index, SPARSE_DEDUP_MARK);
+            }
+            schedule_delayed_work(&sparse->dedup_work, 0);
+        }
+        WRITE_ONCE(sparse->dedup, dedup);
+        up_write(&sparse->lock);
+    }
+
+    return return_code;
+}
+
+
+
+/* Memory holding the data of the device, compressed pages included. Pages
+   shared with other devices count for each of them. */
+u64 pseudo_char_device_sparse_resident_bytes(const device_data_t *device_data)
+{
+    const sparse_data_t *sparse = &device_data->sparse;
+
+    return ((u64)atomic_long_read(&sparse->resident_page_count) <<
+        PAGE_SHIFT) + atomic_long_read(&sparse->compressed_byte_count);
+}
+
+
+
+/*****************************************************************************/
+/* MODE OPERATIONS FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static int sparse_init(device_data_t *device_data)
+{
+    int return_code = 0;
+    sparse_data_t *sparse = &device_data->sparse;
+
+    xa_init(&sparse->pages);
+    init_rwsem(&sparse->lock);
+    INIT_LIST_HEAD(&sparse->reclaim_node);
+    INIT_DELAYED_WORK(&sparse->dedup_work, dedup_work_function);
+    spin_lock_init(&device_data->mapping_lock);
+    atomic_set(&device_data->mmap_count, 0);
+
+    return_code = pseudo_char_device_buffer_check_size(device_data,
+        device_data->buffer_size);
+    if (return_code == 0) {
+        pr_info("Sparse buffer of %zu bytes set up for device %s...\n",
+            device_data->buffer_size, device_data->serial_number);
+    }
+
+    return return_code;
+}
+
+
+
+static void sparse_exit(device_data_t *device_data)
+{
+    pseudo_char_device_sparse_set_reclaimable(device_data, false);
+    cancel_delayed_work_sync(&device_data->sparse.dedup_work);
+
+    sparse_truncate(device_data, 0);
+    xa_destroy(&device_data->sparse.pages);
+}
+
+
+
+/* Only the size changes, pages past the new end are freed. Writers and
+   readers are waited for, so none of them uses a page being freed. */
+static int sparse_resize(device_data_t *device_data, size_t size)
+{
+    int return_code = 0;
+    sparse_data_t *sparse = &device_data->sparse;
+    struct page *page = NULL;
+
+    return_code = pseudo_char_device_buffer_check_size(device_data, size);
+    if (return_code == 0) {
+        down_write(&sparse->lock);
+
+        /* The tail of a compressed or shared last page could not be
+           cleared. A shared page stays if it may be mapped, the resize
+           fails then anyway. */
+        if ((offset_in_page(size) != 0) &&
+            (xa_load(&sparse->pages, size >> PAGE_SHIFT) != NULL)) {
+            page = sparse_get_page(device_data, size >> PAGE_SHIFT,
+                GFP_KERNEL_ACCOUNT);
+            if ((page != NULL) && (page_private(page) != 0) &&
+                (atomic_read(&device_data->mmap_count) == 0)) {
+                page = sparse_unshare_page(device_data, size >> PAGE_SHIFT,
+                    page, NULL, GFP_KERNEL_ACCOUNT);
+            }
+
+            if (page != NULL) {
+                put_page(page);
+            } else {
+                return_code = -ENOMEM;
+            }
+        }
+
+        /* Mapped pages would silently stop being the device memory. */
+        if (return_code == 0) {
+            spin_lock(&device_data->mapping_lock);
+            if (atomic_read(&device_data->mmap_count) > 0) {
+                return_code = -EBUSY;
+            } else {
+                WRITE_ONCE(device_data->buffer_size, size);
+            }
+            spin_unlock(&device_data->mapping_lock);
+        }
+
+        if (return_code == 0) {
+            sparse_truncate(device_data, size);
+        }
+
+        up_write(&sparse->lock);
+    }
+
+    if (return_code == 0) {
+        pr_info("Sparse buffer of device %s resized to %zu bytes.\n",
+            device_data->serial_number, size);
+    } else {
+        pr_err("Sparse buffer resize of device %s failed!\n",
+            device_data->serial_number);
+    }
+
+    return return_code;
+}
+
+
+
+/* Positions follow the random access mode, except that SEEK_HOLE may land
+   on the end of the device, which is where the last hole implicitly is. */
+static loff_t sparse_llseek(struct file *file, loff_t file_position_offset,
+    int whence)
+{
+    loff_t return_code = 0;
+    loff_t new_file_position = 0;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    const loff_t buffer_size = READ_ONCE(device_data->buffer_size);
+
+    pr_debug("Llseek operation requested...\n");
+    pr_debug("Current file position: %lld\n", file->f_pos);
+
+    switch (whence) {
+        case SEEK_SET: {
+            new_file_position = file_position_offset;
+        }
+        break;
+
+        case SEEK_CUR: {
+            new_file_position = file->f_pos + file_position_offset;
+        }
+        break;
+
+        case SEEK_END: {
+            new_file_position = buffer_size + file_position_offset;
+        }
+        break;
+
+        case SEEK_DATA:
+        case SEEK_HOLE: {
+            if ((file_position_offset < 0) ||
+                (file_position_offset >= buffer_size)) {
+                return_code = -ENXIO;
+            } else if (whence == SEEK_DATA) {
+                return_code = sparse_next_data(device_data,
+                    file_position_offset, buffer_size);
+            } else {
+                return_code = sparse_next_hole(device_data,
+                    file_position_offset, buffer_size);
+            }
+        }
+        break;
+
+        default: {
+            return_code = -EINVAL;
+        }
+    }
+
+    if ((whence == SEEK_DATA) || (whence == SEEK_HOLE)) {
+        if (return_code >= 0) {
+            file->f_pos = return_code;
+        }
+    } else if ((return_code == 0) && (new_file_position < buffer_size) &&
+        (new_file_position >= 0)) {
+            file->f_pos = new_file_position;
+            return_code = file->f_pos;
+    } else {
+        return_code = -EINVAL;
+    }
+
+    if (return_code < 0) {
+        pr_debug("Llseek operation failed!\n");
+    } else {
+        pr_debug("New file position: %lld\n", file->f_pos);
+    }
+
+    return return_code;
+}
+
+
+
+static ssize_t sparse_read_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter)
+{
+    ssize_t return_code = 0;
+    size_t byte_count = iov_iter_count(iov_iter);
+    size_t copied_byte_count = 0;
+    size_t chunk_size = 0;
+    size_t chunk_copied_byte_count = 0;
+    loff_t file_position = iocb->ki_pos;
+    const bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    device_data_t *device_data = (device_data_t *)iocb->ki_filp->private_data;
+    void *entry = NULL;
+    struct page *scratch_page = NULL;
+
+    pr_debug("Read operation requested for %zu bytes...\n", byte_count);
+    pr_debug("Current file position: %lld\n", iocb->ki_pos);
+
+    return_code = sparse_lock(device_data, false, nowait);
+    if (return_code != 0) {
+        return return_code;
+    }
+
+    if (file_position >= device_data->buffer_size) {
+        byte_count = 0;
+    } else if ((file_position + byte_count) > device_data->buffer_size) {
+        byte_count = device_data->buffer_size - file_position;
+    }
+
+    /* Holes are never allocated by reads, they are copied out as zeros.
+       Compressed pages stay compressed, they are decompressed into a
+       scratch page. */
+    while (copied_byte_count < byte_count) {
+        chunk_size = min_t(size_t, byte_count - copied_byte_count,
+            PAGE_SIZE - offset_in_page(file_position));
+
+        rcu_read_lock();
+        entry = xa_load(&device_data->sparse.pages,
+            file_position >> PAGE_SHIFT);
+        if (sparse_is_compressed(entry) && (scratch_page != NULL)) {
+            return_code = sparse_decompress(entry,
+                page_address(scratch_page));
+            entry = scratch_page;
+        } else if (entry != NULL) {
+            sparse_touch_page(entry);
+        }
+        rcu_read_unlock();
+
+        if (sparse_is_compressed(entry)) {
+            /* Allocated outside of the RCU read side, then tried again. */
+            scratch_page = alloc_page(nowait ?
+                (GFP_NOWAIT | __GFP_NOWARN) : GFP_KERNEL);
+            if (scratch_page == NULL) {
+                return_code = nowait ? -EAGAIN : -ENOMEM;
+                break;
+            }
+            continue;
+        } else if (return_code != 0) {
+            break;
+        }
+
+        if (entry != NULL) {
+            chunk_copied_byte_count = copy_page_to_iter(entry,
+                offset_in_page(file_position), chunk_size, iov_iter);
+        } else {
+            chunk_copied_byte_count = iov_iter_zero(chunk_size, iov_iter);
+        }
+
+        copied_byte_count += chunk_copied_byte_count;
+        file_position += chunk_copied_byte_count;
+
+        if (chunk_copied_byte_count < chunk_size) {
+            return_code = -EFAULT;
+            break;
+        }
+    }
+
+    up_read(&device_data->sparse.lock);
+
+    if (scratch_page != NULL) {
+        __free_page(scratch_page);
+    }
+
+    if ((copied_byte_count > 0) || (byte_count == 0)) {
+        return_code = copied_byte_count;
+
+        iocb->ki_pos = file_position;
+        pr_debug("New file position: %lld\n", iocb->ki_pos);
+        pr_debug("Successfully read byte count: %zu\n", copied_byte_count);
+    }
+
+    return return_code;
+}
+
+
+
+static ssize_t sparse_write_iter(struct kiocb *iocb,
+    struct iov_iter *iov_iter)
+{
+    ssize_t return_code = 0;
+    size_t byte_count = iov_iter_count(iov_iter);
+    size_t copied_byte_count = 0;
+    size_t chunk_size = 0;
+    size_t chunk_copied_byte_count = 0;
+    loff_t file_position = iocb->ki_pos;
+    const bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    const gfp_t gfp = nowait ? (GFP_NOWAIT | __GFP_ACCOUNT | __GFP_NOWARN) :
+        GFP_KERNEL_ACCOUNT;
+    device_data_t *device_data = (device_data_t *)iocb->ki_filp->private_data;
+    sparse_data_t *sparse = &device_data->sparse;
+    struct page *page = NULL;
+
+    pr_debug("Write operation requested for %zu bytes...\n", byte_count);
+    pr_debug("Current file position: %lld\n", iocb->ki_pos);
+
+    return_code = sparse_lock(device_data, true, nowait);
+    if (return_code != 0) {
+        return return_code;
+    }
+
+    if (file_position >= device_data->buffer_size) {
+        byte_count = 0;
+    } else if ((file_position + byte_count) > device_data->buffer_size) {
+        byte_count = device_data->buffer_size - file_position;
+    }
+
+    if (byte_count == 0) {
+        pr_debug("No available memory for write operation...\n");
+        return_code = -ENOMEM;
+    }
+
+    while (copied_byte_count < byte_count) {
+        chunk_size = min_t(size_t, byte_count - copied_byte_count,
+            PAGE_SIZE - offset_in_page(file_position));
+
+        /* Pages are charged to the memory cgroup of the writer. With
+           IOCB_NOWAIT the allocation may not wait for reclaim either, such
+           a write is retried from a context which can. */
+        page = sparse_get_page(device_data, file_position >> PAGE_SHIFT,
+            gfp);
+        if ((page != NULL) && (page_private(page) != 0)) {
+            page = sparse_unshare_page(device_data,
+                file_position >> PAGE_SHIFT, page, iocb->ki_filp->f_mapping,
+                gfp);
+        }
+        if (page == NULL) {
+            return_code = nowait ? -EAGAIN : -ENOMEM;
+            break;
+        }
+
+        chunk_copied_byte_count = copy_page_from_iter(page,
+            offset_in_page(file_position), chunk_size, iov_iter);
+        put_page(page);
+
+        if (sparse->dedup) {
+            xa_set_mark(&sparse->pages, file_position >> PAGE_SHIFT,
+                SPARSE_DEDUP_MARK);
+        }
+
+        copied_byte_count += chunk_copied_byte_count;
+        file_position += chunk_copied_byte_count;
+
+        if (chunk_copied_byte_count < chunk_size) {
+            return_code = -EFAULT;
+            break;
+        }
+    }
+
+    up_write(&sparse->lock);
+
+    if (copied_byte_count > 0) {
+        if (sparse->dedup) {
+            schedule_delayed_work(&sparse->dedup_work, SPARSE_DEDUP_DELAY);
+        }
+
+        return_code = copied_byte_count;
+
+        iocb->ki_pos = file_position;
+        pr_debug("New file position: %lld\n", iocb->ki_pos);
+        pr_debug("Successfully written byte count: %zu\n",
+            copied_byte_count);
+    } else if (return_code == -EFAULT) {
+        pr_debug("Unable to copy %zu bytes...\n", byte_count);
+    }
+
+    return return_code;
+}
+
+
+
+/* Mapped holes are filled on the first access, as a mapping cannot tell
+   reads from writes. The sparse lock is not taken: readers and writers may
+   fault pages of this very device in while holding it. Pages are only freed
+   by a resize, which waits until nothing is mapped, by the shrinker, which
+   leaves pages referenced by anyone else alone, or when the device goes
+   away. Shared mappings which may be written to get pages of their own:
+   writes through them do not fault once the page is mapped. */
+static vm_fault_t sparse_fault(struct vm_fault *vm_fault)
+{
+    vm_fault_t return_code = 0;
+    struct vm_area_struct *vma = vm_fault->vma;
+    device_data_t *device_data = (device_data_t *)vma->vm_private_data;
+    struct page *page = NULL;
+
+    if (vm_fault->pgoff <
+        (PAGE_ALIGN(READ_ONCE(device_data->buffer_size)) >> PAGE_SHIFT)) {
+        page = sparse_get_page(device_data, vm_fault->pgoff,
+            GFP_KERNEL_ACCOUNT);
+        if ((page != NULL) && (page_private(page) != 0) &&
+            ((vma->vm_flags & (VM_SHARED | VM_MAYWRITE)) ==
+            (VM_SHARED | VM_MAYWRITE))) {
+            page = sparse_unshare_page(device_data, vm_fault->pgoff, page,
+                vma->vm_file->f_mapping, GFP_KERNEL_ACCOUNT);
+        }
+
+        if (page != NULL) {
+            vm_fault->page = page;
+        } else {
+            return_code = VM_FAULT_OOM;
+        }
+    } else {
+        return_code = VM_FAULT_SIGBUS;
+    }
+
+    return return_code;
+}
+
+
+
+/*****************************************************************************/
+/* SHRINKER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static unsigned long sparse_count_objects(struct shrinker *shrinker,
+    struct shrink_control *shrink_control)
+{
+    unsigned long object_count = 0;
+    sparse_data_t *sparse = NULL;
+
+    spin_lock(&reclaim_devices_lock);
+    list_for_each_entry(sparse, &reclaim_devices, reclaim_node) {
+        object_count += atomic_long_read(&sparse->resident_page_count);
+    }
+    spin_unlock(&reclaim_devices_lock);
+
+    return object_count;
+}
+
+
+
+/* Devices busy with writes or resizes are skipped rather than waited
+   for, a writer may well be the one reclaiming memory. */
+static unsigned long sparse_scan_objects(struct shrinker *shrinker,
+    struct shrink_control *shrink_control)
+{
+    unsigned long scan_count = 0;
+    unsigned long freed_count = 0;
+    unsigned device_count = 0;
+    device_data_t *device_data = NULL;
+
+    if (!mutex_trylock(&reclaim_lock)) {
+        return SHRINK_STOP;
+    }
+
+    device_count = READ_ONCE(reclaim_device_count);
+    for (; (device_count > 0) &&
+        (scan_count < shrink_control->nr_to_scan); --device_count) {
+        device_data = reclaim_next_device();
+        if (device_data == NULL) {
+            break;
+        }
+
+        if (down_write_trylock(&device_data->sparse.lock)) {
+            scan_count += reclaim_device(device_data,
+                shrink_control->nr_to_scan - scan_count, &freed_count);
+            up_write(&device_data->sparse.lock);
+        }
+
+        put_device(&device_data->device);
+    }
+
+    mutex_unlock(&reclaim_lock);
+
+    return (scan_count > 0) ? freed_count : SHRINK_STOP;
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+/* Readers share the lock, writers and resizes take it exclusively. With
+   nowait set the caller may not sleep waiting for it (IOCB_NOWAIT). */
+static int sparse_lock(device_data_t *device_data, bool write, bool nowait)
+{
+    int return_code = 0;
+    struct rw_semaphore *lock = &device_data->sparse.lock;
+
+    if (nowait) {
+        if (!(write ? down_write_trylock(lock) : down_read_trylock(lock))) {
+            return_code = -EAGAIN;
+        }
+    } else if (write) {
+        return_code = down_write_killable(lock);
+    } else {
+        return_code = down_read_killable(lock);
+    }
+
+    return return_code;
+}
+
+
+
+/* Look the page up, allocate it if it does not exist yet and decompress it
+   if it was compressed. The caller gets a reference to the page. Faults do
+   this without the sparse lock, so a slot only ever changes from what was
+   seen in it, and the page the shrinker is taking away (its reference count
+   frozen at zero) is waited for to become compressed. */
+static struct page *sparse_get_page(device_data_t *device_data,
+    unsigned long page_index, gfp_t gfp)
+{
+    struct xarray *pages = &device_data->sparse.pages;
+    struct page *page = NULL;
+    struct page *new_page = NULL;
+    void *entry = NULL;
+    void *old_entry = NULL;
+    int return_code = 0;
+
+    while ((page == NULL) && (return_code == 0)) {
+        rcu_read_lock();
+        entry = xa_load(pages, page_index);
+
+        if ((entry != NULL) && !sparse_is_compressed(entry)) {
+            if (get_page_unless_zero(entry)) {
+                if (xa_load(pages, page_index) == entry) {
+                    page = entry;
+                } else {
+                    put_page(entry);
+                }
+            }
+            rcu_read_unlock();
+        } else if (new_page == NULL) {
+            rcu_read_unlock();
+            new_page = alloc_page(gfp | __GFP_ZERO);
+            if (new_page == NULL) {
+                return_code = -ENOMEM;
+            }
+        } else {
+            if (entry != NULL) {
+                return_code = sparse_decompress(entry,
+                    page_address(new_page));
+            }
+            rcu_read_unlock();
+
+            if (return_code == 0) {
+                old_entry = xa_cmpxchg(pages, page_index, entry, new_page,
+                    gfp);
+                if (old_entry == entry) {
+                    atomic_long_inc(&device_data->sparse.resident_page_count);
+                    if (entry != NULL) {
+                        sparse_free_compressed(device_data, entry);
+                    }
+
+                    get_page(new_page);
+                    page = new_page;
+                    new_page = NULL;
+                } else if (xa_is_err(old_entry)) {
+                    return_code = xa_err(old_entry);
+                } else {
+                    /* Lost a race, the page may hold stale data now. */
+                    __free_page(new_page);
+                    new_page = NULL;
+                }
+            }
+        }
+    }
+
+    if (new_page != NULL) {
+        __free_page(new_page);
+    }
+
+    if (page != NULL) {
+        sparse_touch_page(page);
+    }
+
+    return page;
+}
+
+
+
+/* Give the slot a page of its own before it is written to. A page the
+   slot is the only user of just leaves the dedup table, any other one is
+   copied. Mappings of the device may still show the shared page, they are
+   zapped so the copy gets faulted in. The reference to the given page is
+   traded for one to the page to write to. */
+static struct page *sparse_unshare_page(device_data_t *device_data,
+    unsigned long page_index, struct page *page,
+    struct address_space *mapping, gfp_t gfp)
+{
+    struct page *new_page = NULL;
+    void *old_entry = NULL;
+
+    while ((page != NULL) && (page_private(page) != 0) &&
+        !pseudo_char_device_dedup_try_remove(device_data, page)) {
+        new_page = alloc_page(gfp);
+        if (new_page == NULL) {
+            put_page(page);
+            page = NULL;
+            break;
+        }
+        copy_highpage(new_page, page);
+
+        old_entry = xa_cmpxchg(&device_data->sparse.pages, page_index, page,
+            new_page, gfp);
+        if (old_entry == page) {
+            /* Drop the references of the slot and of the caller. */
+            pseudo_char_device_dedup_put(device_data, page);
+            put_page(page);
+            put_page(page);
+
+            if (mapping != NULL) {
+                unmap_mapping_range(mapping,
+                    (loff_t)page_index << PAGE_SHIFT, PAGE_SIZE, 0);
+            }
+
+            get_page(new_page);
+            page = new_page;
+        } else {
+            /* A concurrent fault has unshared it already. */
+            __free_page(new_page);
+            put_page(page);
+            page = xa_is_err(old_entry) ? NULL :
+                sparse_get_page(device_data, page_index, gfp);
+        }
+    }
+
+    return page;
+}
+
+
+
+/* Pages not touched since the previous scan of the shrinker are cold. */
+static void sparse_touch_page(struct page *page)
+{
+    if (!PageReferenced(page)) {
+        SetPageReferenced(page);
+    }
+}
+
+
+
+static bool sparse_is_compressed(const void *entry)
+{
+    return xa_pointer_tag((void *)entry) == SPARSE_COMPRESSED_TAG;
+}
+
+
+
+static int sparse_decompress(const void *entry, void *destination)
+{
+    int return_code = 0;
+    const sparse_compressed_page_t *compressed =
+        xa_untag_pointer((void *)entry);
+
+    if (LZ4_decompress_safe(compressed->data, destination, compressed->size,
+        PAGE_SIZE) != PAGE_SIZE) {
+        pr_err("Corrupted compressed page!\n");
+        return_code = -EIO;
+    }
+
+    return return_code;
+}
+
+
+
+static void sparse_free_compressed(device_data_t *device_data, void *entry)
+{
+    sparse_compressed_page_t *compressed = xa_untag_pointer(entry);
+
+    atomic_long_sub(ksize(compressed),
+        &device_data->sparse.compressed_byte_count);
+    kfree_rcu(compressed, rcu_head);
+}
+
+
+
+/* Free the pages past the given size and clear what is left of the last
+   one, so the bytes come back as zeros if the device grows again. */
+static void sparse_truncate(device_data_t *device_data, size_t size)
+{
+    struct xarray *pages = &device_data->sparse.pages;
+    unsigned long page_index = PAGE_ALIGN(size) >> PAGE_SHIFT;
+    void *entry = NULL;
+
+    xa_for_each_start(pages, page_index, entry, page_index) {
+        xa_erase(pages, page_index);
+        if (sparse_is_compressed(entry)) {
+            sparse_free_compressed(device_data, entry);
+        } else {
+            if (page_private(entry) != 0) {
+                pseudo_char_device_dedup_put(device_data, entry);
+            }
+            atomic_long_dec(&device_data->sparse.resident_page_count);
+            put_page(entry);
+        }
+    }
+
+    if (offset_in_page(size) != 0) {
+        entry = xa_load(pages, size >> PAGE_SHIFT);
+        if (entry != NULL) {
+            zero_user_segment(entry, offset_in_page(size), PAGE_SIZE);
+        }
+    }
+}
+
+
+
+static loff_t sparse_next_data(device_data_t *device_data,
+    loff_t file_position, loff_t buffer_size)
+{
+    loff_t return_code = -ENXIO;
+    unsigned long page_index = file_position >> PAGE_SHIFT;
+
+    if (xa_find(&device_data->sparse.pages, &page_index,
+        (buffer_size - 1) >> PAGE_SHIFT, XA_PRESENT) != NULL) {
+        return_code = max_t(loff_t, file_position,
+            (loff_t)page_index << PAGE_SHIFT);
+    }
+
+    return return_code;
+}
+
+
+
+static loff_t sparse_next_hole(device_data_t *device_data,
+    loff_t file_position, loff_t buffer_size)
+{
+    unsigned long page_index = 0;
+    unsigned long hole_index = file_position >> PAGE_SHIFT;
+    void *entry = NULL;
+
+    /* Walk the run of written pages starting at the position. */
+    xa_for_each_start(&device_data->sparse.pages, page_index, entry,
+        hole_index) {
+        if (page_index != hole_index) {
+            break;
+        }
+        ++hole_index;
+    }
+
+    return min_t(loff_t, buffer_size,
+        max_t(loff_t, file_position, (loff_t)hole_index << PAGE_SHIFT));
+}
+
+
+
+/* Take the first device of the list and move it to the end. A device
+   being released is already on its way out of the list, it is skipped. */
+static device_data_t *reclaim_next_device(void)
+{
+    device_data_t *device_data = NULL;
+    sparse_data_t *sparse = NULL;
+
+    spin_lock(&reclaim_devices_lock);
+    list_for_each_entry(sparse, &reclaim_devices, reclaim_node) {
+        device_data = container_of(sparse, device_data_t, sparse);
+        if (kobject_get_unless_zero(&device_data->device.kobj) != NULL) {
+            list_move_tail(&sparse->reclaim_node, &reclaim_devices);
+            break;
+        }
+        device_data = NULL;
+    }
+    spin_unlock(&reclaim_devices_lock);
+
+    return device_data;
+}
+
+
+
+/* Scan up to the given number of pages, continuing where the previous scan
+   of the device stopped. Returns the number of pages scanned. */
+static unsigned long reclaim_device(device_data_t *device_data,
+    unsigned long scan_count, unsigned long *freed_count)
+{
+    unsigned long scanned_count = 0;
+    unsigned long page_index = 0;
+    sparse_data_t *sparse = &device_data->sparse;
+    void *entry = NULL;
+
+    xa_for_each_start(&sparse->pages, page_index, entry,
+        sparse->reclaim_index) {
+        if (scanned_count == scan_count) {
+            break;
+        }
+        ++scanned_count;
+
+        if (!sparse_is_compressed(entry) &&
+            reclaim_page(device_data, page_index, entry)) {
+            ++(*freed_count);
+        }
+    }
+
+    sparse->reclaim_index = (entry != NULL) ? page_index : 0;
+
+    return scanned_count;
+}
+
+
+
+/* Called with the sparse lock held exclusively, so only faults race with
+   it. A page mapped, used since the previous scan or shared through the
+   dedup table is kept, a page of zeros becomes a hole and any other one is
+   compressed. */
+static bool reclaim_page(device_data_t *device_data,
+    unsigned long page_index, struct page *page)
+{
+    bool reclaimed = false;
+    int compressed_size = 0;
+    size_t freed_byte_count = PAGE_SIZE;
+    sparse_compressed_page_t *compressed = NULL;
+    void *replacement = NULL;
+    const char *data = page_address(page);
+
+    if ((page_count(page) != 1) || (page_private(page) != 0) ||
+        TestClearPageReferenced(page)) {
+        return false;
+    }
+
+    if (memchr_inv(data, 0, PAGE_SIZE) != NULL) {
+        compressed_size = LZ4_compress_default(data, reclaim_buffer,
+            PAGE_SIZE, LZ4_COMPRESSBOUND(PAGE_SIZE), reclaim_work_memory);
+        if ((compressed_size <= 0) ||
+            (compressed_size > SPARSE_COMPRESSED_SIZE_MAX)) {
+            return false;
+        }
+
+        /* Reclaim runs on behalf of whoever needs memory, so compressed
+           pages are not charged to any memory cgroup. */
+        compressed = kmalloc(struct_size(compressed, data, compressed_size),
+            GFP_NOWAIT | __GFP_NOWARN);
+        if (compressed == NULL) {
+            return false;
+        }
+
+        compressed->size = compressed_size;
+        memcpy(compressed->data, reclaim_buffer, compressed_size);
+        replacement = xa_tag_pointer(compressed, SPARSE_COMPRESSED_TAG);
+        freed_byte_count -= ksize(compressed);
+    }
+
+    /* Fails if a fault has just taken a reference to the page. */
+    if (page_ref_freeze(page, 1)) {
+        xa_store(&device_data->sparse.pages, page_index, replacement,
+            GFP_NOWAIT);
+        page_ref_unfreeze(page, 1);
+        put_page(page);
+
+        atomic_long_dec(&device_data->sparse.resident_page_count);
+        if (compressed != NULL) {
+            atomic_long_add(ksize(compressed),
+                &device_data->sparse.compressed_byte_count);
+        }
+        atomic_long_add(freed_byte_count,
+            &device_data->sparse.reclaimed_byte_count);
+        reclaimed = true;
+    } else {
+        kfree(compressed);
+    }
+
+    return reclaimed;
+}
+
+
+
+/* Look the pages written since the previous run up in the dedup table,
+   and come back for more if there are. */
+static void dedup_work_function(struct work_struct *work)
+{
+    sparse_data_t *sparse = container_of(to_delayed_work(work),
+        sparse_data_t, dedup_work);
+    device_data_t *device_data = container_of(sparse, device_data_t, sparse);
+    unsigned long scanned_count = 0;
+    unsigned long page_index = 0;
+    void *entry = NULL;
+
+    down_write(&sparse->lock);
+
+    xa_for_each_marked(&sparse->pages, page_index, entry, SPARSE_DEDUP_MARK) {
+        if ((scanned_count == SPARSE_DEDUP_BATCH) || !sparse->dedup) {
+            break;
+        }
+        ++scanned_count;
+
+        xa_clear_mark(&sparse->pages, page_index, SPARSE_DEDUP_MARK);
+        if (!sparse_is_compressed(entry)) {
+            dedup_page(device_data, page_index, entry);
+        }
+    }
+
+    up_write(&sparse->lock);
+
+    if ((entry != NULL) && sparse->dedup) {
+        schedule_delayed_work(&sparse->dedup_work, 0);
+    }
+}
+
+
+
+/* Called with the sparse lock held exclusively, so only faults race with
+   it. The page either enters the dedup table or is replaced with the page
+   of the table holding the same data. Mapped pages are left alone. */
+static void dedup_page(device_data_t *device_data, unsigned long page_index,
+    struct page *page)
+{
+    struct page *shared_page = NULL;
+
+    if ((page_count(page) != 1) || (page_private(page) != 0)) {
+        return;
+    }
+
+    shared_page = pseudo_char_device_dedup_insert(device_data, page);
+    if ((shared_page == NULL) || (shared_page == page)) {
+        return;
+    }
+
+    /* Fails if a fault has just taken a reference to the page. */
+    if (page_ref_freeze(page, 1)) {
+        xa_store(&device_data->sparse.pages, page_index, shared_page,
+            GFP_NOWAIT);
+        page_ref_unfreeze(page, 1);
+        put_page(page);
+    } else {
+        pseudo_char_device_dedup_put(device_data, shared_page);
+        put_page(shared_page);
+    }
+}
@@ -0,0 +1,406 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <linux/bitops.h>
+#include <linux/device.h>
+#include <linux/kernel.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/stddef.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+#include <linux/u64_stats_sync.h>
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s: "fmt, __func__
+
+/* Read-only attribute showing the counter at the given member of
+   device_stats_t. */
+#define STATS_ATTR(_name, _member, _show)                                   \
+    struct dev_ext_attribute dev_attr_##_name = {                           \
+        __ATTR(_name, 0444, _show, NULL),                                   \
+        (void *)offsetof(device_stats_t, _member)                           \
+    }
+
+#define STATS_COUNTER_ATTR(_name, _member)                                  \
+    STATS_ATTR(_name, _member, stats_counter_show)
+
+#define STATS_HISTOGRAM_ATTR(_name, _member)                                \
+    STATS_ATTR(_name, _member, stats_histogram_show)
+
+
+
+/*****************************************************************************/
+/* DEVICE ATTRIBUTES FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static ssize_t stats_counter_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer);
+
+static ssize_t stats_histogram_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer);
+
+static ssize_t reset_store(struct device *device,
+    struct device_attribute *device_attribute, const char *input_buffer,
+    size_t char_count);
+
+static ssize_t qos_files_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer);
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static void stats_transfer(device_data_t *device_data, bool write,
+    size_t byte_count, ssize_t result, u64 latency);
+
+static u64 stats_sum(const device_data_t *device_data, size_t offset);
+
+static u64 stats_read(device_data_t *device_data, size_t offset);
+
+static u64_stats_t *stats_counter(const device_stats_t *stats,
+    size_t offset);
+
+
+
+/*****************************************************************************/
+/* PRIVATE VARIABLES */
+/*****************************************************************************/
+
+static STATS_COUNTER_ATTR(read_operations, read.operation_count);
+static STATS_COUNTER_ATTR(read_bytes, read.byte_count);
+static STATS_COUNTER_ATTR(read_short_transfers, read.short_transfer_count);
+static STATS_COUNTER_ATTR(read_fault_errors, read.fault_error_count);
+static STATS_COUNTER_ATTR(read_memory_errors, read.memory_error_count);
+static STATS_HISTOGRAM_ATTR(read_latency_histogram, read.latency_histogram);
+
+static STATS_COUNTER_ATTR(write_operations, write.operation_count);
+static STATS_COUNTER_ATTR(write_bytes, write.byte_count);
+static STATS_COUNTER_ATTR(write_short_transfers, write.short_transfer_count);
+static STATS_COUNTER_ATTR(write_fault_errors, write.fault_error_count);
+static STATS_COUNTER_ATTR(write_memory_errors, write.memory_error_count);
+static STATS_HISTOGRAM_ATTR(write_latency_histogram,
+    write.latency_histogram);
+
+static STATS_COUNTER_ATTR(open_operations, open_count);
+static STATS_COUNTER_ATTR(permission_errors, permission_error_count);
+static STATS_COUNTER_ATTR(write_throttles, throttle_count);
+static STATS_COUNTER_ATTR(write_throttle_time, throttle_time);
+
+static DEVICE_ATTR_WO(reset);
+static DEVICE_ATTR_RO(qos_files);
+
+static struct attribute *pseudo_char_device_stats_attributes[] = {
+    &dev_attr_read_operations.attr.attr,
+    &dev_attr_read_bytes.attr.attr,
+    &dev_attr_read_short_transfers.attr.attr,
+    &dev_attr_read_fault_errors.attr.attr,
+    &dev_attr_read_memory_errors.attr.attr,
+    &dev_attr_read_latency_histogram.attr.attr,
+    &dev_attr_write_operations.attr.attr,
+    &dev_attr_write_bytes.attr.attr,
+    &dev_attr_write_short_transfers.attr.attr,
+    &dev_attr_write_fault_errors.attr.attr,
+    &dev_attr_write_memory_errors.attr.attr,
+    &dev_attr_write_latency_histogram.attr.attr,
+    &dev_attr_open_operations.attr.attr,
+    &dev_attr_permission_errors.attr.attr,
+    &dev_attr_write_throttles.attr.attr,
+    &dev_attr_write_throttle_time.attr.attr,
+    &dev_attr_reset.attr,
+    &dev_attr_qos_files.attr,
+    NULL
+};
+
+
+
+/*****************************************************************************/
+/* PUBLIC VARIABLES */
+/*****************************************************************************/
+
+/* Shows up as the statistics/ directory of each device. */
+const struct attribute_group pseudo_char_device_stats_group = {
+    .name = "statistics",
+    .attrs = pseudo_char_device_stats_attributes
+};
+
+
+
+/*****************************************************************************/
+/* PUBLIC FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+int pseudo_char_device_stats_init(device_data_t *device_data)
+{
+    int return_code = 0;
+    unsigned cpu = 0;
+
+    mutex_init(&device_data->stats_lock);
+    memset(&device_data->stats_baseline, 0, sizeof(device_stats_t));
+
+    device_data->stats = alloc_percpu(device_stats_t);
+    if (device_data->stats != NULL) {
+        for_each_possible_cpu(cpu) {
+            u64_stats_init(&per_cpu_ptr(device_data->stats, cpu)->sync);
+        }
+    } else {
+        pr_err("Statistics allocation for device %s failed!\n",
+            device_data->serial_number);
+        return_code = -ENOMEM;
+    }
+
+    return return_code;
+}
+
+
+
+void pseudo_char_device_stats_exit(device_data_t *device_data)
+{
+    free_percpu(device_data->stats);
+    device_data->stats = NULL;
+}
+
+
+
+void pseudo_char_device_stats_open(device_data_t *device_data, int result)
+{
+    device_stats_t *stats = get_cpu_ptr(device_data->stats);
+
+    u64_stats_update_begin(&stats->sync);
+    u64_stats_inc(&stats->open_count);
+    if (result == -EPERM) {
+        u64_stats_inc(&stats->permission_error_count);
+    }
+    u64_stats_update_end(&stats->sync);
+
+    put_cpu_ptr(device_data->stats);
+}
+
+
+
+void pseudo_char_device_stats_read(device_data_t *device_data,
+    size_t byte_count, ssize_t result, u64 latency)
+{
+    stats_transfer(device_data, false, byte_count, result, latency);
+}
+
+
+
+void pseudo_char_device_stats_write(device_data_t *device_data,
+    size_t byte_count, ssize_t result, u64 latency)
+{
+    stats_transfer(device_data, true, byte_count, result, latency);
+}
+
+
+
+/* A write held back by the QoS of its file, for throttle_time
+   nanoseconds. */
+void pseudo_char_device_stats_throttle(device_data_t *device_data,
+    u64 throttle_time)
+{
+    device_stats_t *stats = get_cpu_ptr(device_data->stats);
+
+    u64_stats_update_begin(&stats->sync);
+    u64_stats_inc(&stats->throttle_count);
+    u64_stats_add(&stats->throttle_time, throttle_time);
+    u64_stats_update_end(&stats->sync);
+
+    put_cpu_ptr(device_data->stats);
+}
+
+
+
+/*****************************************************************************/
+/* DEVICE ATTRIBUTES FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static ssize_t stats_counter_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer)
+{
+    ssize_t return_code = 0;
+    device_data_t *device_data = dev_get_drvdata(device);
+    const size_t offset = (size_t)container_of(device_attribute,
+        struct dev_ext_attribute, attr)->var;
+
+    if (device_data != NULL) {
+        return_code = sprintf(output_buffer, "%llu\n",
+            stats_read(device_data, offset));
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+/* All buckets on a single line, from the fastest to the slowest one. */
+static ssize_t stats_histogram_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer)
+{
+    ssize_t return_code = 0;
+    unsigned bucket = 0;
+    size_t offset = (size_t)container_of(device_attribute,
+        struct dev_ext_attribute, attr)->var;
+    device_data_t *device_data = dev_get_drvdata(device);
+
+    if (device_data != NULL) {
+        for (; bucket < DEVICE_LATENCY_BUCKET_COUNT; ++bucket) {
+            return_code += scnprintf(&output_buffer[return_code],
+                PAGE_SIZE - return_code, "%llu%c",
+                stats_read(device_data, offset),
+                (bucket == (DEVICE_LATENCY_BUCKET_COUNT - 1)) ? '\n' : ' ');
+            offset += sizeof(u64_stats_t);
+        }
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+/* The per CPU counters are never written from outside of their CPU, so a
+   reset only records the current values as the new zero. */
+static ssize_t reset_store(struct device *device,
+    struct device_attribute *device_attribute, const char *input_buffer,
+    size_t char_count)
+{
+    ssize_t return_code = 0;
+    bool reset = false;
+    size_t offset = 0;
+    device_data_t *device_data = dev_get_drvdata(device);
+
+    if (device_data != NULL) {
+        return_code = kstrtobool(input_buffer, &reset);
+        if ((return_code == 0) && reset) {
+            mutex_lock(&device_data->stats_lock);
+            for (; offset < offsetof(device_stats_t, sync);
+                offset += sizeof(u64_stats_t)) {
+                    u64_stats_set(stats_counter(&device_data->stats_baseline,
+                        offset), stats_sum(device_data, offset));
+            }
+            mutex_unlock(&device_data->stats_lock);
+        }
+
+        if (return_code == 0) {
+            return_code = char_count;
+        }
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+/* Consumption of each file with QoS settings, not affected by a reset. */
+static ssize_t qos_files_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer)
+{
+    ssize_t return_code = 0;
+    device_data_t *device_data = dev_get_drvdata(device);
+
+    if (device_data != NULL) {
+        return_code = pseudo_char_device_qos_show(device_data,
+            output_buffer);
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static void stats_transfer(device_data_t *device_data, bool write,
+    size_t byte_count, ssize_t result, u64 latency)
+{
+    device_stats_t *stats = get_cpu_ptr(device_data->stats);
+    device_transfer_stats_t *transfer_stats = write ? &stats->write :
+        &stats->read;
+    const unsigned bucket = min_t(unsigned, fls64(latency),
+        DEVICE_LATENCY_BUCKET_COUNT - 1);
+
+    u64_stats_update_begin(&stats->sync);
+
+    u64_stats_inc(&transfer_stats->operation_count);
+    if (result >= 0) {
+        u64_stats_add(&transfer_stats->byte_count, result);
+        if (result < byte_count) {
+            u64_stats_inc(&transfer_stats->short_transfer_count);
+        }
+    } else if (result == -EFAULT) {
+        u64_stats_inc(&transfer_stats->fault_error_count);
+    } else if (result == -ENOMEM) {
+        u64_stats_inc(&transfer_stats->memory_error_count);
+    }
+    u64_stats_inc(&transfer_stats->latency_histogram[bucket]);
+
+    u64_stats_update_end(&stats->sync);
+
+    put_cpu_ptr(device_data->stats);
+}
+
+
+
+static u64 stats_sum(const device_data_t *device_data, size_t offset)
+{
+    u64 sum = 0;
+    u64 value = 0;
+    unsigned start = 0;
+    unsigned cpu = 0;
+    const device_stats_t *stats = NULL;
+
+    for_each_possible_cpu(cpu) {
+        stats = per_cpu_ptr(device_data->stats, cpu);
+        do {
+            start = u64_stats_fetch_begin(&stats->sync);
+            value = u64_stats_read(stats_counter(stats, offset));
+        } while (u64_stats_fetch_retry(&stats->sync, start));
+
+        sum += value;
+    }
+
+    return sum;
+}
+
+
+
+static u64 stats_read(device_data_t *device_data, size_t offset)
+{
+    u64 value = 0;
+
+    mutex_lock(&device_data->stats_lock);
+    value = stats_sum(device_data, offset) -
+        u64_stats_read(stats_counter(&device_data->stats_baseline, offset));
+    mutex_unlock(&device_data->stats_lock);
+
+    return value;
+}
+
+
+
+static u64_stats_t *stats_counter(const device_stats_t *stats,
+    size_t offset)
+{
+    return (u64_stats_t *)((char *)stats + offset);
+}
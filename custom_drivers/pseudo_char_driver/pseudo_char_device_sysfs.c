@@ -0,0 +1,355 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <linux/device.h>
+#include <linux/atomic.h>
+#include <linux/cpumask.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/sysfs.h>
+
+
+
+/*****************************************************************************/
+/* DEVICE ATTRIBUTES FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static ssize_t buffer_size_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer);
+
+static ssize_t buffer_size_store(struct device *device,
+    struct device_attribute *device_attribute, const char *input_buffer,
+    size_t char_count);
+
+static ssize_t serial_number_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer);
+
+static ssize_t reclaimable_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer);
+
+static ssize_t reclaimable_store(struct device *device,
+    struct device_attribute *device_attribute, const char *input_buffer,
+    size_t char_count);
+
+static ssize_t resident_bytes_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer);
+
+static ssize_t reclaimed_bytes_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer);
+
+static ssize_t dedup_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer);
+
+static ssize_t dedup_store(struct device *device,
+    struct device_attribute *device_attribute, const char *input_buffer,
+    size_t char_count);
+
+static ssize_t dedup_pages_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer);
+
+static ssize_t dedup_saved_pages_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer);
+
+
+
+/*****************************************************************************/
+/* PRIVATE VARIABLES */
+/*****************************************************************************/
+
+static DEVICE_ATTR_RW(buffer_size);
+static DEVICE_ATTR_RO(serial_number);
+static DEVICE_ATTR_RW(reclaimable);
+static DEVICE_ATTR_RO(resident_bytes);
+static DEVICE_ATTR_RO(reclaimed_bytes);
+static DEVICE_ATTR_RW(dedup);
+static DEVICE_ATTR_RO(dedup_pages);
+static DEVICE_ATTR_RO(dedup_saved_pages);
+
+static struct attribute *pseudo_char_device_attributes[] = {
+    &dev_attr_buffer_size.attr,
+    &dev_attr_serial_number.attr,
+    &dev_attr_reclaimable.attr,
+    &dev_attr_resident_bytes.attr,
+    &dev_attr_reclaimed_bytes.attr,
+    &dev_attr_dedup.attr,
+    &dev_attr_dedup_pages.attr,
+    &dev_attr_dedup_saved_pages.attr,
+    NULL
+};
+
+static const struct attribute_group pseudo_char_device_attributes_group = {
+    .attrs = pseudo_char_device_attributes
+};
+
+
+
+/*****************************************************************************/
+/* PUBLIC VARIABLES */
+/*****************************************************************************/
+
+const struct attribute_group *pseudo_char_device_attribute_groups[] = {
+    &pseudo_char_device_attributes_group,
+    &pseudo_char_device_stats_group,
+    &pseudo_char_device_compression_group,
+    &pseudo_char_device_checksum_group,
+    NULL
+};
+
+
+
+/*****************************************************************************/
+/* DEVICE ATTRIBUTES FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static ssize_t buffer_size_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer)
+{
+    ssize_t return_code = 0;
+    device_data_t *device_data = dev_get_drvdata(device);
+
+    if (device_data != NULL) {
+        return_code = sprintf(output_buffer, "%zu\n",
+            READ_ONCE(device_data->buffer_size));
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+static ssize_t buffer_size_store(struct device *device,
+    struct device_attribute *device_attribute, const char *input_buffer,
+    size_t char_count)
+{
+    ssize_t return_code = 0;
+    unsigned long long buffer_size = 0;
+    char *end = NULL;
+    device_data_t *device_data = dev_get_drvdata(device);
+
+    if (device_data != NULL) {
+        /* Accepts the usual K, M and G suffixes. */
+        buffer_size = memparse(input_buffer, &end);
+        if ((end == input_buffer) || ((*end != '\0') && (*end != '\n'))) {
+            return_code = -EINVAL;
+        } else if (buffer_size > SIZE_MAX) {
+            /* The mode checks the range, once the size fits in size_t. */
+            return_code = -EINVAL;
+        } else if (device_data->mode_operations->resize == NULL) {
+            return_code = -EOPNOTSUPP;
+        } else {
+            return_code = device_data->mode_operations->resize(device_data,
+                buffer_size);
+        }
+
+        if (return_code == 0) {
+            return_code = char_count;
+        }
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+static ssize_t serial_number_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer)
+{
+    ssize_t return_code = 0;
+    device_data_t *device_data = dev_get_drvdata(device);
+
+    if (device_data != NULL) {
+        return_code = sprintf(output_buffer, "%s\n",
+            device_data->serial_number);
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+static ssize_t reclaimable_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer)
+{
+    ssize_t return_code = 0;
+    device_data_t *device_data = dev_get_drvdata(device);
+
+    if (device_data != NULL) {
+        return_code = sprintf(output_buffer, "%d\n",
+            READ_ONCE(device_data->sparse.reclaimable));
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+/* Only sparse devices may opt in to have their memory reclaimed. */
+static ssize_t reclaimable_store(struct device *device,
+    struct device_attribute *device_attribute, const char *input_buffer,
+    size_t char_count)
+{
+    ssize_t return_code = 0;
+    bool reclaimable = false;
+    device_data_t *device_data = dev_get_drvdata(device);
+
+    if (device_data != NULL) {
+        return_code = kstrtobool(input_buffer, &reclaimable);
+        if (return_code == 0) {
+            return_code = pseudo_char_device_sparse_set_reclaimable(
+                device_data, reclaimable);
+        }
+
+        if (return_code == 0) {
+            return_code = char_count;
+        }
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+/* Memory holding the data of the device. Sparse, compressed and key-value
+   devices may use less than their buffer size, the sharded ones use it once
+   per CPU. */
+static ssize_t resident_bytes_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer)
+{
+    ssize_t return_code = 0;
+    u64 resident_byte_count = 0;
+    device_data_t *device_data = dev_get_drvdata(device);
+
+    if (device_data != NULL) {
+        if (device_data->mode_operations == &sparse_mode_operations) {
+            resident_byte_count =
+                pseudo_char_device_sparse_resident_bytes(device_data);
+        } else if (device_data->mode_operations ==
+            &compressed_mode_operations) {
+            resident_byte_count =
+                pseudo_char_device_compressed_resident_bytes(device_data);
+        } else if (device_data->mode_operations == &sharded_mode_operations) {
+            resident_byte_count = (u64)device_data->buffer_size *
+                num_possible_cpus();
+        } else if (device_data->mode_operations == &kv_mode_operations) {
+            resident_byte_count =
+                pseudo_char_device_kv_resident_bytes(device_data);
+        } else {
+            resident_byte_count =
+                PAGE_ALIGN(READ_ONCE(device_data->buffer_size));
+        }
+
+        return_code = sprintf(output_buffer, "%llu\n", resident_byte_count);
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+/* Bytes of memory given back by the shrinker since the device was
+   created. */
+static ssize_t reclaimed_bytes_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer)
+{
+    ssize_t return_code = 0;
+    device_data_t *device_data = dev_get_drvdata(device);
+
+    if (device_data != NULL) {
+        return_code = sprintf(output_buffer, "%ld\n",
+            atomic_long_read(&device_data->sparse.reclaimed_byte_count));
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+static ssize_t dedup_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer)
+{
+    ssize_t return_code = 0;
+    device_data_t *device_data = dev_get_drvdata(device);
+
+    if (device_data != NULL) {
+        return_code = sprintf(output_buffer, "%d\n",
+            READ_ONCE(device_data->sparse.dedup));
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+/* Only sparse devices may opt in to share their pages. */
+static ssize_t dedup_store(struct device *device,
+    struct device_attribute *device_attribute, const char *input_buffer,
+    size_t char_count)
+{
+    ssize_t return_code = 0;
+    bool dedup = false;
+    device_data_t *device_data = dev_get_drvdata(device);
+
+    if (device_data != NULL) {
+        return_code = kstrtobool(input_buffer, &dedup);
+        if (return_code == 0) {
+            return_code = pseudo_char_device_sparse_set_dedup(device_data,
+                dedup);
+        }
+
+        if (return_code == 0) {
+            return_code = char_count;
+        }
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+/* Pages of the device in the dedup table, shared or ready to be. */
+static ssize_t dedup_pages_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer)
+{
+    ssize_t return_code = 0;
+    device_data_t *device_data = dev_get_drvdata(device);
+
+    if (device_data != NULL) {
+        return_code = sprintf(output_buffer, "%ld\n",
+            atomic_long_read(&device_data->sparse.dedup_page_count));
+    } else {
+        return_code = -ENOENT;
+    }
+
+    return return_code;
+}
+
+
+
+/* Pages saved by sharing, across all devices. */
+static ssize_t dedup_saved_pages_show(struct device *device,
+    struct device_attribute *device_attribute, char *output_buffer)
+{
+    return sprintf(output_buffer, "%lu\n",
+        pseudo_char_device_dedup_saved_pages());
+}
@@ -0,0 +1,547 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+#include "../pseudo_platform_driver/pseudo_platform_device.h"
+
+#include <kunit/test.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/string.h>
+#include <linux/timex.h>
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#define TEST_DEVICE_COUNT_MAX   4
+#define TEST_FILE_COUNT_MAX     8
+
+#define TEST_PATH_SIZE          64
+#define TEST_BLOCK_SIZE         64
+
+/* Operations timed for every buffer size, enough for the cost of the
+   first ones, which fault the buffers in, to disappear. */
+#define TEST_ITERATION_COUNT    1000
+
+#define CHAR_DEVICE_PATH        "/dev/pseudo_char_device_%u"
+#define PLATFORM_DEVICE_PATH    "/dev/pseudo_platform_device_%u"
+
+
+
+/*****************************************************************************/
+/* PRIVATE STRUCTURES */
+/*****************************************************************************/
+
+/* Devices and files a test leaves behind, released by the suite exit even
+   when an assertion ends the test early. */
+typedef struct test_context {
+    char serial_numbers[TEST_DEVICE_COUNT_MAX][PCD_SERIAL_NUMBER_SIZE];
+    unsigned device_count;
+    struct file *files[TEST_FILE_COUNT_MAX];
+    unsigned file_count;
+}test_context_t;
+
+
+
+/*****************************************************************************/
+/* TEST FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static void test_check_permission(struct kunit *test);
+
+static void test_llseek(struct kunit *test);
+
+static void test_read_write(struct kunit *test);
+
+static void test_end_of_buffer(struct kunit *test);
+
+static void test_cycles_per_operation(struct kunit *test);
+
+static void test_broadcast_overrun(struct kunit *test);
+
+static void test_platform_file_operations(struct kunit *test);
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int test_init(struct kunit *test);
+
+static void test_exit(struct kunit *test);
+
+static unsigned create_test_device(struct kunit *test, const char *mode_name,
+    permission_type_t permission_type, size_t buffer_size);
+
+static struct file *open_test_file(struct kunit *test, const char *format,
+    unsigned id, int flags);
+
+
+
+/*****************************************************************************/
+/* PRIVATE VARIABLES */
+/*****************************************************************************/
+
+static const size_t test_buffer_sizes[] = { 64, 512, 4096, 65536 };
+
+static struct kunit_case char_device_test_cases[] = {
+    KUNIT_CASE(test_check_permission),
+    KUNIT_CASE(test_llseek),
+    KUNIT_CASE(test_read_write),
+    KUNIT_CASE(test_end_of_buffer),
+    KUNIT_CASE(test_cycles_per_operation),
+    KUNIT_CASE(test_broadcast_overrun),
+    {}
+};
+
+static struct kunit_suite char_device_test_suite = {
+    .name = "pseudo_char_device",
+    .init = test_init,
+    .exit = test_exit,
+    .test_cases = char_device_test_cases
+};
+
+static struct kunit_case platform_device_test_cases[] = {
+    KUNIT_CASE(test_platform_file_operations),
+    {}
+};
+
+static struct kunit_suite platform_device_test_suite = {
+    .name = "pseudo_platform_device",
+    .init = test_init,
+    .exit = test_exit,
+    .test_cases = platform_device_test_cases
+};
+
+
+
+/*****************************************************************************/
+/* TEST FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+/* Devices limited to one direction refuse files open for the other one,
+   including files open for both. */
+static void test_check_permission(struct kunit *test)
+{
+    const unsigned read_id = create_test_device(test, NULL,
+        PERMISSION_TYPE_READ, DEVICE_BUFFER_SIZE);
+    const unsigned write_id = create_test_device(test, NULL,
+        PERMISSION_TYPE_WRITE, DEVICE_BUFFER_SIZE);
+    const unsigned read_write_id = create_test_device(test, NULL,
+        PERMISSION_TYPE_READ_WRITE, DEVICE_BUFFER_SIZE);
+
+    KUNIT_EXPECT_EQ(test, PTR_ERR_OR_ZERO(open_test_file(test,
+        CHAR_DEVICE_PATH, read_id, O_RDONLY)), 0);
+    KUNIT_EXPECT_EQ(test, PTR_ERR_OR_ZERO(open_test_file(test,
+        CHAR_DEVICE_PATH, read_id, O_WRONLY)), -EPERM);
+    KUNIT_EXPECT_EQ(test, PTR_ERR_OR_ZERO(open_test_file(test,
+        CHAR_DEVICE_PATH, read_id, O_RDWR)), -EPERM);
+
+    KUNIT_EXPECT_EQ(test, PTR_ERR_OR_ZERO(open_test_file(test,
+        CHAR_DEVICE_PATH, write_id, O_RDONLY)), -EPERM);
+    KUNIT_EXPECT_EQ(test, PTR_ERR_OR_ZERO(open_test_file(test,
+        CHAR_DEVICE_PATH, write_id, O_WRONLY)), 0);
+    KUNIT_EXPECT_EQ(test, PTR_ERR_OR_ZERO(open_test_file(test,
+        CHAR_DEVICE_PATH, write_id, O_RDWR)), -EPERM);
+
+    KUNIT_EXPECT_EQ(test, PTR_ERR_OR_ZERO(open_test_file(test,
+        CHAR_DEVICE_PATH, read_write_id, O_RDONLY)), 0);
+    KUNIT_EXPECT_EQ(test, PTR_ERR_OR_ZERO(open_test_file(test,
+        CHAR_DEVICE_PATH, read_write_id, O_WRONLY)), 0);
+    KUNIT_EXPECT_EQ(test, PTR_ERR_OR_ZERO(open_test_file(test,
+        CHAR_DEVICE_PATH, read_write_id, O_RDWR)), 0);
+}
+
+
+
+/* Positions are only valid inside the buffer, so SEEK_END needs a negative
+   offset. A refused seek leaves the position where it was. */
+static void test_llseek(struct kunit *test)
+{
+    const loff_t size = DEVICE_BUFFER_SIZE;
+    const unsigned id = create_test_device(test, NULL,
+        PERMISSION_TYPE_READ_WRITE, size);
+    struct file *file = open_test_file(test, CHAR_DEVICE_PATH, id, O_RDWR);
+
+    KUNIT_ASSERT_FALSE(test, IS_ERR(file));
+
+    KUNIT_EXPECT_EQ(test, vfs_llseek(file, size - 1, SEEK_SET), size - 1);
+    KUNIT_EXPECT_EQ(test, vfs_llseek(file, size, SEEK_SET), (loff_t)-EINVAL);
+    KUNIT_EXPECT_EQ(test, vfs_llseek(file, -1, SEEK_SET), (loff_t)-EINVAL);
+    KUNIT_EXPECT_EQ(test, file->f_pos, size - 1);
+
+    KUNIT_EXPECT_EQ(test, vfs_llseek(file, -1, SEEK_CUR), size - 2);
+    KUNIT_EXPECT_EQ(test, vfs_llseek(file, 2, SEEK_CUR), (loff_t)-EINVAL);
+    KUNIT_EXPECT_EQ(test, vfs_llseek(file, -size, SEEK_CUR),
+        (loff_t)-EINVAL);
+    KUNIT_EXPECT_EQ(test, file->f_pos, size - 2);
+
+    KUNIT_EXPECT_EQ(test, vfs_llseek(file, -1, SEEK_END), size - 1);
+    KUNIT_EXPECT_EQ(test, vfs_llseek(file, -size, SEEK_END), (loff_t)0);
+    KUNIT_EXPECT_EQ(test, vfs_llseek(file, 0, SEEK_END), (loff_t)-EINVAL);
+    KUNIT_EXPECT_EQ(test, vfs_llseek(file, -size - 1, SEEK_END),
+        (loff_t)-EINVAL);
+    KUNIT_EXPECT_EQ(test, file->f_pos, (loff_t)0);
+
+    KUNIT_EXPECT_EQ(test, vfs_llseek(file, 0, SEEK_DATA), (loff_t)-EINVAL);
+}
+
+
+
+static void test_read_write(struct kunit *test)
+{
+    const size_t size = DEVICE_BUFFER_SIZE;
+    const unsigned id = create_test_device(test, NULL,
+        PERMISSION_TYPE_READ_WRITE, size);
+    struct file *file = open_test_file(test, CHAR_DEVICE_PATH, id, O_RDWR);
+    char *source = kunit_kzalloc(test, size, GFP_KERNEL);
+    char *destination = kunit_kzalloc(test, size, GFP_KERNEL);
+    loff_t position = 0;
+    size_t index = 0;
+
+    KUNIT_ASSERT_FALSE(test, IS_ERR(file));
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, source);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, destination);
+
+    for (; index < size; ++index) {
+        source[index] = index;
+    }
+
+    KUNIT_EXPECT_EQ(test, kernel_write(file, source, size, &position),
+        (ssize_t)size);
+    KUNIT_EXPECT_EQ(test, position, (loff_t)size);
+
+    position = 0;
+    KUNIT_EXPECT_EQ(test, kernel_read(file, destination, size, &position),
+        (ssize_t)size);
+    KUNIT_EXPECT_EQ(test, position, (loff_t)size);
+    KUNIT_EXPECT_EQ(test, memcmp(source, destination, size), 0);
+
+    /* Partial transfers in the middle of the buffer. */
+    position = TEST_BLOCK_SIZE;
+    KUNIT_EXPECT_EQ(test, kernel_read(file, destination, TEST_BLOCK_SIZE,
+        &position), (ssize_t)TEST_BLOCK_SIZE);
+    KUNIT_EXPECT_EQ(test, memcmp(&source[TEST_BLOCK_SIZE], destination,
+        TEST_BLOCK_SIZE), 0);
+}
+
+
+
+/* Transfers crossing the end of the buffer are cut short, the ones starting
+   at it read nothing and find no room to write. */
+static void test_end_of_buffer(struct kunit *test)
+{
+    const size_t size = DEVICE_BUFFER_SIZE;
+    const size_t tail_size = TEST_BLOCK_SIZE / 4;
+    const unsigned id = create_test_device(test, NULL,
+        PERMISSION_TYPE_READ_WRITE, size);
+    struct file *file = open_test_file(test, CHAR_DEVICE_PATH, id, O_RDWR);
+    char *source = kunit_kzalloc(test, TEST_BLOCK_SIZE, GFP_KERNEL);
+    char *destination = kunit_kzalloc(test, TEST_BLOCK_SIZE, GFP_KERNEL);
+    loff_t position = 0;
+
+    KUNIT_ASSERT_FALSE(test, IS_ERR(file));
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, source);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, destination);
+
+    memset(source, 'x', TEST_BLOCK_SIZE);
+
+    position = size - tail_size;
+    KUNIT_EXPECT_EQ(test, kernel_write(file, source, TEST_BLOCK_SIZE,
+        &position), (ssize_t)tail_size);
+    KUNIT_EXPECT_EQ(test, position, (loff_t)size);
+    KUNIT_EXPECT_EQ(test, kernel_write(file, source, TEST_BLOCK_SIZE,
+        &position), (ssize_t)-ENOMEM);
+    KUNIT_EXPECT_EQ(test, position, (loff_t)size);
+
+    position = size - tail_size;
+    KUNIT_EXPECT_EQ(test, kernel_read(file, destination, TEST_BLOCK_SIZE,
+        &position), (ssize_t)tail_size);
+    KUNIT_EXPECT_EQ(test, position, (loff_t)size);
+    KUNIT_EXPECT_EQ(test, memcmp(source, destination, tail_size), 0);
+    KUNIT_EXPECT_EQ(test, kernel_read(file, destination, TEST_BLOCK_SIZE,
+        &position), (ssize_t)0);
+
+    position = size + TEST_BLOCK_SIZE;
+    KUNIT_EXPECT_EQ(test, kernel_read(file, destination, TEST_BLOCK_SIZE,
+        &position), (ssize_t)0);
+}
+
+
+
+/* Cycles of whole buffer reads and writes and of seeks, measured without
+   the syscall entry and exit a userspace benchmark pays for. Architectures
+   without a cycle counter report 0. */
+static void test_cycles_per_operation(struct kunit *test)
+{
+    unsigned size_index = 0;
+    unsigned index = 0;
+    size_t size = 0;
+    unsigned id = 0;
+    struct file *file = NULL;
+    char *block = NULL;
+    loff_t position = 0;
+    ssize_t byte_count = 0;
+    loff_t new_position = 0;
+    cycles_t start = 0;
+    u64 read_cycles = 0;
+    u64 write_cycles = 0;
+    u64 llseek_cycles = 0;
+
+    for (; size_index < ARRAY_SIZE(test_buffer_sizes); ++size_index) {
+        size = test_buffer_sizes[size_index];
+        id = create_test_device(test, NULL, PERMISSION_TYPE_READ_WRITE,
+            size);
+        file = open_test_file(test, CHAR_DEVICE_PATH, id, O_RDWR);
+        block = kunit_kzalloc(test, size, GFP_KERNEL);
+
+        KUNIT_ASSERT_FALSE(test, IS_ERR(file));
+        KUNIT_ASSERT_NOT_ERR_OR_NULL(test, block);
+
+        start = get_cycles();
+        for (index = 0; index < TEST_ITERATION_COUNT; ++index) {
+            position = 0;
+            byte_count = kernel_write(file, block, size, &position);
+        }
+        write_cycles = get_cycles() - start;
+        KUNIT_EXPECT_EQ(test, byte_count, (ssize_t)size);
+
+        start = get_cycles();
+        for (index = 0; index < TEST_ITERATION_COUNT; ++index) {
+            position = 0;
+            byte_count = kernel_read(file, block, size, &position);
+        }
+        read_cycles = get_cycles() - start;
+        KUNIT_EXPECT_EQ(test, byte_count, (ssize_t)size);
+
+        start = get_cycles();
+        for (index = 0; index < TEST_ITERATION_COUNT; ++index) {
+            new_position = vfs_llseek(file, -1, SEEK_END);
+        }
+        llseek_cycles = get_cycles() - start;
+        KUNIT_EXPECT_EQ(test, new_position, (loff_t)size - 1);
+
+        kunit_info(test, "%zu byte buffer: %llu read, %llu write, %llu "
+            "llseek cycles per operation\n", size,
+            div_u64(read_cycles, TEST_ITERATION_COUNT),
+            div_u64(write_cycles, TEST_ITERATION_COUNT),
+            div_u64(llseek_cycles, TEST_ITERATION_COUNT));
+    }
+}
+
+
+
+/* A reader lapped by the writers reads on from the oldest byte still in
+   the ring. The read goes through the file position the way read() does,
+   which only stores the position back on success, so the cursor has to
+   move and the overrun has to be counted once, not on every read. */
+static void test_broadcast_overrun(struct kunit *test)
+{
+    const size_t size = DEVICE_BUFFER_SIZE;
+    const size_t chunk_size = size / 2;
+    const unsigned id = create_test_device(test, "broadcast",
+        PERMISSION_TYPE_READ_WRITE, size);
+    struct file *file = open_test_file(test, CHAR_DEVICE_PATH, id, O_RDWR);
+    char *source = kunit_kzalloc(test, 3 * size, GFP_KERNEL);
+    char *destination = kunit_kzalloc(test, chunk_size, GFP_KERNEL);
+    device_data_t *device_data = NULL;
+    loff_t write_position = 0;
+    size_t index = 0;
+
+    KUNIT_ASSERT_FALSE(test, IS_ERR(file));
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, source);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, destination);
+    device_data = (device_data_t *)file->private_data;
+
+    for (; index < (3 * size); ++index) {
+        source[index] = index / chunk_size;
+    }
+
+    /* Three rings worth, the cursor at 0 ends up two rings behind. */
+    for (index = 0; index < (3 * size); index += chunk_size) {
+        KUNIT_ASSERT_EQ(test, kernel_write(file, &source[index], chunk_size,
+            &write_position), (ssize_t)chunk_size);
+    }
+
+    KUNIT_EXPECT_EQ(test, kernel_read(file, destination, chunk_size,
+        &file->f_pos), (ssize_t)chunk_size);
+    KUNIT_EXPECT_EQ(test, file->f_pos, (loff_t)(2 * size + chunk_size));
+    KUNIT_EXPECT_EQ(test, memcmp(&source[2 * size], destination,
+        chunk_size), 0);
+
+    KUNIT_EXPECT_EQ(test, kernel_read(file, destination, chunk_size,
+        &file->f_pos), (ssize_t)chunk_size);
+    KUNIT_EXPECT_EQ(test, file->f_pos, (loff_t)(3 * size));
+    KUNIT_EXPECT_EQ(test, memcmp(&source[2 * size + chunk_size],
+        destination, chunk_size), 0);
+
+    KUNIT_EXPECT_EQ(test, file->f_version, (u64)(2 * size));
+    KUNIT_EXPECT_EQ(test,
+        (u64)atomic64_read(&device_data->broadcast.overrun_count), (u64)1);
+    KUNIT_EXPECT_EQ(test,
+        (u64)atomic64_read(&device_data->broadcast.lost_byte_count),
+        (u64)(2 * size));
+}
+
+
+
+/* The platform devices do not move any data yet: every operation succeeds
+   without transferring a byte. Transfers are empty, so the file operations
+   can be reached without any user memory, and only the cost of getting to
+   them is measured. Devices of a platform driver not loaded are left
+   out. */
+static void test_platform_file_operations(struct kunit *test)
+{
+    unsigned device_index = 0;
+    unsigned index = 0;
+    struct file *file = NULL;
+    loff_t position = 0;
+    ssize_t byte_count = 0;
+    cycles_t start = 0;
+    u64 read_cycles = 0;
+    u64 write_cycles = 0;
+
+    for (; device_index < PSEUDO_PLATFORM_DEVICE_COUNT; ++device_index) {
+        file = open_test_file(test, PLATFORM_DEVICE_PATH, device_index,
+            O_RDWR);
+        if (PTR_ERR_OR_ZERO(file) == -ENOENT) {
+            kunit_info(test, "Platform device %u not present, left out\n",
+                device_index);
+            continue;
+        }
+
+        KUNIT_ASSERT_FALSE(test, IS_ERR(file));
+        KUNIT_ASSERT_TRUE(test, file->f_op->read != NULL);
+        KUNIT_ASSERT_TRUE(test, file->f_op->write != NULL);
+
+        KUNIT_EXPECT_EQ(test, vfs_llseek(file, 0, SEEK_SET), (loff_t)0);
+        KUNIT_EXPECT_EQ(test, file->f_op->read(file, NULL, 0, &position),
+            (ssize_t)0);
+        KUNIT_EXPECT_EQ(test, file->f_op->write(file, NULL, 0, &position),
+            (ssize_t)0);
+        KUNIT_EXPECT_EQ(test, position, (loff_t)0);
+
+        start = get_cycles();
+        for (index = 0; index < TEST_ITERATION_COUNT; ++index) {
+            byte_count = file->f_op->read(file, NULL, 0, &position);
+        }
+        read_cycles = get_cycles() - start;
+        KUNIT_EXPECT_EQ(test, byte_count, (ssize_t)0);
+
+        start = get_cycles();
+        for (index = 0; index < TEST_ITERATION_COUNT; ++index) {
+            byte_count = file->f_op->write(file, NULL, 0, &position);
+        }
+        write_cycles = get_cycles() - start;
+        KUNIT_EXPECT_EQ(test, byte_count, (ssize_t)0);
+
+        kunit_info(test, "Platform device %u: %llu read, %llu write cycles "
+            "per operation\n", device_index,
+            div_u64(read_cycles, TEST_ITERATION_COUNT),
+            div_u64(write_cycles, TEST_ITERATION_COUNT));
+    }
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+static int test_init(struct kunit *test)
+{
+    test->priv = kunit_kzalloc(test, sizeof(test_context_t), GFP_KERNEL);
+
+    return (test->priv != NULL) ? 0 : -ENOMEM;
+}
+
+
+
+/* Files go first, a device is only destroyed once nobody uses it. */
+static void test_exit(struct kunit *test)
+{
+    test_context_t *context = test->priv;
+    unsigned index = 0;
+
+    for (; index < context->file_count; ++index) {
+        filp_close(context->files[index], NULL);
+    }
+
+    for (index = 0; index < context->device_count; ++index) {
+        pseudo_char_device_destroy(context->serial_numbers[index]);
+    }
+}
+
+
+
+/* Device destroyed when the test ends, in random access mode for a NULL
+   mode name. Returns the id its node is named after. */
+static unsigned create_test_device(struct kunit *test, const char *mode_name,
+    permission_type_t permission_type, size_t buffer_size)
+{
+    test_context_t *context = test->priv;
+    char *serial_number = NULL;
+    device_config_t config = {
+        .mode_name = mode_name,
+        .buffer_size = buffer_size,
+        .permission_type = permission_type
+    };
+    unsigned id = 0;
+
+    KUNIT_ASSERT_LT(test, context->device_count,
+        (unsigned)TEST_DEVICE_COUNT_MAX);
+
+    serial_number = context->serial_numbers[context->device_count];
+    snprintf(serial_number, PCD_SERIAL_NUMBER_SIZE, "pcd_test_%u",
+        context->device_count);
+    config.serial_number = serial_number;
+
+    KUNIT_ASSERT_EQ(test, pseudo_char_device_create(&config, &id), 0);
+    ++context->device_count;
+
+    return id;
+}
+
+
+
+/* File of the node the format names after the id, closed when the test
+   ends. Returns an ERR_PTR if it cannot be opened. */
+static struct file *open_test_file(struct kunit *test, const char *format,
+    unsigned id, int flags)
+{
+    test_context_t *context = test->priv;
+    struct file *file = NULL;
+    char path[TEST_PATH_SIZE];
+
+    KUNIT_ASSERT_LT(test, context->file_count,
+        (unsigned)TEST_FILE_COUNT_MAX);
+
+    snprintf(path, sizeof(path), format, id);
+
+    file = filp_open(path, flags, 0);
+    if (!IS_ERR(file)) {
+        context->files[context->file_count++] = file;
+    }
+
+    return file;
+}
+
+
+
+/*****************************************************************************/
+/* MODULE REGISTRATION */
+/*****************************************************************************/
+
+kunit_test_suites(&char_device_test_suite, &platform_device_test_suite);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Jakub Standarski");
+MODULE_DESCRIPTION("KUnit tests of the pseudo char and platform devices.");
@@ -0,0 +1,152 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pseudo_char_device
+
+#if !defined(PSEUDO_CHAR_DEVICE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define PSEUDO_CHAR_DEVICE_TRACE_H
+
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include <linux/tracepoint.h>
+#include <linux/types.h>
+
+
+
+/*****************************************************************************/
+/* TRACE EVENTS */
+/*****************************************************************************/
+
+/* Events of the file operations, available under
+   /sys/kernel/tracing/events/pseudo_char_device/. A disabled event costs a
+   single patched-out branch, so the data path does not pay for them. */
+TRACE_EVENT(pcd_open,
+    TP_PROTO(unsigned int minor, fmode_t file_mode, int result),
+    TP_ARGS(minor, file_mode, result),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(bool, readable)
+        __field(bool, writable)
+        __field(int, result)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->readable = (file_mode & FMODE_READ) != 0;
+        __entry->writable = (file_mode & FMODE_WRITE) != 0;
+        __entry->result = result;
+    ),
+
+    TP_printk("minor=%u mode=%s%s result=%d", __entry->minor,
+        __entry->readable ? "r" : "", __entry->writable ? "w" : "",
+        __entry->result)
+);
+
+
+
+TRACE_EVENT(pcd_release,
+    TP_PROTO(unsigned int minor),
+    TP_ARGS(minor),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+    ),
+
+    TP_printk("minor=%u", __entry->minor)
+);
+
+
+
+TRACE_EVENT(pcd_llseek,
+    TP_PROTO(unsigned int minor, loff_t file_position, loff_t offset,
+        int whence, loff_t result),
+    TP_ARGS(minor, file_position, offset, whence, result),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, file_position)
+        __field(loff_t, offset)
+        __field(int, whence)
+        __field(loff_t, result)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->file_position = file_position;
+        __entry->offset = offset;
+        __entry->whence = whence;
+        __entry->result = result;
+    ),
+
+    TP_printk("minor=%u position=%lld offset=%lld whence=%s result=%lld",
+        __entry->minor, __entry->file_position, __entry->offset,
+        __print_symbolic(__entry->whence,
+            { SEEK_SET, "SEEK_SET" },
+            { SEEK_CUR, "SEEK_CUR" },
+            { SEEK_END, "SEEK_END" }),
+        __entry->result)
+);
+
+
+
+/* The result is the byte count actually transferred, or a negative error
+   code. */
+DECLARE_EVENT_CLASS(pcd_transfer,
+    TP_PROTO(unsigned int minor, loff_t file_position, size_t byte_count,
+        ssize_t result),
+    TP_ARGS(minor, file_position, byte_count, result),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, file_position)
+        __field(size_t, byte_count)
+        __field(ssize_t, result)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->file_position = file_position;
+        __entry->byte_count = byte_count;
+        __entry->result = result;
+    ),
+
+    TP_printk("minor=%u position=%lld requested=%zu result=%zd",
+        __entry->minor, __entry->file_position, __entry->byte_count,
+        __entry->result)
+);
+
+
+
+DEFINE_EVENT(pcd_transfer, pcd_read,
+    TP_PROTO(unsigned int minor, loff_t file_position, size_t byte_count,
+        ssize_t result),
+    TP_ARGS(minor, file_position, byte_count, result)
+);
+
+
+
+DEFINE_EVENT(pcd_transfer, pcd_write,
+    TP_PROTO(unsigned int minor, loff_t file_position, size_t byte_count,
+        ssize_t result),
+    TP_ARGS(minor, file_position, byte_count, result)
+);
+
+#endif /* PSEUDO_CHAR_DEVICE_TRACE_H */
+
+
+
+/*****************************************************************************/
+/* TRACE DEFINITIONS */
+/*****************************************************************************/
+
+/* The header lives next to the sources instead of include/trace/events/. */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pseudo_char_device_trace
+#include <trace/define_trace.h>
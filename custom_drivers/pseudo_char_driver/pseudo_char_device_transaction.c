@@ -0,0 +1,574 @@
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include "pseudo_char_device.h"
+
+#include <linux/fs.h>
+#include <linux/kcsan-checks.h>
+#include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/xarray.h>
+
+
+
+/*****************************************************************************/
+/* PRIVATE MACROS */
+/*****************************************************************************/
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s: "fmt, __func__
+
+/* Optimistic copies of the buffer made before taking the device lock. */
+#define COPY_ATTEMPT_COUNT  3
+
+
+
+/*****************************************************************************/
+/* PRIVATE DATA TYPES */
+/*****************************************************************************/
+
+/* Byte range [offset, end) written by a transaction. */
+typedef struct transaction_range {
+    u64 offset;
+    u64 end;
+}transaction_range_t;
+
+
+
+/* Shadow copy of the buffer the file stages its writes into, up to date
+   with the buffer as of the given sequence. The ranges written so far are
+   kept sorted and disjoint, so everything else can be copied again from a
+   newer buffer. A transaction out of the xarray is only used by the task
+   which took it out, and by staging writes which got hold of it before;
+   the lock keeps them apart. */
+typedef struct transaction {
+    struct kref kref;
+    struct mutex lock;
+    struct file *owner;
+    device_buffer_t *shadow;
+    unsigned int sequence;
+    bool ended;
+    bool failed;
+    u32 range_count;
+    transaction_range_t ranges[DEVICE_TRANSACTION_RANGE_COUNT_MAX];
+    struct list_head release_node;
+}transaction_t;
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DECLARATIONS */
+/*****************************************************************************/
+
+static int transaction_begin(struct file *file, u32 *id);
+
+static int transaction_snapshot(device_data_t *device_data,
+    transaction_t *transaction);
+
+static int transaction_write(struct file *file,
+    const struct pcd_transaction *user_transaction);
+
+static int transaction_commit(struct file *file, u32 id);
+
+static int transaction_abort(struct file *file, u32 id);
+
+static int transaction_add_range(transaction_t *transaction, u64 offset,
+    u64 end);
+
+static void transaction_rebase(transaction_t *transaction,
+    const device_buffer_t *buffer);
+
+static bool transaction_refresh(device_data_t *device_data,
+    transaction_t *transaction);
+
+static transaction_t *transaction_get(struct file *file, u32 id);
+
+static transaction_t *transaction_take(struct file *file, u32 id);
+
+static void transaction_end(transaction_t *transaction);
+
+static void transaction_free(struct kref *kref);
+
+
+
+/*****************************************************************************/
+/* PUBLIC FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+void pseudo_char_device_transaction_init(device_data_t *device_data)
+{
+    xa_init_flags(&device_data->transactions, XA_FLAGS_ALLOC1);
+}
+
+
+
+/* Every file beginning a transaction releases it, nothing is left by now. */
+void pseudo_char_device_transaction_exit(device_data_t *device_data)
+{
+    xa_destroy(&device_data->transactions);
+}
+
+
+
+long pseudo_char_device_transaction_ioctl(struct file *file,
+    unsigned int command, unsigned long argument)
+{
+    long return_code = 0;
+    void __user *user_pointer = (void __user *)argument;
+    struct pcd_transaction user_transaction;
+
+    /* Aborting is left to anyone, a file only ever holds transactions it
+       was allowed to begin. */
+    if (((command == PCD_IOCTL_TXN_BEGIN) ||
+        (command == PCD_IOCTL_TXN_WRITE) ||
+        (command == PCD_IOCTL_TXN_COMMIT)) &&
+        !(file->f_mode & FMODE_WRITE)) {
+        return -EBADF;
+    }
+
+    if (command == PCD_IOCTL_TXN_BEGIN) {
+        memset(&user_transaction, 0, sizeof(user_transaction));
+        return_code = transaction_begin(file, &user_transaction.id);
+        if ((return_code == 0) && (copy_to_user(user_pointer,
+            &user_transaction, sizeof(user_transaction)) != 0)) {
+            transaction_abort(file, user_transaction.id);
+            return_code = -EFAULT;
+        }
+    } else if (copy_from_user(&user_transaction, user_pointer,
+        sizeof(user_transaction)) != 0) {
+        return_code = -EFAULT;
+    } else if (user_transaction.reserved != 0) {
+        return_code = -EINVAL;
+    } else if (command == PCD_IOCTL_TXN_WRITE) {
+        return_code = transaction_write(file, &user_transaction);
+    } else if (command == PCD_IOCTL_TXN_COMMIT) {
+        return_code = transaction_commit(file, user_transaction.id);
+    } else if (command == PCD_IOCTL_TXN_ABORT) {
+        return_code = transaction_abort(file, user_transaction.id);
+    } else {
+        return_code = -ENOTTY;
+    }
+
+    return return_code;
+}
+
+
+
+/* Abort the transactions the file left open. */
+void pseudo_char_device_transaction_release(struct file *file)
+{
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    struct xarray *transactions = &device_data->transactions;
+    unsigned long id = 0;
+    transaction_t *transaction = NULL;
+    transaction_t *next_transaction = NULL;
+    LIST_HEAD(released_transactions);
+
+    xa_lock(transactions);
+    xa_for_each(transactions, id, transaction) {
+        if (transaction->owner == file) {
+            __xa_erase(transactions, id);
+            list_add(&transaction->release_node, &released_transactions);
+        }
+    }
+    xa_unlock(transactions);
+
+    list_for_each_entry_safe(transaction, next_transaction,
+        &released_transactions, release_node) {
+        transaction_end(transaction);
+    }
+}
+
+
+
+/*****************************************************************************/
+/* HELPER FUNCTIONS DEFINITIONS */
+/*****************************************************************************/
+
+/* The id is reserved first, so a device with all its transactions open
+   does not copy its buffer for nothing. Lookups miss the transaction until
+   its shadow copy is stored. */
+static int transaction_begin(struct file *file, u32 *id)
+{
+    int return_code = 0;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    transaction_t *transaction = NULL;
+
+    transaction = kzalloc(sizeof(transaction_t), GFP_KERNEL);
+    if (transaction == NULL) {
+        return -ENOMEM;
+    }
+
+    kref_init(&transaction->kref);
+    mutex_init(&transaction->lock);
+    transaction->owner = file;
+
+    /* Full when the limit is reached. */
+    return_code = xa_alloc(&device_data->transactions, id, NULL,
+        XA_LIMIT(1, DEVICE_TRANSACTION_COUNT_MAX), GFP_KERNEL);
+    if (return_code != 0) {
+        kref_put(&transaction->kref, transaction_free);
+        return return_code;
+    }
+
+    return_code = transaction_snapshot(device_data, transaction);
+    if (return_code == 0) {
+        xa_store(&device_data->transactions, *id, transaction, GFP_KERNEL);
+    } else {
+        xa_release(&device_data->transactions, *id);
+        kref_put(&transaction->kref, transaction_free);
+    }
+
+    return return_code;
+}
+
+
+
+/* Copy the whole buffer into a new shadow copy. Writers are held off only
+   if they keep overlapping the optimistic copies. */
+static int transaction_snapshot(device_data_t *device_data,
+    transaction_t *transaction)
+{
+    int return_code = 0;
+    int srcu_index = 0;
+    size_t size = 0;
+    device_buffer_t *buffer = NULL;
+
+    buffer = pseudo_char_device_buffer_read_lock(device_data, &srcu_index);
+    size = buffer->size;
+    pseudo_char_device_buffer_read_unlock(srcu_index);
+
+    transaction->shadow = pseudo_char_device_buffer_alloc(size);
+    if (transaction->shadow == NULL) {
+        return -ENOMEM;
+    }
+
+    if (!transaction_refresh(device_data, transaction)) {
+        return_code = pseudo_char_device_buffer_lock(device_data, false);
+        if (return_code == 0) {
+            buffer = rcu_dereference_protected(device_data->buffer,
+                lockdep_is_held(&device_data->buffer_lock));
+            if (buffer->size == size) {
+                transaction_rebase(transaction, buffer);
+                transaction->sequence =
+                    raw_read_seqcount(&device_data->buffer_sequence);
+            } else {
+                pr_debug("Device resized while taking its copy...\n");
+                return_code = -EAGAIN;
+            }
+            mutex_unlock(&device_data->buffer_lock);
+        }
+    }
+
+    return return_code;
+}
+
+
+
+static int transaction_write(struct file *file,
+    const struct pcd_transaction *user_transaction)
+{
+    int return_code = 0;
+    transaction_t *transaction = NULL;
+    device_buffer_t *shadow = NULL;
+    const u64 offset = user_transaction->offset;
+    const u64 length = user_transaction->length;
+
+    if ((length == 0) || (offset > (U64_MAX - length))) {
+        return -EINVAL;
+    }
+
+    transaction = transaction_get(file, user_transaction->id);
+    if (transaction == NULL) {
+        return -ENOENT;
+    }
+
+    if (mutex_lock_interruptible(&transaction->lock) != 0) {
+        kref_put(&transaction->kref, transaction_free);
+        return -ERESTARTSYS;
+    }
+
+    shadow = transaction->shadow;
+    if (transaction->ended) {
+        return_code = -ENOENT;
+    } else if ((offset >= shadow->size) || ((shadow->size - offset) < length)) {
+        return_code = -ENXIO;
+    } else {
+        return_code = transaction_add_range(transaction, offset,
+            offset + length);
+    }
+
+    /* The range is already staged, part of it would hold stale data. */
+    if ((return_code == 0) &&
+        (copy_from_user(&shadow->data[offset],
+            u64_to_user_ptr(user_transaction->data), length) != 0)) {
+        transaction->failed = true;
+        return_code = -EFAULT;
+    }
+
+    mutex_unlock(&transaction->lock);
+    kref_put(&transaction->kref, transaction_free);
+
+    return return_code;
+}
+
+
+
+/* Writes since the transaction began are caught up with optimistically
+   first, so the device lock is normally only held to swap the shadow copy
+   in, and to catch up with whatever was written in between otherwise.
+   Readers never wait for the commit: those which started before it keep
+   reading the old buffer, freed after they are done. */
+static int transaction_commit(struct file *file, u32 id)
+{
+    int return_code = 0;
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    transaction_t *transaction = NULL;
+    device_buffer_t *buffer = NULL;
+    u32 index = 0;
+
+    transaction = transaction_take(file, id);
+    if (transaction == NULL) {
+        return -ENOENT;
+    }
+
+    /* Staging writes still in progress are short, and the transaction is
+       gone from the xarray, so the commit cannot be restarted. */
+    mutex_lock(&transaction->lock);
+
+    if (transaction->failed) {
+        mutex_unlock(&transaction->lock);
+        transaction_end(transaction);
+        return -EFAULT;
+    }
+
+    if (raw_read_seqcount(&device_data->buffer_sequence) !=
+        transaction->sequence) {
+        transaction_refresh(device_data, transaction);
+    }
+
+    mutex_lock(&device_data->buffer_lock);
+
+    buffer = rcu_dereference_protected(device_data->buffer,
+        lockdep_is_held(&device_data->buffer_lock));
+
+    if (buffer->size != transaction->shadow->size) {
+        pr_debug("Device resized since the transaction began...\n");
+        return_code = -ESTALE;
+    } else {
+        if (raw_read_seqcount(&device_data->buffer_sequence) !=
+            transaction->sequence) {
+            transaction_rebase(transaction, buffer);
+        }
+
+        return_code = pseudo_char_device_buffer_replace(device_data,
+            transaction->shadow);
+    }
+
+    if (return_code == 0) {
+        transaction->shadow = NULL;
+        for (index = 0; index < transaction->range_count; ++index) {
+            const transaction_range_t *range = &transaction->ranges[index];
+
+            pseudo_char_device_backing_mark_dirty(device_data, range->offset,
+                range->end - range->offset);
+            pseudo_char_device_notify_write(device_data, range->offset,
+                range->end - range->offset);
+        }
+    }
+
+    mutex_unlock(&device_data->buffer_lock);
+
+    transaction->ended = true;
+    mutex_unlock(&transaction->lock);
+    kref_put(&transaction->kref, transaction_free);
+
+    return return_code;
+}
+
+
+
+static int transaction_abort(struct file *file, u32 id)
+{
+    transaction_t *transaction = transaction_take(file, id);
+
+    if (transaction == NULL) {
+        return -ENOENT;
+    }
+
+    transaction_end(transaction);
+
+    return 0;
+}
+
+
+
+/* Merge [offset, end) with the ranges it overlaps or touches. */
+static int transaction_add_range(transaction_t *transaction, u64 offset,
+    u64 end)
+{
+    transaction_range_t *ranges = transaction->ranges;
+    u32 first = 0;
+    u32 last = 0;
+
+    while ((first < transaction->range_count) &&
+        (ranges[first].end < offset)) {
+        ++first;
+    }
+
+    for (last = first; (last < transaction->range_count) &&
+        (ranges[last].offset <= end); ++last) {
+        offset = min(offset, ranges[last].offset);
+        end = max(end, ranges[last].end);
+    }
+
+    if (first == last) {
+        if (transaction->range_count == DEVICE_TRANSACTION_RANGE_COUNT_MAX) {
+            return -ENOSPC;
+        }
+
+        memmove(&ranges[first + 1], &ranges[first],
+            (transaction->range_count - first) * sizeof(*ranges));
+        ++transaction->range_count;
+    } else if ((last - first) > 1) {
+        memmove(&ranges[first + 1], &ranges[last],
+            (transaction->range_count - last) * sizeof(*ranges));
+        transaction->range_count -= last - first - 1;
+    }
+
+    ranges[first].offset = offset;
+    ranges[first].end = end;
+
+    return 0;
+}
+
+
+
+/* Copy everything the transaction did not write from a buffer of the same
+   size. */
+static void transaction_rebase(transaction_t *transaction,
+    const device_buffer_t *buffer)
+{
+    u8 *data = transaction->shadow->data;
+    u64 position = 0;
+    u32 index = 0;
+
+    for (; index < transaction->range_count; ++index) {
+        memcpy(&data[position], &buffer->data[position],
+            transaction->ranges[index].offset - position);
+        position = transaction->ranges[index].end;
+    }
+
+    memcpy(&data[position], &buffer->data[position],
+        buffer->size - position);
+}
+
+
+
+/* Bring the shadow copy up to date without holding off writers, the way
+   readers copy: again if a write overlapped the copy, giving up after a few
+   attempts. Returns whether the copy matches the sequence recorded. */
+static bool transaction_refresh(device_data_t *device_data,
+    transaction_t *transaction)
+{
+    device_buffer_t *buffer = NULL;
+    int srcu_index = 0;
+    unsigned attempt = 0;
+    unsigned sequence = 0;
+    bool done = false;
+
+    for (; (attempt < COPY_ATTEMPT_COUNT) && !done; ++attempt) {
+        sequence = raw_read_seqcount(&device_data->buffer_sequence);
+        if ((sequence & 1) == 0) {
+            buffer = pseudo_char_device_buffer_read_lock(device_data,
+                &srcu_index);
+            if (buffer->size == transaction->shadow->size) {
+                /* Writes may race with the copy, which is only kept if the
+                   sequence shows none did. */
+                kcsan_disable_current();
+                transaction_rebase(transaction, buffer);
+                kcsan_enable_current();
+                done = !read_seqcount_retry(&device_data->buffer_sequence,
+                    sequence);
+            }
+            pseudo_char_device_buffer_read_unlock(srcu_index);
+        }
+    }
+
+    if (done) {
+        transaction->sequence = sequence;
+    }
+
+    return done;
+}
+
+
+
+static transaction_t *transaction_get(struct file *file, u32 id)
+{
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    struct xarray *transactions = &device_data->transactions;
+    transaction_t *transaction = NULL;
+
+    xa_lock(transactions);
+    transaction = xa_load(transactions, id);
+    if ((transaction != NULL) && (transaction->owner == file)) {
+        kref_get(&transaction->kref);
+    } else {
+        transaction = NULL;
+    }
+    xa_unlock(transactions);
+
+    return transaction;
+}
+
+
+
+/* Only one task gets to commit or abort the transaction. */
+static transaction_t *transaction_take(struct file *file, u32 id)
+{
+    device_data_t *device_data = (device_data_t *)file->private_data;
+    struct xarray *transactions = &device_data->transactions;
+    transaction_t *transaction = NULL;
+
+    xa_lock(transactions);
+    transaction = xa_load(transactions, id);
+    if ((transaction != NULL) && (transaction->owner == file)) {
+        __xa_erase(transactions, id);
+    } else {
+        transaction = NULL;
+    }
+    xa_unlock(transactions);
+
+    return transaction;
+}
+
+
+
+/* Staging writes which got hold of the transaction find it ended. */
+static void transaction_end(transaction_t *transaction)
+{
+    mutex_lock(&transaction->lock);
+    transaction->ended = true;
+    mutex_unlock(&transaction->lock);
+
+    kref_put(&transaction->kref, transaction_free);
+}
+
+
+
+static void transaction_free(struct kref *kref)
+{
+    transaction_t *transaction = container_of(kref, transaction_t, kref);
+
+    pseudo_char_device_buffer_free(transaction->shadow);
+    mutex_destroy(&transaction->lock);
+    kfree(transaction);
+}
@@ -13,6 +13,9 @@
 #include <linux/platform_device.h>
 #include <linux/slab.h>
 
+#define CREATE_TRACE_POINTS
+#include "pseudo_platform_driver_trace.h"
+
 
 
 /*****************************************************************************/
@@ -292,37 +295,64 @@ static int pseudo_platform_driver_remove(
 
 static int pseudo_platform_device_open(struct inode *inode, struct file *file)
 {
+    int return_code = 0;
+
     /* TODO */
-    return 0;
+
+    trace_ppd_open(iminor(inode), return_code);
+
+    return return_code;
 }
 
 static int pseudo_platform_device_release(struct inode *inode,
     struct file *file)
 {
+    int return_code = 0;
+
     /* TODO */
-    return 0;
+
+    trace_ppd_release(iminor(inode), return_code);
+
+    return return_code;
 }
 
 static ssize_t pseudo_platform_device_read(struct file *file,
     char __user *data_destination, size_t byte_to_read_count,
     loff_t *file_position)
 {
+    ssize_t return_code = 0;
+
     /* TODO */
-    return 0;
+
+    trace_ppd_read(iminor(file_inode(file)), *file_position,
+        byte_to_read_count, return_code);
+
+    return return_code;
 }
 
 static ssize_t pseudo_platform_device_write(struct file *file,
     const char __user *data_source, size_t byte_to_write_count,
     loff_t *file_position)
 {
+    ssize_t return_code = 0;
+
     /* TODO */
-    return 0;
+
+    trace_ppd_write(iminor(file_inode(file)), *file_position,
+        byte_to_write_count, return_code);
+
+    return return_code;
 }
 
 static loff_t pseudo_platform_device_llseek(struct file *file,
     loff_t file_position_offset, int whence)
 {
+    loff_t return_code = 0;
+
     /* TODO */
-    return 0;
-}
 
+    trace_ppd_llseek(iminor(file_inode(file)), file->f_pos,
+        file_position_offset, whence, return_code);
+
+    return return_code;
+}
@@ -0,0 +1,138 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pseudo_platform_driver
+
+#if !defined(PSEUDO_PLATFORM_DRIVER_TRACE_H) || \
+    defined(TRACE_HEADER_MULTI_READ)
+#define PSEUDO_PLATFORM_DRIVER_TRACE_H
+
+/*****************************************************************************/
+/* HEADER FILES */
+/*****************************************************************************/
+
+#include <linux/tracepoint.h>
+#include <linux/types.h>
+
+
+
+/*****************************************************************************/
+/* TRACE EVENTS */
+/*****************************************************************************/
+
+/* Events of the file operations, available under
+   /sys/kernel/tracing/events/pseudo_platform_driver/. */
+DECLARE_EVENT_CLASS(ppd_file,
+    TP_PROTO(unsigned int minor, int result),
+    TP_ARGS(minor, result),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(int, result)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->result = result;
+    ),
+
+    TP_printk("minor=%u result=%d", __entry->minor, __entry->result)
+);
+
+
+
+DEFINE_EVENT(ppd_file, ppd_open,
+    TP_PROTO(unsigned int minor, int result),
+    TP_ARGS(minor, result)
+);
+
+
+
+DEFINE_EVENT(ppd_file, ppd_release,
+    TP_PROTO(unsigned int minor, int result),
+    TP_ARGS(minor, result)
+);
+
+
+
+TRACE_EVENT(ppd_llseek,
+    TP_PROTO(unsigned int minor, loff_t file_position, loff_t offset,
+        int whence, loff_t result),
+    TP_ARGS(minor, file_position, offset, whence, result),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, file_position)
+        __field(loff_t, offset)
+        __field(int, whence)
+        __field(loff_t, result)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->file_position = file_position;
+        __entry->offset = offset;
+        __entry->whence = whence;
+        __entry->result = result;
+    ),
+
+    TP_printk("minor=%u position=%lld offset=%lld whence=%d result=%lld",
+        __entry->minor, __entry->file_position, __entry->offset,
+        __entry->whence, __entry->result)
+);
+
+
+
+/* The result is the byte count actually transferred, or a negative error
+   code. */
+DECLARE_EVENT_CLASS(ppd_transfer,
+    TP_PROTO(unsigned int minor, loff_t file_position, size_t byte_count,
+        ssize_t result),
+    TP_ARGS(minor, file_position, byte_count, result),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, file_position)
+        __field(size_t, byte_count)
+        __field(ssize_t, result)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->file_position = file_position;
+        __entry->byte_count = byte_count;
+        __entry->result = result;
+    ),
+
+    TP_printk("minor=%u position=%lld requested=%zu result=%zd",
+        __entry->minor, __entry->file_position, __entry->byte_count,
+        __entry->result)
+);
+
+
+
+DEFINE_EVENT(ppd_transfer, ppd_read,
+    TP_PROTO(unsigned int minor, loff_t file_position, size_t byte_count,
+        ssize_t result),
+    TP_ARGS(minor, file_position, byte_count, result)
+);
+
+
+
+DEFINE_EVENT(ppd_transfer, ppd_write,
+    TP_PROTO(unsigned int minor, loff_t file_position, size_t byte_count,
+        ssize_t result),
+    TP_ARGS(minor, file_position, byte_count, result)
+);
+
+#endif /* PSEUDO_PLATFORM_DRIVER_TRACE_H */
+
+
+
+/*****************************************************************************/
+/* TRACE DEFINITIONS */
+/*****************************************************************************/
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pseudo_platform_driver_trace
+#include <trace/define_trace.h>